@@ -0,0 +1,614 @@
+// Copyright © 2015, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen,
+// Sergey Koren, and Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+// Microbenchmarks of the hot kernels ("make bench"), on synthetic inputs made
+// from fixed seeds, so runs are comparable across builds and releases. Each
+// kernel is run for every SIMD level the CPU supports, where it has variants.
+// The report is one tab-separated line per benchmark:
+//
+//   <benchmark> <path> <unit> <ns per unit> <GB/s>
+//
+// where GB/s is of the input the kernel reads, and both are from the fastest
+// of several repeats (each long enough to be timed reliably). Give names (or
+// parts of them) as arguments to run only some.
+
+#include "mash/CommandDistance.h"
+#include "mash/HashSet.h"
+#include "mash/MinHashHeap.h"
+#include "mash/MurmurHash3.h"
+#include "mash/Sketch.h"
+#include "mash/fastx/FastxIO.h"
+#include "mash/simd.h"
+#include <algorithm>
+#include <chrono>
+#include <fcntl.h>
+#include <functional>
+#include <random>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+using namespace::std;
+using namespace::mash;
+using namespace::mash::fa;
+
+static const int repeats = 5;
+static const double repeatSeconds = 0.2;
+
+static vector<string> filters;
+
+static bool selected(const string & name)
+{
+	if ( filters.size() == 0 )
+	{
+		return true;
+	}
+
+	for ( size_t i = 0; i < filters.size(); i++ )
+	{
+		if ( name.find(filters[i]) != string::npos )
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// Times run(), which processes units units of bytes bytes, and prints the
+// fastest rate.
+//
+static void report(const string & name, const string & path, const char * unit, uint64_t units, uint64_t bytes, const function<void()> & run)
+{
+	typedef chrono::steady_clock Clock;
+
+	run(); // warm up
+
+	double best = 0;
+
+	for ( int r = 0; r < repeats; r++ )
+	{
+		Clock::time_point start = Clock::now();
+		uint64_t runs = 0;
+		double seconds;
+
+		do
+		{
+			run();
+			runs++;
+			seconds = chrono::duration<double>(Clock::now() - start).count();
+		}
+		while ( seconds < repeatSeconds );
+
+		double perRun = seconds / runs;
+
+		if ( r == 0 || perRun < best )
+		{
+			best = perRun;
+		}
+	}
+
+	printf("%s\t%s\t%s\t%.3f\t%.3f\n", name.c_str(), path.c_str(), unit, best * 1e9 / units, bytes / best / 1e9);
+	fflush(stdout);
+}
+
+static vector<SimdLevel> simdLevels()
+{
+	vector<SimdLevel> levels;
+	SimdLevel supported = getSimdLevelSupported();
+
+	for ( int level = SIMD_NONE; level <= supported; level++ )
+	{
+		levels.push_back((SimdLevel)level);
+	}
+
+	return levels;
+}
+
+static string randomBases(uint64_t length, uint64_t seed)
+{
+	mt19937_64 random(seed);
+	string bases(length, 'A');
+
+	for ( uint64_t i = 0; i < length; i++ )
+	{
+		bases[i] = "ACGT"[random() & 3];
+	}
+
+	return bases;
+}
+
+static Sketch::Parameters nucleotideParameters()
+{
+	Sketch::Parameters parameters;
+
+	parameters.kmerSize = 21;
+	parameters.minHashesPerWindow = 1000;
+	parameters.use64 = true;
+	parameters.seed = 42;
+	setAlphabetFromString(parameters, alphabetNucleotide);
+
+	return parameters;
+}
+
+static void benchAddMinHashes()
+{
+	if ( ! selected("addMinHashes") )
+	{
+		return;
+	}
+
+	const Sketch::Parameters parameters = nucleotideParameters();
+	const string seq = randomBases(1 << 22, 1);
+	const uint64_t kmers = seq.length() - parameters.kmerSize + 1;
+	vector<SimdLevel> levels = simdLevels();
+
+	for ( size_t i = 0; i < levels.size(); i++ )
+	{
+		setSimdLevel(levels[i]);
+
+		report("addMinHashes", getSimdLevelName(levels[i]), "kmer", kmers, seq.length(), [&]()
+		{
+			MinHashHeap heap(parameters.use64, parameters.minHashesPerWindow);
+			addMinHashes(heap, seq.c_str(), seq.length(), parameters);
+		});
+	}
+
+	setSimdLevel(getSimdLevelSupported());
+}
+
+static void benchMurmurHash3()
+{
+	if ( ! selected("MurmurHash3_x64_128") )
+	{
+		return;
+	}
+
+	const int kmerSize = 21;
+	const uint32_t seed = 42;
+	const string seq = randomBases(1 << 20, 2);
+	const uint64_t kmers = seq.length() - kmerSize + 1;
+	volatile uint64_t sink = 0;
+
+	report("MurmurHash3_x64_128", "scalar", "kmer", kmers, kmers * kmerSize, [&]()
+	{
+		uint64_t out[2];
+		uint64_t sum = 0;
+
+		for ( uint64_t i = 0; i < kmers; i++ )
+		{
+			MurmurHash3_x64_128(seq.c_str() + i, kmerSize, seed, out);
+			sum += out[0];
+		}
+
+		sink = sum;
+	});
+
+	// the batched k-mer kernels (4 per AVX2 call, 16 per AVX-512 call)
+	//
+	vector<SimdLevel> levels = simdLevels();
+
+	for ( size_t i = 0; i < levels.size(); i++ )
+	{
+		setSimdLevel(levels[i]);
+		const SimdKernels & kernels = getSimdKernels();
+
+		if ( kernels.hashKmers == 0 )
+		{
+			continue;
+		}
+
+		const int width = kernels.hashWidth;
+		const uint64_t batches = kmers / width;
+
+		report("MurmurHash3_x64_128", getSimdLevelName(levels[i]), "kmer", batches * width, batches * width * kmerSize, [&]()
+		{
+			const char * keys[16];
+			uint64_t out[32];
+			uint64_t sum = 0;
+
+			for ( uint64_t b = 0; b < batches; b++ )
+			{
+				for ( int j = 0; j < width; j++ )
+				{
+					keys[j] = seq.c_str() + b * width + j;
+				}
+
+				kernels.hashKmers(keys, kmerSize, seed, out);
+				sum += out[0];
+			}
+
+			sink = sum;
+		});
+	}
+
+	setSimdLevel(getSimdLevelSupported());
+}
+
+// Sorted sketches of sketchSize hashes, pairs of which share about half.
+//
+template <class Hash>
+static vector<vector<Hash>> randomSketches(int count, int sketchSize, uint64_t seed)
+{
+	mt19937_64 random(seed);
+	vector<Hash> shared(sketchSize);
+	vector<vector<Hash>> sketches(count);
+
+	for ( int i = 0; i < sketchSize; i++ )
+	{
+		shared[i] = random();
+	}
+
+	for ( int s = 0; s < count; s++ )
+	{
+		for ( int i = 0; i < sketchSize; i++ )
+		{
+			sketches[s].push_back(random() & 1 ? shared[i] : (Hash)random());
+		}
+
+		sort(sketches[s].begin(), sketches[s].end());
+		sketches[s].erase(unique(sketches[s].begin(), sketches[s].end()), sketches[s].end());
+	}
+
+	return sketches;
+}
+
+static void benchIntersect()
+{
+	const int count = 64;
+	const int sketchSize = 1000;
+	vector<vector<uint64_t>> sketches64 = randomSketches<uint64_t>(count, sketchSize, 3);
+	vector<vector<uint32_t>> sketches32 = randomSketches<uint32_t>(count, sketchSize, 4);
+	vector<SimdLevel> levels = simdLevels();
+	volatile uint64_t sink = 0;
+
+	// Every pair, stopping at the sketch size as dist does; the unit is a
+	// hash read from either list.
+	//
+	for ( int bits = 64; bits >= 32; bits -= 32 )
+	{
+		string name = bits == 64 ? "intersect64" : "intersect32";
+
+		if ( ! selected(name) )
+		{
+			continue;
+		}
+
+		for ( size_t l = 0; l < levels.size(); l++ )
+		{
+			setSimdLevel(levels[l]);
+			const SimdKernels & kernels = getSimdKernels();
+			uint64_t hashes = 0;
+
+			auto run = [&]()
+			{
+				uint64_t common = 0;
+				hashes = 0;
+
+				for ( int i = 0; i < count; i++ )
+				{
+					for ( int j = 0; j < count; j++ )
+					{
+						uint64_t i_a = 0;
+						uint64_t i_b = 0;
+
+						if ( bits == 64 )
+						{
+							common += kernels.intersect64(sketches64[i].data(), sketches64[i].size(), sketches64[j].data(), sketches64[j].size(), sketchSize, &i_a, &i_b);
+						}
+						else
+						{
+							common += kernels.intersect32(sketches32[i].data(), sketches32[i].size(), sketches32[j].data(), sketches32[j].size(), sketchSize, &i_a, &i_b);
+						}
+
+						hashes += i_a + i_b;
+					}
+				}
+
+				sink = common;
+			};
+
+			run(); // to count the hashes
+			report(name, getSimdLevelName(levels[l]), "hash", hashes, hashes * bits / 8, run);
+		}
+	}
+
+	// Pairs of 10k-hash sketches picked at random from far more than the
+	// caches hold, to compare with intersect64 (1k hashes, all in cache):
+	// the difference is all that sharing loads between pairs could save.
+	//
+	if ( selected("intersect64cold") )
+	{
+		const int coldCount = 2048;
+		const int coldSize = 10000;
+		const int coldPairs = 4096;
+		vector<vector<uint64_t>> cold = randomSketches<uint64_t>(coldCount, coldSize, 5);
+		vector<pair<int, int>> pairs(coldPairs);
+		mt19937_64 random(6);
+
+		for ( int i = 0; i < coldPairs; i++ )
+		{
+			pairs[i] = make_pair(random() % coldCount, random() % coldCount);
+		}
+
+		for ( size_t l = 0; l < levels.size(); l++ )
+		{
+			setSimdLevel(levels[l]);
+			const SimdKernels & kernels = getSimdKernels();
+			uint64_t hashes = 0;
+
+			auto run = [&]()
+			{
+				uint64_t common = 0;
+				hashes = 0;
+
+				for ( int i = 0; i < coldPairs; i++ )
+				{
+					const vector<uint64_t> & a = cold[pairs[i].first];
+					const vector<uint64_t> & b = cold[pairs[i].second];
+					uint64_t i_a = 0;
+					uint64_t i_b = 0;
+
+					common += kernels.intersect64(a.data(), a.size(), b.data(), b.size(), coldSize, &i_a, &i_b);
+					hashes += i_a + i_b;
+				}
+
+				sink = common;
+			};
+
+			run(); // to count the hashes
+			report("intersect64cold", getSimdLevelName(levels[l]), "hash", hashes, hashes * 8, run);
+		}
+	}
+
+	setSimdLevel(getSimdLevelSupported());
+}
+
+static void benchTryInsert()
+{
+	if ( ! selected("tryInsert") )
+	{
+		return;
+	}
+
+	const uint64_t count = 1 << 22;
+	const int sketchSize = 1000;
+	mt19937_64 random(5);
+	vector<hash_u> hashes(count);
+
+	for ( uint64_t i = 0; i < count; i++ )
+	{
+		hashes[i].hash64 = random();
+	}
+
+	// as for genomes (bottom-k), in the batches addMinHashes gives, and for
+	// reads with -m 2 (with about half the hashes repeated)
+	//
+	report("tryInsert", "bottom-k", "hash", count, count * sizeof(uint64_t), [&]()
+	{
+		MinHashHeap heap(true, sketchSize);
+
+		for ( uint64_t i = 0; i < count; i += 16 )
+		{
+			heap.tryInsert(hashes.data() + i, 16);
+		}
+	});
+
+	for ( uint64_t i = 1; i < count; i += 2 )
+	{
+		hashes[i] = hashes[random() % i];
+	}
+
+	report("tryInsert", "minCov", "hash", count, count * sizeof(uint64_t), [&]()
+	{
+		MinHashHeap heap(true, sketchSize, 2);
+
+		for ( uint64_t i = 0; i < count; i++ )
+		{
+			heap.tryInsert(hashes[i]);
+		}
+	});
+}
+
+static void benchHashSet()
+{
+	if ( ! selected("hashSet") )
+	{
+		return;
+	}
+
+	const uint64_t count = 1 << 22;
+	const uint64_t window = 1 << 16;
+	mt19937_64 random(8);
+	vector<hash_u> hashes(count);
+
+	for ( uint64_t i = 0; i < count; i++ )
+	{
+		hashes[i].hash64 = random();
+	}
+
+	// churn as in the pending set of a heap: each hash is looked up, added,
+	// and erased again once window more have been added
+	//
+	for ( int counted = 1; counted >= 0; counted-- )
+	{
+		report("hashSet", counted ? "counted" : "count-free", "hash", count, count * sizeof(uint64_t), [&]()
+		{
+			HashSet set(true, counted);
+			uint64_t found = 0;
+
+			set.reserve(window);
+
+			for ( uint64_t i = 0; i < count; i++ )
+			{
+				found += set.count(hashes[i]);
+				set.insert(hashes[i]);
+
+				if ( i >= window )
+				{
+					set.erase(hashes[i - window]);
+				}
+			}
+
+			if ( found != 0 )
+			{
+				fprintf(stderr, "ERROR: unexpected repeated hashes.\n");
+			}
+		});
+	}
+}
+
+// A multi-fasta file of random records (100 bp to 100 kbp, 60 bases per
+// line) in the temporary directory, removed at exit.
+//
+static string fastaFile;
+
+static void removeFastaFile()
+{
+	unlink(fastaFile.c_str());
+}
+
+static const string & makeFastaFile(uint64_t * bytes)
+{
+	static uint64_t size = 0;
+
+	if ( fastaFile == "" )
+	{
+		const char * tmp = getenv("TMPDIR");
+		char name[4096];
+
+		snprintf(name, sizeof(name), "%s/mash-bench-XXXXXX", tmp ? tmp : "/tmp");
+
+		int fd = mkstemp(name);
+		FILE * file = fd < 0 ? 0 : fdopen(fd, "w");
+
+		if ( file == 0 )
+		{
+			fprintf(stderr, "ERROR: could not create a temporary file in %s.\n", tmp ? tmp : "/tmp");
+			exit(1);
+		}
+
+		fastaFile = name;
+		atexit(removeFastaFile);
+
+		mt19937_64 random(6);
+		const string bases = randomBases(1 << 20, 7);
+
+		for ( int record = 0; size < (1 << 25); record++ )
+		{
+			uint64_t length = 100 + random() % 100000;
+
+			size += fprintf(file, ">record%d synthetic\n", record);
+
+			for ( uint64_t i = 0; i < length; i += 60 )
+			{
+				uint64_t line = length - i < 60 ? length - i : 60;
+
+				size += fwrite(bases.c_str() + (record * 7919 + i) % (bases.length() - 60), 1, line, file);
+				size += fwrite("\n", 1, 1, file);
+			}
+		}
+
+		fclose(file);
+	}
+
+	*bytes = size;
+	return fastaFile;
+}
+
+static void benchFasta()
+{
+	bool read = selected("ReadNextChunk");
+	bool format = selected("chunkFormat");
+
+	if ( ! read && ! format )
+	{
+		return;
+	}
+
+	const int halo = 20; // for k = 21
+	const uint64_t chunkSize = 1 << 20;
+	uint64_t bytes;
+	const string & file = makeFastaFile(&bytes);
+
+	// enough chunks for the whole file to be held for chunkFormat
+	//
+	FastaDataPool pool(bytes / chunkSize * 2 + 16, chunkSize);
+
+	auto readChunks = [&](vector<FastaChunk *> * chunks)
+	{
+		int fd = open(file.c_str(), O_RDONLY);
+		FastaFileReader fileReader(fd, halo);
+		FastaReader reader(fileReader, pool);
+		FastaChunk * chunk;
+
+		while ( (chunk = reader.readNextChunk()) != 0 )
+		{
+			if ( chunks != 0 )
+			{
+				chunks->push_back(chunk);
+			}
+			else
+			{
+				pool.Release(chunk->chunk);
+				delete chunk;
+			}
+		}
+	};
+
+	if ( read )
+	{
+		report("ReadNextChunk", "uncompressed", "byte", bytes, bytes, [&]()
+		{
+			readChunks(0);
+		});
+	}
+
+	if ( format )
+	{
+		vector<FastaChunk *> chunks;
+
+		readChunks(&chunks);
+
+		report("chunkFormat", "views", "byte", bytes, bytes, [&]()
+		{
+			vector<SequenceView> seqs;
+
+			for ( size_t i = 0; i < chunks.size(); i++ )
+			{
+				seqs.clear();
+				chunkFormat(*chunks[i], seqs);
+			}
+		});
+
+		for ( size_t i = 0; i < chunks.size(); i++ )
+		{
+			pool.Release(chunks[i]->chunk);
+			delete chunks[i];
+		}
+	}
+}
+
+int main(int argc, const char ** argv)
+{
+	for ( int i = 1; i < argc; i++ )
+	{
+		filters.push_back(argv[i]);
+	}
+
+	printf("#Benchmark\tPath\tUnit\tns/unit\tGB/s\n");
+
+	benchAddMinHashes();
+	benchMurmurHash3();
+	benchIntersect();
+	benchTryInsert();
+	benchHashSet();
+	benchFasta();
+
+	return 0;
+}
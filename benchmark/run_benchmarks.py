@@ -0,0 +1,259 @@
+#!/usr/bin/env python
+'''
+End-to-end throughput benchmarks of mash on genomes downloaded with
+download_genomes.py (ref/<clade>/*_genomic.fna.gz).
+
+A fixed-seed sample of the genomes is sketched (whole files and with -i),
+compared (dist and triangle), screened against, and pasted, at each thread
+count given. Every run records wall time, CPU time (user + system), peak
+resident memory and throughput, and the runs are written to a JSON report
+(and summarized as a table on standard output), so results can be compared
+across builds and machines.
+'''
+import sys
+import os
+import glob
+import json
+import platform
+import random
+import shutil
+import subprocess
+import tempfile
+import time
+from enum import IntEnum
+argv = sys.argv
+
+
+if sys.version_info[0] != 3:
+    raise Exception("Python 3 required")
+
+
+class ExitCodes(IntEnum):
+    EXIT_SUCCESS = 0
+    EXIT_FAILURE = 1
+
+
+ALL_COMMANDS = ["sketch", "sketch-i", "dist", "triangle", "screen", "paste"]
+PASTE_PARTS = 8
+
+
+def getopts():
+    import argparse
+    a = argparse.ArgumentParser(description=__doc__.strip().split("\n")[0])
+    a.add_argument("--ref", "-r", default="ref",
+                   help="Folder of references from download_genomes.py.")
+    a.add_argument("--clades", "-c", nargs="+",
+                   help="Clades (subfolders of --ref) to sample from. "
+                   "Default: all that are present.")
+    a.add_argument("--genomes", "-n", type=int, default=1000,
+                   help="Number of genomes to sample.")
+    a.add_argument("--seed", type=int, default=0,
+                   help="Seed for sampling the genomes.")
+    a.add_argument("--threads", "-p", default="1,4,16",
+                   help="Comma-separated thread counts to run at.")
+    a.add_argument("--commands", default=",".join(ALL_COMMANDS),
+                   help="Comma-separated benchmarks to run, of %s." %
+                   ", ".join(ALL_COMMANDS))
+    a.add_argument("--mash", default="mash",
+                   help="mash binary to benchmark.")
+    a.add_argument("--mixture", nargs="+",
+                   help="Reads (or sequences) to screen. Default: the "
+                   "first 10 genomes of the sample.")
+    a.add_argument("--repeats", type=int, default=1,
+                   help="Runs of each benchmark, of which the fastest "
+                   "is reported.")
+    a.add_argument("--work", help="Folder for sketches and outputs. "
+                   "Default: a temporary folder, removed when done.")
+    a.add_argument("--output", "-o", default="benchmark.json",
+                   help="Path to which to write the report.")
+    a.add_argument("--sketch-args", default="",
+                   help="Further options for sketch, e.g. \"-k 21 -s 1000\".")
+    return a.parse_args()
+
+
+def sample_genomes(ref, clades, count, seed):
+    if not clades:
+        clades = sorted(d for d in os.listdir(ref)
+                        if os.path.isdir(os.path.join(ref, d)))
+    files = []
+    for clade in clades:
+        files += glob.glob(os.path.join(ref, clade, "*.fna.gz"))
+        files += glob.glob(os.path.join(ref, clade, "*.fna"))
+    files.sort()
+    if count < len(files):
+        files = sorted(random.Random(seed).sample(files, count))
+    return files
+
+
+def run(command, stdout_path):
+    '''
+    Runs command, returning its wall time, CPU time (of it and its threads)
+    and peak resident memory, in bytes.
+    '''
+    with open(stdout_path, "w") as out, open(stdout_path + ".err", "w") as err:
+        start = time.monotonic()
+        process = subprocess.Popen(command, stdout=out, stderr=err)
+        _, status, usage = os.wait4(process.pid, 0)
+        wall = time.monotonic() - start
+    if status != 0:
+        with open(stdout_path + ".err") as err:
+            sys.stderr.write(err.read())
+        raise RuntimeError("Failed (status %i): %s" % (status,
+                                                       " ".join(command)))
+    # kilobytes on Linux, bytes on macOS
+    rss = usage.ru_maxrss * (1 if sys.platform == "darwin" else 1024)
+    return wall, usage.ru_utime + usage.ru_stime, rss
+
+
+def sketch_lengths(mash, sketch):
+    '''Lengths of the sketches of sketch (mash info -t).'''
+    info = subprocess.check_output([mash, "info", "-t", sketch]).decode()
+    return [int(line.split("\t")[1]) for line in info.splitlines()
+            if line and not line.startswith("#")]
+
+
+def main():
+    args = getopts()
+    threads = [int(t) for t in args.threads.split(",")]
+    commands = args.commands.split(",")
+    for command in commands:
+        if command not in ALL_COMMANDS:
+            print("Benchmark %s is not one of %s" % (
+                command, ", ".join(ALL_COMMANDS)), file=sys.stderr)
+            return ExitCodes.EXIT_FAILURE
+    genomes = sample_genomes(args.ref, args.clades, args.genomes, args.seed)
+    if len(genomes) < 2:
+        print("Found fewer than 2 genomes in %s." % args.ref,
+              file=sys.stderr)
+        return ExitCodes.EXIT_FAILURE
+    mixture = args.mixture if args.mixture else genomes[:10]
+    work = args.work if args.work else tempfile.mkdtemp(prefix="mash-bench-")
+    if not os.path.isdir(work):
+        os.makedirs(work)
+    sketch_args = args.sketch_args.split()
+    mash = args.mash
+    version = subprocess.check_output([mash, "--version"]).decode().strip()
+    print("Benchmarking mash %s on %i genomes, in %s" % (
+        version, len(genomes), work), file=sys.stderr)
+
+    list_file = os.path.join(work, "genomes.txt")
+    with open(list_file, "w") as f:
+        f.write("".join(g + "\n" for g in genomes))
+    out = os.path.join(work, "out")
+    sketch = os.path.join(work, "genomes.msh")
+
+    # for the sizes of the inputs, and what the commands after sketch use
+    #
+    subprocess.check_call([mash, "sketch", "-p", str(max(threads)), "-l",
+                           "-o", sketch, list_file] + sketch_args,
+                          stderr=subprocess.DEVNULL)
+    bases = sum(sketch_lengths(mash, sketch))
+    n = len(genomes)
+
+    parts = []
+    if "paste" in commands:
+        for i in range(PASTE_PARTS):
+            part_list = os.path.join(work, "part%i.txt" % i)
+            with open(part_list, "w") as f:
+                f.write("".join(g + "\n" for g in genomes[i::PASTE_PARTS]))
+            part = os.path.join(work, "part%i.msh" % i)
+            subprocess.check_call([mash, "sketch", "-p", str(max(threads)),
+                                   "-l", "-o", part, part_list] + sketch_args,
+                                  stderr=subprocess.DEVNULL)
+            parts.append(part)
+
+    mixture_bases = 0
+    if "screen" in commands:
+        mixture_sketch = os.path.join(work, "mixture.msh")
+        subprocess.check_call([mash, "sketch", "-o", mixture_sketch] +
+                              sketch_args + mixture,
+                              stderr=subprocess.DEVNULL)
+        mixture_bases = sum(sketch_lengths(mash, mixture_sketch))
+
+    results = []
+    for t in threads:
+        for command in commands:
+            p = ["-p", str(t)]
+            pasted = os.path.join(work, "pasted.msh")
+            if command == "sketch":
+                line = [mash, "sketch"] + p + ["-l", "-o", out + ".msh",
+                                               list_file] + sketch_args
+                rates = {"genomes": n, "bases": bases}
+            elif command == "sketch-i":
+                line = [mash, "sketch"] + p + ["-i", "-l", "-o",
+                                               out + ".msh", list_file] + \
+                    sketch_args
+                rates = {"genomes": n, "bases": bases}
+            elif command == "dist":
+                line = [mash, "dist"] + p + [sketch, sketch]
+                rates = {"pairs": n * n}
+            elif command == "triangle":
+                line = [mash, "triangle"] + p + [sketch]
+                rates = {"pairs": n * (n - 1) // 2}
+            elif command == "screen":
+                line = [mash, "screen"] + p + [sketch] + mixture
+                rates = {"genomes": n, "bases": mixture_bases}
+            elif command == "paste":
+                # single-threaded; timed once
+                if t != threads[0]:
+                    continue
+                line = [mash, "paste", pasted] + parts
+                rates = {"genomes": n}
+            best = None
+            for _ in range(args.repeats):
+                if os.path.exists(pasted):
+                    os.remove(pasted)
+                measured = run(line, out + ".txt")
+                if best is None or measured[0] < best[0]:
+                    best = measured
+            wall, cpu, rss = best
+            result = {
+                "command": command,
+                "threads": t if command != "paste" else 1,
+                "arguments": line[1:],
+                "wall_s": round(wall, 4),
+                "cpu_s": round(cpu, 4),
+                "max_rss_bytes": rss,
+            }
+            for unit, count in rates.items():
+                result[unit] = count
+                result[unit + "_per_s"] = count / wall if wall > 0 else 0
+            results.append(result)
+            print("%-9s %3i threads %10.3f s wall %10.3f s cpu %8.1f MB  %s"
+                  % (command, result["threads"], wall, cpu, rss / 1e6,
+                     "  ".join("%.4g %s/s" % (c / wall, u)
+                               for u, c in rates.items())))
+            sys.stdout.flush()
+
+    report = {
+        "mash": os.path.abspath(shutil.which(mash) or mash),
+        "version": version,
+        "host": {
+            "name": platform.node(),
+            "system": platform.platform(),
+            "processor": platform.processor(),
+            "cpus": os.cpu_count(),
+        },
+        "dataset": {
+            "ref": os.path.abspath(args.ref),
+            "clades": args.clades,
+            "seed": args.seed,
+            "genomes": n,
+            "bases": bases,
+            "mixture": mixture,
+            "mixture_bases": mixture_bases,
+            "sketch_args": sketch_args,
+        },
+        "results": results,
+    }
+    with open(args.output, "w") as f:
+        json.dump(report, f, indent=1)
+        f.write("\n")
+    print("Wrote %s" % args.output, file=sys.stderr)
+    if not args.work:
+        shutil.rmtree(work)
+    return ExitCodes.EXIT_SUCCESS
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,518 @@
+// Copyright © 2015, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen,
+// Sergey Koren, and Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#include "Api.h"
+#include "CommandDistance.h"
+#include "CommandScreen.h"
+#include "MinHashHeap.h"
+#include "ScreenIndex.h"
+#include "Sketch.h"
+#include "ThreadPool.h"
+#include <algorithm>
+#include <math.h>
+#include <mutex>
+
+using namespace::std;
+
+namespace mash {
+namespace api {
+
+struct MinHash::Data
+{
+	Options options;
+	Sketch::Parameters parameters;
+	Sketch::Reference reference;
+};
+
+// Threads
+
+struct Job
+{
+	const function<void()> * work;
+};
+
+struct JobDone
+{
+};
+
+static JobDone * runJob(Job * job)
+{
+	(*job->work)();
+	return new JobDone();
+}
+
+struct Threads::Pool
+{
+	Pool(int count) : threadPool(runJob, count) {}
+
+	ThreadPool<Job, JobDone> threadPool;
+};
+
+Threads::Threads(int countNew)
+	:
+	count(countNew < 1 ? 1 : countNew)
+{
+	if ( count > 1 )
+	{
+		pool = new Pool(count);
+	}
+}
+
+Threads::~Threads()
+{
+	delete pool;
+}
+
+void Threads::run(const vector<function<void()>> & jobs)
+{
+	if ( pool == 0 )
+	{
+		for ( size_t i = 0; i < jobs.size(); i++ )
+		{
+			jobs[i]();
+		}
+
+		return;
+	}
+
+	vector<Job *> inputs(jobs.size());
+
+	for ( size_t i = 0; i < jobs.size(); i++ )
+	{
+		inputs[i] = new Job {&jobs[i]};
+	}
+
+	pool->threadPool.runWhenThreadAvailable(inputs);
+
+	for ( size_t i = 0; i < jobs.size(); i++ )
+	{
+		delete pool->threadPool.popOutputWhenAvailable();
+	}
+}
+
+// Runs work(first, last) on ranges of [0, count), enough of them to keep the
+// threads busy if some take longer than others.
+//
+static void runRanges(uint64_t count, Threads * threads, const function<void(uint64_t, uint64_t)> & work)
+{
+	if ( threads == 0 || threads->getCount() == 1 || count < 2 )
+	{
+		work(0, count);
+		return;
+	}
+
+	uint64_t ranges = min(count, uint64_t(threads->getCount()) * 8);
+	vector<function<void()>> jobs;
+
+	for ( uint64_t i = 0; i < ranges; i++ )
+	{
+		uint64_t first = count * i / ranges;
+		uint64_t last = count * (i + 1) / ranges;
+
+		jobs.push_back([&work, first, last]() {work(first, last);});
+	}
+
+	threads->run(jobs);
+}
+
+// Sketching
+
+string checkOptions(const Options & options)
+{
+	if ( options.kmerSize < 0 || options.kmerSize > 32 )
+	{
+		return "k-mer size must be between 1 and 32";
+	}
+
+	if ( options.sketchSize < 1 )
+	{
+		return "sketch size must be at least 1";
+	}
+
+	if ( options.minCopies < 1 )
+	{
+		return "minimum copies must be at least 1";
+	}
+
+	if ( options.protein && options.alphabet.size() != 0 )
+	{
+		return "protein and custom alphabets are exclusive";
+	}
+
+	return "";
+}
+
+// as sketchParameterSetup()
+//
+static void setParameters(Sketch::Parameters & parameters, const Options & options)
+{
+	parameters.kmerSize = options.kmerSize != 0 ? options.kmerSize : options.protein ? 9 : 21;
+	parameters.minHashesPerWindow = options.sketchSize;
+	parameters.seed = options.seed;
+	parameters.noncanonical = options.noncanonical || options.protein || options.alphabet.size() != 0;
+	parameters.preserveCase = options.preserveCase;
+	parameters.minCov = options.minCopies;
+	parameters.reads = options.minCopies > 1;
+
+	if ( options.protein )
+	{
+		setAlphabetFromString(parameters, alphabetProtein);
+	}
+	else if ( options.alphabet.size() != 0 )
+	{
+		setAlphabetFromString(parameters, options.alphabet.c_str());
+	}
+	else
+	{
+		setAlphabetFromString(parameters, alphabetNucleotide);
+	}
+}
+
+static MinHashHeap * newHeap(const Sketch::Parameters & parameters)
+{
+	return new MinHashHeap(parameters.use64, parameters.minHashesPerWindow, parameters.reads ? parameters.minCov : 1);
+}
+
+// Adds the hashes of a sequence, uppercased (as sketching files does) unless
+// preserving case.
+//
+static void addSequence(MinHashHeap & heap, const char * data, uint64_t length, const Sketch::Parameters & parameters, string & buffer)
+{
+	if ( length < uint64_t(parameters.kmerSize) )
+	{
+		return;
+	}
+
+	if ( ! parameters.preserveCase )
+	{
+		buffer.assign(data, length);
+
+		for ( uint64_t i = 0; i < length; i++ )
+		{
+			if ( buffer[i] > 96 && buffer[i] < 123 )
+			{
+				buffer[i] -= 32;
+			}
+		}
+
+		data = buffer.data();
+	}
+
+	addMinHashes(heap, data, length, parameters);
+}
+
+static MinHash finish(const MinHashHeap & heap, const Options & options, const Sketch::Parameters & parameters, const string & name, const string & comment, uint64_t length)
+{
+	shared_ptr<MinHash::Data> data = make_shared<MinHash::Data>();
+	Sketch::Reference & reference = data->reference;
+
+	data->options = options;
+	data->parameters = parameters;
+
+	reference.name = name;
+	reference.comment = comment;
+	reference.length = length;
+	reference.hashesSorted.setUse64(parameters.use64);
+
+	setMinHashesForReference(reference, heap);
+
+	return MinHash(data);
+}
+
+MinHash sketchSequence(const Sequence & sequence, const Options & options)
+{
+	Sketch::Parameters parameters;
+	setParameters(parameters, options);
+
+	unique_ptr<MinHashHeap> heap(newHeap(parameters));
+	string buffer;
+
+	addSequence(*heap, sequence.data, sequence.length, parameters, buffer);
+
+	return finish(*heap, options, parameters, sequence.name, sequence.comment, sequence.length);
+}
+
+MinHash sketchChunks(const ChunkCallback & nextChunk, const Options & options, const string & name, const string & comment)
+{
+	Sketch::Parameters parameters;
+	setParameters(parameters, options);
+
+	unique_ptr<MinHashHeap> heap(newHeap(parameters));
+	string buffer;
+	Sequence chunk;
+	uint64_t length = 0;
+
+	while ( nextChunk(chunk) )
+	{
+		addSequence(*heap, chunk.data, chunk.length, parameters, buffer);
+		length += chunk.length;
+	}
+
+	return finish(*heap, options, parameters, name, comment, length);
+}
+
+vector<MinHash> sketchSequences(const vector<Sequence> & sequences, const Options & options, Threads * threads)
+{
+	vector<MinHash> sketches(sequences.size());
+
+	runRanges(sequences.size(), threads, [&](uint64_t first, uint64_t last)
+	{
+		for ( uint64_t i = first; i < last; i++ )
+		{
+			sketches[i] = sketchSequence(sequences[i], options);
+		}
+	});
+
+	return sketches;
+}
+
+const string & MinHash::getName() const {return data->reference.name;}
+const string & MinHash::getComment() const {return data->reference.comment;}
+uint64_t MinHash::getLength() const {return data->reference.length;}
+bool MinHash::getUse64() const {return data->parameters.use64;}
+const Options & MinHash::getOptions() const {return data->options;}
+
+Span<uint32_t> MinHash::getHashes32() const
+{
+	const HashList & hashes = data->reference.hashesSorted;
+	return hashes.get64() ? Span<uint32_t>() : Span<uint32_t>(hashes.data32(), hashes.size());
+}
+
+Span<uint64_t> MinHash::getHashes64() const
+{
+	const HashList & hashes = data->reference.hashesSorted;
+	return hashes.get64() ? Span<uint64_t>(hashes.data64(), hashes.size()) : Span<uint64_t>();
+}
+
+Span<uint32_t> MinHash::getCounts() const
+{
+	return Span<uint32_t>(data->reference.counts.data(), data->reference.counts.size());
+}
+
+// Comparing
+
+bool compatible(const MinHash & a, const MinHash & b)
+{
+	const Sketch::Parameters & parametersA = a.getData().parameters;
+	const Sketch::Parameters & parametersB = b.getData().parameters;
+
+	return
+		parametersA.kmerSize == parametersB.kmerSize &&
+		parametersA.seed == parametersB.seed &&
+		parametersA.use64 == parametersB.use64 &&
+		parametersA.noncanonical == parametersB.noncanonical &&
+		memcmp(parametersA.alphabet, parametersB.alphabet, sizeof(parametersA.alphabet)) == 0;
+}
+
+static Distance compareWith(const MinHash & reference, const MinHash & query, const CommandDistance::CompareTables * tables)
+{
+	const Sketch::Parameters & parameters = reference.getData().parameters;
+
+	CommandDistance::CompareOutput::PairOutput pair;
+	Distance distance;
+
+	compareSketches
+	(
+		&pair,
+		reference.getData().reference,
+		query.getData().reference,
+		min(parameters.minHashesPerWindow, query.getData().parameters.minHashesPerWindow),
+		parameters.kmerSize,
+		pow(parameters.alphabetSize, parameters.kmerSize),
+		-1,
+		-1,
+		tables
+	);
+
+	distance.distance = pair.distance;
+	distance.pValue = pair.pValue;
+	distance.shared = pair.numer;
+	distance.hashes = pair.denom;
+
+	return distance;
+}
+
+Distance compare(const MinHash & reference, const MinHash & query)
+{
+	return compareWith(reference, query, 0);
+}
+
+void compareAll(const vector<MinHash> & references, const vector<MinHash> & queries, vector<Distance> & distances, Threads * threads)
+{
+	distances.resize(references.size() * queries.size());
+
+	if ( distances.size() == 0 )
+	{
+		return;
+	}
+
+	// the tables are for one sketch size, so only if all have it
+	//
+	uint64_t sketchSize = references[0].getData().parameters.minHashesPerWindow;
+	bool sameSize = true;
+
+	for ( size_t i = 0; i < references.size(); i++ )
+	{
+		sameSize &= references[i].getData().parameters.minHashesPerWindow == sketchSize;
+	}
+
+	for ( size_t i = 0; i < queries.size(); i++ )
+	{
+		sameSize &= queries[i].getData().parameters.minHashesPerWindow == sketchSize;
+	}
+
+	unique_ptr<CommandDistance::CompareTables> tables;
+
+	if ( sameSize )
+	{
+		tables.reset(new CommandDistance::CompareTables(sketchSize, references[0].getData().parameters.kmerSize));
+	}
+
+	runRanges(distances.size(), threads, [&](uint64_t first, uint64_t last)
+	{
+		for ( uint64_t i = first; i < last; i++ )
+		{
+			distances[i] = compareWith(references[i % references.size()], queries[i / references.size()], tables.get());
+		}
+	});
+}
+
+// Screening
+
+struct Screen::State
+{
+	Sketch sketch; // of the queries
+	Sketch::Parameters parameters;
+	ScreenIndex index;
+	bool trans;
+
+	// of the mixture, for estimating its distinct k-mers
+	//
+	unique_ptr<MinHashHeap> heap;
+	mutex heapMutex;
+
+	MinHashHeap * newMixtureHeap() const {return new MinHashHeap(parameters.use64, parameters.minHashesPerWindow);}
+
+	void hash(const Sequence & sequence, MinHashHeap * heapTarget)
+	{
+		if ( sequence.length == 0 )
+		{
+			return;
+		}
+
+		// hashSequence() uppercases in place and deletes the copy with input
+		//
+		char * seq = new char[sequence.length];
+		memcpy(seq, sequence.data, sequence.length);
+
+		CommandScreen::HashInput input(index, heapTarget, seq, sequence.length, parameters, trans);
+		delete hashSequence(&input);
+	}
+
+	void merge(const MinHashHeap & heapOther)
+	{
+		lock_guard<mutex> lock(heapMutex);
+		heap->merge(heapOther);
+	}
+};
+
+Screen::Screen(const vector<MinHash> & queries, Threads * threads)
+	:
+	state(new State())
+{
+	vector<Sketch::Reference> references(queries.size());
+
+	for ( size_t i = 0; i < queries.size(); i++ )
+	{
+		references[i] = queries[i].getData().reference;
+	}
+
+	if ( queries.size() != 0 )
+	{
+		state->parameters = queries[0].getData().parameters;
+	}
+
+	state->sketch.initFromReferences(references, state->parameters);
+	state->trans = queries.size() != 0 && queries[0].getData().options.protein;
+	state->index.build(state->sketch, threads != 0 ? threads->getCount() : 1);
+	state->heap.reset(state->newMixtureHeap());
+}
+
+Screen::~Screen()
+{
+	delete state;
+}
+
+void Screen::add(const Sequence & sequence)
+{
+	state->hash(sequence, state->heap.get());
+}
+
+void Screen::add(const ChunkCallback & nextChunk)
+{
+	Sequence chunk;
+
+	while ( nextChunk(chunk) )
+	{
+		add(chunk);
+	}
+}
+
+void Screen::add(const vector<Sequence> & sequences, Threads * threads)
+{
+	runRanges(sequences.size(), threads, [&](uint64_t first, uint64_t last)
+	{
+		unique_ptr<MinHashHeap> heap(state->newMixtureHeap());
+
+		for ( uint64_t i = first; i < last; i++ )
+		{
+			state->hash(sequences[i], heap.get());
+		}
+
+		state->merge(*heap);
+	});
+}
+
+void Screen::getResults(vector<ScreenResult> & results, uint32_t minCopies, Threads * threads) const
+{
+	const Sketch & sketch = state->sketch;
+	uint64_t count = sketch.getReferenceCount();
+	int threadCount = threads != 0 ? threads->getCount() : 1;
+
+	vector<uint64_t> shared(count);
+	vector<vector<uint64_t>> depths(count);
+
+	gatherDepths(sketch, state->index, minCopies, 0, shared.data(), depths.data(), threadCount);
+
+	uint64_t setSize = state->heap->estimateSetSize();
+	results.resize(count);
+
+	for ( uint64_t i = 0; i < count; i++ )
+	{
+		ScreenResult & result = results[i];
+		uint64_t hashes = sketch.getReference(i).hashesSorted.size();
+
+		result.identity = estimateIdentity(shared[i], hashes, sketch.getKmerSize(), sketch.getKmerSpace());
+		result.shared = shared[i];
+		result.hashes = hashes;
+		result.pValue = pValueWithin(shared[i], setSize, sketch.getKmerSpace(), hashes);
+
+		if ( shared[i] != 0 )
+		{
+			nth_element(depths[i].begin(), depths[i].begin() + shared[i] / 2, depths[i].end());
+			result.medianMultiplicity = depths[i][shared[i] / 2];
+		}
+	}
+}
+
+void Screen::clear()
+{
+	state->index.clearCounts(1);
+	state->heap.reset(state->newMixtureHeap());
+}
+
+} // namespace api
+} // namespace mash
@@ -0,0 +1,225 @@
+// Copyright © 2015, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen,
+// Sergey Koren, and Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#ifndef INCLUDED_Api
+#define INCLUDED_Api
+
+#include <functional>
+#include <memory>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Sketching, comparing and screening in-process, for programs linking
+// libmash.a: sequences come from memory (buffers, or a callback giving them
+// in chunks) rather than files, and sketches, distances and screen results
+// come back as values rather than text. The results are those of the
+// commands with the same options (sketch, dist and screen).
+//
+// Only standard types appear here, so this header stays the same as the
+// internals change. Work is spread over a Threads given by the caller, which
+// can be kept and reused across calls (its threads sleep in between), or run
+// on the calling thread when there is none.
+
+namespace mash {
+namespace api {
+
+// Sketching options, as those of mash sketch.
+//
+struct Options
+{
+	int kmerSize = 0; // 0 for the default (21, or 9 for protein)
+	uint64_t sketchSize = 1000;
+	uint32_t seed = 42;
+	bool noncanonical = false; // only the given strand
+	bool protein = false; // (implies noncanonical)
+	std::string alphabet; // of a custom alphabet (implies noncanonical), if not empty
+	bool preserveCase = false;
+	uint32_t minCopies = 1; // of a k-mer for it to count (for reads, as -m)
+};
+
+// Why options cannot be sketched with (empty if they can). The sketching
+// functions expect options that can.
+//
+std::string checkOptions(const Options & options);
+
+// A read-only view of values owned elsewhere.
+//
+template <class T>
+struct Span
+{
+	Span() {}
+	Span(const T * dataNew, uint64_t sizeNew) : data(dataNew), size(sizeNew) {}
+
+	const T * begin() const {return data;}
+	const T * end() const {return data + size;}
+	const T & operator[](uint64_t index) const {return data[index];}
+
+	const T * data = 0;
+	uint64_t size = 0;
+};
+
+// A sequence (or a chunk of one) in memory, which is not copied or kept
+// beyond the call it is given to.
+//
+struct Sequence
+{
+	Sequence() {}
+	Sequence(const char * dataNew, uint64_t lengthNew, const std::string & nameNew = "", const std::string & commentNew = "")
+		: data(dataNew), length(lengthNew), name(nameNew), comment(commentNew) {}
+
+	const char * data = 0;
+	uint64_t length = 0;
+	std::string name;
+	std::string comment;
+};
+
+// Gives the next chunk of a sequence (or of a set of them, as mash sketches
+// the records of a file) by setting its data and length; false when there are
+// no more. Chunks are sketched as separate sequences, so k-mers spanning two
+// are not included; the data need only stay valid until the next call.
+//
+typedef std::function<bool(Sequence & chunk)> ChunkCallback;
+
+// A pool of threads to run work on, kept until destroyed. Used by one call at
+// a time.
+//
+class Threads
+{
+public:
+
+	Threads(int countNew);
+	~Threads();
+
+	int getCount() const {return count;}
+
+	// Runs each job on the threads (or on the calling thread, if there is
+	// only one), returning once all have.
+	//
+	void run(const std::vector<std::function<void()>> & jobs);
+
+	struct Pool;
+
+private:
+
+	int count;
+	Pool * pool = 0;
+};
+
+// The sketch of one sequence (or set of them), as a reference of a sketch
+// file. Cheap to copy, and immutable: copies share the hashes.
+//
+class MinHash
+{
+public:
+
+	struct Data;
+
+	MinHash() {}
+	MinHash(std::shared_ptr<const Data> dataNew) : data(dataNew) {}
+
+	bool empty() const {return data == 0;} // default-constructed
+
+	const std::string & getName() const;
+	const std::string & getComment() const;
+	uint64_t getLength() const; // of the sequence(s)
+
+	// The hashes, sorted; 64-bit unless the k-mer space fits in 32 bits (see
+	// getUse64()), in which case only getHashes32() has them.
+	//
+	bool getUse64() const;
+	Span<uint32_t> getHashes32() const;
+	Span<uint64_t> getHashes64() const;
+	Span<uint32_t> getCounts() const; // of each hash, if sketched with minCopies > 1
+
+	const Options & getOptions() const;
+
+	const Data & getData() const {return *data;}
+
+private:
+
+	std::shared_ptr<const Data> data;
+};
+
+MinHash sketchSequence(const Sequence & sequence, const Options & options);
+MinHash sketchChunks(const ChunkCallback & nextChunk, const Options & options, const std::string & name = "", const std::string & comment = "");
+
+// sketches each sequence on its own, over threads
+//
+std::vector<MinHash> sketchSequences(const std::vector<Sequence> & sequences, const Options & options, Threads * threads = 0);
+
+// As a pair of mash dist; shared / hashes is the Jaccard estimate.
+//
+struct Distance
+{
+	double distance = 1;
+	double pValue = 1;
+	uint64_t shared = 0;
+	uint64_t hashes = 0; // of the union compared
+};
+
+// Whether sketches can be compared with each other (same k-mer size,
+// alphabet, seed and hash size).
+//
+bool compatible(const MinHash & a, const MinHash & b);
+
+// Compares (compatible) sketches.
+//
+Distance compare(const MinHash & reference, const MinHash & query);
+
+// Compares every query to every reference over threads, giving the distance
+// of query q to reference r at distances[q * references.size() + r].
+//
+void compareAll(const std::vector<MinHash> & references, const std::vector<MinHash> & queries, std::vector<Distance> & distances, Threads * threads = 0);
+
+// As a line of mash screen.
+//
+struct ScreenResult
+{
+	double identity = 0;
+	uint64_t shared = 0;
+	uint64_t hashes = 0; // of the query
+	uint64_t medianMultiplicity = 0; // of the shared hashes in the mixture
+	double pValue = 1;
+};
+
+// Screens mixtures given in any number of pieces against an index of the
+// hashes of (compatible) queries, which is built once and can be reused for
+// further mixtures after clear(). Protein queries are screened against all
+// six translated frames of the mixture, as by the command.
+//
+class Screen
+{
+public:
+
+	Screen(const std::vector<MinHash> & queries, Threads * threads = 0);
+	~Screen();
+
+	void add(const Sequence & sequence);
+	void add(const ChunkCallback & nextChunk);
+	void add(const std::vector<Sequence> & sequences, Threads * threads = 0);
+
+	// One for each query, in order; with minCopies, only hashes with at
+	// least that many copies in the mixture are counted as shared.
+	//
+	void getResults(std::vector<ScreenResult> & results, uint32_t minCopies = 1, Threads * threads = 0) const;
+
+	void clear(); // for the next mixture
+
+	struct State;
+
+private:
+
+	Screen(const Screen &);
+	Screen & operator=(const Screen &);
+
+	State * state;
+};
+
+} // namespace api
+} // namespace mash
+
+#endif
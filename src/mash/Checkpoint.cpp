@@ -0,0 +1,190 @@
+// Copyright © 2015, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen,
+// Sergey Koren, and Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#include "Checkpoint.h"
+#include <fcntl.h>
+#include <iostream>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace::std;
+
+bool Checkpoint::sameRun(const Checkpoint & other) const
+{
+    return
+        version == other.version &&
+        run.sameRun(other.run) &&
+        run.index == other.run.index &&
+        run.pairBegin == other.run.pairBegin &&
+        run.pairEnd == other.run.pairEnd &&
+        format == other.format;
+}
+
+string checkpointFile(const string & output)
+{
+    return output + ".checkpoint";
+}
+
+static bool syncFile(const string & file)
+{
+    int fd = open(file.c_str(), O_RDONLY);
+
+    if ( fd < 0 )
+    {
+        return false;
+    }
+
+    bool synced = fsync(fd) == 0;
+
+    close(fd);
+    return synced;
+}
+
+bool writeCheckpoint(const string & output, const Checkpoint & checkpoint)
+{
+    string file = checkpointFile(output);
+    string fileNew = file + ".new";
+
+    if ( ! syncFile(output) )
+    {
+        return false;
+    }
+
+    FILE * stream = fopen(fileNew.c_str(), "wb");
+
+    if ( stream == NULL )
+    {
+        return false;
+    }
+
+    bool written =
+        fwrite(&checkpoint, sizeof(Checkpoint), 1, stream) == 1 &&
+        fflush(stream) == 0 &&
+        fsync(fileno(stream)) == 0;
+
+    if ( fclose(stream) != 0 || ! written )
+    {
+        remove(fileNew.c_str());
+        return false;
+    }
+
+    return rename(fileNew.c_str(), file.c_str()) == 0;
+}
+
+bool readCheckpoint(const string & output, Checkpoint & checkpoint)
+{
+    FILE * stream = fopen(checkpointFile(output).c_str(), "rb");
+
+    if ( stream == NULL )
+    {
+        return false;
+    }
+
+    bool read = fread(&checkpoint, sizeof(Checkpoint), 1, stream) == 1;
+
+    fclose(stream);
+    return read && checkpoint.magic == Checkpoint::magicValue;
+}
+
+void removeCheckpoint(const string & output)
+{
+    remove(checkpointFile(output).c_str());
+}
+
+bool resumeOutput(const string & output, Checkpoint & checkpoint, ofstream & stream, bool truncate)
+{
+    Checkpoint last;
+    
+    if ( ! readCheckpoint(output, last) )
+    {
+        cerr << "No checkpoint for " << output << "; starting from the beginning." << endl;
+        
+        checkpoint.pairDone = checkpoint.run.pairBegin;
+        checkpoint.bytes = 0;
+        stream.open(output, ios::out | ios::binary | ios::trunc);
+        
+        if ( ! stream.is_open() )
+        {
+            cerr << "ERROR: could not open " << output << " for writing." << endl;
+            return false;
+        }
+        
+        return true;
+    }
+    
+    if ( ! last.sameRun(checkpoint) )
+    {
+        cerr << "ERROR: " << checkpointFile(output) << " is from a different run (inputs, options or shard differ); rerun without -resume to start over." << endl;
+        return false;
+    }
+    
+    struct stat info;
+    
+    if ( stat(output.c_str(), &info) != 0 || uint64_t(info.st_size) < last.bytes )
+    {
+        cerr << "ERROR: " << output << " is missing or shorter than its checkpoint; rerun without -resume to start over." << endl;
+        return false;
+    }
+    
+    if ( truncate && ::truncate(output.c_str(), last.bytes) != 0 )
+    {
+        cerr << "ERROR: could not truncate " << output << "." << endl;
+        return false;
+    }
+    
+    stream.open(output, ios::in | ios::out | ios::binary);
+    
+    if ( ! stream.is_open() )
+    {
+        cerr << "ERROR: could not open " << output << " for writing." << endl;
+        return false;
+    }
+    
+    stream.seekp(last.bytes);
+    checkpoint = last;
+    
+    cerr << "Resuming " << output << " from pair " << last.pairDone << " (" << last.pairDone - last.run.pairBegin << " of " << last.run.pairEnd - last.run.pairBegin << " done)" << endl;
+    
+    return true;
+}
+
+bool CheckpointTimer::due()
+{
+    if ( stopAfter != 0 )
+    {
+        return true;
+    }
+
+    if ( interval == 0 )
+    {
+        return false;
+    }
+
+    time_t now = time(0);
+
+    if ( now - last < time_t(interval) )
+    {
+        return false;
+    }
+
+    last = now;
+    return true;
+}
+
+void CheckpointTimer::written()
+{
+    count++;
+
+    if ( stopAfter != 0 && count == stopAfter )
+    {
+        // no cleanup, so the output and checkpoint are left as a kill would
+        // leave them
+        //
+        cerr << "Stopping after checkpoint " << count << "." << endl;
+        _exit(3);
+    }
+}
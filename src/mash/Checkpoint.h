@@ -0,0 +1,92 @@
+// Copyright © 2015, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen,
+// Sergey Koren, and Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#ifndef Checkpoint_h
+#define Checkpoint_h
+
+#include "Shard.h"
+#include <fstream>
+#include <stdint.h>
+#include <string>
+#include <time.h>
+
+// Progress records for dist and triangle runs with -o, so a run that is
+// stopped part way (preempted, killed, out of memory) can be continued with
+// -resume instead of started over. The binary output is written in pair
+// order (see Shard.h), so the progress is just the first pair not yet in the
+// output and the length of the output up to it. Every so often the output
+// is synced and a Checkpoint is written next to it (<output>.checkpoint,
+// replaced atomically); it is removed when the run finishes.
+//
+// -resume checks that the checkpoint is from the same run (inputs, options
+// and shard), truncates the output to the recorded length and computes the
+// rest of the pairs, giving the output the run would have written in one go.
+
+struct Checkpoint
+{
+    static const uint64_t magicValue = 0x54504b4348534d; // "MSHCKPT" in file order
+    static const uint64_t versionCurrent = 1;
+
+    uint64_t magic = magicValue;
+    uint64_t version = versionCurrent;
+
+    ShardHeader run; // the run's identity and its range of pairs
+    uint64_t format = 0; // output format options not in the ShardHeader
+
+    uint64_t pairDone = 0; // pairs before this are in the output
+    uint64_t bytes = 0; // of output up to pairDone
+    double pValuePeak = 0; // for triangle's report
+
+    bool sameRun(const Checkpoint & other) const;
+};
+
+std::string checkpointFile(const std::string & output);
+
+// Syncs output (which the caller has flushed) and then replaces its
+// checkpoint; false if either fails.
+//
+bool writeCheckpoint(const std::string & output, const Checkpoint & checkpoint);
+
+// false if there is no (complete) checkpoint for output
+//
+bool readCheckpoint(const std::string & output, Checkpoint & checkpoint);
+
+void removeCheckpoint(const std::string & output);
+
+// Opens output into stream to continue the run in checkpoint.run from its
+// last checkpoint (which must be from the same run), cutting it back to the
+// checkpoint's length unless truncate is false (for outputs that are written
+// in place). The progress is then in checkpoint; with no checkpoint, output
+// is started over from the run's first pair. false (with an error message)
+// if output cannot be continued.
+//
+bool resumeOutput(const std::string & output, Checkpoint & checkpoint, std::ofstream & stream, bool truncate = true);
+
+// Times checkpoints (every interval seconds; never if 0). With stopAfter,
+// for testing -resume, every checkpoint is due and the process exits at once
+// after the stopAfter-th is written (see written()), as if it were killed.
+//
+class CheckpointTimer
+{
+public:
+
+    CheckpointTimer(uint64_t intervalNew, uint64_t stopAfterNew = 0) : interval(intervalNew), stopAfter(stopAfterNew), count(0), last(time(0)) {}
+
+    bool due();
+
+    // called after each checkpoint is written
+    //
+    void written();
+
+private:
+
+    uint64_t interval;
+    uint64_t stopAfter;
+    uint64_t count;
+    time_t last;
+};
+
+#endif
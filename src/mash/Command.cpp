@@ -10,6 +10,9 @@
 #include <fstream>
 
 #include "Command.h"
+#include "Numa.h"
+#include "simd.h"
+#include "Stats.h"
 #include "version.h"
 
 using std::cout;
@@ -176,7 +179,7 @@ Command::Command()
     addAvailableOption("warning", Option(Option::Number, "w", "Sketch", "Probability threshold for warning about low k-mer size.", "0.01", 0, 1));
     addAvailableOption("reads", Option(Option::Boolean, "r", "Sketch", "Input is a read set. See Reads options below. Incompatible with -i.", ""));
     addAvailableOption("seed", Option(Option::Integer, "S", "Sketch", "Seed to provide to the hash function.", "42", 0, 0xFFFFFFFF));
-    addAvailableOption("memory", Option(Option::Size, "b", "Reads", "Use a Bloom filter of this size (raw bytes or with K/M/G/T) to filter out unique k-mers. This is useful if exact filtering with -m uses too much memory. However, some unique k-mers may pass erroneously, and copies cannot be counted beyond 2. Implies -r."));
+    addAvailableOption("memory", Option(Option::Size, "b", "Reads", "Use a counting filter of this size (raw bytes or with K/M/G/T) to filter out k-mers with fewer copies than -m (2 by default, at most 15). This is useful if exact filtering with -m uses too much memory. However, some k-mers may pass erroneously, more so if the filter is small for the number of distinct k-mers. Implies -r."));
     addAvailableOption("minCov", Option(Option::Integer, "m", "Reads", "Minimum copies of each k-mer required to pass noise filter for reads. Implies -r.", "1"));
     addAvailableOption("targetCov", Option(Option::Number, "c", "Reads", "Target coverage. Sketching will conclude if this coverage is reached before the end of the input file (estimated by average k-mer multiplicity). Implies -r."));
     addAvailableOption("genome", Option(Option::Size, "g", "Reads", "Genome size (raw bases or with K/M/G/T). If specified, will be used for p-value calculation instead of an estimated size from k-mer content. Implies -r."));
@@ -185,10 +188,18 @@ Command::Command()
     addAvailableOption("alphabet", Option(Option::String, "z", "Alphabet", "Alphabet to base hashes on (case ignored by default; see -Z). K-mers with other characters will be ignored. Implies -n.", ""));
     addAvailableOption("case", Option(Option::Boolean, "Z", "Alphabet", "Preserve case in k-mers and alphabet (case is ignored by default). Sequence letters whose case is not in the current alphabet will be skipped when sketching.", ""));
     addAvailableOption("threads", Option(Option::Integer, "p", "", "Parallelism. This many threads will be spawned for processing.", "1"));
+    addAvailableOption("simd", Option(Option::String, "simd", "", "Instruction set for hashing and comparison (auto, none, sse4, avx2, avx512). By default the best one supported by this CPU is used.", "auto"));
+    addAvailableOption("numa", Option(Option::Boolean, "numa", "", "On machines with several NUMA nodes (sockets), spread the threads over the nodes and interleave the memory of the sketches over them, so threads on every node read them at the same cost. Sketch files are then loaded rather than mapped.", ""));
+    addAvailableOption("cache", Option(Option::File, "cache", "", "Share the reference sketch file (.msh) with other runs on this machine through a copy in this directory (e.g. /dev/shm), published by the first run to load it and mapped by the rest. Copies are replaced when the original changes.", ""));
+    addAvailableOption("stats", Option(Option::File, "stats", "", "Write counts and times of each stage of the run (reading, decompression, parsing, hashing, merging, writing and waits between threads), summed and by thread, as JSON to this file (\"-\" for standard error).", ""));
     addAvailableOption("pacbio", Option(Option::Boolean, "pacbio", "", "Use default settings for PacBio sequences.", ""));
     addAvailableOption("illumina", Option(Option::Boolean, "illumina", "", "Use default settings for Illumina sequences.", ""));
     addAvailableOption("nanopore", Option(Option::Boolean, "nanopore", "", "Use default settings for Oxford Nanopore sequences.", ""));
     addAvailableOption("factor", Option(Option::Number, "f", "Window", "Compression factor", "100"));
+    addAvailableOption("append", Option(Option::Boolean, "append", "Output", "Add the new sketches to the output file if it exists, in place, rather than replacing it. Its parameters must match. Only the new sketches are written, as an extra part of the file that is read along with the rest; paste the file to fold its parts into one.", ""));
+    addAvailableOption("index", Option(Option::Boolean, "index", "Output", "Also write an index of sketch names (<output>.msh.idx), so subsets can be loaded quickly with -names.", ""));
+    addAvailableOption("names", Option(Option::File, "names", "Input", "Only load sketches with these names (one per line) from sketch files. Uses the index of each sketch file, if present (see 'mash sketch -index').", ""));
+    addAvailableOption("range", Option(Option::String, "range", "Input", "Only load sketches at these positions in sketch files, as <first>-<last> (0-based, inclusive).", ""));
 	//addAvailableOption("freeMemory", Option(Option::Boolean, "fw", "Output", "free the memory by writeToCpanp to several subfiles intermediately.", ""));
 
     addCategory("", "");
@@ -344,7 +355,44 @@ int Command::run(int argc, const char ** argv)
         }
     }
     
-    return run();
+    if ( options.count("simd") && options.at("simd").active )
+    {
+        SimdLevel level;
+        
+        if ( ! parseSimdLevel(options.at("simd").argument, level) )
+        {
+            cerr << "ERROR: Unknown instruction set for -simd: " << options.at("simd").argument << endl;
+            return 1;
+        }
+        
+        if ( ! setSimdLevel(level) )
+        {
+            cerr << "ERROR: " << getSimdLevelName(level) << " instructions are not supported by this CPU" << endl;
+            return 1;
+        }
+    }
+    
+    if ( options.count("numa") && options.at("numa").active && ! enableNuma() )
+    {
+        cerr << "WARNING: Found one NUMA node; -numa has no effect." << endl;
+    }
+    
+    bool stats = options.count("stats") && options.at("stats").active;
+    
+    if ( stats )
+    {
+        Stats::enable();
+    }
+    
+    int result = run();
+    
+    if ( stats && ! Stats::write(options.at("stats").argument, name) )
+    {
+        cerr << "ERROR: Could not write stats to " << options.at("stats").argument << endl;
+        return 1;
+    }
+    
+    return result;
 }
 
 void Command::useOption(string name)
@@ -355,6 +403,8 @@ void Command::useOption(string name)
 void Command::useSketchOptions()
 {
     useOption("threads");
+    useOption("simd");
+    useOption("stats");
     useOption("kmer");
     useOption("noncanonical");
     useOption("protein");
@@ -0,0 +1,440 @@
+// Copyright © 2015, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen,
+// Sergey Koren, and Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#include "CommandCluster.h"
+#include "CommandTriangle.h"
+#include "Sketch.h"
+#include "HyperLogLog.h"
+#include "ThreadPool.h"
+#include "sketchParameterSetup.h"
+#include <iostream>
+#include <math.h>
+
+using namespace::std;
+
+namespace mash {
+
+CommandCluster::CommandCluster()
+: Command()
+{
+    name = "cluster";
+    summary = "Cluster sequences by distance without a distance matrix.";
+    description = "Cluster the input sequences, as compared by \"triangle\", straight from the comparisons, without storing any distances. By default, clusters are the single-linkage clusters at the maximum distance (connected by chains of pairs within it); pairs already in the same cluster are not compared. With -greedy, each sequence in input order joins the nearest earlier representative within the maximum distance, or becomes a representative itself, and is only compared to the representatives that share enough hashes to be within it. The input sequences can be fasta or fastq, gzipped or not, or Mash sketch files (.msh) with matching k-mer sizes. The output format is [seq-ID, cluster, representative-ID], with clusters numbered from 1 in the order of their first member (which, for single linkage, is the representative).";
+    argumentString = "<seq1> [<seq2>] ...";
+    
+    useOption("help");
+    addOption("list", Option(Option::Boolean, "l", "Input", "List input. Lines in each <seq> specify paths to sequence files, one per line.", ""));
+    addOption("comment", Option(Option::Boolean, "C", "Output", "Use comment fields for sequence names instead of IDs.", ""));
+    addOption("distance", Option(Option::Number, "d", "Output", "Maximum distance for clustering (less than 1).", "0.05", 0., 1.));
+    addOption("pvalue", Option(Option::Number, "v", "Output", "Maximum p-value for clustering.", "1.0", 0., 1.));
+    addOption("greedy", Option(Option::Boolean, "greedy", "Output", "Greedy clustering around representatives instead of single linkage.", ""));
+    addOption("prefilter", Option(Option::Boolean, "prefilter", "Output", "Compare the smallest 128-512 hashes of each pair first (as for triangle -prefilter).", ""));
+    useSketchOptions();
+}
+
+int CommandCluster::run() const
+{
+    if ( arguments.size() < 1 || options.at("help").active )
+    {
+        print();
+        return 0;
+    }
+    
+    int threads = options.at("threads").getArgumentAsNumber();
+    bool list = options.at("list").active;
+    bool comment = options.at("comment").active;
+    bool greedy = options.at("greedy").active;
+    double distanceMax = options.at("distance").getArgumentAsNumber();
+    double pValueMax = options.at("pvalue").getArgumentAsNumber();
+    
+    if ( distanceMax >= 1 )
+    {
+        cerr << "ERROR: The maximum distance (-" << options.at("distance").identifier << ") must be less than 1." << endl;
+        return 1;
+    }
+    
+    Sketch::Parameters parameters;
+    
+    if ( sketchParameterSetup(parameters, *(Command *)this) )
+    {
+        return 1;
+    }
+    
+    if ( arguments.size() == 1 )
+    {
+        parameters.concatenated = false;
+    }
+    
+    vector<string> files;
+    
+    for ( size_t i = 0; i < arguments.size(); i++ )
+    {
+        if ( list )
+        {
+            splitFile(arguments[i], files);
+        }
+        else
+        {
+            files.push_back(arguments[i]);
+        }
+    }
+    
+    Sketch sketch;
+    
+    sketch.initFromFiles(files, parameters);
+    
+    uint64_t count = sketch.getReferenceCount();
+    uint64_t compared = 0;
+    vector<uint64_t> representatives(count); // of each sequence
+    
+    CommandDistance::CompareTables tables(sketch.getMinHashesPerWindow(), sketch.getKmerSize());
+    
+    if ( options.at("prefilter").active )
+    {
+        tables.enablePrefilter(distanceMax);
+        tables.enableSizeFilter(distanceMax, sketch.getReferenceCount() ? hllGetPrecision(sketch.getReference(0).hll.size()) : 0);
+    }
+    
+    if ( ! greedy )
+    {
+        UnionFind clusters(count);
+        ThreadPool<TileInput, TileOutput> threadPool(clusterTile, threads);
+        uint64_t tileSize = CommandTriangle::getTileSize(count < 2 ? 0 : count * (count - 1) / 2, threads);
+        
+        // tiles in triangle order, so clusters within the earlier sequences
+        // are joined (and their pairs skipped) before the later rows
+        //
+        for ( uint64_t rowStart = 1; rowStart < count; rowStart += tileSize )
+        {
+            uint64_t rowEnd = min(rowStart + tileSize, count);
+            
+            for ( uint64_t columnStart = 0; columnStart < rowEnd - 1; columnStart += tileSize )
+            {
+                threadPool.runWhenThreadAvailable(new TileInput(sketch, rowStart, rowEnd, columnStart, min(columnStart + tileSize, rowEnd - 1), distanceMax, pValueMax, tables, clusters));
+                
+                while ( threadPool.outputAvailable() )
+                {
+                    TileOutput * output = threadPool.popOutputWhenAvailable();
+                    compared += output->compared;
+                    delete output;
+                }
+            }
+        }
+        
+        while ( threadPool.running() )
+        {
+            TileOutput * output = threadPool.popOutputWhenAvailable();
+            compared += output->compared;
+            delete output;
+        }
+        
+        for ( uint64_t i = 0; i < count; i++ )
+        {
+            representatives[i] = clusters.find(i);
+        }
+    }
+    else
+    {
+        // Candidates are matched in batches, in parallel, against the
+        // representatives chosen before the batch. Then each also goes
+        // through the representatives chosen within the batch before it (which
+        // are indexed as they are chosen, while the threads are idle), so the
+        // result does not depend on the batch size or thread count.
+        //
+        Representatives chosen;
+        ThreadPool<GreedyInput, GreedyOutput> threadPool(matchCandidates, threads);
+        uint64_t batchSize = candidatesPerInput * inputsPerThread * threads;
+        
+        for ( uint64_t batch = 0; batch < count; batch += batchSize )
+        {
+            uint64_t batchEnd = min(batch + batchSize, count);
+            uint64_t indexed = chosen.sketches.size();
+            
+            for ( uint64_t start = batch; start < batchEnd; start += candidatesPerInput )
+            {
+                threadPool.runWhenThreadAvailable(new GreedyInput(sketch, start, min(start + candidatesPerInput, batchEnd), distanceMax, pValueMax, tables, chosen));
+            }
+            
+            vector<GreedyOutput *> outputs;
+            
+            while ( threadPool.running() )
+            {
+                outputs.push_back(threadPool.popOutputWhenAvailable());
+            }
+            
+            for ( uint64_t o = 0; o < outputs.size(); o++ )
+            {
+                GreedyOutput * output = outputs[o];
+                
+                compared += output->compared;
+                
+                for ( uint64_t i = 0; i < output->matches.size(); i++ )
+                {
+                    uint64_t candidate = output->start + i;
+                    GreedyOutput::Match match = output->matches[i];
+                    GreedyOutput::Match matchNew = matchRepresentative(sketch, candidate, chosen, indexed, chosen.sketches.size(), distanceMax, pValueMax, tables, true, compared);
+                    
+                    if ( matchNew.representative != GreedyOutput::noMatch && (match.representative == GreedyOutput::noMatch || matchNew.distance < match.distance) )
+                    {
+                        match = matchNew;
+                    }
+                    
+                    if ( match.representative == GreedyOutput::noMatch )
+                    {
+                        representatives[candidate] = candidate;
+                        chosen.sketches.push_back(candidate);
+                        chosen.add(sketch, chosen.sketches.size() - 1);
+                    }
+                    else
+                    {
+                        representatives[candidate] = chosen.sketches[match.representative];
+                    }
+                }
+                
+                delete output;
+            }
+        }
+    }
+    
+    vector<uint64_t> numbers(count, 0); // of clusters, by representative
+    uint64_t clusterCount = 0;
+    
+    for ( uint64_t i = 0; i < count; i++ )
+    {
+        uint64_t representative = representatives[i];
+        
+        if ( numbers[representative] == 0 )
+        {
+            numbers[representative] = ++clusterCount;
+        }
+        
+        const Sketch::Reference & ref = sketch.getReference(i);
+        const Sketch::Reference & rep = sketch.getReference(representative);
+        
+        cout << (comment ? ref.comment : ref.name) << '\t' << numbers[representative] << '\t' << (comment ? rep.comment : rep.name) << '\n';
+    }
+    
+    cout.flush();
+    cerr << count << " sequences in " << clusterCount << " clusters (" << compared << " pairs compared)" << endl;
+    
+    return 0;
+}
+
+CommandCluster::UnionFind::UnionFind(uint64_t count)
+    :
+    parents(count)
+{
+    for ( uint64_t i = 0; i < count; i++ )
+    {
+        parents[i].store(i, memory_order_relaxed);
+    }
+}
+
+uint64_t CommandCluster::UnionFind::find(uint64_t i)
+{
+    while ( true )
+    {
+        uint64_t parent = parents[i].load(memory_order_acquire);
+        
+        if ( parent == i )
+        {
+            return i;
+        }
+        
+        uint64_t grandparent = parents[parent].load(memory_order_acquire);
+        
+        if ( grandparent != parent )
+        {
+            // path halving; losing the race to another thread is harmless
+            //
+            parents[i].compare_exchange_weak(parent, grandparent, memory_order_acq_rel);
+        }
+        
+        i = grandparent;
+    }
+}
+
+void CommandCluster::UnionFind::join(uint64_t a, uint64_t b)
+{
+    while ( true )
+    {
+        a = find(a);
+        b = find(b);
+        
+        if ( a == b )
+        {
+            return;
+        }
+        
+        if ( a > b )
+        {
+            swap(a, b);
+        }
+        
+        uint64_t expected = b;
+        
+        // b may have been linked meanwhile; if so, find again
+        //
+        if ( parents[b].compare_exchange_strong(expected, a, memory_order_acq_rel) )
+        {
+            return;
+        }
+    }
+}
+
+void CommandCluster::Representatives::add(const Sketch & sketch, uint64_t index)
+{
+    const HashList & hashList = sketch.getReference(sketches[index]).hashesSorted;
+    
+    if ( hashList.size() == 0 )
+    {
+        empty.push_back(index);
+    }
+    
+    for ( int i = 0; i < hashList.size(); i++ )
+    {
+        hashes[hashList.get64() ? hashList.at(i).hash64 : hashList.at(i).hash32].push_back(index);
+    }
+}
+
+CommandCluster::TileOutput * clusterTile(CommandCluster::TileInput * input)
+{
+    const Sketch & sketch = input->sketch;
+    CommandCluster::TileOutput * output = new CommandCluster::TileOutput();
+    CommandDistance::CompareOutput::PairOutput pair;
+    uint64_t sketchSize = sketch.getMinHashesPerWindow();
+    
+    for ( uint64_t row = input->rowStart; row < input->rowEnd; row++ )
+    {
+        for ( uint64_t column = input->columnStart; column < min(input->columnEnd, row); column++ )
+        {
+            if ( input->clusters.same(row, column) )
+            {
+                continue;
+            }
+            
+            compareSketches(&pair, sketch.getReference(row), sketch.getReference(column), sketchSize, sketch.getKmerSize(), sketch.getKmerSpace(), input->maxDistance, input->maxPValue, &input->tables);
+            output->compared++;
+            
+            if ( pair.pass )
+            {
+                input->clusters.join(row, column);
+            }
+        }
+    }
+    
+    return output;
+}
+
+CommandCluster::GreedyOutput * matchCandidates(CommandCluster::GreedyInput * input)
+{
+    CommandCluster::GreedyOutput * output = new CommandCluster::GreedyOutput();
+    
+    output->start = input->start;
+    output->matches.resize(input->end - input->start);
+    
+    for ( uint64_t i = input->start; i < input->end; i++ )
+    {
+        output->matches[i - input->start] = matchRepresentative(input->sketch, i, input->representatives, 0, input->representatives.sketches.size(), input->maxDistance, input->maxPValue, input->tables, true, output->compared);
+    }
+    
+    return output;
+}
+
+// A pair within the maximum distance has a Jaccard estimate of at least the
+// minimum for it, and that estimate is at most the hashes the sketches
+// share over min(sketch size, larger sketch), as for dist -prune.
+//
+CommandCluster::GreedyOutput::Match matchRepresentative(const Sketch & sketch, uint64_t candidate, const CommandCluster::Representatives & representatives, uint64_t start, uint64_t end, double maxDistance, double maxPValue, const CommandDistance::CompareTables & tables, bool index, uint64_t & compared)
+{
+    CommandCluster::GreedyOutput::Match match;
+    CommandDistance::CompareOutput::PairOutput pair;
+    const Sketch::Reference & query = sketch.getReference(candidate);
+    uint64_t sketchSize = sketch.getMinHashesPerWindow();
+    double jaccardMin = jaccardForDistance(maxDistance, sketch.getKmerSize());
+    
+    match.representative = CommandCluster::GreedyOutput::noMatch;
+    match.distance = 1;
+    
+    static thread_local vector<uint32_t> counts;
+    vector<uint32_t> touched;
+    
+    if ( index )
+    {
+        const HashList & hashList = query.hashesSorted;
+        
+        counts.resize(end);
+        
+        if ( hashList.size() == 0 )
+        {
+            for ( uint32_t position : representatives.empty )
+            {
+                if ( position >= start && position < end && counts[position]++ == 0 )
+                {
+                    touched.push_back(position);
+                }
+            }
+        }
+        
+        for ( int i = 0; i < hashList.size(); i++ )
+        {
+            auto found = representatives.hashes.find(hashList.get64() ? hashList.at(i).hash64 : hashList.at(i).hash32);
+            
+            if ( found == representatives.hashes.end() )
+            {
+                continue;
+            }
+            
+            for ( uint32_t position : found->second )
+            {
+                if ( position >= start && position < end && counts[position]++ == 0 )
+                {
+                    touched.push_back(position);
+                }
+            }
+        }
+        
+        sort(touched.begin(), touched.end());
+    }
+    else
+    {
+        for ( uint64_t position = start; position < end; position++ )
+        {
+            touched.push_back(position);
+        }
+    }
+    
+    for ( uint64_t position : touched )
+    {
+        const Sketch::Reference & ref = sketch.getReference(representatives.sketches[position]);
+        
+        if ( index )
+        {
+            uint64_t shared = counts[position];
+            uint64_t denomMin = min(sketchSize, uint64_t(max(ref.hashesSorted.size(), query.hashesSorted.size())));
+            
+            counts[position] = 0;
+            
+            if ( double(shared) < jaccardMin * denomMin )
+            {
+                continue;
+            }
+        }
+        
+        compareSketches(&pair, ref, query, sketchSize, sketch.getKmerSize(), sketch.getKmerSpace(), maxDistance, maxPValue, &tables);
+        compared++;
+        
+        if ( pair.pass && (match.representative == CommandCluster::GreedyOutput::noMatch || pair.distance < match.distance) )
+        {
+            match.representative = position;
+            match.distance = pair.distance;
+        }
+    }
+    
+    return match;
+}
+
+} // namespace mash
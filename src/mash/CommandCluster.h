@@ -0,0 +1,157 @@
+// Copyright © 2015, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen,
+// Sergey Koren, and Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#ifndef INCLUDED_CommandCluster
+#define INCLUDED_CommandCluster
+
+#include "Command.h"
+#include "CommandDistance.h"
+#include "Sketch.h"
+
+#include <atomic>
+#include <stdint.h>
+#include <unordered_map>
+#include <vector>
+
+namespace mash {
+
+class CommandCluster : public Command
+{
+public:
+    
+    // Disjoint sets that threads can join concurrently. Each set is a tree
+    // rooted at its smallest member, and links only go to smaller indices,
+    // so concurrent unions cannot form cycles and every set ends up rooted
+    // at the same member whatever the order of the unions.
+    //
+    class UnionFind
+    {
+    public:
+        
+        UnionFind(uint64_t count);
+        
+        uint64_t find(uint64_t i); // root (smallest member) of i's set
+        void join(uint64_t a, uint64_t b);
+        
+        // May be out of date by the time it returns, but only by sets that
+        // have since been joined.
+        //
+        bool same(uint64_t a, uint64_t b) {return find(a) == find(b);}
+        
+    private:
+        
+        std::vector<std::atomic<uint64_t>> parents;
+    };
+    
+    // A tile of the triangle for single linkage (as for triangle), whose
+    // passing pairs are joined by the worker. Pairs already in the same
+    // cluster are not compared.
+    //
+    struct TileInput
+    {
+        TileInput(const Sketch & sketchNew, uint64_t rowStartNew, uint64_t rowEndNew, uint64_t columnStartNew, uint64_t columnEndNew, double maxDistanceNew, double maxPValueNew, const CommandDistance::CompareTables & tablesNew, UnionFind & clustersNew)
+            :
+            sketch(sketchNew),
+            rowStart(rowStartNew),
+            rowEnd(rowEndNew),
+            columnStart(columnStartNew),
+            columnEnd(columnEndNew),
+            maxDistance(maxDistanceNew),
+            maxPValue(maxPValueNew),
+            tables(tablesNew),
+            clusters(clustersNew)
+            {}
+        
+        const Sketch & sketch;
+        uint64_t rowStart;
+        uint64_t rowEnd;
+        uint64_t columnStart;
+        uint64_t columnEnd;
+        double maxDistance;
+        double maxPValue;
+        const CommandDistance::CompareTables & tables;
+        UnionFind & clusters;
+    };
+    
+    struct TileOutput
+    {
+        uint64_t compared = 0;
+    };
+    
+    // Representatives for greedy clustering, with an index of their hashes
+    // so candidates only compare to those that share enough of them.
+    //
+    struct Representatives
+    {
+        void add(const Sketch & sketch, uint64_t index);
+        
+        std::vector<uint64_t> sketches; // indices in the input
+        std::unordered_map<uint64_t, std::vector<uint32_t>> hashes; // to positions in sketches
+        std::vector<uint32_t> empty; // positions of those without hashes (only at distance 0 from each other)
+    };
+    
+    // A run of candidates for greedy clustering, each compared to the
+    // representatives chosen before the batch it is in.
+    //
+    struct GreedyInput
+    {
+        GreedyInput(const Sketch & sketchNew, uint64_t startNew, uint64_t endNew, double maxDistanceNew, double maxPValueNew, const CommandDistance::CompareTables & tablesNew, const Representatives & representativesNew)
+            :
+            sketch(sketchNew),
+            start(startNew),
+            end(endNew),
+            maxDistance(maxDistanceNew),
+            maxPValue(maxPValueNew),
+            tables(tablesNew),
+            representatives(representativesNew)
+            {}
+        
+        const Sketch & sketch;
+        uint64_t start;
+        uint64_t end;
+        double maxDistance;
+        double maxPValue;
+        const CommandDistance::CompareTables & tables;
+        const Representatives & representatives;
+    };
+    
+    struct GreedyOutput
+    {
+        struct Match
+        {
+            uint64_t representative; // position, or noMatch
+            double distance;
+        };
+        
+        static const uint64_t noMatch = UINT64_MAX;
+        
+        uint64_t start;
+        std::vector<Match> matches; // by candidate
+        uint64_t compared = 0;
+    };
+    
+    CommandCluster();
+    
+    int run() const; // override
+    
+private:
+    
+    static const uint64_t candidatesPerInput = 16;
+    static const uint64_t inputsPerThread = 4; // per greedy batch
+};
+
+CommandCluster::TileOutput * clusterTile(CommandCluster::TileInput * input);
+CommandCluster::GreedyOutput * matchCandidates(CommandCluster::GreedyInput * input);
+
+// Nearest passing representative to candidate of those in positions [start,
+// end), preferring earlier ones if tied. If index is set, only those sharing
+// enough hashes to pass are compared (all of them otherwise).
+//
+CommandCluster::GreedyOutput::Match matchRepresentative(const Sketch & sketch, uint64_t candidate, const CommandCluster::Representatives & representatives, uint64_t start, uint64_t end, double maxDistance, double maxPValue, const CommandDistance::CompareTables & tables, bool index, uint64_t & compared);
+
+} // namespace mash
+
+#endif
@@ -5,12 +5,15 @@
 // See the LICENSE.txt file included with this software for license information.
 
 #include "CommandContain.h"
+#include "HyperLogLog.h"
 #include "Sketch.h"
 #include <iostream>
 #include <zlib.h>
 #include "ThreadPool.h"
 #include "sketchParameterSetup.h"
 #include <math.h>
+#include <algorithm>
+#include "simd.h"
 
 using namespace::std;
 
@@ -26,6 +29,7 @@ CommandContain::CommandContain()
     
     addOption("list", Option(Option::Boolean, "l", "Input", "List input. Each query file contains a list of sequence files, one per line. The reference file is not affected.", ""));
     addOption("errorThreshold", Option(Option::Number, "e", "Output", "Error bound threshold for reporting scores values. Error bounds can generally be increased by increasing the sketch size of the reference.", "0.05"));
+    addOption("hll", Option(Option::Boolean, "hll", "Output", "Score pairs whose sketches both have HyperLogLog registers (see sketch -hll) by the sizes of the query, the reference and their union estimated from those, rather than by min-hashes, so the score does not depend on the sketch size. The error bound is then that of the estimates. Other pairs are scored by min-hashes.", ""));
     useOption("help");
     useSketchOptions();
 }
@@ -103,6 +107,11 @@ int CommandContain::run() const
         string alphabet;
         sketchRef.getAlphabetAsString(alphabet);
         setAlphabetFromString(parameters, alphabet.c_str());
+        
+        if ( sketchRef.getReferenceCount() != 0 )
+        {
+            parameters.hll = hllGetPrecision(sketchRef.getReference(0).hll.size());
+        }
     }
     else
     {
@@ -110,6 +119,7 @@ int CommandContain::run() const
     }
     
     ThreadPool<ContainInput, ContainOutput> threadPool(contain, threads);
+    OutputWriter writer;
     
     vector<string> queryFiles;
     
@@ -160,34 +170,51 @@ int CommandContain::run() const
             j -= sketchRef.getReferenceCount();
         }
         
-		threadPool.runWhenThreadAvailable(new ContainInput(sketchRef, sketchQuery, j, i, pairsPerThread, parameters));
+		ContainInput * input = new ContainInput(sketchRef, sketchQuery, j, i, pairsPerThread, parameters);
+		
+		input->hll = options.at("hll").active;
+		threadPool.runWhenThreadAvailable(input);
 	
 		while ( threadPool.outputAvailable() )
 		{
-			writeOutput(threadPool.popOutputWhenAvailable(), parameters.error);
+			writeOutput(threadPool.popOutputWhenAvailable(), writer);
 		}
     }
     
     while ( threadPool.running() )
     {
-        writeOutput(threadPool.popOutputWhenAvailable(), parameters.error);
+        writeOutput(threadPool.popOutputWhenAvailable(), writer);
     }
     
     return 0;
 }
 
-void CommandContain::writeOutput(ContainOutput * output, float error) const
+void CommandContain::writeOutput(ContainOutput * output, OutputWriter & writer) const
+{
+    writer.write(output->text);
+    delete output;
+}
+
+static void formatOutput(CommandContain::ContainOutput * output, float error)
 {
+    string & text = output->text;
     uint64_t i = output->indexQuery;
     uint64_t j = output->indexRef;
     
     for ( uint64_t k = 0; k < output->pairCount && i < output->sketchQuery.getReferenceCount(); k++ )
     {
-        const ContainOutput::PairOutput * pair = &output->pairs[k];
+        const CommandContain::ContainOutput::PairOutput * pair = &output->pairs[k];
         
 		if ( pair->error <= error )
 		{
-			cout << pair->score << '\t' << pair->error << '\t' << output->sketchRef.getReference(j).name << '\t' << output->sketchQuery.getReference(i).name << endl;
+			appendDouble(text, pair->score);
+			text.push_back('\t');
+			appendDouble(text, pair->error);
+			text.push_back('\t');
+			text.append(output->sketchRef.getReference(j).name);
+			text.push_back('\t');
+			text.append(output->sketchQuery.getReference(i).name);
+			text.push_back('\n');
 		}
         
         j++;
@@ -198,8 +225,6 @@ void CommandContain::writeOutput(ContainOutput * output, float error) const
             i++;
         }
 	}
-    
-    delete output;
 }
 
 CommandContain::ContainOutput * contain(CommandContain::ContainInput * input)
@@ -214,7 +239,17 @@ CommandContain::ContainOutput * contain(CommandContain::ContainInput * input)
     
     for ( uint64_t k = 0; k < input->pairCount && i < sketchQuery.getReferenceCount(); k++ )
     {
-		output->pairs[k].score = containSketches(sketchRef.getReference(j).hashesSorted, sketchQuery.getReference(i).hashesSorted, output->pairs[k].error);
+		const Sketch::Reference & ref = sketchRef.getReference(j);
+		const Sketch::Reference & query = sketchQuery.getReference(i);
+		
+		if ( input->hll && ref.hll.size() != 0 && ref.hll.size() == query.hll.size() )
+		{
+			output->pairs[k].score = containHll(ref, query, output->pairs[k].error);
+		}
+		else
+		{
+			output->pairs[k].score = containSketches(ref.hashesSorted, query.hashesSorted, output->pairs[k].error);
+		}
         
         j++;
         
@@ -225,36 +260,43 @@ CommandContain::ContainOutput * contain(CommandContain::ContainInput * input)
         }
     }
     
+    formatOutput(output, input->parameters.error);
+    
     return output;
 }
 
 double containSketches(const HashList & hashesSortedRef, const HashList & hashesSortedQuery, double & errorToSet)
 {
-    int common = 0;
-    int denom = hashesSortedRef.size() < hashesSortedQuery.size() ?
-        hashesSortedRef.size() :
-        hashesSortedQuery.size();
-    
-    int i = 0;
-    int j = 0;
-    
-    for ( int steps = 0; steps < denom && i < hashesSortedRef.size(); steps++ )
+    // Of the smallest hashes of the query (as many as the smaller sketch
+    // has), the reference sketch would hold any that are no greater than its
+    // largest, so the score is the fraction of those that it does. They are
+    // found by binary search and counted with the intersection kernels used
+    // by dist (with a union bound that cannot be reached, so they run to the
+    // end of one list).
+    //
+    const SimdKernels & kernels = getSimdKernels();
+    uint64_t sizeRef = hashesSortedRef.size();
+    uint64_t denom = std::min(sizeRef, uint64_t(hashesSortedQuery.size()));
+    uint64_t common = 0;
+    uint64_t j = 0;
+    uint64_t i_a;
+    uint64_t i_b;
+    
+    if ( denom != 0 && hashesSortedRef.get64() )
     {
-        if ( hashLessThan(hashesSortedRef.at(i), hashesSortedQuery.at(j), hashesSortedRef.get64()) )
-        {
-            i++;
-            steps--;
-        }
-        else if ( hashLessThan(hashesSortedQuery.at(j), hashesSortedRef.at(i), hashesSortedRef.get64()) )
-        {
-            j++;
-        }
-        else
-        {
-            i++;
-            j++;
-            common++;
-        }
+        const uint64_t * ref = (const uint64_t *)hashesSortedRef.data64();
+        const uint64_t * query = (const uint64_t *)hashesSortedQuery.data64();
+        
+        j = upper_bound(query, query + denom, ref[sizeRef - 1]) - query;
+        common = kernels.intersect64(ref, sizeRef, query, j, sizeRef + j + 1, &i_a, &i_b);
+    }
+    else if ( denom != 0 )
+    {
+        const uint32_t * ref = (const uint32_t *)hashesSortedRef.data32();
+        const uint32_t * query = (const uint32_t *)hashesSortedQuery.data32();
+        
+        j = upper_bound(query, query + denom, ref[sizeRef - 1]) - query;
+        common = kernels.intersect32(ref, sizeRef, query, j, sizeRef + j + 1, &i_a, &i_b);
     }
     
     errorToSet = 1. / sqrt(j);
@@ -262,4 +304,25 @@ double containSketches(const HashList & hashesSortedRef, const HashList & hashes
     return double(common) / j;
 }
 
+double containHll(const Sketch::Reference & ref, const Sketch::Reference & query, double & errorToSet)
+{
+    // the intersection by inclusion-exclusion, with the error of each of
+    // the three estimates added
+    //
+    double sizeUnion = hllEstimate(ref.hll.data(), query.hll.data(), ref.hll.size());
+    double common = ref.hllSize + query.hllSize - sizeUnion;
+    double error = 1.04 / sqrt(double(ref.hll.size()));
+    
+    if ( query.hllSize == 0 )
+    {
+        errorToSet = 1;
+        return 0;
+    }
+    
+    common = max(0., min(common, query.hllSize));
+    errorToSet = error * (ref.hllSize + query.hllSize + sizeUnion) / query.hllSize;
+    
+    return common / query.hllSize;
+}
+
 } // namespace mash
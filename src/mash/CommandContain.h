@@ -8,6 +8,7 @@
 #define INCLUDED_CommandContain
 
 #include "Command.h"
+#include "OutputWriter.h"
 #include "Sketch.h"
 
 namespace mash {
@@ -37,6 +38,8 @@ public:
         
         std::string nameRef;
         const Sketch::Parameters & parameters;
+        
+        bool hll = false; // score with HyperLogLog registers where both have them
     };
     
     struct ContainOutput
@@ -71,6 +74,8 @@ public:
         uint64_t pairCount;
         
         PairOutput * pairs;
+        
+        std::string text; // formatted by the worker
     };
     
     CommandContain();
@@ -79,11 +84,12 @@ public:
     
 private:
     
-    void writeOutput(ContainOutput * output, float error) const;
+    void writeOutput(ContainOutput * output, OutputWriter & writer) const;
 };
 
 CommandContain::ContainOutput * contain(CommandContain::ContainInput * data);
 double containSketches(const HashList & hashesSortedRef, const HashList & hashesSortedQuery, double & errorToSet);
+double containHll(const Sketch::Reference & ref, const Sketch::Reference & query, double & errorToSet);
 
 } // namespace mash
 
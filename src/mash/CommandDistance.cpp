@@ -10,20 +10,18 @@
 #include <zlib.h>
 #include "ThreadPool.h"
 #include "sketchParameterSetup.h"
+#include "Numa.h"
+#include "SketchCache.h"
+#include "Shard.h"
+#include "Checkpoint.h"
+#include "HyperLogLog.h"
+#include "PackedDist.h"
 #include <math.h>
 
-#if defined __AVX512F__ && defined __AVX512CD__
-#include <immintrin.h>
-#else 
-#if defined __AVX2__
-#include <immintrin.h>
-#else
-#if defined __SSE4_1__
-#include <nmmintrin.h>
-#else
+#include "simd.h"
 
-#endif
-#endif
+#ifdef SIMD_X86
+#include <immintrin.h>
 #endif
 
 #ifdef USE_BOOST
@@ -37,6 +35,11 @@ using namespace::std;
 
 namespace mash {
 
+// Hash bytes of the references compared as a tile against each query of a
+// block (about half of a typical L2).
+//
+static const uint64_t compareTileBytes = 1 << 18;
+
     CommandDistance::CommandDistance()
         : Command()
     {
@@ -53,6 +56,20 @@ namespace mash {
         addOption("distance", Option(Option::Number, "d", "Output", "Maximum distance to report.", "1.0", 0., 1.));
         addOption("comment", Option(Option::Boolean, "C", "Output", "Show comment fields with reference/query names (denoted with ':').", "1.0", 0., 1.));
         addOption("binOutput", Option(Option::String, "o", "Output", "Output file name in binary format", ""));
+        addOption("pack", Option(Option::Boolean, "pack", "Output", "With -o, write only the pairs that pass -d and -v, delta-coded with 32-bit distances and compressed in blocks on a separate thread, which is much smaller and faster to write than plain -o output. Read by dumpdist. Incompatible with -shard and -resume.", ""));
+        addOption("prune", Option(Option::Boolean, "prune", "Output", "With -d or -v, index the reference hashes and only compare pairs that share enough of them to pass. Output is the same; faster when most pairs share no hashes.", ""));
+        addOption("weighted", Option(Option::Boolean, "weighted", "Output", "Weight the Jaccard index by the counts of hashes in each sketch, for comparing abundances (as of metagenomes): the sum of the smaller count of each hash over the sum of the larger. Sketches must keep counts (sketch -r), or be sketched here. Shared-hashes become the weighted sums, and p-values stay those of the unweighted count. Incompatible with -prune and -lsh.", ""));
+        addOption("prefilter", Option(Option::Boolean, "prefilter", "Output", "With -d, first compare the smallest 128-512 hashes of each pair and skip the rest of pairs that share too few of them to pass. A passing pair is skipped with probability at most 1e-9; faster when most pairs are far apart. Has no effect for distances above about 0.12 (k = 21). With sketches made with sketch -hll, pairs whose sizes differ too much to pass are also skipped, by the same margin.", ""));
+        addOption("lsh", Option(Option::Number, "lsh", "Output", "With -d, only compare the pairs found by a locality-sensitive index of the references, each pair within the distance being found with at least this probability (the recall). Other pairs are compared less often the farther apart they are, so output may miss some passing pairs but takes time that grows with their number rather than with the reference count. The index is written next to a reference sketch (<reference>.msl) and read by later runs with the same -d and recall.", "0.99", 0., 1.));
+        addOption("top", Option(Option::Integer, "top", "Output", "Only report the <int> nearest references to each query (of those that pass -d and -v), by increasing distance, then p-value. Incompatible with -t. 0 reports all.", "0"));
+        addOption("checkpoint", Option(Option::Integer, "checkpoint", "Output", "Seconds between checkpoints of the progress of -o output, for -resume (0 for none).", "600"));
+        addOption("resume", Option(Option::Boolean, "resume", "Output", "Continue a run with -o that was stopped part way from its last checkpoint, with the same inputs and options (including -shard). Starts from the beginning if there is no checkpoint.", ""));
+        addOption("checkpointStop", Option(Option::Integer, "checkpointstop", "Testing", "For testing -resume: checkpoint after every write and exit right after the <int>-th checkpoint, as if killed.", "0")); // not in help (its category is not added)
+        addOption("shard", Option(Option::String, "shard", "Output", "Only compare shard <i>/<n> of the pairs (1 <= i <= n), so a run can be spread over processes or nodes. The shards are balanced and depend only on the inputs, <i> and <n>. Requires -o; combine the outputs with \"mash merge\".", ""));
+        useOption("names");
+        useOption("range");
+        useOption("numa");
+        useOption("cache");
         useSketchOptions();
     }
 
@@ -63,26 +80,14 @@ namespace mash {
             print();
             return 0;
         }
-#if defined __AVX512F__ && defined __AVX512CD__
-        cerr << "Using AVX512 instructions" << endl;
-#else 
-#if defined __AVX2__
-        cerr << "Using AVX2 instructions" << endl;
-        //cerr << "Not implemented yet! Please use:" << endl;
-        //cerr << "./configure --disable-simd" << endl;
-        //TODO: implement by avx2-----DONE by zjx
-#else
-#if defined __SSE4_1__
-        cerr << "Using SSE4 instructions" << endl;
-        //cerr << "Not implemented yet! Please use:" << endl;
-        //cerr << "./configure --disable-simd" << endl;
-        //TODO:implement by sse----DONE by zjx
-#else
-        cerr << "No SIMD instructions used" << endl;
-        //implement without optimization
-#endif
-#endif
-#endif
+        if ( getSimdKernels().level == SIMD_NONE )
+        {
+            cerr << "No SIMD instructions used" << endl;
+        }
+        else
+        {
+            cerr << "Using " << getSimdLevelName(getSimdKernels().level) << " instructions" << endl;
+        }
 
 
         int threads = options.at("threads").getArgumentAsNumber();
@@ -92,6 +97,7 @@ namespace mash {
         //bool log = options.at("log").active;
         double pValueMax = options.at("pvalue").getArgumentAsNumber();
         double distanceMax = options.at("distance").getArgumentAsNumber();
+        uint64_t top = options.at("top").getArgumentAsNumber();
 		bool binOut = true;
 
 		string oFileName = options.at("binOutput").argument;
@@ -100,6 +106,75 @@ namespace mash {
 		if(binOut)
 			cerr << "Results will be written to " << oFileName << endl;
 
+        bool lsh = options.at("lsh").active;
+        
+        if ( lsh && distanceMax >= 1 )
+        {
+            cerr << "ERROR: The option -" << options.at("lsh").identifier << " requires -" << options.at("distance").identifier << " below 1." << endl;
+            return 1;
+        }
+        
+        if ( lsh && options.at("prune").active )
+        {
+            cerr << "ERROR: The options -" << options.at("lsh").identifier << " and -" << options.at("prune").identifier << " are exclusive." << endl;
+            return 1;
+        }
+        
+        if ( top != 0 && table )
+        {
+            cerr << "ERROR: The option -" << options.at("top").identifier << " cannot be used with -" << options.at("table").identifier << "." << endl;
+            return 1;
+        }
+        
+        bool weighted = options.at("weighted").active;
+        
+        if ( weighted && (lsh || options.at("prune").active) )
+        {
+            cerr << "ERROR: The option -" << options.at("weighted").identifier << " cannot be used with -" << options.at(lsh ? "lsh" : "prune").identifier << "." << endl;
+            return 1;
+        }
+        
+        uint64_t shardIndex = 0;
+        uint64_t shardCount = 1;
+        bool shard = options.at("shard").active;
+        
+        if ( shard )
+        {
+            if ( ! parseShard(options.at("shard").argument, shardIndex, shardCount) )
+            {
+                cerr << "ERROR: The option -" << options.at("shard").identifier << " must be <i>/<n>, with 1 <= <i> <= <n>." << endl;
+                return 1;
+            }
+            
+            if ( ! binOut )
+            {
+                cerr << "ERROR: The option -" << options.at("shard").identifier << " requires -" << options.at("binOutput").identifier << "." << endl;
+                return 1;
+            }
+        }
+        
+        bool resume = options.at("resume").active;
+        
+        if ( resume && ! binOut )
+        {
+            cerr << "ERROR: The option -" << options.at("resume").identifier << " requires -" << options.at("binOutput").identifier << "." << endl;
+            return 1;
+        }
+        
+        bool pack = options.at("pack").active;
+        
+        if ( pack && ! binOut )
+        {
+            cerr << "ERROR: The option -" << options.at("pack").identifier << " requires -" << options.at("binOutput").identifier << "." << endl;
+            return 1;
+        }
+        
+        if ( pack && (shard || resume) )
+        {
+            cerr << "ERROR: The option -" << options.at("pack").identifier << " cannot be used with -" << options.at("shard").identifier << " or -" << options.at("resume").identifier << "." << endl;
+            return 1;
+        }
+        
         Sketch::Parameters parameters;
 
         if ( sketchParameterSetup(parameters, *(Command *)this) )
@@ -107,6 +182,11 @@ namespace mash {
             return 1;
         }
         //parameters.use64 = false;
+        
+        // sketch files are only read (but are copied with -numa, since
+        // mapped pages stay wherever the page cache has them)
+        //
+        parameters.mapped = ! getNumaEnabled();
 
         Sketch sketchRef;
 
@@ -121,7 +201,7 @@ namespace mash {
 		//string oFileName = "/home/ssd/dist_output.bin";
 		
 		ofstream oFile;
-		if(binOut)
+		if(binOut && ! resume && ! pack) // resumed output is opened once the checkpoint is checked
 		{
 			oFile.open(oFileName, ios::out | ios::binary | ios::trunc);
 			if(!oFile.is_open()){
@@ -164,10 +244,17 @@ namespace mash {
         }
 
         vector<string> refArgVector;
-        refArgVector.push_back(fileReference);
+        refArgVector.push_back(isSketch && options.at("cache").active ? getSketchCache(fileReference, options.at("cache").argument, parameters.parallelism) : fileReference);
 
         //cerr << "Sketch for " << fileReference << " not found or out of date; creating..." << endl;
 
+        // -names and -range select from the reference
+        //
+        if ( sketchSubsetSetup(sketchRef, *this) )
+        {
+            return 1;
+        }
+        
         sketchRef.initFromFiles(refArgVector, parameters);
 
         double lengthThreshold = (parameters.warning * sketchRef.getKmerSpace()) / (1. - parameters.warning);
@@ -192,6 +279,13 @@ namespace mash {
             string alphabet;
             sketchRef.getAlphabetAsString(alphabet);
             setAlphabetFromString(parameters, alphabet.c_str());
+
+            // queries sketched here get registers like the reference's
+            //
+            if ( sketchRef.getReferenceCount() != 0 )
+            {
+                parameters.hll = hllGetPrecision(sketchRef.getReference(0).hll.size());
+            }
         }
         else
         {
@@ -229,6 +323,7 @@ namespace mash {
         }
 
         ThreadPool<CompareInput, CompareOutput> threadPool(compare, threads);
+        OutputWriter writer;
 
         vector<string> queryFiles;
 
@@ -248,7 +343,121 @@ namespace mash {
 
         sketchQuery.initFromFiles(queryFiles, parameters, 0, true);
 
-        uint64_t pairCount = sketchRef.getReferenceCount() * sketchQuery.getReferenceCount();
+        if ( weighted && ! (hasCountsAll(sketchRef) && hasCountsAll(sketchQuery)) )
+        {
+            cerr << "ERROR: The option -" << options.at("weighted").identifier << " requires hash counts, which sketch files only keep if sketched with -r." << endl;
+            return 1;
+        }
+
+        HashIndex index;
+        bool prune = options.at("prune").active && (distanceMax < 1 || pValueMax < 1);
+
+        if ( prune )
+        {
+            index.build(sketchRef);
+        }
+        
+        LshIndex lshIndex;
+        
+        if ( lsh )
+        {
+            LshIndex::Shape shape;
+            double recall = options.at("lsh").getArgumentAsNumber();
+            
+            if ( ! LshIndex::chooseShape(sketchRef.getMinHashesPerWindow(), jaccardForDistance(distanceMax, sketchRef.getKmerSize()), recall, shape) )
+            {
+                cerr << "WARNING: The sketch size is too small for a recall of " << recall << " at this distance; using bands of one hash." << endl;
+            }
+            
+            string lshFile = LshIndex::indexFile(fileReference);
+            string error;
+            
+            if ( ! isSketch || ! lshIndex.open(lshFile, sketchRef, shape, error) )
+            {
+                if ( isSketch )
+                {
+                    cerr << error << "; writing it..." << endl;
+                }
+                
+                lshIndex.build(sketchRef, shape, threads);
+                
+                if ( isSketch && ! lshIndex.write(lshFile, sketchRef) )
+                {
+                    cerr << "WARNING: could not write " << lshFile << "." << endl;
+                }
+            }
+        }
+
+        uint64_t pairTotal = sketchRef.getReferenceCount() * sketchQuery.getReferenceCount();
+        uint64_t pairBegin = shardBoundary(pairTotal, shardIndex, shardCount);
+        uint64_t pairEnd = shardBoundary(pairTotal, shardIndex + 1, shardCount);
+        
+        if ( top != 0 && sketchRef.getReferenceCount() != 0 )
+        {
+            // whole queries, so each shard can pick their best pairs itself
+            //
+            uint64_t refCount = sketchRef.getReferenceCount();
+            
+            pairBegin = (pairBegin + refCount - 1) / refCount * refCount;
+            pairEnd = (pairEnd + refCount - 1) / refCount * refCount;
+        }
+        
+        ShardHeader header;
+        
+        header.kind = ShardHeader::kindDist;
+        header.index = shardIndex;
+        header.count = shardCount;
+        header.pairTotal = pairTotal;
+        header.pairBegin = pairBegin;
+        header.pairEnd = pairEnd;
+        header.refCount = sketchRef.getReferenceCount();
+        header.queryCount = sketchQuery.getReferenceCount();
+        header.kmerSize = sketchRef.getKmerSize();
+        header.sketchSize = min(sketchRef.getMinHashesPerWindow(), sketchQuery.getMinHashesPerWindow());
+        header.seed = sketchRef.getHashSeed();
+        header.top = top;
+        header.distanceMax = distanceMax;
+        header.pValueMax = pValueMax;
+        
+        PackedDistWriter * packedWriter = 0;
+        
+        if ( pack )
+        {
+            PackedDistHeader packedHeader;
+            
+            packedHeader.refCount = header.refCount;
+            packedHeader.queryCount = header.queryCount;
+            packedHeader.kmerSize = header.kmerSize;
+            packedHeader.sketchSize = header.sketchSize;
+            packedHeader.seed = header.seed;
+            packedHeader.distanceMax = distanceMax;
+            packedHeader.pValueMax = pValueMax;
+            
+            packedWriter = new PackedDistWriter(oFileName, packedHeader);
+        }
+        
+        Checkpoint checkpoint;
+        
+        checkpoint.run = header;
+        
+        if ( resume )
+        {
+            if ( ! resumeOutput(oFileName, checkpoint, oFile) )
+            {
+                return 1;
+            }
+            
+            pairBegin = checkpoint.pairDone;
+        }
+        
+        if ( shard && pairBegin == header.pairBegin )
+        {
+            oFile.write((char *)&header, sizeof(ShardHeader));
+            
+            cerr << "Shard " << shardIndex + 1 << "/" << shardCount << ": pairs " << pairBegin << "-" << pairEnd << " of " << pairTotal << endl;
+        }
+        
+        uint64_t pairCount = pairEnd - pairBegin;
         uint64_t pairsPerThread = pairCount / parameters.parallelism;
 
         if ( pairsPerThread == 0 )
@@ -256,58 +465,135 @@ namespace mash {
             pairsPerThread = 1;
         }
 
-        static uint64_t maxPairsPerThread = 0x1000;
+        // large enough to span several queries for the tiled compare
+        //
+        static uint64_t maxPairsPerThread = 0x10000;
 
         if ( pairsPerThread > maxPairsPerThread )
         {
             pairsPerThread = maxPairsPerThread;
         }
 
-        uint64_t iFloor = pairsPerThread / sketchRef.getReferenceCount();
-        uint64_t iMod = pairsPerThread % sketchRef.getReferenceCount();
-
-        for ( uint64_t i = 0, j = 0; i < sketchQuery.getReferenceCount(); i += iFloor, j += iMod )
+        vector<CompareOutput::BestPair> pending; // with -top
+        
+        CompareTables tables(min(sketchRef.getMinHashesPerWindow(), sketchQuery.getMinHashesPerWindow()), sketchRef.getKmerSize());
+        
+        if ( options.at("prefilter").active )
+        {
+            tables.enablePrefilter(distanceMax);
+            tables.enableSizeFilter(distanceMax, parameters.hll);
+        }
+        
+        tables.weighted = weighted;
+        
+        uint64_t refCount = sketchRef.getReferenceCount();
+        bool checkpointed = binOut && ! pack;
+        CheckpointTimer timer(checkpointed ? options.at("checkpoint").getArgumentAsNumber() : 0, checkpointed ? options.at("checkpointStop").getArgumentAsNumber() : 0);
+        
+        auto popOutput = [&]()
         {
-            if ( j >= sketchRef.getReferenceCount() )
+            CompareOutput * output = threadPool.popOutputWhenAvailable();
+            uint64_t done = output->indexQuery * refCount + output->indexRef + output->pairCount; // pairs before are written
+            
+            if ( top != 0 )
+            {
+                mergeBest(output, pending, top, false);
+                
+                // the best of a query are only written once the next query is
+                // reached, so resume from the start of the one pending
+                //
+                done = pending.size() ? pending[0].indexQuery * refCount : done / refCount * refCount;
+            }
+            
+			if(pack)
+				writeOutput(output, *packedWriter);
+			else if(binOut)
+            	writeOutput(output, table, comment, oFile);
+			else
+            	writeOutput(output, table, comment, writer);
+            
+            if ( timer.due() )
             {
-                if ( i == sketchQuery.getReferenceCount() - 1 )
+                oFile.flush();
+                checkpoint.pairDone = done;
+                checkpoint.bytes = oFile.tellp();
+                
+                if ( ! writeCheckpoint(oFileName, checkpoint) )
                 {
-                    break;
+                    cerr << "WARNING: could not write " << checkpointFile(oFileName) << "." << endl;
                 }
+                
+                timer.written();
+            }
+        };
+        
+        for ( uint64_t pair = pairBegin; pair < pairEnd; pair += pairsPerThread )
+        {
+            uint64_t i = pair / sketchRef.getReferenceCount();
+            uint64_t j = pair % sketchRef.getReferenceCount();
+            
+            CompareInput * input = new CompareInput(sketchRef, sketchQuery, j, i, min(pairsPerThread, pairEnd - pair), parameters, distanceMax, pValueMax);
 
-                i++;
-                j -= sketchRef.getReferenceCount();
+            if ( prune )
+            {
+                input->index = &index;
             }
+            
+            if ( lsh )
+            {
+                input->lsh = &lshIndex;
+            }
+            
+            input->top = top;
+            input->tables = &tables;
+            input->format = ! binOut;
+            input->pack = pack;
+            input->table = table;
+            input->comment = comment;
 
-            threadPool.runWhenThreadAvailable(new CompareInput(sketchRef, sketchQuery, j, i, pairsPerThread, parameters, distanceMax, pValueMax));
+            threadPool.runWhenThreadAvailable(input);
 
             while ( threadPool.outputAvailable() )
             {
-				if(binOut)
-                	writeOutput(threadPool.popOutputWhenAvailable(), table, comment, oFile);
-				else
-                	writeOutput(threadPool.popOutputWhenAvailable(), table, comment);
+                popOutput();
             }
         }
 
         while ( threadPool.running() )
         {
-			if(binOut)
-            	writeOutput(threadPool.popOutputWhenAvailable(), table, comment, oFile);
+            popOutput();
+        }
+        
+        if ( pending.size() )
+        {
+            CompareOutput * output = new CompareOutput(sketchRef, sketchQuery, 0, 0, 0);
+            
+            mergeBest(output, pending, top, true);
+            
+			if(pack)
+				writeOutput(output, *packedWriter);
+			else if(binOut)
+            	writeOutput(output, table, comment, oFile);
 			else
-            	writeOutput(threadPool.popOutputWhenAvailable(), table, comment);
+            	writeOutput(output, table, comment, writer);
         }
+        
+        delete packedWriter; // writes the rest
 
         if ( warningCount > 0 && ! parameters.reads )
         {
             warnKmerSize(parameters, *this, lengthMax, lengthMaxName, randomChance, kMin, warningCount);
         }
 
-		if(binOut) oFile.close();
+		if(binOut && ! pack)
+		{
+			oFile.close();
+			removeCheckpoint(oFileName);
+		}
         return 0;
     }
 
-    void CommandDistance::writeOutput(CompareOutput * output, bool table, bool comment, ofstream &oFile) const
+    void CommandDistance::writeOutput(CompareOutput * output, bool, bool, ofstream &oFile) const
     {
         uint64_t i = output->indexQuery;
         uint64_t j = output->indexRef;
@@ -360,215 +646,529 @@ namespace mash {
 
 	
 		oFile.write((char*)buffer, passCount * sizeof(Result));
+		
+		for ( k = 0; k < output->best.size(); k++ )
+		{
+			const CompareOutput::BestPair & best = output->best[k];
+			Result result;
+			
+			result.refID = best.indexRef;
+			result.queryID = best.indexQuery;
+			result.distance = best.pair.distance;
+			result.pValue = best.pair.pValue;
+			result.number = best.pair.numer;
+			result.denom = best.pair.denom;
+			
+			oFile.write((char*)&result, sizeof(Result));
+		}
+		
 		oFile.flush();
 		delete buffer;
         delete output;
     }
 
-    CommandDistance::CompareOutput * compare(CommandDistance::CompareInput * input)
+    void CommandDistance::HashIndex::build(const Sketch & sketch)
     {
-        const Sketch & sketchRef = input->sketchRef;
-        const Sketch & sketchQuery = input->sketchQuery;
-
-        CommandDistance::CompareOutput * output = new CommandDistance::CompareOutput(input->sketchRef, input->sketchQuery, input->indexRef, input->indexQuery, input->pairCount);
+        vector<pair<uint64_t, uint32_t>> entries;
 
-        uint64_t sketchSize = sketchQuery.getMinHashesPerWindow() < sketchRef.getMinHashesPerWindow() ?
-            sketchQuery.getMinHashesPerWindow() :
-            sketchRef.getMinHashesPerWindow();
+        for ( uint64_t i = 0; i < sketch.getReferenceCount(); i++ )
+        {
+            const HashList & hashList = sketch.getReference(i).hashesSorted;
 
-        uint64_t i = input->indexQuery;
-        uint64_t j = input->indexRef;
+            for ( int j = 0; j < hashList.size(); j++ )
+            {
+                entries.push_back(pair<uint64_t, uint32_t>(hashList.get64() ? hashList.at(j).hash64 : hashList.at(j).hash32, i));
+            }
+        }
 
-        for ( uint64_t k = 0; k < input->pairCount && i < sketchQuery.getReferenceCount(); k++ )
-        {
-            compareSketches(&output->pairs[k], sketchRef.getReference(j), sketchQuery.getReference(i), sketchSize, sketchRef.getKmerSize(), sketchRef.getKmerSpace(), input->maxDistance, input->maxPValue);
+        sort(entries.begin(), entries.end());
 
-            j++;
+        hashes.clear();
+        offsets.clear();
+        references.resize(entries.size());
 
-            if ( j == sketchRef.getReferenceCount() )
+        for ( uint64_t i = 0; i < entries.size(); i++ )
+        {
+            if ( i == 0 || entries[i].first != entries[i - 1].first )
             {
-                j = 0;
-                i++;
+                hashes.push_back(entries[i].first);
+                offsets.push_back(i);
             }
+
+            references[i] = entries[i].second;
         }
 
-        return output;
+        offsets.push_back(entries.size());
     }
 
-	void CommandDistance::writeOutput(CompareOutput * output, bool table, bool comment) const
-	{
-	    uint64_t i = output->indexQuery;
-	    uint64_t j = output->indexRef;
-	    
-	    for ( uint64_t k = 0; k < output->pairCount && i < output->sketchQuery.getReferenceCount(); k++ )
-	    {
-	        const CompareOutput::PairOutput * pair = &output->pairs[k];
-	        
-	        if ( table && j == 0 )
-	        {
-	            cout << output->sketchQuery.getReference(i).name;
-	        }
-	        
-	        if ( table )
-	        {
-	            cout << '\t';
-	    
-	            if ( pair->pass )
-	            {
-	                cout << pair->distance;
-	            }
-	        }
-	        else if ( pair->pass )
-	        {
-	            cout << output->sketchRef.getReference(j).name;
-	            
-	            if ( comment )
-	            {
-	                cout << ':' << output->sketchRef.getReference(j).comment;
-	            }
-	            
-	            cout << '\t' << output->sketchQuery.getReference(i).name;
-	            
-	            if ( comment )
-	            {
-	                cout << ':' << output->sketchQuery.getReference(i).comment;
-	            }
-	            
-	            cout << '\t' << pair->distance << '\t' << pair->pValue << '\t' << pair->numer << '/' << pair->denom << endl;
-	        }
-	    
-	        j++;
-	        
-	        if ( j == output->sketchRef.getReferenceCount() )
-	        {
-	            if ( table )
-	            {
-	                cout << endl;
-	            }
-	            
-	            j = 0;
-	            i++;
-	        }
-	    }
-	    
-	    delete output;
-	}
-    void compareSketches(CommandDistance::CompareOutput::PairOutput * output, const Sketch::Reference & refRef, const Sketch::Reference & refQry, uint64_t sketchSize, int kmerSize, double kmerSpace, double maxDistance, double maxPValue)
+    // Compares only the pairs of the block [start, end) that could pass, using
+    // the counts of hashes each reference shares with the query (from the
+    // index) as bounds. No pair can pass without a shared hash, since the
+    // distance is then 1 and the p-value 1. With -d, the Jaccard estimate is
+    // at most shared / min(sketch size, larger sketch), so pairs below the
+    // Jaccard for the maximum distance are skipped too.
+    //
+    static void compareCandidates(CommandDistance::CompareOutput * output, const CommandDistance::CompareInput * input, uint64_t sketchSize, uint64_t start, uint64_t end)
     {
-        uint64_t i = 0;
-        uint64_t j = 0;
-        uint64_t common = 0;
-        uint64_t denom = 0;
-        const HashList & hashesSortedRef = refRef.hashesSorted;
-        const HashList & hashesSortedQry = refQry.hashesSorted;
-
-        output->pass = false;
+        const Sketch & sketchRef = input->sketchRef;
+        const Sketch & sketchQuery = input->sketchQuery;
+        const CommandDistance::HashIndex & index = *input->index;
+        uint64_t refCount = sketchRef.getReferenceCount();
 
-        //#if defined (__ICC) || defined (__INTEL_COMPILER)
-#if defined __AVX512F__ && defined __AVX512CD__
-        //if(parameters.use64)
-        if(hashesSortedRef.get64())
-        {
-            //cerr << "implement the 64bit avx512 addbyxxm " << endl;
-            //exit(0);
-            common = u64_intersect_vector_avx512((uint64_t*)hashesSortedRef.hashes64.data(), hashesSortedRef.size(), (uint64_t*)hashesSortedQry.hashes64.data(), hashesSortedQry.size(), sketchSize, &i, &j);
+        double jaccardMin = 0;
 
-            denom = i + j - common;
-            //cout << "denom: " << denom << endl;
-            //cout << "common: " << common << endl;
-            //cout << "i: " << i<< endl;
-            //cout << "j: " << j<< endl;
-            //cout << "hash i: " << (uint64_t)hashesSortedRef.at(i).hash64 << endl;
-            //cout << "hash j: " << (uint64_t)hashesSortedQry.at(j).hash64 << endl;
-        }
-        else //if(hashesSortedRef.get32())
-        {
-            //cerr << "implement the 32bit avx512 addbyxxm " << endl;
-            //exit(0);
-            common = u32_intersect_vector_avx512((uint32_t*)hashesSortedRef.hashes32.data(), hashesSortedRef.size(), (uint32_t*)hashesSortedQry.hashes32.data(), hashesSortedQry.size(), sketchSize, &i, &j);
-            denom = i + j - common;
-        }
-#else
-#ifdef __AVX2__
-        // implement by avx2
-    
-        if(hashesSortedRef.get64())
+        if ( input->maxDistance >= 0 && input->maxDistance < 1 )
         {
-            common = u64_intersect_vector_avx2((uint64_t*)hashesSortedRef.hashes64.data(), hashesSortedRef.size(), (uint64_t*)hashesSortedQry.hashes64.data(), hashesSortedQry.size(), sketchSize, &i, &j);
-            //add later
-            denom = i + j - common;
+            jaccardMin = jaccardForDistance(input->maxDistance, sketchRef.getKmerSize());
         }
-        else //if(hashesSortedRef.get32())
-        {
-            //cout << "hi before call funtion" << endl;
-            common = u32_intersect_vector_avx2((uint32_t*)hashesSortedRef.hashes32.data(), hashesSortedRef.size(), (uint32_t*)hashesSortedQry.hashes32.data(), hashesSortedQry.size(), sketchSize, &i, &j);
-            denom = i + j - common;
-        }
-#else
-#ifdef __SSE4_1__
-        // implement by sse
 
-        if(hashesSortedRef.get64())
+        static thread_local vector<uint32_t> counts;
+        vector<uint32_t> touched;
+
+        if ( counts.size() < refCount )
         {
-            common = u64_intersection_vector_sse((uint64_t*)hashesSortedRef.hashes64.data(), hashesSortedRef.size(), (uint64_t*)hashesSortedQry.hashes64.data(), hashesSortedQry.size(), sketchSize, &i, &j);
-            //add later
-            denom = i + j - common;
+            counts.resize(refCount, 0);
         }
-        else //if(hashesSortedRef.get32())
+
+        for ( uint64_t k = 0; k < end - start; k++ )
         {
-            //cout << "hi before call funtion" << endl;
-            common = u32_intersection_vector_sse((uint32_t*)hashesSortedRef.hashes32.data(), hashesSortedRef.size(), (uint32_t*)hashesSortedQry.hashes32.data(), hashesSortedQry.size(), sketchSize, &i, &j);
-            denom = i + j - common;
+            output->pairs[k].pass = false;
         }
-#else
-        //implement without optimization	
-        while ( denom < sketchSize && i < hashesSortedRef.size() && j < hashesSortedQry.size() )
+
+        for ( uint64_t i = start / refCount; i <= (end - 1) / refCount; i++ )
         {
-            if ( hashLessThan(hashesSortedRef.at(i), hashesSortedQry.at(j), hashesSortedRef.get64()) )
-            {
-                i++;
-            }
-            else if ( hashLessThan(hashesSortedQry.at(j), hashesSortedRef.at(i), hashesSortedRef.get64()) )
-            {
-                j++;
-            }
-            else
+            uint64_t row = i * refCount;
+            uint64_t jStart = start > row ? start - row : 0;
+            uint64_t jEnd = end - row < refCount ? end - row : refCount;
+            const Sketch::Reference & query = sketchQuery.getReference(i);
+            const HashList & hashList = query.hashesSorted;
+
+            if ( hashList.size() == 0 )
             {
-                //		cout << "res: " << (uint64_t)hashesSortedRef.at(i).hash64 << endl;
-                i++;
-                j++;
-                common++;
+                // an empty query compares to empty references with distance 0
+                //
+                for ( uint64_t j = jStart; j < jEnd; j++ )
+                {
+                    compareSketches(&output->pairs[row + j - start], sketchRef.getReference(j), query, sketchSize, sketchRef.getKmerSize(), sketchRef.getKmerSpace(), input->maxDistance, input->maxPValue, input->tables);
+                }
+
+                continue;
             }
 
-            denom++;
-        }
-#endif
-#endif
-#endif
+            for ( int h = 0; h < hashList.size(); h++ )
+            {
+                uint64_t hash = hashList.get64() ? hashList.at(h).hash64 : hashList.at(h).hash32;
+                vector<uint64_t>::const_iterator found = lower_bound(index.hashes.begin(), index.hashes.end(), hash);
 
-        //#endif
+                if ( found == index.hashes.end() || *found != hash )
+                {
+                    continue;
+                }
 
+                uint64_t entry = found - index.hashes.begin();
 
-        if ( denom < sketchSize )
-        {
-            // complete the union operation if possible
+                for ( uint64_t r = index.offsets[entry]; r < index.offsets[entry + 1]; r++ )
+                {
+                    uint32_t j = index.references[r];
 
-            if ( i < hashesSortedRef.size() )
+                    if ( counts[j]++ == 0 )
+                    {
+                        touched.push_back(j);
+                    }
+                }
+            }
+
+            for ( uint64_t t = 0; t < touched.size(); t++ )
             {
-                denom += hashesSortedRef.size() - i;
+                uint32_t j = touched[t];
+                uint64_t shared = counts[j];
+
+                counts[j] = 0;
+
+                if ( j < jStart || j >= jEnd )
+                {
+                    continue;
+                }
+
+                const Sketch::Reference & reference = sketchRef.getReference(j);
+                uint64_t denomMin = max(reference.hashesSorted.size(), hashList.size());
+
+                if ( denomMin > sketchSize )
+                {
+                    denomMin = sketchSize;
+                }
+
+                if ( double(shared) < jaccardMin * denomMin )
+                {
+                    continue;
+                }
+
+                compareSketches(&output->pairs[row + j - start], reference, query, sketchSize, sketchRef.getKmerSize(), sketchRef.getKmerSpace(), input->maxDistance, input->maxPValue, input->tables);
             }
 
-            if ( j < hashesSortedQry.size() )
+            touched.clear();
+        }
+    }
+
+    // Compares only the pairs of the block [start, end) whose references the
+    // LSH index gives as candidates for the query.
+    //
+    static void compareLshCandidates(CommandDistance::CompareOutput * output, const CommandDistance::CompareInput * input, uint64_t sketchSize, uint64_t start, uint64_t end)
+    {
+        const Sketch & sketchRef = input->sketchRef;
+        const Sketch & sketchQuery = input->sketchQuery;
+        uint64_t refCount = sketchRef.getReferenceCount();
+        vector<uint32_t> candidates;
+
+        for ( uint64_t k = 0; k < end - start; k++ )
+        {
+            output->pairs[k].pass = false;
+        }
+
+        for ( uint64_t i = start / refCount; i <= (end - 1) / refCount; i++ )
+        {
+            uint64_t row = i * refCount;
+            uint64_t jStart = start > row ? start - row : 0;
+            uint64_t jEnd = end - row < refCount ? end - row : refCount;
+            const Sketch::Reference & query = sketchQuery.getReference(i);
+
+            input->lsh->findCandidates(query.hashesSorted, candidates);
+
+            for ( vector<uint32_t>::const_iterator j = lower_bound(candidates.begin(), candidates.end(), jStart); j != candidates.end() && *j < jEnd; j++ )
             {
-                denom += hashesSortedQry.size() - j;
+                compareSketches(&output->pairs[row + *j - start], sketchRef.getReference(*j), query, sketchSize, sketchRef.getKmerSize(), sketchRef.getKmerSpace(), input->maxDistance, input->maxPValue, input->tables);
             }
+        }
+    }
 
-            if ( denom > sketchSize )
+    static CommandDistance::CompareOutput * compareBlock(CommandDistance::CompareInput * input)
+    {
+        const Sketch & sketchRef = input->sketchRef;
+        const Sketch & sketchQuery = input->sketchQuery;
+
+        CommandDistance::CompareOutput * output = new CommandDistance::CompareOutput(input->sketchRef, input->sketchQuery, input->indexRef, input->indexQuery, input->pairCount);
+
+        uint64_t sketchSize = sketchQuery.getMinHashesPerWindow() < sketchRef.getMinHashesPerWindow() ?
+            sketchQuery.getMinHashesPerWindow() :
+            sketchRef.getMinHashesPerWindow();
+
+        // The block is a run of pairs in query-major order. Rather than walking
+        // it in order, which streams every reference once per query, it is
+        // compared a tile of references at a time against each query it
+        // covers, so the tile stays in cache while it is reused. Each pair
+        // still goes to its own slot, so the output is unchanged.
+        //
+        // Comparing each reference against several queries in one kernel call,
+        // so its loaded vectors (or their rotations) are shared, does not help
+        // here: the vector kernels are bound by their compares and shuffles
+        // rather than by loads (benchmark/bench intersect64 against
+        // intersect64cold: 10k-hash pairs out of cache take only about 20-30%
+        // more per hash than 1k-hash pairs in it, which the tiles already
+        // save), and the batched merges branch per query. Batched kernels
+        // measured 10-75% slower than the pairwise ones (about 30% sharing
+        // the loaded reference, 10-30% also sharing its rotations, 20% with
+        // broadcast compares and 75% interleaving the merges).
+
+        uint64_t refCount = sketchRef.getReferenceCount();
+        uint64_t start = input->indexQuery * refCount + input->indexRef;
+        uint64_t end = start + input->pairCount;
+
+        if ( end > sketchQuery.getReferenceCount() * refCount )
+        {
+            end = sketchQuery.getReferenceCount() * refCount;
+        }
+
+        if ( end <= start )
+        {
+            return output;
+        }
+
+        if ( input->index != 0 )
+        {
+            compareCandidates(output, input, sketchSize, start, end);
+            return output;
+        }
+        
+        if ( input->lsh != 0 )
+        {
+            compareLshCandidates(output, input, sketchSize, start, end);
+            return output;
+        }
+
+        uint64_t tileRefs = compareTileBytes / (sketchSize * (sketchRef.getUse64() ? 8 : 4) + 1);
+
+        if ( tileRefs == 0 )
+        {
+            tileRefs = 1;
+        }
+
+        uint64_t queryFirst = start / refCount;
+        uint64_t queryLast = (end - 1) / refCount;
+
+        for ( uint64_t tile = 0; tile < refCount; tile += tileRefs )
+        {
+            uint64_t tileEnd = tile + tileRefs < refCount ? tile + tileRefs : refCount;
+
+            for ( uint64_t i = queryFirst; i <= queryLast; i++ )
             {
-                denom = sketchSize;
+                uint64_t row = i * refCount;
+                uint64_t jStart = start > row + tile ? start - row : tile;
+                uint64_t jEnd = end - row < tileEnd ? end - row : tileEnd;
+
+                for ( uint64_t j = jStart; j < jEnd; j++ )
+                {
+                    compareSketches(&output->pairs[row + j - start], sketchRef.getReference(j), sketchQuery.getReference(i), sketchSize, sketchRef.getKmerSize(), sketchRef.getKmerSpace(), input->maxDistance, input->maxPValue, input->tables);
+                }
+            }
+        }
+
+        return output;
+    }
+
+    // Order of the pairs of a query with -top: distance, then p-value, then
+    // reference order, so the choice does not depend on how blocks are split.
+    //
+    static bool betterPair(const CommandDistance::CompareOutput::BestPair & a, const CommandDistance::CompareOutput::BestPair & b)
+    {
+        if ( a.pair.distance != b.pair.distance )
+        {
+            return a.pair.distance < b.pair.distance;
+        }
+
+        if ( a.pair.pValue != b.pair.pValue )
+        {
+            return a.pair.pValue < b.pair.pValue;
+        }
+
+        return a.indexRef < b.indexRef;
+    }
+
+    // Keeps the best passing pairs of each query in the block, with a heap
+    // bounded to the top count (worst on top), and drops the rest.
+    //
+    static void keepBest(CommandDistance::CompareOutput * output, uint64_t top)
+    {
+        uint64_t i = output->indexQuery;
+        uint64_t j = output->indexRef;
+        uint64_t refCount = output->sketchRef.getReferenceCount();
+        vector<CommandDistance::CompareOutput::BestPair> heap;
+
+        for ( uint64_t k = 0; k < output->pairCount && i < output->sketchQuery.getReferenceCount(); k++ )
+        {
+            const CommandDistance::CompareOutput::PairOutput & pair = output->pairs[k];
+
+            if ( pair.pass )
+            {
+                CommandDistance::CompareOutput::BestPair best;
+
+                best.indexRef = j;
+                best.indexQuery = i;
+                best.pair = pair;
+
+                if ( heap.size() < top )
+                {
+                    heap.push_back(best);
+                    push_heap(heap.begin(), heap.end(), betterPair);
+                }
+                else if ( betterPair(best, heap.front()) )
+                {
+                    pop_heap(heap.begin(), heap.end(), betterPair);
+                    heap.back() = best;
+                    push_heap(heap.begin(), heap.end(), betterPair);
+                }
+            }
+
+            j++;
+
+            if ( j == refCount || k == output->pairCount - 1 )
+            {
+                sort_heap(heap.begin(), heap.end(), betterPair);
+                output->best.insert(output->best.end(), heap.begin(), heap.end());
+                heap.clear();
+            }
+
+            if ( j == refCount )
+            {
+                j = 0;
+                i++;
+            }
+        }
+
+        // only the best pairs are written
+        //
+        output->pairCount = 0;
+    }
+
+    // Queries can span blocks, so the best pairs of the last query seen are
+    // held in pending until the next query shows up (or all blocks are done)
+    // and then cut to the top count. The output is left with the queries
+    // that are complete.
+    //
+    void mergeBest(CommandDistance::CompareOutput * output, vector<CommandDistance::CompareOutput::BestPair> & pending, uint64_t top, bool last)
+    {
+        vector<CommandDistance::CompareOutput::BestPair> best;
+
+        for ( uint64_t k = 0; k <= output->best.size(); k++ )
+        {
+            bool end = k == output->best.size();
+
+            if ( pending.size() && ((end && last) || (! end && output->best[k].indexQuery != pending[0].indexQuery)) )
+            {
+                sort(pending.begin(), pending.end(), betterPair);
+
+                if ( pending.size() > top )
+                {
+                    pending.resize(top);
+                }
+
+                best.insert(best.end(), pending.begin(), pending.end());
+                pending.clear();
+            }
+
+            if ( ! end )
+            {
+                pending.push_back(output->best[k]);
             }
         }
 
+        output->best.swap(best);
+    }
+
+    CommandDistance::CompareOutput * compare(CommandDistance::CompareInput * input)
+    {
+        CommandDistance::CompareOutput * output = compareBlock(input);
+
+        if ( input->top != 0 )
+        {
+            // formatted once the best pairs of each query are merged
+            //
+            keepBest(output, input->top);
+        }
+        else if ( input->pack )
+        {
+            packOutput(output, output->packed);
+            output->isPacked = true;
+        }
+        else if ( input->format )
+        {
+            formatOutput(output, input->table, input->comment);
+        }
+
+        return output;
+    }
+
+	static void appendPair(string & text, const CommandDistance::CompareOutput * output, uint64_t indexRef, uint64_t indexQuery, const CommandDistance::CompareOutput::PairOutput & pair, bool comment)
+	{
+	    const Sketch::Reference & ref = output->sketchRef.getReference(indexRef);
+	    const Sketch::Reference & query = output->sketchQuery.getReference(indexQuery);
+	    
+	    text.append(ref.name);
+	    
+	    if ( comment )
+	    {
+	        text.push_back(':');
+	        text.append(ref.comment);
+	    }
+	    
+	    text.push_back('\t');
+	    text.append(query.name);
+	    
+	    if ( comment )
+	    {
+	        text.push_back(':');
+	        text.append(query.comment);
+	    }
+	    
+	    text.push_back('\t');
+	    appendDouble(text, pair.distance);
+	    text.push_back('\t');
+	    appendDouble(text, pair.pValue);
+	    text.push_back('\t');
+	    appendInteger(text, pair.numer);
+	    text.push_back('/');
+	    appendInteger(text, pair.denom);
+	    text.push_back('\n');
+	}
+	
+	void formatOutput(CommandDistance::CompareOutput * output, bool table, bool comment)
+	{
+	    string & text = output->text;
+	    uint64_t i = output->indexQuery;
+	    uint64_t j = output->indexRef;
+	    
+	    for ( uint64_t k = 0; k < output->pairCount && i < output->sketchQuery.getReferenceCount(); k++ )
+	    {
+	        const CommandDistance::CompareOutput::PairOutput * pair = &output->pairs[k];
+	        
+	        if ( table && j == 0 )
+	        {
+	            text.append(output->sketchQuery.getReference(i).name);
+	        }
+	        
+	        if ( table )
+	        {
+	            text.push_back('\t');
+	    
+	            if ( pair->pass )
+	            {
+	                appendDouble(text, pair->distance);
+	            }
+	        }
+	        else if ( pair->pass )
+	        {
+	            appendPair(text, output, j, i, *pair, comment);
+	        }
+	    
+	        j++;
+	        
+	        if ( j == output->sketchRef.getReferenceCount() )
+	        {
+	            if ( table )
+	            {
+	                text.push_back('\n');
+	            }
+	            
+	            j = 0;
+	            i++;
+	        }
+	    }
+	    
+	    for ( uint64_t k = 0; k < output->best.size(); k++ )
+	    {
+	        const CommandDistance::CompareOutput::BestPair & best = output->best[k];
+	        
+	        appendPair(text, output, best.indexRef, best.indexQuery, best.pair, comment);
+	    }
+	    
+	    output->formatted = true;
+	}
+	
+	void CommandDistance::writeOutput(CompareOutput * output, bool table, bool comment, OutputWriter & writer) const
+	{
+	    if ( ! output->formatted )
+	    {
+	        formatOutput(output, table, comment);
+	    }
+	    
+	    writer.write(output->text);
+	    delete output;
+	}
+	
+	void CommandDistance::writeOutput(CompareOutput * output, PackedDistWriter & writer) const
+	{
+	    // with -top, the best pairs are only final once merged
+	    //
+	    if ( ! output->isPacked )
+	    {
+	        packOutput(output, output->packed);
+	    }
+	    
+	    writer.write(output->packed);
+	    delete output;
+	}
+	
+    static double distanceFromCounts(uint64_t common, uint64_t denom, int kmerSize)
+    {
         double distance;
         double jaccard = double(common) / denom;
 
@@ -585,53 +1185,446 @@ namespace mash {
             //distance = log(double(common + 1) / (denom + 1)) / log(1. / (denom + 1));
             distance = -log(2 * jaccard / (1. + jaccard)) / kmerSize;
 
-            if ( distance > 1 )
+            if ( distance > 1 )
+            {
+                distance = 1;
+            }
+        }
+
+        return distance;
+    }
+
+    bool hasCountsAll(const Sketch & sketch)
+    {
+        for ( uint64_t i = 0; i < sketch.getReferenceCount(); i++ )
+        {
+            const Sketch::Reference & reference = sketch.getReference(i);
+            
+            if ( reference.counts.size() != uint64_t(reference.hashesSorted.size()) )
+            {
+                return false;
+            }
+        }
+        
+        return true;
+    }
+
+    double jaccardForDistance(double distance, int kmerSize)
+    {
+        double t = exp(-distance * kmerSize);
+        return t / (2. - t) * (1. - 1e-9); // margin for rounding
+    }
+
+    // As compareSketches(), with the weighted Jaccard index of the bottom
+    // sketchSize hashes of the union: the sum over them of the smaller count
+    // of each in the two sketches, over the sum of the larger (counting those
+    // in one sketch only with 0 in the other). The distance is estimated from
+    // it as from the unweighted index, and the p-value is that of the
+    // unweighted shared count, while numer and denom are the weighted sums.
+    // The prefilters do not apply, since weighted indices are not bounded by
+    // the unweighted ones.
+    //
+    static void compareSketchesWeighted(CommandDistance::CompareOutput::PairOutput * output, const Sketch::Reference & refRef, const Sketch::Reference & refQry, uint64_t sketchSize, int kmerSize, double kmerSpace, double maxDistance, double maxPValue, const CommandDistance::CompareTables * tables)
+    {
+        uint64_t i = 0;
+        uint64_t j = 0;
+        uint64_t common;
+        uint64_t minSum;
+        uint64_t countSum;
+        const HashList & hashesSortedRef = refRef.hashesSorted;
+        const HashList & hashesSortedQry = refQry.hashesSorted;
+        const uint32_t * countsRef = refRef.counts.data();
+        const uint32_t * countsQry = refQry.counts.data();
+
+        const SimdKernels & kernels = getSimdKernels();
+
+        if ( hashesSortedRef.get64() )
+        {
+            common = kernels.intersectCounts64((uint64_t*)hashesSortedRef.data64(), countsRef, hashesSortedRef.size(), (uint64_t*)hashesSortedQry.data64(), countsQry, hashesSortedQry.size(), sketchSize, &i, &j, &minSum, &countSum);
+        }
+        else
+        {
+            common = kernels.intersectCounts32((uint32_t*)hashesSortedRef.data32(), countsRef, hashesSortedRef.size(), (uint32_t*)hashesSortedQry.data32(), countsQry, hashesSortedQry.size(), sketchSize, &i, &j, &minSum, &countSum);
+        }
+
+        uint64_t denom = i + j - common;
+
+        // complete the union, if short, from the rest of either list (as in
+        // compareSketches())
+
+        for ( ; i < uint64_t(hashesSortedRef.size()) && denom < sketchSize; i++, denom++ )
+        {
+            countSum += countsRef[i];
+        }
+
+        for ( ; j < uint64_t(hashesSortedQry.size()) && denom < sketchSize; j++, denom++ )
+        {
+            countSum += countsQry[j];
+        }
+
+        uint64_t maxSum = countSum - minSum;
+        double distance = distanceFromCounts(minSum, maxSum, kmerSize);
+
+        if ( maxDistance >= 0 && distance > maxDistance )
+        {
+            return;
+        }
+
+        output->numer = minSum;
+        output->denom = maxSum;
+        output->distance = distance;
+        output->pValue = tables->pValue(common, refRef.length, refQry.length, kmerSpace, denom);
+
+        if ( maxPValue >= 0 && output->pValue > maxPValue )
+        {
+            return;
+        }
+
+        output->pass = true;
+    }
+
+    void compareSketches(CommandDistance::CompareOutput::PairOutput * output, const Sketch::Reference & refRef, const Sketch::Reference & refQry, uint64_t sketchSize, int kmerSize, double kmerSpace, double maxDistance, double maxPValue, const CommandDistance::CompareTables * tables)
+    {
+        uint64_t i = 0;
+        uint64_t j = 0;
+        uint64_t common = 0;
+        uint64_t denom = 0;
+        const HashList & hashesSortedRef = refRef.hashesSorted;
+        const HashList & hashesSortedQry = refQry.hashesSorted;
+
+        output->pass = false;
+
+        const SimdKernels & kernels = getSimdKernels();
+
+        if ( tables != 0 && tables->weighted )
+        {
+            compareSketchesWeighted(output, refRef, refQry, sketchSize, kmerSize, kmerSpace, maxDistance, maxPValue, tables);
+            return;
+        }
+
+        if
+        (
+            tables != 0 &&
+            tables->sizeFilterRegisters != 0 &&
+            refRef.hll.size() == tables->sizeFilterRegisters &&
+            refQry.hll.size() == tables->sizeFilterRegisters
+        )
+        {
+            double sizeMin = min(refRef.hllSize, refQry.hllSize);
+            double sizeMax = max(refRef.hllSize, refQry.hllSize);
+
+            if ( sizeMax > 0 && sizeMin / sizeMax < tables->sizeRatioMin )
+            {
+                return;
+            }
+        }
+
+        if ( tables != 0 && tables->prefilterHashes != 0 && sketchSize > tables->prefilterHashes )
+        {
+            // The smallest prefilterHashes of the union are a random sample of
+            // the full union, so a pair with too few shared among them is
+            // certain enough to fail that the rest need not be merged.
+            //
+            uint64_t prefix = tables->prefilterHashes;
+
+            if ( hashesSortedRef.get64() )
+            {
+                common = kernels.intersect64((uint64_t*)hashesSortedRef.data64(), hashesSortedRef.size(), (uint64_t*)hashesSortedQry.data64(), hashesSortedQry.size(), prefix, &i, &j);
+            }
+            else
+            {
+                common = kernels.intersect32((uint32_t*)hashesSortedRef.data32(), hashesSortedRef.size(), (uint32_t*)hashesSortedQry.data32(), hashesSortedQry.size(), prefix, &i, &j);
+            }
+
+            if ( i + j - common >= prefix && common < tables->prefilterShared )
+            {
+                return;
+            }
+        }
+
+        if(hashesSortedRef.get64())
+        {
+            common = kernels.intersect64((uint64_t*)hashesSortedRef.data64(), hashesSortedRef.size(), (uint64_t*)hashesSortedQry.data64(), hashesSortedQry.size(), sketchSize, &i, &j);
+        }
+        else
+        {
+            common = kernels.intersect32((uint32_t*)hashesSortedRef.data32(), hashesSortedRef.size(), (uint32_t*)hashesSortedQry.data32(), hashesSortedQry.size(), sketchSize, &i, &j);
+        }
+
+        denom = i + j - common;
+
+        //#endif
+
+
+        if ( denom < sketchSize )
+        {
+            // complete the union operation if possible
+
+            if ( i < hashesSortedRef.size() )
+            {
+                denom += hashesSortedRef.size() - i;
+            }
+
+            if ( j < hashesSortedQry.size() )
+            {
+                denom += hashesSortedQry.size() - j;
+            }
+
+            if ( denom > sketchSize )
+            {
+                denom = sketchSize;
+            }
+        }
+
+        double distance;
+
+        if ( tables != 0 && denom == tables->sketchSize && kmerSize == tables->kmerSize )
+        {
+            distance = tables->distances[common];
+        }
+        else
+        {
+            distance = distanceFromCounts(common, denom, kmerSize);
+        }
+
+        if ( maxDistance >= 0 && distance > maxDistance )
+        {
+            return;
+        }
+
+        output->numer = common;
+        output->denom = denom;
+        output->distance = distance;
+        output->pValue = tables != 0 ?
+            tables->pValue(common, refRef.length, refQry.length, kmerSpace, denom) :
+            pValue(common, refRef.length, refQry.length, kmerSpace, denom);
+
+        if ( maxPValue >= 0 && output->pValue > maxPValue )
+        {
+            return;
+        }
+
+        output->pass = true;
+
+
+    }
+
+    double pValue(uint64_t x, uint64_t lengthRef, uint64_t lengthQuery, double kmerSpace, uint64_t sketchSize)
+    {
+        if ( x == 0 )
+        {
+            return 1.;
+        }
+
+        double pX = 1. / (1. + kmerSpace / lengthRef);
+        double pY = 1. / (1. + kmerSpace / lengthQuery);
+
+        double r = pX * pY / (pX + pY - pX * pY);
+
+        //double M = (double)kmerSpace * (pX + pY) / (1. + r);
+
+        //return gsl_cdf_hypergeometric_Q(x - 1, r * M, M - r * M, sketchSize);
+
+#ifdef USE_BOOST
+        return cdf(complement(binomial(sketchSize, r), x - 1));
+#else
+        return gsl_cdf_binomial_Q(x - 1, r, sketchSize);
+#endif
+    }
+
+    CommandDistance::CompareTables::CompareTables(uint64_t sketchSizeNew, int kmerSizeNew)
+        :
+        sketchSize(sketchSizeNew),
+        kmerSize(kmerSizeNew)
+    {
+        distances.resize(sketchSize + 1);
+        logFactorials.resize(sketchSize + 1);
+
+        for ( uint64_t i = 0; i <= sketchSize; i++ )
+        {
+            distances[i] = distanceFromCounts(i, sketchSize, kmerSize);
+            logFactorials[i] = lgamma(i + 1.);
+        }
+    }
+
+    // P(X >= x) for X ~ binomial(sketchSize, r), summed directly from the
+    // terms of the distribution, each the last times
+    // (sketchSize - i) / (i + 1) * r / (1 - r). Well above the mean (as for
+    // pairs of unrelated genomes, where the mean is tiny) the upper tail is
+    // summed and converges in a few terms; well below it, one minus the lower
+    // tail is used. Near the mean, where either would take many terms, the
+    // library distribution is used, as in pValue().
+    //
+    // The shared count among the first m hashes of a union whose Jaccard is p
+    // is hypergeometric with mean m * p, which the Chernoff bound
+    // exp(-m * D(t / m || p)) limits below t for t < m * p, D being the
+    // relative entropy of Bernoulli variables. The threshold is the largest
+    // t that bound puts at or under 1e-9 for the smallest passing Jaccard,
+    // so passing pairs are (at that rate) never filtered. The prefix is the
+    // shortest of 128, 256, ... (up to 3/4 of the sketch) that gives a
+    // threshold; greater distances need longer ones (with k = 21, 128 is
+    // enough for -d 0.06 and 512 for 0.12).
+    //
+    void CommandDistance::CompareTables::enablePrefilter(double maxDistance)
+    {
+        static const double missMax = 1e-9;
+
+        prefilterHashes = 0;
+        prefilterShared = 0;
+
+        if ( maxDistance < 0 || maxDistance >= 1 )
+        {
+            return;
+        }
+
+        double p = jaccardForDistance(maxDistance, kmerSize);
+
+        for ( uint64_t prefix = 128; prefix * 4 <= sketchSize * 3; prefix *= 2 )
+        {
+            double m = prefix;
+
+            for ( uint64_t t = 0; t < m * p; t++ )
+            {
+                double q = t / m;
+                double divergence = (1. - q) * log((1. - q) / (1. - p));
+
+                if ( t > 0 )
+                {
+                    divergence += q * log(q / p);
+                }
+
+                if ( exp(-m * divergence) > missMax )
+                {
+                    break;
+                }
+
+                prefilterHashes = prefix;
+                prefilterShared = t + 1;
+            }
+
+            if ( prefilterHashes != 0 )
             {
-                distance = 1;
+                return;
             }
         }
+    }
 
-        if ( maxDistance >= 0 && distance > maxDistance )
+    void CommandDistance::CompareTables::enableSizeFilter(double maxDistance, int hllPrecision)
+    {
+        static const double missMax = 1e-9;
+        static const double deviations = 6; // of the size estimates, for missMax
+
+        sizeFilterRegisters = 0;
+        sizeRatioMin = 0;
+
+        if ( hllPrecision == 0 || maxDistance < 0 || maxDistance >= 1 )
         {
             return;
         }
 
-        output->numer = common;
-        output->denom = denom;
-        output->distance = distance;
-        output->pValue = pValue(common, refRef.length, refQry.length, kmerSpace, denom);
+        // A pair whose Jaccard index is q passes if its sketch estimates at
+        // least p, which is no more likely than missMax below the q found
+        // here (by the same bound as enablePrefilter()).
+        //
+        double p = jaccardForDistance(maxDistance, kmerSize);
+        double m = sketchSize;
+        double q = 0;
 
-        if ( maxPValue >= 0 && output->pValue > maxPValue )
+        for ( int i = 1023; i > 0; i-- )
         {
-            return;
+            double r = p * i / 1024;
+            double divergence = p * log(p / r) + (1. - p) * log((1. - p) / (1. - r));
+
+            if ( exp(-m * divergence) <= missMax )
+            {
+                q = r;
+                break;
+            }
         }
 
-        output->pass = true;
+        // the ratio of two estimates is within this of the true ratio
+        //
+        double error = deviations * 1.04 / sqrt(double(uint64_t(1) << hllPrecision));
 
+        if ( q == 0 || error >= 1 )
+        {
+            return;
+        }
 
+        sizeFilterRegisters = uint64_t(1) << hllPrecision;
+        sizeRatioMin = q * (1. - error) / (1. + error);
     }
 
-    double pValue(uint64_t x, uint64_t lengthRef, uint64_t lengthQuery, double kmerSpace, uint64_t sketchSize)
+    double CommandDistance::CompareTables::pValue(uint64_t x, uint64_t lengthRef, uint64_t lengthQuery, double kmerSpace, uint64_t sketchSize) const
     {
+        static const uint64_t termsMax = 64;
+
         if ( x == 0 )
         {
             return 1.;
         }
 
+        if ( sketchSize >= logFactorials.size() || x > sketchSize )
+        {
+            return mash::pValue(x, lengthRef, lengthQuery, kmerSpace, sketchSize);
+        }
+
         double pX = 1. / (1. + kmerSpace / lengthRef);
         double pY = 1. / (1. + kmerSpace / lengthQuery);
 
         double r = pX * pY / (pX + pY - pX * pY);
+        double odds = r / (1. - r);
+        double mean = sketchSize * r;
 
-        //double M = (double)kmerSpace * (pX + pY) / (1. + r);
+        if ( r <= 0 || r >= 1 )
+        {
+            return mash::pValue(x, lengthRef, lengthQuery, kmerSpace, sketchSize);
+        }
 
-        //return gsl_cdf_hypergeometric_Q(x - 1, r * M, M - r * M, sketchSize);
+        if ( x > mean )
+        {
+            double term = 1.;
+            double sum = 1.;
+            uint64_t i;
 
-#ifdef USE_BOOST
-        return cdf(complement(binomial(sketchSize, r), x - 1));
-#else
-        return gsl_cdf_binomial_Q(x - 1, r, sketchSize);
-#endif
+            for ( i = x; i < sketchSize && i < x + termsMax; i++ )
+            {
+                term *= (sketchSize - i) / (i + 1.) * odds;
+                sum += term;
+
+                if ( term < sum * 1e-17 )
+                {
+                    break;
+                }
+            }
+
+            if ( i == x + termsMax )
+            {
+                return mash::pValue(x, lengthRef, lengthQuery, kmerSpace, sketchSize);
+            }
+
+            double logTerm =
+                logFactorials[sketchSize] - logFactorials[x] - logFactorials[sketchSize - x] +
+                x * log(r) + (sketchSize - x) * log1p(-r);
+
+            return exp(logTerm) * sum;
+        }
+
+        if ( x <= termsMax && mean - x > 4 * sqrt(mean) ) // mean more than 4 sd above
+        {
+            double term = exp(sketchSize * log1p(-r));
+            double sum = term;
+
+            for ( uint64_t i = 0; i + 1 < x; i++ )
+            {
+                term *= (sketchSize - i) / (i + 1.) * odds;
+                sum += term;
+            }
+
+            return 1. - sum;
+        }
+
+        return mash::pValue(x, lengthRef, lengthQuery, kmerSpace, sketchSize);
     }
 
     //#if defined (__ICC) || defined (__INTEL_COMPILER)
@@ -672,7 +1665,7 @@ namespace mash {
             return counter;
     }
 
-    uint64_t u32_intersect_scalar_stop(const uint32_t *list1, uint32_t size1, const uint32_t *list2, uint32_t size2, uint32_t size3,
+    uint64_t u32_intersect_scalar_stop(const uint32_t *list1, uint64_t size1, const uint32_t *list2, uint64_t size2, uint64_t size3,
             uint64_t *i_a, uint64_t *i_b){
         uint64_t counter=0;
         const uint32_t *end1 = list1+size1, *end2 = list2+size2;
@@ -707,7 +1700,55 @@ namespace mash {
 #endif
             return counter;
     }
-#if defined __AVX512F__ && defined __AVX512CD__
+
+    // The weighted intersections below also sum the counts of the hashes
+    // passed in either list (countSum) and the smaller count of each shared
+    // hash (minSum), so the union reached has the weighted Jaccard index
+    // minSum / (countSum - minSum).
+
+    template <class T>
+    static inline uint64_t intersectCountsScalar(const T *list1, const uint32_t *counts1, uint64_t size1, const T *list2, const uint32_t *counts2, uint64_t size2, uint64_t size3,
+            uint64_t *i_a, uint64_t *i_b, uint64_t *minSum, uint64_t *countSum){
+        uint64_t counter=0;
+        uint64_t a = 0, b = 0;
+        uint64_t sumMin = 0, sum = 0;
+
+        while(a != size1 && b != size2){
+            if(list1[a] < list2[b]){
+                sum += counts1[a];
+                a++;
+            }else if(list1[a] > list2[b]){
+                sum += counts2[b];
+                b++;
+            }else{
+                counter++;
+                sum += counts1[a] + (uint64_t)counts2[b];
+                sumMin += std::min(counts1[a], counts2[b]);
+                a++; b++;
+            }
+            if(--size3 == 0) break;
+        }
+
+        *i_a = a;
+        *i_b = b;
+        *minSum = sumMin;
+        *countSum = sum;
+        return counter;
+    }
+
+    uint64_t u64_intersect_counts_scalar(const uint64_t *list1, const uint32_t *counts1, uint64_t size1, const uint64_t *list2, const uint32_t *counts2, uint64_t size2, uint64_t size3,
+            uint64_t *i_a, uint64_t *i_b, uint64_t *minSum, uint64_t *countSum){
+        return intersectCountsScalar(list1, counts1, size1, list2, counts2, size2, size3, i_a, i_b, minSum, countSum);
+    }
+
+    uint64_t u32_intersect_counts_scalar(const uint32_t *list1, const uint32_t *counts1, uint64_t size1, const uint32_t *list2, const uint32_t *counts2, uint64_t size2, uint64_t size3,
+            uint64_t *i_a, uint64_t *i_b, uint64_t *minSum, uint64_t *countSum){
+        return intersectCountsScalar(list1, counts1, size1, list2, counts2, size2, size3, i_a, i_b, minSum, countSum);
+    }
+
+#ifdef SIMD_X86
+    // Lookup tables for the AVX512 kernels (currently unused); they are kept
+    // out of the target regions so their static initialization runs anywhere.
 
     static /*constexpr*/ std::array<uint64_t,8*7> u64_prepare_shuffle_vectors(){
         std::array<uint64_t,8*7> arr = {};
@@ -725,6 +1766,30 @@ namespace mash {
     static const /*constexpr*/ auto u64_shuffle_vectors_arr = u64_prepare_shuffle_vectors();
 
     static const /*constexpr*/ __m512i *u64_shuffle_vectors = (__m512i*)u64_shuffle_vectors_arr.data();
+
+    static /*constexpr*/ std::array<uint32_t,16*16> u32_prepare_shuffle_vectors(){
+        std::array<uint32_t,16*16> arr_unalign = {};
+        //std::array<uint64_t,8*7> arr = {};
+        uint32_t *arr = (uint32_t *)(((long)arr_unalign.data() + 64) & (~63));
+        //__m512i *temp;
+        uint64_t start=1;
+        for(uint64_t i=0; i<15; ++i){
+            uint64_t counter = start;
+            for(uint64_t j=0; j<16; ++j){
+                arr[i*16 + j] = counter % 16;
+                ++counter;
+            }
+            ++start;
+        }
+        return arr_unalign;
+    }
+    static const /*constexpr*/ auto u32_shuffle_vectors_arr = u32_prepare_shuffle_vectors();
+    static const /*constexpr*/ __m512i *u32_shuffle_vectors_unalign = (__m512i*)u32_shuffle_vectors_arr.data();
+    //static const /*constexpr*/ __m512i *u64_shuffle_vectors = (__m512i*)u64_shuffle_vectors_arr.data();
+    static const __m512i *u32_shuffle_vectors = (__m512i *)(((long)u32_shuffle_vectors_unalign + 64) & (~63));
+
+SIMD_TARGET_BEGIN(SIMD_TARGET_AVX512)
+
     static void inline
         inspect(__m512i v){
             uint64_t f[8] __attribute__((aligned(64)));
@@ -842,28 +1907,8 @@ namespace mash {
     }
 
 
-    static /*constexpr*/ std::array<uint32_t,16*16> u32_prepare_shuffle_vectors(){
-        std::array<uint32_t,16*16> arr_unalign = {};
-        //std::array<uint64_t,8*7> arr = {};
-        uint32_t *arr = (uint32_t *)(((long)arr_unalign.data() + 64) & (~63));
-        //__m512i *temp;
-        uint64_t start=1;
-        for(uint64_t i=0; i<15; ++i){
-            uint64_t counter = start;
-            for(uint64_t j=0; j<16; ++j){
-                arr[i*16 + j] = counter % 16;
-                ++counter;
-            }
-            ++start;
-        }
-        return arr_unalign;
-    }
-    static const /*constexpr*/ auto u32_shuffle_vectors_arr = u32_prepare_shuffle_vectors();
-    static const /*constexpr*/ __m512i *u32_shuffle_vectors_unalign = (__m512i*)u32_shuffle_vectors_arr.data();
-    //static const /*constexpr*/ __m512i *u64_shuffle_vectors = (__m512i*)u64_shuffle_vectors_arr.data();
-    static const __m512i *u32_shuffle_vectors = (__m512i *)(((long)u32_shuffle_vectors_unalign + 64) & (~63));
     //size3 is the stop threshold of the sum of size1&size2 
-    uint32_t u32_intersect_vector_avx512(const uint32_t *list1, uint32_t size1, const uint32_t *list2, uint32_t size2, uint32_t size3, uint64_t *i_a, uint64_t *i_b){
+    uint64_t u32_intersect_vector_avx512(const uint32_t *list1, uint64_t size1, const uint32_t *list2, uint64_t size2, uint64_t size3, uint64_t *i_a, uint64_t *i_b){
         //assert(size3 <= size1 + size2);
         uint64_t count=0;
         *i_a = 0;
@@ -997,12 +2042,147 @@ namespace mash {
         return count;
     }
 
+    // Weighted, as u64_intersect_counts_avx2()
+
+    uint64_t u64_intersect_counts_avx512(const uint64_t *list1, const uint32_t *counts1, uint64_t size1, const uint64_t *list2, const uint32_t *counts2, uint64_t size2, uint64_t size3,
+            uint64_t *i_a, uint64_t *i_b, uint64_t *minSum, uint64_t *countSum){
+        uint64_t count=0;
+        *i_a = 0;
+        *i_b = 0;
+        uint64_t st_a = size1 > 8 ? size1 - 8 : 0;
+        uint64_t st_b = size2 > 8 ? size2 - 8 : 0;
+
+        if(size3 <= 16){
+            return u64_intersect_counts_scalar(list1, counts1, size1, list2, counts2, size2, size3, i_a, i_b, minSum, countSum);
+        }
 
+        uint64_t stop = size3 - 16;
+        __m512i lanes = _mm512_setr_epi64(0, 1, 2, 3, 4, 5, 6, 7);
+        __m512i sumMin = _mm512_setzero_si512();
+        __m512i sum = _mm512_setzero_si512();
 
-#else
-#ifdef __AVX2__
+        while(*i_a < st_a && *i_b < st_b){
+            uint64_t a_max = list1[*i_a+7];
+            uint64_t b_max = list2[*i_b+7];
+
+            __m512i v_a = _mm512_loadu_si512((__m512i*)&list1[*i_a]);
+            __m512i v_b = _mm512_loadu_si512((__m512i*)&list2[*i_b]);
+            __m512i c_a = _mm512_cvtepu32_epi64(_mm256_loadu_si256((__m256i*)&counts1[*i_a]));
+            __m512i c_b = _mm512_cvtepu32_epi64(_mm256_loadu_si256((__m256i*)&counts2[*i_b]));
+
+            __mmask8 cmp_mask = 0;
+            __m512i partner = lanes;
+
+            for(int r = 1; r < 8; r++){
+                __m512i idx = _mm512_and_si512(_mm512_add_epi64(lanes, _mm512_set1_epi64(r)), _mm512_set1_epi64(7));
+                __mmask8 cmp = _mm512_cmpeq_epu64_mask(v_a, _mm512_permutexvar_epi64(idx, v_b));
+                cmp_mask |= cmp;
+                partner = _mm512_mask_mov_epi64(partner, cmp, idx);
+            }
+
+            cmp_mask |= _mm512_cmpeq_epu64_mask(v_a, v_b);
+            count += _mm_popcnt_u32(cmp_mask);
+            sumMin = _mm512_mask_add_epi64(sumMin, cmp_mask, sumMin, _mm512_min_epu64(c_a, _mm512_permutexvar_epi64(partner, c_b)));
+
+            if(a_max <= b_max){
+                sum = _mm512_add_epi64(sum, c_a);
+                *i_a += 8;
+            }
+            if(a_max >= b_max){
+                sum = _mm512_add_epi64(sum, c_b);
+                *i_b += 8;
+            }
+
+            if(*i_a + *i_b - count >= stop) break;
+        }
+
+        uint64_t i_a_s, i_b_s, minSum_s, countSum_s;
+
+        count += u64_intersect_counts_scalar(list1+*i_a, counts1+*i_a, size1-*i_a, list2+*i_b, counts2+*i_b, size2-*i_b, size3 - (*i_a+*i_b - count), &i_a_s, &i_b_s, &minSum_s, &countSum_s);
+
+        *i_a += i_a_s;
+        *i_b += i_b_s;
+        *minSum = _mm512_reduce_add_epi64(sumMin) + minSum_s;
+        *countSum = _mm512_reduce_add_epi64(sum) + countSum_s;
+        return count;
+    }
+
+    // (as widenAdd32())
+    //
+    static inline __m512i widenAdd32x16(__m512i sum, __m512i v){
+        __m512i lo = _mm512_and_si512(v, _mm512_set1_epi64(0xffffffff));
+        __m512i hi = _mm512_srli_epi64(v, 32);
+        return _mm512_add_epi64(sum, _mm512_add_epi64(lo, hi));
+    }
+
+    uint64_t u32_intersect_counts_avx512(const uint32_t *list1, const uint32_t *counts1, uint64_t size1, const uint32_t *list2, const uint32_t *counts2, uint64_t size2, uint64_t size3,
+            uint64_t *i_a, uint64_t *i_b, uint64_t *minSum, uint64_t *countSum){
+        uint64_t count=0;
+        *i_a = 0;
+        *i_b = 0;
+        uint64_t st_a = size1 > 16 ? size1 - 16 : 0;
+        uint64_t st_b = size2 > 16 ? size2 - 16 : 0;
+
+        if(size3 <= 32){
+            return u32_intersect_counts_scalar(list1, counts1, size1, list2, counts2, size2, size3, i_a, i_b, minSum, countSum);
+        }
+
+        uint64_t stop = size3 - 32;
+        __m512i lanes = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+        __m512i sumMin = _mm512_setzero_si512();
+        __m512i sum = _mm512_setzero_si512();
+
+        while(*i_a < st_a && *i_b < st_b){
+            uint32_t a_max = list1[*i_a+15];
+            uint32_t b_max = list2[*i_b+15];
+
+            __m512i v_a = _mm512_loadu_si512((__m512i*)&list1[*i_a]);
+            __m512i v_b = _mm512_loadu_si512((__m512i*)&list2[*i_b]);
+            __m512i c_a = _mm512_loadu_si512((__m512i*)&counts1[*i_a]);
+            __m512i c_b = _mm512_loadu_si512((__m512i*)&counts2[*i_b]);
+
+            __mmask16 cmp_mask = 0;
+            __m512i partner = lanes;
+
+            for(int r = 1; r < 16; r++){
+                __m512i idx = _mm512_and_si512(_mm512_add_epi32(lanes, _mm512_set1_epi32(r)), _mm512_set1_epi32(15));
+                __mmask16 cmp = _mm512_cmpeq_epu32_mask(v_a, _mm512_permutexvar_epi32(idx, v_b));
+                cmp_mask |= cmp;
+                partner = _mm512_mask_mov_epi32(partner, cmp, idx);
+            }
+
+            cmp_mask |= _mm512_cmpeq_epu32_mask(v_a, v_b);
+            count += _mm_popcnt_u32(cmp_mask);
+            sumMin = widenAdd32x16(sumMin, _mm512_maskz_min_epu32(cmp_mask, c_a, _mm512_permutexvar_epi32(partner, c_b)));
+
+            if(a_max <= b_max){
+                sum = widenAdd32x16(sum, c_a);
+                *i_a += 16;
+            }
+            if(a_max >= b_max){
+                sum = widenAdd32x16(sum, c_b);
+                *i_b += 16;
+            }
+
+            if(*i_a + *i_b - count >= stop) break;
+        }
+
+        uint64_t i_a_s, i_b_s, minSum_s, countSum_s;
+
+        count += u32_intersect_counts_scalar(list1+*i_a, counts1+*i_a, size1-*i_a, list2+*i_b, counts2+*i_b, size2-*i_b, size3 - (*i_a+*i_b - count), &i_a_s, &i_b_s, &minSum_s, &countSum_s);
+
+        *i_a += i_a_s;
+        *i_b += i_b_s;
+        *minSum = _mm512_reduce_add_epi64(sumMin) + minSum_s;
+        *countSum = _mm512_reduce_add_epi64(sum) + countSum_s;
+        return count;
+    }
+
+SIMD_TARGET_END
+
+SIMD_TARGET_BEGIN(SIMD_TARGET_AVX2)
     
-    size_t u32_intersect_vector_avx2(const uint32_t *list1, uint32_t size1, const uint32_t *list2, uint32_t size2, uint32_t size3, uint64_t* i_a, uint64_t* i_b){
+    uint64_t u32_intersect_vector_avx2(const uint32_t *list1, uint64_t size1, const uint32_t *list2, uint64_t size2, uint64_t size3, uint64_t* i_a, uint64_t* i_b){
         //assert(size3 <= size1 + size2);
         uint64_t count=0;
         *i_a = 0;
@@ -1117,7 +2297,7 @@ namespace mash {
         return count;
     }
 
-    size_t u64_intersect_vector_avx2(const uint64_t *list1, uint64_t size1, const uint64_t *list2, uint64_t size2, uint64_t size3, uint64_t* i_a, uint64_t* i_b){
+    uint64_t u64_intersect_vector_avx2(const uint64_t *list1, uint64_t size1, const uint64_t *list2, uint64_t size2, uint64_t size3, uint64_t* i_a, uint64_t* i_b){
     		//assert(size3 <= size1 + size2);
     		uint64_t count=0;
     		*i_a = 0;
@@ -1244,8 +2424,199 @@ namespace mash {
     		//}
     		return count;
     }
-#else
-#ifdef __SSE4_1__
+
+    // Weighted (see intersectCountsScalar()): as each block of list1 is
+    // compared with rotations of a block of list2, the position in list2 of
+    // each lane's match (there is at most one) is kept, so the matching counts
+    // take a single permute; the smaller of each pair is added to 64-bit sums,
+    // as are the counts of each block passed. Blocks are only taken while
+    // more of their list follows, so that the scalar tail passes the entries
+    // of a block left behind when the other list ends (which the unweighted
+    // kernels can leave out), and the result is the same as the scalar one.
+
+    static inline uint64_t sumLanes64(__m256i v){
+        __m128i s = _mm_add_epi64(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+        return _mm_cvtsi128_si64(s) + _mm_extract_epi64(s, 1);
+    }
+
+    // adds the 32-bit lanes of v to 64-bit sums (of their pairs), splitting
+    // them with a mask and a shift rather than shuffles, which compete with
+    // the rotations for a port
+    //
+    static inline __m256i widenAdd32(__m256i sum, __m256i v){
+        __m256i lo = _mm256_and_si256(v, _mm256_set1_epi64x(0xffffffff));
+        __m256i hi = _mm256_srli_epi64(v, 32);
+        return _mm256_add_epi64(sum, _mm256_add_epi64(lo, hi));
+    }
+
+    uint64_t u64_intersect_counts_avx2(const uint64_t *list1, const uint32_t *counts1, uint64_t size1, const uint64_t *list2, const uint32_t *counts2, uint64_t size2, uint64_t size3,
+            uint64_t *i_a, uint64_t *i_b, uint64_t *minSum, uint64_t *countSum){
+        uint64_t count=0;
+        *i_a = 0;
+        *i_b = 0;
+        uint64_t st_a = size1 > 4 ? size1 - 4 : 0;
+        uint64_t st_b = size2 > 4 ? size2 - 4 : 0;
+
+        if(size3 <= 8){
+            return u64_intersect_counts_scalar(list1, counts1, size1, list2, counts2, size2, size3, i_a, i_b, minSum, countSum);
+        }
+
+        uint64_t stop = size3 - 8;
+
+        // positions in the counts of list2 of the lanes of each rotation of
+        // its block (by 0, 1, 2 and 3), as 64-bit lanes
+        __m256i idx0 = _mm256_setr_epi32(0, 4, 1, 4, 2, 4, 3, 4);
+        __m256i idx1 = _mm256_setr_epi32(1, 4, 2, 4, 3, 4, 0, 4);
+        __m256i idx2 = _mm256_setr_epi32(2, 4, 3, 4, 0, 4, 1, 4);
+        __m256i idx3 = _mm256_setr_epi32(3, 4, 0, 4, 1, 4, 2, 4);
+        __m256i sumMin = _mm256_setzero_si256();
+        __m256i sum = _mm256_setzero_si256();
+
+        while(*i_a < st_a && *i_b < st_b){
+            uint64_t a_max = list1[*i_a+3];
+            uint64_t b_max = list2[*i_b+3];
+
+            __m256i v_a = _mm256_loadu_si256((__m256i*)&(list1[*i_a]));
+            __m256i v_b = _mm256_loadu_si256((__m256i*)&(list2[*i_b]));
+            __m128i c_a = _mm_loadu_si128((__m128i*)&(counts1[*i_a]));
+            __m128i c_b = _mm_loadu_si128((__m128i*)&(counts2[*i_b]));
+
+            __m256i cmp_mask1 = _mm256_cmpeq_epi64(v_a, v_b);
+            __m256i cmp_mask2 = _mm256_cmpeq_epi64(v_a, _mm256_permute4x64_epi64(v_b, 57));//00111001
+            __m256i cmp_mask3 = _mm256_cmpeq_epi64(v_a, _mm256_permute4x64_epi64(v_b, 78));//01001110
+            __m256i cmp_mask4 = _mm256_cmpeq_epi64(v_a, _mm256_permute4x64_epi64(v_b, 147));//10010011
+
+            __m256i cmp_mask = _mm256_or_si256(_mm256_or_si256(cmp_mask1, cmp_mask2), _mm256_or_si256(cmp_mask3, cmp_mask4));
+            int64_t mask = _mm256_movemask_pd((__m256d)cmp_mask);
+
+            if(mask){
+                // (c_b in the low lanes, so index 4 gives the upper halves 0)
+                __m256i partner = _mm256_or_si256(
+                        _mm256_or_si256(_mm256_and_si256(cmp_mask1, idx0), _mm256_and_si256(cmp_mask2, idx1)),
+                        _mm256_or_si256(_mm256_and_si256(cmp_mask3, idx2), _mm256_and_si256(cmp_mask4, idx3)));
+                __m256i c_b8 = _mm256_zextsi128_si256(c_b);
+                __m256i c_bp = _mm256_permutevar8x32_epi32(c_b8, partner);
+                __m256i mins = _mm256_and_si256(cmp_mask, _mm256_min_epu32(_mm256_cvtepu32_epi64(c_a), c_bp));
+                sumMin = _mm256_add_epi64(sumMin, mins);
+                count += _mm_popcnt_u64(mask);
+            }
+
+            if(a_max <= b_max){
+                sum = _mm256_add_epi64(sum, _mm256_cvtepu32_epi64(c_a));
+                *i_a += 4;
+            }
+            if(a_max >= b_max){
+                sum = _mm256_add_epi64(sum, _mm256_cvtepu32_epi64(c_b));
+                *i_b += 4;
+            }
+
+            if(*i_a + *i_b - count >= stop) break;
+        }
+
+        uint64_t i_a_s, i_b_s, minSum_s, countSum_s;
+
+        count += u64_intersect_counts_scalar(list1+*i_a, counts1+*i_a, size1-*i_a, list2+*i_b, counts2+*i_b, size2-*i_b, size3 - (*i_a+*i_b - count), &i_a_s, &i_b_s, &minSum_s, &countSum_s);
+
+        *i_a += i_a_s;
+        *i_b += i_b_s;
+        *minSum = sumLanes64(sumMin) + minSum_s;
+        *countSum = sumLanes64(sum) + countSum_s;
+        return count;
+    }
+
+    uint64_t u32_intersect_counts_avx2(const uint32_t *list1, const uint32_t *counts1, uint64_t size1, const uint32_t *list2, const uint32_t *counts2, uint64_t size2, uint64_t size3,
+            uint64_t *i_a, uint64_t *i_b, uint64_t *minSum, uint64_t *countSum){
+        uint64_t count=0;
+        *i_a = 0;
+        *i_b = 0;
+        uint64_t st_a = size1 > 8 ? size1 - 8 : 0;
+        uint64_t st_b = size2 > 8 ? size2 - 8 : 0;
+
+        if(size3 <= 16){
+            return u32_intersect_counts_scalar(list1, counts1, size1, list2, counts2, size2, size3, i_a, i_b, minSum, countSum);
+        }
+
+        uint64_t stop = size3 - 16;
+
+        const int32_t cyclic_shift = _MM_SHUFFLE(0,3,2,1); //rotating right
+        const int32_t cyclic_shift2= _MM_SHUFFLE(2,1,0,3); //rotating left
+        const int32_t cyclic_shift3= _MM_SHUFFLE(1,0,3,2); //between
+        __m256i idx1 = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+        __m256i idx2 = (__m256i)_mm256_permute_ps((__m256)idx1, cyclic_shift);
+        __m256i idx3 = (__m256i)_mm256_permute_ps((__m256)idx1, cyclic_shift3);
+        __m256i idx4 = (__m256i)_mm256_permute_ps((__m256)idx1, cyclic_shift2);
+        __m256i idx5 = (__m256i)_mm256_permute2f128_ps((__m256)idx1, (__m256)idx1, 1);
+        __m256i idx6 = (__m256i)_mm256_permute_ps((__m256)idx5, cyclic_shift);
+        __m256i idx7 = (__m256i)_mm256_permute_ps((__m256)idx5, cyclic_shift3);
+        __m256i idx8 = (__m256i)_mm256_permute_ps((__m256)idx5, cyclic_shift2);
+        __m256i sumMin = _mm256_setzero_si256();
+        __m256i sum = _mm256_setzero_si256();
+
+        while(*i_a < st_a && *i_b < st_b){
+            uint32_t a_max = list1[*i_a+7];
+            uint32_t b_max = list2[*i_b+7];
+
+            __m256i v_a = _mm256_loadu_si256((__m256i*)&(list1[*i_a]));
+            __m256i v_b = _mm256_loadu_si256((__m256i*)&(list2[*i_b]));
+            __m256i c_a = _mm256_loadu_si256((__m256i*)&(counts1[*i_a]));
+            __m256i c_b = _mm256_loadu_si256((__m256i*)&(counts2[*i_b]));
+
+            // the rotations of u32_intersect_vector_avx2(), each with the
+            // positions it takes from v_b
+            __m256i rot4 = (__m256i)_mm256_permute2f128_ps((__m256)v_b, (__m256)v_b, 1);
+            __m256i cmp1 = _mm256_cmpeq_epi32(v_a, v_b);
+            __m256i cmp2 = _mm256_cmpeq_epi32(v_a, (__m256i)_mm256_permute_ps((__m256)v_b, cyclic_shift));
+            __m256i cmp3 = _mm256_cmpeq_epi32(v_a, (__m256i)_mm256_permute_ps((__m256)v_b, cyclic_shift3));
+            __m256i cmp4 = _mm256_cmpeq_epi32(v_a, (__m256i)_mm256_permute_ps((__m256)v_b, cyclic_shift2));
+            __m256i cmp5 = _mm256_cmpeq_epi32(v_a, rot4);
+            __m256i cmp6 = _mm256_cmpeq_epi32(v_a, (__m256i)_mm256_permute_ps((__m256)rot4, cyclic_shift));
+            __m256i cmp7 = _mm256_cmpeq_epi32(v_a, (__m256i)_mm256_permute_ps((__m256)rot4, cyclic_shift3));
+            __m256i cmp8 = _mm256_cmpeq_epi32(v_a, (__m256i)_mm256_permute_ps((__m256)rot4, cyclic_shift2));
+
+            __m256i cmp_mask = _mm256_or_si256(
+                    _mm256_or_si256(_mm256_or_si256(cmp1, cmp2), _mm256_or_si256(cmp3, cmp4)),
+                    _mm256_or_si256(_mm256_or_si256(cmp5, cmp6), _mm256_or_si256(cmp7, cmp8)));
+            __m256i partner = _mm256_or_si256(
+                    _mm256_or_si256(
+                        _mm256_or_si256(_mm256_and_si256(cmp1, idx1), _mm256_and_si256(cmp2, idx2)),
+                        _mm256_or_si256(_mm256_and_si256(cmp3, idx3), _mm256_and_si256(cmp4, idx4))),
+                    _mm256_or_si256(
+                        _mm256_or_si256(_mm256_and_si256(cmp5, idx5), _mm256_and_si256(cmp6, idx6)),
+                        _mm256_or_si256(_mm256_and_si256(cmp7, idx7), _mm256_and_si256(cmp8, idx8))));
+
+            int32_t mask = _mm256_movemask_ps((__m256)cmp_mask);
+
+            if(mask){
+                __m256i mins = _mm256_and_si256(cmp_mask, _mm256_min_epu32(c_a, _mm256_permutevar8x32_epi32(c_b, partner)));
+                sumMin = widenAdd32(sumMin, mins);
+                count += _mm_popcnt_u32(mask);
+            }
+
+            if(a_max <= b_max){
+                sum = widenAdd32(sum, c_a);
+                *i_a += 8;
+            }
+            if(a_max >= b_max){
+                sum = widenAdd32(sum, c_b);
+                *i_b += 8;
+            }
+
+            if(*i_a + *i_b - count >= stop) break;
+        }
+
+        uint64_t i_a_s, i_b_s, minSum_s, countSum_s;
+
+        count += u32_intersect_counts_scalar(list1+*i_a, counts1+*i_a, size1-*i_a, list2+*i_b, counts2+*i_b, size2-*i_b, size3 - (*i_a+*i_b - count), &i_a_s, &i_b_s, &minSum_s, &countSum_s);
+
+        *i_a += i_a_s;
+        *i_b += i_b_s;
+        *minSum = sumLanes64(sumMin) + minSum_s;
+        *countSum = sumLanes64(sum) + countSum_s;
+        return count;
+    }
+SIMD_TARGET_END
+
+SIMD_TARGET_BEGIN(SIMD_TARGET_SSE4)
     // implement by sse
 
 uint64_t u32_intersection_vector_sse(const uint32_t *list1, uint64_t size1, const uint32_t *list2, uint64_t size2, uint64_t size3, uint64_t *i_a, uint64_t *i_b){
@@ -1340,8 +2711,7 @@ uint64_t u64_intersection_vector_sse(const uint64_t *list1, uint64_t size1, cons
 
     return count;
 }
-#endif
-#endif
+SIMD_TARGET_END
 #endif
 
     //#endif
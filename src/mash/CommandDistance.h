@@ -8,9 +8,14 @@
 #define INCLUDED_CommandDistance
 
 #include "Command.h"
+#include "OutputWriter.h"
 #include "Sketch.h"
+#include "simd.h"
+#include "LshIndex.h"
 #include <fstream>
 
+class PackedDistWriter;
+
 namespace mash {
 
 class CommandDistance : public Command
@@ -26,6 +31,63 @@ public:
 		int denom = 0;
 	};
 
+    // Inverted index of reference hashes (hash -> references), used to find
+    // the references that share hashes with a query
+    //
+    struct HashIndex
+    {
+        void build(const Sketch & sketch);
+        
+        std::vector<uint64_t> hashes; // sorted, unique
+        std::vector<uint64_t> offsets; // of each hash's references (one extra at the end)
+        std::vector<uint32_t> references;
+    };
+    
+    // Per-run values for compareSketches() that depend only on the sketch
+    // and k-mer sizes: the distance for each shared-hash count (for pairs
+    // whose union is the full sketch size) and log factorials for p-values.
+    //
+    struct CompareTables
+    {
+        CompareTables(uint64_t sketchSizeNew, int kmerSizeNew);
+        
+        // as mash::pValue(), to a relative precision of about 1e-10
+        //
+        double pValue(uint64_t x, uint64_t lengthRef, uint64_t lengthQuery, double kmerSpace, uint64_t sketchSize) const;
+        
+        // For -prefilter: pairs sharing fewer than prefilterShared of the
+        // smallest prefilterHashes hashes of their union are not compared in
+        // full, being within 1e-9 of certain to fail maxDistance (see
+        // compareSketches()). Does nothing if maxDistance does not reject
+        // anything or the sketches are not larger than the prefix.
+        //
+        void enablePrefilter(double maxDistance);
+        
+        // Also for -prefilter, with the HyperLogLog registers of sketch
+        // -hll: pairs whose estimated sizes have a ratio below sizeRatioMin
+        // are not compared, their Jaccard index being at most that ratio and
+        // so (within 1e-9 of certain) too low to pass maxDistance.
+        //
+        void enableSizeFilter(double maxDistance, int hllPrecision);
+        
+        uint64_t sketchSize;
+        int kmerSize;
+        
+        uint64_t prefilterHashes = 0; // 0 if off
+        uint64_t prefilterShared = 0;
+        
+        uint64_t sizeFilterRegisters = 0; // 0 if off
+        double sizeRatioMin = 0;
+        
+        // compare by weighted Jaccard (see compareSketches()); the references
+        // must have counts for all hashes (see hasCountsAll())
+        //
+        bool weighted = false;
+        
+        std::vector<double> distances;
+        std::vector<double> logFactorials;
+    };
+    
     struct CompareInput
     {
         CompareInput(const Sketch & sketchRefNew, const Sketch & sketchQueryNew, uint64_t indexRefNew, uint64_t indexQueryNew, uint64_t pairCountNew, const Sketch::Parameters & parametersNew, double maxDistanceNew, double maxPValueNew)
@@ -50,6 +112,33 @@ public:
         const Sketch::Parameters & parameters;
         double maxDistance;
         double maxPValue;
+        
+        // if set, pairs that cannot pass the thresholds are not compared
+        //
+        const HashIndex * index = 0;
+        
+        // if set, only the candidates it gives for each query are compared
+        //
+        const LshIndex * lsh = 0;
+        
+        const CompareTables * tables = 0;
+        
+        // if set, the worker also formats the block as text (see
+        // CompareOutput::text)
+        //
+        bool format = false;
+        bool table = false;
+        bool comment = false;
+        
+        // if nonzero, only the best passing pairs of each query are kept (see
+        // CompareOutput::best)
+        //
+        uint64_t top = 0;
+        
+        // if set, the worker packs the passing pairs instead (see
+        // CompareOutput::packed)
+        //
+        bool pack = false;
     };
     
     struct CompareOutput
@@ -79,6 +168,13 @@ public:
             bool pass;
         };
         
+        struct BestPair
+        {
+            uint64_t indexRef;
+            uint64_t indexQuery;
+            PairOutput pair;
+        };
+        
         const Sketch & sketchRef;
         const Sketch & sketchQuery;
         
@@ -87,6 +183,16 @@ public:
         uint64_t pairCount;
         
         PairOutput * pairs;
+        
+        // passing pairs kept with -top, by query and then by rank
+        //
+        std::vector<BestPair> best;
+        
+        std::string text;
+        bool formatted = false;
+        
+        std::string packed; // for -pack (see packOutput())
+        bool isPacked = false;
     };
     
     CommandDistance();
@@ -95,40 +201,41 @@ public:
     
 private:
     
-    void writeOutput(CompareOutput * output, bool table, bool comment) const;
+    void writeOutput(CompareOutput * output, bool table, bool comment, OutputWriter & writer) const;
     void writeOutput(CompareOutput * output, bool table, bool comment, std::ofstream &) const;
+    void writeOutput(CompareOutput * output, PackedDistWriter & writer) const;
 };
 
 CommandDistance::CompareOutput * compare(CommandDistance::CompareInput * input);
-void compareSketches(CommandDistance::CompareOutput::PairOutput * output, const Sketch::Reference & refRef, const Sketch::Reference & refQry, uint64_t sketchSize, int kmerSize, double kmerSpace, double maxDistance, double maxPValue);
+void formatOutput(CommandDistance::CompareOutput * output, bool table, bool comment);
+void mergeBest(CommandDistance::CompareOutput * output, std::vector<CommandDistance::CompareOutput::BestPair> & pending, uint64_t top, bool last);
+void compareSketches(CommandDistance::CompareOutput::PairOutput * output, const Sketch::Reference & refRef, const Sketch::Reference & refQry, uint64_t sketchSize, int kmerSize, double kmerSpace, double maxDistance, double maxPValue, const CommandDistance::CompareTables * tables = 0);
 double pValue(uint64_t x, uint64_t lengthRef, uint64_t lengthQuery, double kmerSpace, uint64_t sketchSize);
-
-//#if defined (__ICC) || defined (__INTEL_COMPILER)
-	#if defined __AVX512F__ && defined __AVX512CD__
-uint32_t u32_intersect_vector_avx512(const uint32_t *list1,  uint32_t size1, const uint32_t *list2, uint32_t size2, uint32_t size3, uint64_t *i_a, uint64_t *i_b);
-uint64_t u64_intersect_vector_avx512(const uint64_t *list1,  uint64_t size1, const uint64_t *list2, uint64_t size2, uint64_t size3, uint64_t *i_a, uint64_t *i_b);
-	#else 
-		#if defined __AVX2__
-			//implement by avx2
-
-            size_t u32_intersect_vector_avx2(const uint32_t *list1, uint32_t size1, const uint32_t *list2, uint32_t size2, uint32_t size3, uint64_t* i_a, uint64_t* i_b);
-
-            size_t u64_intersect_vector_avx2(const uint64_t *list1, uint64_t size1, const uint64_t *list2, uint64_t size2, uint64_t size3, uint64_t* i_a, uint64_t* i_b);
-		#else
-			#if defined __SSE4_1__
-			//implement by sse
-            uint64_t u64_intersection_vector_sse(const uint64_t *list1, uint64_t size1, const uint64_t *list2, uint64_t size2, uint64_t size3, uint64_t *i_a, uint64_t *i_b);
-
-
-            uint64_t u32_intersection_vector_sse(const uint32_t *list1, uint64_t size1, const uint32_t *list2, uint64_t size2, uint64_t size3, uint64_t *i_a, uint64_t *i_b);
-
-			#else
-			//implement without optimization
-			#endif
-		#endif
-	#endif
-
-//#endif
+double jaccardForDistance(double distance, int kmerSize); // smallest Jaccard estimate within the distance
+bool hasCountsAll(const Sketch & sketch); // every reference has a count for each hash
+
+// Sorted-list intersection kernels; the vectorized ones are compiled for their
+// own instruction sets and are selected at run time through getSimdKernels().
+
+uint64_t u64_intersect_scalar_stop(const uint64_t *list1, uint64_t size1, const uint64_t *list2, uint64_t size2, uint64_t size3, uint64_t *i_a, uint64_t *i_b);
+uint64_t u32_intersect_scalar_stop(const uint32_t *list1, uint64_t size1, const uint32_t *list2, uint64_t size2, uint64_t size3, uint64_t *i_a, uint64_t *i_b);
+uint64_t u64_intersect_counts_scalar(const uint64_t *list1, const uint32_t *counts1, uint64_t size1, const uint64_t *list2, const uint32_t *counts2, uint64_t size2, uint64_t size3, uint64_t *i_a, uint64_t *i_b, uint64_t *minSum, uint64_t *countSum);
+uint64_t u32_intersect_counts_scalar(const uint32_t *list1, const uint32_t *counts1, uint64_t size1, const uint32_t *list2, const uint32_t *counts2, uint64_t size2, uint64_t size3, uint64_t *i_a, uint64_t *i_b, uint64_t *minSum, uint64_t *countSum);
+
+#ifdef SIMD_X86
+uint64_t u32_intersect_vector_avx512(const uint32_t *list1, uint64_t size1, const uint32_t *list2, uint64_t size2, uint64_t size3, uint64_t *i_a, uint64_t *i_b);
+uint64_t u64_intersect_vector_avx512(const uint64_t *list1, uint64_t size1, const uint64_t *list2, uint64_t size2, uint64_t size3, uint64_t *i_a, uint64_t *i_b);
+uint64_t u64_intersect_counts_avx512(const uint64_t *list1, const uint32_t *counts1, uint64_t size1, const uint64_t *list2, const uint32_t *counts2, uint64_t size2, uint64_t size3, uint64_t *i_a, uint64_t *i_b, uint64_t *minSum, uint64_t *countSum);
+uint64_t u32_intersect_counts_avx512(const uint32_t *list1, const uint32_t *counts1, uint64_t size1, const uint32_t *list2, const uint32_t *counts2, uint64_t size2, uint64_t size3, uint64_t *i_a, uint64_t *i_b, uint64_t *minSum, uint64_t *countSum);
+
+uint64_t u32_intersect_vector_avx2(const uint32_t *list1, uint64_t size1, const uint32_t *list2, uint64_t size2, uint64_t size3, uint64_t *i_a, uint64_t *i_b);
+uint64_t u64_intersect_vector_avx2(const uint64_t *list1, uint64_t size1, const uint64_t *list2, uint64_t size2, uint64_t size3, uint64_t *i_a, uint64_t *i_b);
+uint64_t u64_intersect_counts_avx2(const uint64_t *list1, const uint32_t *counts1, uint64_t size1, const uint64_t *list2, const uint32_t *counts2, uint64_t size2, uint64_t size3, uint64_t *i_a, uint64_t *i_b, uint64_t *minSum, uint64_t *countSum);
+uint64_t u32_intersect_counts_avx2(const uint32_t *list1, const uint32_t *counts1, uint64_t size1, const uint32_t *list2, const uint32_t *counts2, uint64_t size2, uint64_t size3, uint64_t *i_a, uint64_t *i_b, uint64_t *minSum, uint64_t *countSum);
+
+uint64_t u32_intersection_vector_sse(const uint32_t *list1, uint64_t size1, const uint32_t *list2, uint64_t size2, uint64_t size3, uint64_t *i_a, uint64_t *i_b);
+uint64_t u64_intersection_vector_sse(const uint64_t *list1, uint64_t size1, const uint64_t *list2, uint64_t size2, uint64_t size3, uint64_t *i_a, uint64_t *i_b);
+#endif
 
 } // namespace mash
 
@@ -4,6 +4,8 @@
 #include "CommandDumpdist.h"
 #include "CommandDistance.h"
 #include "Sketch.h"
+#include "Shard.h"
+#include "PackedDist.h"
 
 #include <iostream>
 #include <fstream>
@@ -11,9 +13,13 @@
 #include <string>
 #include <sys/stat.h> //FIXME: port to windows
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include <stdint.h>
 #include <cstdio>
+#include <algorithm>
 
 using namespace::std;
 
@@ -24,13 +30,15 @@ CommandDumpdist::CommandDumpdist() : Command()
 {
 	name = "dumpdist";
 	summary = "Convert binary dist results to human-readable texts.";
-	description = "Convert binary results produced by \"dist\" operation to human-readable texts using multiple threads.";
+	description = "Convert binary results produced by \"dist\" operation (plain or packed with -pack) to human-readable texts using multiple threads.";
 	argumentString = "<reference.msh> <query.msh> [<query.msh>] <dist.bin>";
 	
     addOption("list", Option(Option::Boolean, "l", "Input", "List input. Lines in each <query> specify paths to sequence files, one per line. The reference file is not affected.", ""));
     addOption("table", Option(Option::Boolean, "t", "Output", "Table output (will not report p-values, but fields will be blank if they do not meet the p-value threshold).", ""));
     addOption("comment", Option(Option::Boolean, "C", "Output", "Show comment fields with reference/query names (denoted with ':').", "1.0", 0., 1.));
 	addOption("output", Option(Option::String, "o", "Output", "output human-readable text file", ""));
+	addOption("pvalue", Option(Option::Number, "v", "Output", "Maximum p-value to report (skipping the others without formatting them). Incompatible with -t.", "1.0", 0., 1.));
+	addOption("distance", Option(Option::Number, "d", "Output", "Maximum distance to report (skipping the others without formatting them). Incompatible with -t.", "1.0", 0., 1.));
 
 	useOption("threads");
 	useOption("help");
@@ -43,6 +51,56 @@ int64_t getFileSize( const char * fileName)
 	return (int64_t)statbuf.st_size;
 }
 
+MappedFile::~MappedFile()
+{
+	if(data != 0)
+		munmap((void *)data, size);
+}
+
+bool MappedFile::open(const string & file)
+{
+	int fd = ::open(file.c_str(), O_RDONLY);
+	struct stat fileInfo;
+
+	if(fd < 0 || fstat(fd, &fileInfo) != 0)
+	{
+		if(fd >= 0)
+			close(fd);
+		return false;
+	}
+
+	size = fileInfo.st_size;
+
+	if(size != 0)
+	{
+		void * mapped = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+		if(mapped == MAP_FAILED)
+		{
+			close(fd);
+			size = 0;
+			return false;
+		}
+
+		data = (const char *)mapped;
+		madvise(mapped, size, MADV_SEQUENTIAL);
+	}
+
+	close(fd);
+	return true;
+}
+
+void appendFixed(string & text, double value)
+{
+	char buffer[32];
+	int length = snprintf(buffer, sizeof(buffer), "%f", value);
+
+	if(length < 0 || length >= int(sizeof(buffer)))
+		text += to_string(value); // too long for the buffer
+	else
+		text.append(buffer, length);
+}
+
 
 int CommandDumpdist::run() const
 {
@@ -64,6 +122,13 @@ int CommandDumpdist::run() const
     bool table = options.at("table").active;
     bool comment = options.at("comment").active;
     bool list = options.at("list").active;
+	double distanceMax = options.at("distance").getArgumentAsNumber();
+	double pValueMax = options.at("pvalue").getArgumentAsNumber();
+
+	if(table && (options.at("distance").active || options.at("pvalue").active)){
+		cerr << "ERROR: The table output (-t) is for all pairs and cannot be filtered with -d or -v." << endl;
+		return 1;
+	}
 
 	if(!hasSuffix(refMsh, ".msh")){
 		cerr << refMsh << " is not msh format, please provide correct input" << endl;
@@ -101,8 +166,13 @@ int CommandDumpdist::run() const
 		cerr << "writting result to " << oFileName << endl;
 	}
 
-	fstream resultFile(fileName.c_str(), ios::binary | ios::in);
-	if(!resultFile.is_open()){
+	if(isShardFile(fileName)){
+		cerr << fileName << " is one shard of a sharded run; combine the shards with \"mash merge\" first" << endl;
+		exit(1);
+	}
+
+	MappedFile resultFile;
+	if(!resultFile.open(fileName)){
 		cerr << "fail to open " << fileName << endl;
 		return 1;
 	}
@@ -120,7 +190,94 @@ int CommandDumpdist::run() const
 	querySketch.initFromFiles(queryFiles, parameters);
 	refSketch.initFromFiles(refFiles, parameters);
 
-	int64_t binSize = getFileSize(fileName.c_str());
+	auto formatPair = [&](const CommandDistance::Result & result, string & text)
+	{
+		if( result.distance > distanceMax || result.pValue > pValueMax )
+			return;
+
+		const Sketch::Reference & ref = refSketch.getReference(result.refID);
+		const Sketch::Reference & query = querySketch.getReference(result.queryID);
+
+		text += ref.name;
+		if( comment ) { text += ':'; text += ref.comment; }
+		text += '\t';
+		text += query.name;
+		if( comment ) { text += ':'; text += query.comment; }
+		text += '\t';
+		appendFixed(text, result.distance);
+		text += '\t';
+		appendFixed(text, result.pValue);
+		text += '\t';
+		appendInteger(text, result.number);
+		text += '/';
+		appendInteger(text, result.denom);
+		text += '\n';
+	};
+
+	if(isPackedDistFile(fileName))
+	{
+		PackedDistReader packed;
+
+		if(!packed.open(resultFile.getData(), resultFile.getSize())){
+			cerr << "ERROR: " << fileName << " is " << packed.getError() << "." << endl;
+			return 1;
+		}
+
+		const PackedDistHeader & header = packed.getHeader();
+
+		if(table){
+			cerr << "ERROR: " << fileName << " is packed (dist -pack), which only keeps passing pairs, so it cannot be written as a table (-t)." << endl;
+			return 1;
+		}
+
+		if(header.refCount != refSketch.getReferenceCount() || header.queryCount != querySketch.getReferenceCount()){
+			cerr << "ERROR: " << fileName << " is for " << header.refCount << " references and " << header.queryCount << " queries, but the sketches have " << refSketch.getReferenceCount() << " and " << querySketch.getReferenceCount() << "." << endl;
+			return 1;
+		}
+
+		cerr << "ref sketches: "   << refSketch.getReferenceCount()   << endl;
+		cerr << "query sketches: " << querySketch.getReferenceCount() << endl;
+		cerr << "packed blocks: " << packed.getBlockCount() << endl;
+
+		OutputWriter writer(fileno(fout));
+		const uint64_t groupBlocks = 4 * (threads > 0 ? threads : 1);
+		vector<vector<CommandDistance::Result>> decoded(groupBlocks);
+		vector<CommandDistance::Result> results;
+
+		// blocks are decoded a group at a time in parallel, then formatted
+		//
+		for(uint64_t group = 0; group < packed.getBlockCount(); group += groupBlocks)
+		{
+			uint64_t blocks = min(groupBlocks, packed.getBlockCount() - group);
+			bool good = true;
+
+			#pragma omp parallel for schedule(dynamic) num_threads(threads) reduction(&&:good)
+			for(int64_t block = 0; block < int64_t(blocks); block++)
+			{
+				decoded[block].clear();
+				good = packed.decodeBlock(group + block, decoded[block]) && good;
+			}
+
+			if(!good){
+				cerr << "ERROR: " << fileName << " is corrupt." << endl;
+				exit(1);
+			}
+
+			results.clear();
+
+			for(uint64_t block = 0; block < blocks; block++)
+				results.insert(results.end(), decoded[block].begin(), decoded[block].end());
+
+			formatRecords(results.data(), results.size(), threads, writer, formatPair);
+		}
+
+		writer.flush();
+		fclose(fout);
+
+		return 0;
+	}
+
+	int64_t binSize = resultFile.getSize();
 	int64_t resSize = binSize / sizeof(CommandDistance::Result);
 	if(binSize % sizeof(CommandDistance::Result) != 0)
 	{
@@ -133,74 +290,9 @@ int CommandDumpdist::run() const
 	cerr << "binary file size: " << binSize << endl;
 	cerr << "number of results: " << resSize << endl;
 
-	CommandDistance::Result *buffer = new CommandDistance::Result[binSize / sizeof(CommandDistance::Result)];
-
-	resultFile.read((char*)buffer, binSize); //FIXME: portable but not memory efficient
-	
-	string oFilePrefix = fileName + ".dist";
-#pragma omp parallel for default(shared) num_threads(threads)
-	for(int i = 0; i < threads; i++)
-	{
-		fstream oFile(oFilePrefix + to_string(i), ios::out | ios::binary | ios::trunc);
-		int64_t start = i * ((resSize + threads - 1) / threads);
-		int64_t end = resSize < (i + 1) * ((resSize + threads - 1) / threads)
-				    ? resSize : (i + 1) * ((resSize + threads - 1) / threads);
-
-		for(int j = start; j < end; j++){
-			//ostringstream tmp;
-			//tmp
-		    // << refSketch.getReference(buffer[j].refID).name << "\t" 
-			// << querySketch.getReference(buffer[j].queryID).name << "\t" 
-			// << buffer[j].distance << "\t" 
-			// << buffer[j].pValue << "\t"
-		    // << buffer[j].number << "/" << buffer[j].denom << endl;
-
-			//oFile.write(tmp.str().c_str(), tmp.str().size());
-			if( table && buffer[j].refID == 0 ){
-				string tmp = querySketch.getReference(buffer[j].queryID).name;
-				if(tmp == "")
-					cerr << "WARNING: emptry string name. refID: " << buffer[j].refID 
-					     << " queryID: " << buffer[j].queryID << endl;
-				oFile.write(tmp.c_str(), tmp.size());
-			}
-			if( table ) 
-			{
-				string tmp = '\t' + to_string(buffer[j].distance);
-				if( buffer[j].refID == (refSketch.getReferenceCount() - 1) ) 
-					tmp += '\n';
-				oFile.write(tmp.c_str(), tmp.size());
-			} else {
-
-				string tmp =
-  	    		       refSketch.getReference(buffer[j].refID).name;
-				if( comment ) tmp += ':' + refSketch.getReference(buffer[j].refID).comment;
-				tmp += '\t' + querySketch.getReference(buffer[j].queryID).name;
-				if( comment ) tmp += ':' + querySketch.getReference(buffer[j].queryID).comment;
-				tmp += '\t' 
-					+ to_string(buffer[j].distance) + '\t' 
-					+ to_string(buffer[j].pValue  ) + '\t'
-				    + to_string(buffer[j].number  ) + '/'
-					+ to_string(buffer[j].denom   ) + '\n';// endl;
-				oFile.write(tmp.c_str(), tmp.size());
-			}
-		}
-		oFile.close();
-	}
-	//while( resultFile.peek() != EOF )
-	//{
-	//	resultFile.read((char*)&buffer, sizeof(CommandDistance::Result));
-	//	cout 
-	//	     << refSketch.getReference(buffer.refID).name << "\t" 
-	//		 << querySketch.getReference(buffer.queryID).name << "\t" 
-	//		 //<< buffer.refID   << "\t"
-	//		 //<< buffer.queryID << "\t"
-	//		 << buffer.distance << "\t" 
-	//		 << buffer.pValue << "\t"
-	//	     << buffer.number << "/" << buffer.denom << endl;
-	//}
-
-	//combine and remove tmp files
-	double t1 = get_sec();
+	const CommandDistance::Result * buffer = (const CommandDistance::Result *)resultFile.getData();
+	int refLast = refSketch.getReferenceCount() - 1;
+	OutputWriter writer(fileno(fout));
 
     if ( table )
     {
@@ -213,43 +305,32 @@ int CommandDumpdist::run() const
 		
 		tmp += '\n';
 		
-		fwrite(tmp.c_str(), 1, tmp.size(), fout);
-    }
-
-	int tmpSize = 1<<20;
-	unsigned char *tmpBuffer = new unsigned char[tmpSize];
+		writer.write(tmp);
 
-	for(int i = 0; i < threads; i++)
-	{
-		FILE *tmpFile =  fopen((oFilePrefix + to_string(i)).c_str(), "rb");
-		if(tmpFile == NULL)
+		formatRecords(buffer, resSize, threads, writer, [&](const CommandDistance::Result & result, string & text)
 		{
-			cerr << "can not open " << (oFilePrefix + to_string(i)) << endl;
-			exit(1);
-		}
-		int n;
-		while(true)
-		{
-			n = fread(tmpBuffer, sizeof(unsigned char), tmpSize, tmpFile);
-			fwrite((void*)tmpBuffer, sizeof(unsigned char), n, fout);
-			if( n < tmpSize ) break;
-		}
-
-		fclose(tmpFile);
-		remove((oFilePrefix + to_string(i)).c_str());
+			if( result.refID == 0 ){
+				const string & name = querySketch.getReference(result.queryID).name;
+				if(name == "")
+					cerr << "WARNING: emptry string name. refID: " << result.refID 
+					     << " queryID: " << result.queryID << endl;
+				text += name;
+			}
+			text += '\t';
+			appendFixed(text, result.distance);
+			if( result.refID == refLast ) 
+				text += '\n';
+		});
+    }
+	else
+	{
+		formatRecords(buffer, resSize, threads, writer, formatPair);
 	}
 
-	double t2 = get_sec();
-	cerr << "combine time: " << t2 - t1 << endl;
-
-	resultFile.close();
+	writer.flush();
 	fclose(fout);
 
-	delete tmpBuffer;
-	delete buffer;
-
 	return 0;
 }
 
 } //namespace mash
-
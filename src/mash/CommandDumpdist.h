@@ -1,7 +1,11 @@
+
 #ifndef INCLUDED_COMMANDDUMPDIST
 #define INCLUDED_COMMANDDUMPDIST
 
 #include "Command.h"
+#include "OutputWriter.h"
+#include <string>
+#include <vector>
 
 namespace mash{
 
@@ -17,6 +21,71 @@ private:
 };
 int64_t getFileSize( const char * fileName);
 
+// Read-only mapping of a binary result file, for dumpdist and dumptri.
+//
+class MappedFile
+{
+public:
+
+	MappedFile() : data(0), size(0) {}
+	~MappedFile();
+
+	bool open(const std::string & file); // false if it cannot be mapped
+
+	const char * getData() const {return data;}
+	uint64_t getSize() const {return size;}
+
+private:
+
+	const char * data;
+	uint64_t size;
+};
+
+// Appends value as std::to_string() would ("%f"), without the allocation.
+//
+void appendFixed(std::string & text, double value);
+
+// Formats count records to writer, in order. Ranges of chunkRecords are
+// formatted in parallel, each into its own buffer by format(record, text)
+// (which appends nothing for records that are filtered out), a block of
+// them at a time, so the writer thread can write one block while the next
+// is formatted.
+//
+template <class Record, class Format>
+void formatRecords(const Record * records, uint64_t count, int threads, OutputWriter & writer, const Format & format)
+{
+	const uint64_t chunkRecords = 1 << 16;
+	const uint64_t blockChunks = 4 * (threads > 0 ? threads : 1);
+
+	std::vector<std::string> texts(blockChunks);
+
+	for(uint64_t block = 0; block < count; block += chunkRecords * blockChunks)
+	{
+		uint64_t chunks = (count - block + chunkRecords - 1) / chunkRecords;
+
+		if(chunks > blockChunks)
+			chunks = blockChunks;
+
+		#pragma omp parallel for schedule(dynamic) num_threads(threads)
+		for(int64_t chunk = 0; chunk < int64_t(chunks); chunk++)
+		{
+			std::string & text = texts[chunk];
+			uint64_t start = block + chunk * chunkRecords;
+			uint64_t end = start + chunkRecords < count ? start + chunkRecords : count;
+
+			for(uint64_t i = start; i < end; i++)
+			{
+				format(records[i], text);
+			}
+		}
+
+		for(uint64_t chunk = 0; chunk < chunks; chunk++)
+		{
+			writer.write(texts[chunk]);
+		}
+	}
+}
+
 } // namespace mash
 
 
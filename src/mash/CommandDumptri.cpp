@@ -5,15 +5,19 @@
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <vector>
 
 #include <sys/stat.h> //FIXME: port to windows
 #include <sys/time.h>
 #include <math.h>
+#include <string.h>
 
 #include "CommandDistance.h"
 #include "CommandTriangle.h"
 #include "Sketch.h"
 #include "CommandDumpdist.h"
+#include "Shard.h"
+#include "Condensed.h"
 
 #define DIST 1
 
@@ -21,11 +25,63 @@ using namespace::std;
 
 namespace mash{
 
+// Writes a condensed matrix as the Phylip text dumptri writes for ordinary
+// triangle output, formatting blocks of rows in parallel straight from the
+// mapped file.
+//
+static void writeCondensed(const CondensedMatrix & matrix, const Sketch & sketch, bool comment, int threads, FILE * fout)
+{
+	const uint64_t blockPairs = 1 << 22;
+	uint64_t count = matrix.getHeader().count;
+	vector<string> rows;
+
+	string head = to_string(count) + "\n" + (comment ? sketch.getReference(0).comment : sketch.getReference(0).name) + "\n";
+	fwrite(head.c_str(), 1, head.size(), fout);
+
+	for(uint64_t start = 1; start < count; )
+	{
+		uint64_t end = start;
+		uint64_t pairs = 0;
+
+		while(end < count && pairs < blockPairs)
+		{
+			pairs += end;
+			end++;
+		}
+
+		rows.resize(end - start);
+
+		#pragma omp parallel for schedule(dynamic) num_threads(threads)
+		for(int64_t row = start; row < int64_t(end); row++)
+		{
+			string & text = rows[row - start];
+			const Sketch::Reference & ref = sketch.getReference(row);
+
+			text = comment ? ref.comment : ref.name;
+
+			for(uint64_t column = 0; column < uint64_t(row); column++)
+			{
+				text += "\t";
+				text += to_string(matrix.getDistance(row, column));
+			}
+
+			text += "\n";
+		}
+
+		for(uint64_t i = 0; i < rows.size(); i++)
+		{
+			fwrite(rows[i].c_str(), 1, rows[i].size(), fout);
+		}
+
+		start = end;
+	}
+}
+
 CommandDumptri::CommandDumptri() : Command()
 {
 	name = "dumptri";
 	summary = "Convert binary triangle results to human-readable texts.";
-	description = "Convert binary results produced by \"triangle\" operation to human-readable texts using multiple threads.";
+	description = "Convert binary results produced by \"triangle\" operation (including condensed matrices from -condensed) to human-readable texts using multiple threads.";
 	argumentString = "<seq.msh> [<seq.msh>] <triangle.bin>";
 
     addOption("list", Option(Option::Boolean, "l", "Input", "List input. Lines in each <seq> specify paths to sequence files, one per line. The reference file is not affected.", ""));
@@ -34,6 +90,8 @@ CommandDumptri::CommandDumptri() : Command()
     //addOption("edge", Option(Option::Boolean, "E", "Output", "Output edge list instead of Phylip matrix, with fields [seq1, seq2, dist, p-val, shared-hashes].", ""));
 
 	addOption("output", Option(Option::String, "o", "Output", "output file", ""));
+	addOption("pvalue", Option(Option::Number, "v", "Output", "Maximum p-value to report in edge lists (skipping the others without formatting them).", "1.0", 0., 1.));
+	addOption("distance", Option(Option::Number, "d", "Output", "Maximum distance to report in edge lists (skipping the others without formatting them).", "1.0", 0., 1.));
 	useOption("threads");
 	
 	useOption("help");
@@ -56,6 +114,8 @@ int CommandDumptri::run() const
 	bool edge = false;
 	double distanceMax = 1.0;
 	double pValueMax = 1.0;
+	double filterDistance = options.at("distance").getArgumentAsNumber();
+	double filterPValue = options.at("pvalue").getArgumentAsNumber();
 
 	//string refMsh = arguments[0];
 	string fileName = arguments.back();
@@ -92,8 +152,46 @@ int CommandDumptri::run() const
 		cerr << "writting result to: " << oFileName << endl;
 	}
 	
-	fstream resultFile(fileName.c_str(), ios::binary | ios::in);
-	if(!resultFile.is_open()){
+	if(isShardFile(fileName)){
+		cerr << fileName << " is one shard of a sharded run; combine the shards with \"mash merge\" first" << endl;
+		exit(1);
+	}
+
+	if(isCondensedFile(fileName)){
+		CondensedMatrix matrix;
+
+		if(!matrix.open(fileName)){
+			cerr << matrix.getError() << endl;
+			exit(1);
+		}
+
+		Sketch::Parameters parameters;
+		Sketch querySketch;
+		querySketch.initFromFiles(queryFiles, parameters);
+
+		const CondensedHeader & header = matrix.getHeader();
+
+		if(header.count != querySketch.getReferenceCount() || header.kmerSize != uint64_t(querySketch.getKmerSize()) || header.sketchSize != querySketch.getMinHashesPerWindow() || header.seed != querySketch.getHashSeed()){
+			cerr << "unmatched msh file or bin file"  << endl;
+			cerr << "please checkout whether the msh file and bin file is from the same data and parameters" << endl;
+			exit(1);
+		}
+
+		cerr << "condensed matrix of " << header.count << " sketches" << endl;
+
+		if(filterDistance < 1 || filterPValue < 1)
+		{
+			cerr << "ERROR: The matrix output is for all pairs and cannot be filtered with -d or -v." << endl;
+			exit(1);
+		}
+
+		writeCondensed(matrix, querySketch, comment, options.at("threads").getArgumentAsNumber(), fout);
+		fclose(fout);
+		return 0;
+	}
+
+	MappedFile resultFile;
+	if(!resultFile.open(fileName)){
 		cerr << "fail to open " << fileName << endl;
 		return 1;
 	}
@@ -105,10 +203,10 @@ int CommandDumptri::run() const
 	Sketch querySketch;
 	querySketch.initFromFiles(queryFiles, parameters);
 
-	int64_t binSize = getFileSize(fileName.c_str());
-	binSize -= sizeof(uint64_t) + 2 * sizeof(double);//edge header
+	const int64_t headerSize = sizeof(uint64_t) + 2 * sizeof(double);//edge header
+	int64_t binSize = resultFile.getSize() - headerSize;
 	int64_t resSize = binSize / sizeof(CommandTriangle::Result);
-	if(binSize % sizeof(CommandTriangle::Result) != 0)
+	if(binSize < 0 || binSize % sizeof(CommandTriangle::Result) != 0)
 	{
 		cerr << "imcomplete binary file" << endl;
 		exit(1);
@@ -119,10 +217,11 @@ int CommandDumptri::run() const
 	cerr << "number of results: " << resSize << endl;
 
 	//read header edge distance pvalue
+	const char * data = resultFile.getData();
 	uint64_t header = 0;
-	resultFile.read((char*)&header, sizeof(uint64_t));	
-	resultFile.read((char*)&distanceMax, sizeof(double));	
-	resultFile.read((char*)&pValueMax  , sizeof(double));	
+	memcpy(&header, data, sizeof(uint64_t));
+	memcpy(&distanceMax, data + sizeof(uint64_t), sizeof(double));
+	memcpy(&pValueMax, data + sizeof(uint64_t) + sizeof(double), sizeof(double));
 	if(header == 0x1) edge = true;
 
 	if(edge)
@@ -144,165 +243,66 @@ int CommandDumptri::run() const
 		}
 		//cerr << "msh and binary file are checked out !" << endl;
 
+		if(filterDistance < 1 || filterPValue < 1)
+		{
+			cerr << "ERROR: The matrix output is for all pairs and cannot be filtered with -d or -v (the triangle run was not made with -E, -d or -v)." << endl;
+			exit(1);
+		}
 	}
 
-	CommandTriangle::Result * buffer = new CommandTriangle::Result [binSize / sizeof(CommandTriangle::Result)];
-	resultFile.read((char*)buffer, binSize);
+	const CommandTriangle::Result * buffer = (const CommandTriangle::Result *)(data + headerSize);
+	OutputWriter writer(fileno(fout));
 	
-	string oFilePrefix = fileName + ".tri";
 	if(edge){
-		#pragma omp parallel for default(shared) num_threads(threads)
-		for(int i = 0; i < threads; i++)
+		formatRecords(buffer, resSize, threads, writer, [&](const CommandTriangle::Result & result, string & text)
 		{
-			fstream oFile(oFilePrefix + to_string(i), ios::out | ios::binary | ios:: trunc);
-			int64_t start = i * ((resSize + threads -1) /threads);
-			int64_t end = resSize < (i + 1) * ((resSize + threads - 1) / threads)
-						? resSize : (i + 1) * ((resSize + threads - 1) / threads);
-			
-			for(int j = start; j < end; j++){
-				if(!comment){
-					string tmp = 
-							querySketch.getReference(buffer[j].refID).name + "\t"
-							+ querySketch.getReference(buffer[j].queryID).name + "\t"
-							+ to_string(buffer[j].distance) + "\t"
-							+ to_string(buffer[j].pValue) + "\t"
-							+ to_string(buffer[j].numer) + "/"
-							+ to_string(buffer[j].denom) + "\n";
-					oFile.write(tmp.c_str(), tmp.size());
-				}
-				else{
-					string tmp = 
-							querySketch.getReference(buffer[j].refID).comment + "\t"
-							+ querySketch.getReference(buffer[j].queryID).comment + "\t"
-							+ to_string(buffer[j].distance) + "\t"
-							+ to_string(buffer[j].pValue) + "\t"
-							+ to_string(buffer[j].numer) + "/"
-							+ to_string(buffer[j].denom) + "\n";
-					oFile.write(tmp.c_str(), tmp.size());
-				}
-			}
-		}
+			if(result.distance > filterDistance || result.pValue > filterPValue)
+				return;
+
+			const Sketch::Reference & ref = querySketch.getReference(result.refID);
+			const Sketch::Reference & query = querySketch.getReference(result.queryID);
+
+			text += comment ? ref.comment : ref.name;
+			text += "\t";
+			text += comment ? query.comment : query.name;
+			text += "\t";
+			appendFixed(text, result.distance);
+			text += "\t";
+			appendFixed(text, result.pValue);
+			text += "\t";
+			appendInteger(text, result.numer);
+			text += "/";
+			appendInteger(text, result.denom);
+			text += "\n";
+		});
 	}//end if(edge)
 
 	else{//not edge triangle output
 		
 		//add the first two line of the triangle.
-		fstream oFileHead(oFilePrefix + "head", ios::out | ios::binary | ios::trunc);
-		string tmp1 = to_string(querySketch.getReferenceCount()) + "\n";
-		oFileHead.write(tmp1.c_str(), tmp1.size());
-		string tmp2 = (comment ? querySketch.getReference(0).comment : querySketch.getReference(0).name) + "\n";
-		oFileHead.write(tmp2.c_str(), tmp2.size());
-		oFileHead.close();
-
-		int mean = (resSize + threads - 1) / threads;
-		#pragma omp parallel for default(shared) num_threads(threads)
-		for(int i = 0; i < threads; i++)
+		string head = to_string(querySketch.getReferenceCount()) + "\n";
+		head += (comment ? querySketch.getReference(0).comment : querySketch.getReference(0).name) + "\n";
+		writer.write(head);
+
+		//the records are row by row, so each row starts at column 0 and ends at the column before the row
+		formatRecords(buffer, resSize, threads, writer, [&](const CommandTriangle::Result & result, string & text)
 		{
-			fstream oFile(oFilePrefix + to_string(i), ios::out | ios::binary | ios::trunc);
-			int startLine = sqrt(i * mean * 2);
-			int endLine = sqrt((i+1) * mean * 2);
-			int start = (startLine+1)*(startLine+2)/2 - 1;
-			int end = resSize < (endLine+1)*(endLine+2)/2 ? resSize-1 : (endLine+1)*(endLine+2)/2 - 1;
-			
-			//int curLine = startLine+1+ ceil((double)i/threads);
-			int curLine = startLine + 1;
-			string tmp;
-
-			if(!comment)
-				tmp = querySketch.getReference(buffer[start].refID).name;
-			else
-				tmp = querySketch.getReference(buffer[start].refID).comment;
-
-			for(int j = start; j <= end; j++){
-				if(!comment){
-					tmp += "\t";
-					tmp += to_string(buffer[j].distance);
-					if(j+1 == curLine * (curLine+1) / 2){
-						if(start == 0 || j != start){//erase multiThread redundant output
-							tmp +="\n";
-							oFile.write(tmp.c_str(), tmp.size());
-						}
-						curLine++;
-						tmp = 
-						querySketch.getReference(buffer[j+1].refID).name;
-					}
-
-				}
-				else{
-					tmp += "\t";
-					tmp += to_string(buffer[j].distance);
-					if(j+1 == curLine * (curLine+1) / 2){
-						if(start == 0 || j != start){
-							tmp +="\n";
-							oFile.write(tmp.c_str(), tmp.size());
-						}
-						curLine++;
-						tmp = 
-						querySketch.getReference(buffer[j+1].refID).comment;
-					}
-
-				}
+			if(result.queryID == 0){
+				const Sketch::Reference & ref = querySketch.getReference(result.refID);
+				text += comment ? ref.comment : ref.name;
 			}
-
-//			tmp +="\n";
-//			oFile.write(tmp.c_str(), tmp.size());
-
-			oFile.close();
-
-		}
+			text += "\t";
+			appendFixed(text, result.distance);
+			if(result.queryID == result.refID - 1)
+				text += "\n";
+		});
 
 	}//end else(not edge)
-	
-	double t1 = get_sec();
-	int tmpSize = 1<<20;
-	unsigned char *tmpBuffer = new unsigned char[tmpSize];
-
-	if(!edge){
-		FILE *tmpFileHead = fopen((oFilePrefix + "head").c_str(), "rb");
-		if(tmpFileHead == NULL){
-			cerr << "can not open" << (oFilePrefix + "head") << endl;
-			exit(1);
-		}
-		int lengthHead;
-		while(true){
-			lengthHead = fread(tmpBuffer, sizeof(unsigned char), tmpSize, tmpFileHead);
-			fwrite((void*)tmpBuffer, sizeof(unsigned char), lengthHead, fout);
-			if(lengthHead < tmpSize) break;
-		}
-		remove((oFilePrefix + "head").c_str());
-	}
-
-	for(int i = 0; i < threads; i++){
-		FILE *tmpFile = fopen((oFilePrefix + to_string(i)).c_str(), "rb");
-		if(tmpFile == NULL){
-			cerr << "can not open " << (oFilePrefix + to_string(i)) << endl;
-			exit(1);
-		}
 
-		int n;
-		while(true){
-			n = fread(tmpBuffer, sizeof(unsigned char), tmpSize, tmpFile);
-			fwrite((void*)tmpBuffer, sizeof(unsigned char), n, fout);
-			if(n < tmpSize) break;
-		}
-
-		fclose(tmpFile);
-		remove((oFilePrefix + to_string(i)).c_str());
-	
-	}
-
-	double t2 = get_sec();
-
-	cerr << "combine time is: " << t2 - t1 << endl;
-
-	resultFile.close();
+	writer.flush();
 	fclose(fout);
-	
-	delete tmpBuffer;
-	delete buffer;
 
 	return 0;
 }
 
 }//namespace mash
-
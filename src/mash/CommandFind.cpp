@@ -9,7 +9,7 @@
 #include <zlib.h>
 #include "kseq.h"
 #include <iostream>
-#include <set>
+#include <algorithm>
 //#include <unordered_set>
 #include "ThreadPool.h"
 #include "sketchParameterSetup.h"
@@ -149,7 +149,26 @@ int CommandFind::run() const
             //printf("seq: %s\n", seq->seq.s);
             //if (seq->qual.l) printf("qual: %s\n", seq->qual.s);
             
-            threadPool.runWhenThreadAvailable(new FindInput(sketch, seq->name.s, seq->seq.s, l, threshold, best, selfMatches));
+            FindInput * input = new FindInput(sketch, seq->name.s, seq->seq.s, l, threshold, best, selfMatches);
+            
+            if ( threads > 1 && uint32_t(l) >= parallelLength )
+            {
+                // Too long to leave to one thread; finish the queries before
+                // it (to keep the output in order) and find it here, over all
+                // of them.
+                //
+                while ( threadPool.running() )
+                {
+                    writeOutput(sketch, threadPool.popOutputWhenAvailable());
+                }
+                
+                input->threads = threads;
+                writeOutput(sketch, find(input));
+                delete input;
+                continue;
+            }
+            
+            threadPool.runWhenThreadAvailable(input);
             
             while ( threadPool.outputAvailable() )
             {
@@ -230,11 +249,11 @@ CommandFind::FindOutput * find(CommandFind::FindInput * data)
 
 void findPerStrand(const CommandFind::FindInput * input, CommandFind::FindOutput * output, bool minusStrand)
 {
-    typedef robin_hood::unordered_map < uint32_t, std::set<uint32_t> > PositionsBySequence_umap;
+    typedef robin_hood::unordered_map < uint32_t, vector<uint32_t> > PositionsBySequence_umap;
     
     bool verbose = false;
     
-    Sketch::Hash_set minHashes;
+    vector<Sketch::hash_t> minHashes;
     
     const Sketch & sketch = input->sketch;
     int kmerSize = sketch.getKmerSize();
@@ -287,14 +306,51 @@ void findPerStrand(const CommandFind::FindInput * input, CommandFind::FindOutput
     params.windowed = true;
     params.windowSize = windowSize;
     params.use64 = true;
+    params.seed = sketch.getHashSeed();
+    
+    int kmers = length - kmerSize + 1;
     
-    getMinHashPositions(positionHashes, seq, length, params);
+    if ( input->threads > 1 && kmers > windowSize )
+    {
+        // The min-hashes of each window depend only on its own k-mers, so the
+        // windows are split into segments, each with the bases of its last
+        // window (the overlap with the next segment), and found separately.
+        //
+        int windows = kmers - windowSize + 1;
+        int segmentWindows = std::max(windows / (input->threads * 4) + 1, 4 * windowSize);
+        int segments = (windows + segmentWindows - 1) / segmentWindows;
+        vector<vector<Sketch::PositionHash>> positionHashesBySegment(segments);
+        
+        #pragma omp parallel for schedule(dynamic, 1) num_threads(input->threads)
+        for ( int i = 0; i < segments; i++ )
+        {
+            int start = i * segmentWindows;
+            int end = std::min(start + segmentWindows, windows) + windowSize - 1 + kmerSize - 1;
+            
+            getMinHashPositions(positionHashesBySegment[i], seq + start, end - start, params);
+        }
+        
+        for ( int i = 0; i < segments; i++ )
+        {
+            positionHashes.insert(positionHashes.end(), positionHashesBySegment[i].begin(), positionHashesBySegment[i].end());
+        }
+    }
+    else
+    {
+        getMinHashPositions(positionHashes, seq, length, params);
+    }
+    
+    // the same hash can be a min-hash at many positions (and, with segments,
+    // be found by more than one)
     //
     for ( int i = 0; i < positionHashes.size(); i++ )
     {
-        minHashes.insert(positionHashes.at(i).hash);
+        minHashes.push_back(positionHashes.at(i).hash);
     }
     
+    std::sort(minHashes.begin(), minHashes.end());
+    minHashes.erase(std::unique(minHashes.begin(), minHashes.end()), minHashes.end());
+    
     if ( minusStrand )
     {
         delete [] seq;
@@ -305,13 +361,13 @@ void findPerStrand(const CommandFind::FindInput * input, CommandFind::FindOutput
     //
     PositionsBySequence_umap hits;
     //
-    for ( Sketch::Hash_set::const_iterator i = minHashes.begin(); i != minHashes.end(); ++i )
+    for ( vector<Sketch::hash_t>::const_iterator i = minHashes.begin(); i != minHashes.end(); ++i )
     {
         Sketch::hash_t hash = *i;
         
         if ( sketch.hasLociByHash(hash) )
         {
-            const vector<Sketch::Locus> loci = sketch.getLociByHash(hash);
+            const vector<Sketch::Locus> & loci = sketch.getLociByHash(hash);
             
             for ( int j = 0; j < loci.size(); j++ )
             {
@@ -321,20 +377,39 @@ void findPerStrand(const CommandFind::FindInput * input, CommandFind::FindOutput
                 
                 if ( locus.sequence != selfIndexRef || selfMatches )
                 {
-                    hits[locus.sequence].insert(locus.position); // set will be created if needed
+                    hits[locus.sequence].push_back(locus.position); // list will be created if needed
                 }
             }
         }
     }
     
+    // References are clustered separately (over threads, if given), each
+    // keeping its best hits, which are then combined.
+    //
+    vector<PositionsBySequence_umap::iterator> sequences;
+    //
     for ( PositionsBySequence_umap::iterator i = hits.begin(); i != hits.end(); ++i )
     {
-    	using std::set;
-    	
+        sequences.push_back(i);
+    }
+    
+    vector<std::priority_queue<CommandFind::FindOutput::Hit>> hitsBySequence(sequences.size());
+    
+    #pragma omp parallel for schedule(dynamic, 1) num_threads(input->threads)
+    for ( int64_t s = 0; s < int64_t(sequences.size()); s++ )
+    {
+        PositionsBySequence_umap::iterator i = sequences[s];
+        std::priority_queue<CommandFind::FindOutput::Hit> & hitsSequence = hitsBySequence[s];
+        
+        // sorted and distinct, as the window is moved over them
+        //
+        std::sort(i->second.begin(), i->second.end());
+        i->second.erase(std::unique(i->second.begin(), i->second.end()), i->second.end());
+        
         // pointer to the position at the beginning of the window; to be updated
         // as the end of the window is incremented
         //
-        set<uint32_t>::const_iterator windowStart = i->second.begin();
+        vector<uint32_t>::const_iterator windowStart = i->second.begin();
         
         if ( verbose ) cout << "Clustering in seq " << i->first << endl;
         
@@ -342,7 +417,7 @@ void findPerStrand(const CommandFind::FindInput * input, CommandFind::FindOutput
         //
         int windowCount = 0;
         
-        for ( set<uint32_t>::const_iterator j = i->second.begin(); j != i->second.end(); j++ )
+        for ( vector<uint32_t>::const_iterator j = i->second.begin(); j != i->second.end(); j++ )
         {
             windowCount++;
             
@@ -376,23 +451,23 @@ void findPerStrand(const CommandFind::FindInput * input, CommandFind::FindOutput
                 score >= threshold &&
                 (
                     best == 0 ||
-                    output->hits.size() < best ||
-                    CommandFind::FindOutput::Hit(i->first, *windowStart, *j, minusStrand, score) < output->hits.top()
+                    hitsSequence.size() < uint64_t(best) ||
+                    CommandFind::FindOutput::Hit(i->first, *windowStart, *j, minusStrand, score) < hitsSequence.top()
                 )
             )
             {
                 if ( verbose ) cout << input->seqId << '\t' << sketch.getReference(i->first).name << '\t' << *windowStart << '\t' << *j << '\t' << float(windowCount) / mins << endl;
                 
-                output->hits.push(CommandFind::FindOutput::Hit(i->first, *windowStart, *j, minusStrand, score));
+                hitsSequence.push(CommandFind::FindOutput::Hit(i->first, *windowStart, *j, minusStrand, score));
                 
-                if ( best != 0 && output->hits.size() > best )
+                if ( best != 0 && hitsSequence.size() > uint64_t(best) )
                 {
-                    output->hits.pop();
+                    hitsSequence.pop();
                 }
                 
                 //break;
                 
-                for ( set<uint32_t>::const_iterator k = windowStart; k != i->second.end() && *k <= *j; k++ )
+                for ( vector<uint32_t>::const_iterator k = windowStart; k != i->second.end() && *k <= *j; k++ )
                 {
                     if ( verbose ) cout << "      " << *k << endl;
                 }
@@ -400,6 +475,20 @@ void findPerStrand(const CommandFind::FindInput * input, CommandFind::FindOutput
         }
     }
     
+    for ( size_t s = 0; s < hitsBySequence.size(); s++ )
+    {
+        while ( hitsBySequence[s].size() > 0 )
+        {
+            output->hits.push(hitsBySequence[s].top());
+            hitsBySequence[s].pop();
+            
+            if ( best != 0 && output->hits.size() > uint64_t(best) )
+            {
+                output->hits.pop();
+            }
+        }
+    }
+    
     //cout << "done\n";
 }
 
@@ -35,7 +35,8 @@ public:
         threshold(thresholdNew),
         seqId(seqIdNew),
         best(bestNew),
-        selfMatches(selfMatchesNew)
+        selfMatches(selfMatchesNew),
+        threads(1)
         {
             seq = new char[strlen(seqNew) + 1];
             strcpy(seq, seqNew);
@@ -53,6 +54,7 @@ public:
         float threshold;
         int best;
         bool selfMatches;
+        int threads; // to find this one over
     };
     
     struct FindOutput
@@ -85,6 +87,10 @@ public:
     
 private:
     
+    // queries at least this long are found over all threads, one at a time
+    //
+    static const uint32_t parallelLength = 1 << 20;
+    
     void writeOutput(const Sketch & sketch, FindOutput * output) const;
 };
 
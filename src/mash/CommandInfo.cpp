@@ -5,7 +5,10 @@
 // See the LICENSE.txt file included with this software for license information.
 
 #include "CommandInfo.h"
+#include "CommandDumpdist.h"
+#include "OutputWriter.h"
 #include "Sketch.h"
+#include "sketchParameterSetup.h"
 #include <iostream>
 
 using std::cerr;
@@ -16,6 +19,13 @@ using std::vector;
 
 namespace mash {
 
+// the references of sketch, which are stored contiguously
+//
+static const Sketch::Reference * referencesBegin(const Sketch & sketch)
+{
+	return sketch.getReferenceCount() ? &sketch.getReference(0) : 0;
+}
+
 #ifdef ARCH_32
 	#define HASH "MurmurHash3_x86_32"
 #else
@@ -35,6 +45,9 @@ CommandInfo::CommandInfo()
     addOption("tabular", Option(Option::Boolean, "t", "", "Tabular output (rather than padded), with no header. Incompatible with -d, -H and -c.", ""));
     addOption("counts", Option(Option::Boolean, "c", "", "Show hash count histograms for each sketch. Incompatible with -d, -H and -t.", ""));
     addOption("dump", Option(Option::Boolean, "d", "", "Dump sketches in JSON format. Incompatible with -H, -t, and -c.", ""));
+    useOption("threads");
+    useOption("names");
+    useOption("range");
 }
 
 int CommandInfo::run() const
@@ -49,6 +62,7 @@ int CommandInfo::run() const
     bool tabular = options.at("tabular").active;
     bool counts = options.at("counts").active;
     bool dump = options.at("dump").active;
+    int threads = options.at("threads").getArgumentAsNumber();
     
     if ( header && tabular )
     {
@@ -99,23 +113,31 @@ int CommandInfo::run() const
     
 	Sketch sketch;
 	Sketch::Parameters params;
-	params.parallelism = 1;
+	params.parallelism = threads;
+	params.mapped = true;
 	
 	uint64_t referenceCount;
 	
 	if ( header )
 	{
+		// only the root fields, not the references
+		//
 		referenceCount = sketch.initParametersFromCapnp(arguments[0].c_str());
 	}
 	else
 	{
+		if ( sketchSubsetSetup(sketch, *this) )
+		{
+			return 1;
+		}
+		
 	    sketch.initFromFiles(arguments, params);
 	    referenceCount = sketch.getReferenceCount();
 	}
     
     if ( counts )
     {
-    	return printCounts(sketch);
+    	return printCounts(sketch, threads);
     }
     else if ( dump )
     {
@@ -125,6 +147,22 @@ int CommandInfo::run() const
     if ( tabular )
     {
     	cout << "#Hashes\tLength\tID\tComment" << endl;
+    	
+    	OutputWriter writer;
+    	
+    	formatRecords(referencesBegin(sketch), sketch.getReferenceCount(), threads, writer, [](const Sketch::Reference & ref, string & text)
+    	{
+    		appendInteger(text, ref.hashesSorted.size());
+    		text += '\t';
+    		appendInteger(text, ref.length);
+    		text += '\t';
+    		text += ref.name;
+    		text += '\t';
+    		text += ref.comment;
+    		text += '\n';
+    	});
+    	
+    	return 0;
     }
     else
     {
@@ -143,48 +181,31 @@ int CommandInfo::run() const
     {
         vector<vector<string>> columns(4);
         
-        if ( ! tabular )
-        {
-			cout << endl;
-			cout << "Sketches:" << endl;
-		
-			columns[0].push_back("[Hashes]");
-			columns[1].push_back("[Length]");
-			columns[2].push_back("[ID]");
-			columns[3].push_back("[Comment]");
-		}
+		cout << endl;
+		cout << "Sketches:" << endl;
+	
+		columns[0].push_back("[Hashes]");
+		columns[1].push_back("[Length]");
+		columns[2].push_back("[ID]");
+		columns[3].push_back("[Comment]");
         
         for ( uint64_t i = 0; i < sketch.getReferenceCount(); i++ )
         {
             const Sketch::Reference & ref = sketch.getReference(i);
             
-            if ( tabular )
-            {
-            	cout
-            		<< ref.hashesSorted.size() << '\t'
-            		<< ref.length << '\t'
-            		<< ref.name << '\t'
-            		<< ref.comment << endl;
-            }
-            else
-            {
-				columns[0].push_back(std::to_string(ref.hashesSorted.size()));
-				columns[1].push_back(std::to_string(ref.length));
-				columns[2].push_back(ref.name);
-				columns[3].push_back(ref.comment);
-			}
+			columns[0].push_back(std::to_string(ref.hashesSorted.size()));
+			columns[1].push_back(std::to_string(ref.length));
+			columns[2].push_back(ref.name);
+			columns[3].push_back(ref.comment);
         }
         
-        if ( ! tabular )
-        {
-	        printColumns(columns, 2, 2, "-", 0);
-	    }
+        printColumns(columns, 2, 2, "-", 0);
     }
     
     return 0;
 }
 
-int CommandInfo::printCounts(const Sketch & sketch) const
+int CommandInfo::printCounts(const Sketch & sketch, int threads) const
 {
 	using std::map;
 	
@@ -202,19 +223,28 @@ int CommandInfo::printCounts(const Sketch & sketch) const
 	
 	cout << "#Sketch\tBin\tFrequency" << endl;
 	
-	map<uint32_t, uint64_t> histogram;
+	const Sketch::Reference * references = referencesBegin(sketch);
+	OutputWriter writer;
 	
-	for ( uint64_t i = 0; i < sketch.getReferenceCount(); i++ )
+	// histograms of ranges of references are made by the threads and written
+	// in order
+	//
+	formatRecords(references, sketch.getReferenceCount(), threads, writer, [&](const Sketch::Reference & ref, string & text)
 	{
-		const string & name = sketch.getReference(i).name;
+		map<uint32_t, uint64_t> histogram;
 		
-		sketch.getReferenceHistogram(i, histogram);
+		sketch.getReferenceHistogram(&ref - references, histogram);
 		
 		for ( map<uint32_t, uint64_t>::const_iterator j = histogram.begin(); j != histogram.end(); j++ )
 		{
-			cout << name << '\t' << j->first << '\t' << j->second << endl;
+			text += ref.name;
+			text += '\t';
+			appendInteger(text, j->first);
+			text += '\t';
+			appendInteger(text, j->second);
+			text += '\n';
 		}
-	}
+	});
 	
 	return 0;
 }
@@ -22,7 +22,7 @@ public:
     
 private:
 	
-	int printCounts(const Sketch & sketch) const;
+	int printCounts(const Sketch & sketch, int threads) const;
 	int writeJson(const Sketch & sketch) const;
 };
 
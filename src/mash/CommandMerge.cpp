@@ -0,0 +1,198 @@
+// Copyright © 2015, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen,
+// Sergey Koren, and Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#include "CommandMerge.h"
+#include "CommandDistance.h"
+#include "CommandTriangle.h"
+#include "Shard.h"
+#include <algorithm>
+#include <iostream>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <vector>
+
+using namespace::std;
+
+namespace mash {
+
+struct ShardFile
+{
+	string name;
+	ShardHeader header;
+	uint64_t records;
+};
+
+static bool shardLess(const ShardFile & a, const ShardFile & b)
+{
+	return a.header.index < b.header.index;
+}
+
+CommandMerge::CommandMerge()
+: Command()
+{
+	name = "merge";
+	summary = "Merge the binary outputs of a sharded dist or triangle run.";
+	description = "Combine the binary outputs (-o) of all shards of a \"dist\" or \"triangle\" run made with -shard into one binary file, as the unsharded run would have written it, for \"dumpdist\" or \"dumptri\". The shards can be given in any order; they are checked to be complete and from the same run. Records are streamed, so the merge takes little memory.";
+	argumentString = "<shard.bin> [<shard.bin>] ...";
+
+	useOption("help");
+	addOption("output", Option(Option::String, "o", "Output", "Output file name (required).", ""));
+}
+
+int CommandMerge::run() const
+{
+	if ( arguments.size() < 1 || options.at("help").active )
+	{
+		print();
+		return 0;
+	}
+
+	string oFileName = options.at("output").argument;
+
+	if ( oFileName == "" )
+	{
+		cerr << "ERROR: An output file must be given with -" << options.at("output").identifier << "." << endl;
+		return 1;
+	}
+
+	vector<ShardFile> shards(arguments.size());
+
+	for ( size_t i = 0; i < arguments.size(); i++ )
+	{
+		ShardFile & shard = shards[i];
+		FILE * file = fopen(arguments[i].c_str(), "rb");
+		struct stat fileInfo;
+
+		shard.name = arguments[i];
+
+		if ( file == NULL || fstat(fileno(file), &fileInfo) != 0 )
+		{
+			cerr << "ERROR: could not open " << arguments[i] << "." << endl;
+			return 1;
+		}
+
+		bool good = readShardHeader(file, shard.header) && shard.header.version == ShardHeader::versionCurrent;
+		fclose(file);
+
+		if ( ! good )
+		{
+			cerr << "ERROR: " << arguments[i] << " is not the output of a sharded run (see -shard for dist and triangle)." << endl;
+			return 1;
+		}
+
+		uint64_t recordBytes = shard.header.kind == ShardHeader::kindTriangle ? sizeof(CommandTriangle::Result) : sizeof(CommandDistance::Result);
+		uint64_t bytes = fileInfo.st_size - sizeof(ShardHeader);
+
+		if ( bytes % recordBytes != 0 )
+		{
+			cerr << "ERROR: " << arguments[i] << " is incomplete." << endl;
+			return 1;
+		}
+
+		shard.records = bytes / recordBytes;
+
+		if ( ! shard.header.sameRun(shards[0].header) )
+		{
+			cerr << "ERROR: " << arguments[i] << " is from a different run than " << arguments[0] << " (inputs, options or shard counts differ)." << endl;
+			return 1;
+		}
+	}
+
+	sort(shards.begin(), shards.end(), shardLess);
+
+	const ShardHeader & first = shards[0].header;
+
+	for ( uint64_t i = 0; i < shards.size(); i++ )
+	{
+		const ShardHeader & header = shards[i].header;
+
+		if ( header.index != i )
+		{
+			if ( header.index < i )
+			{
+				cerr << "ERROR: shard " << header.index + 1 << "/" << header.count << " was given more than once." << endl;
+			}
+			else
+			{
+				cerr << "ERROR: shard " << i + 1 << "/" << header.count << " is missing." << endl;
+			}
+
+			return 1;
+		}
+
+		if ( header.pairBegin != (i == 0 ? 0 : shards[i - 1].header.pairEnd) )
+		{
+			cerr << "ERROR: " << shards[i].name << " does not continue from the shard before it." << endl;
+			return 1;
+		}
+	}
+
+	if ( shards.size() != first.count || shards.back().header.pairEnd != first.pairTotal )
+	{
+		cerr << "ERROR: shard " << shards.size() + 1 << "/" << first.count << " is missing." << endl;
+		return 1;
+	}
+
+	FILE * fout = fopen(oFileName.c_str(), "wb");
+
+	if ( fout == NULL )
+	{
+		cerr << "ERROR: could not open " << oFileName << " for writing." << endl;
+		return 1;
+	}
+
+	if ( first.kind == ShardHeader::kindTriangle )
+	{
+		// as written by an unsharded triangle run
+		//
+		uint64_t isEdge = first.edge;
+
+		fwrite(&isEdge, sizeof(uint64_t), 1, fout);
+		fwrite(&first.distanceMax, sizeof(double), 1, fout);
+		fwrite(&first.pValueMax, sizeof(double), 1, fout);
+	}
+
+	const uint64_t bufferSize = 1 << 20;
+	vector<char> buffer(bufferSize);
+	uint64_t records = 0;
+
+	for ( uint64_t i = 0; i < shards.size(); i++ )
+	{
+		FILE * file = fopen(shards[i].name.c_str(), "rb");
+
+		if ( file == NULL || fseek(file, sizeof(ShardHeader), SEEK_SET) != 0 )
+		{
+			cerr << "ERROR: could not read " << shards[i].name << "." << endl;
+			return 1;
+		}
+
+		uint64_t n;
+
+		while ( (n = fread(buffer.data(), 1, bufferSize, file)) > 0 )
+		{
+			if ( fwrite(buffer.data(), 1, n, fout) != n )
+			{
+				cerr << "ERROR: could not write to " << oFileName << "." << endl;
+				return 1;
+			}
+		}
+
+		fclose(file);
+		records += shards[i].records;
+	}
+
+	if ( fclose(fout) != 0 )
+	{
+		cerr << "ERROR: could not write to " << oFileName << "." << endl;
+		return 1;
+	}
+
+	cerr << "Merged " << shards.size() << " shards (" << records << " results) into " << oFileName << endl;
+
+	return 0;
+}
+
+} // namespace mash
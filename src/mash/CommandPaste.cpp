@@ -6,6 +6,7 @@
 
 #include "CommandPaste.h"
 #include "Sketch.h"
+#include "SketchWriter.h"
 #include <iostream>
 #include "unistd.h"
 
@@ -20,11 +21,13 @@ CommandPaste::CommandPaste()
 {
     name = "paste";
     summary = "Create a single sketch file from multiple sketch files.";
-    description = "Create a single sketch file from multiple sketch files.";
+    description = "Create a single sketch file from multiple sketch files. Sketch files that were appended to (see -append) are written as one part, so pasting one into a new file compacts it.";
     argumentString = "<out_prefix> <sketch> [<sketch>] ...";
     
     useOption("help");
     addOption("list", Option(Option::Boolean, "l", "", "Input files are lists of file names.", ""));
+    useOption("index");
+    useOption("append");
 }
 
 int CommandPaste::run() const
@@ -50,10 +53,7 @@ int CommandPaste::run() const
         }
     }
     
-    Sketch sketch;
     std::vector<string> filesGood;
-    Sketch::Parameters parameters;
-    parameters.parallelism = 1;
     
     for ( int i = 0; i < files.size(); i++ )
     {
@@ -68,7 +68,6 @@ int CommandPaste::run() const
         filesGood.push_back(file);
     }
     
-	sketch.initFromFiles(filesGood, parameters);
     string out = arguments[0];
     
     if ( ! hasSuffix(out, suffixSketch) )
@@ -76,14 +75,65 @@ int CommandPaste::run() const
         out += suffixSketch;
     }
 
-	if( access(out.c_str(), F_OK) != -1 )
+	bool append = options.at("append").active;
+	
+	if( ! append && access(out.c_str(), F_OK) != -1 )
 	{
-		cerr << "ERROR: \"" << out << "\" exists; remove to write." << endl;
+		cerr << "ERROR: \"" << out << "\" exists; remove to write (or see -append)." << endl;
 		exit(1);
 	}
 	
-    cerr << "Writing " << out << "..." << endl;
-    sketch.writeToCapnp(out.c_str());
+	// The parameters come from the header of the first input, and the inputs
+	// are then loaded (and checked against them) one at a time, mapped, with
+	// their references copied to the output as it is written. Only one input
+	// is held at once, rather than all of them and a message built from them.
+	//
+	Sketch first;
+	first.initParametersFromCapnp(filesGood[0].c_str());
+	
+	Sketch::Parameters parameters = first.getParameters();
+	parameters.parallelism = 1;
+	parameters.mapped = true;
+	
+	string alphabet;
+	first.getAlphabetAsString(alphabet);
+	
+    cerr << (append ? "Appending to " : "Writing ") << out << "..." << endl;
+    
+    SketchWriter writer(out, parameters, alphabet, append);
+    std::vector<string> names; // for the index
+    uint64_t referenceCount = 0;
+    
+    for ( size_t i = 0; i < filesGood.size(); i++ )
+    {
+        Sketch sketch;
+        
+        sketch.initFromFiles(std::vector<string>(1, filesGood[i]), parameters, 0, true);
+        
+        for ( uint64_t j = 0; j < sketch.getReferenceCount(); j++ )
+        {
+            writer.addReference(referenceCount++, sketch.getReference(j));
+            
+            if ( options.at("index").active && ! append )
+            {
+                names.push_back(sketch.getReference(j).name);
+            }
+        }
+    }
+    
+    writer.close();
+    
+    if ( options.at("index").active )
+    {
+        if ( append )
+        {
+            Sketch::writeIndexFromFile(out.c_str());
+        }
+        else
+        {
+            Sketch::writeIndex(out.c_str(), names);
+        }
+    }
     
     return 0;
 }
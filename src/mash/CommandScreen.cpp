@@ -8,16 +8,26 @@
 #include "fastx/FastxIO.h"
 #include "fastx/FastxStream.h"
 #include "fastx/FastxChunk.h"
+#include "fastx/ChunkReader.h"
 
 #include "CommandScreen.h"
 #include "CommandDistance.h" // for pvalue
 #include "Sketch.h"
+#include "Numa.h"
+#include "SketchCache.h"
+#include "OutputWriter.h"
+#include "Stats.h"
+#include "simd.h"
 #include "kseq.h"
 #include <iostream>
 #include <zlib.h>
 #include "ThreadPool.h"
 #include <math.h>
 #include <set>
+#include <fcntl.h>
+#include <fstream>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #ifdef USE_BOOST
 	#include <boost/math/distributions/binomial.hpp>
@@ -50,43 +60,49 @@ CommandScreen::CommandScreen()
 	
 	useOption("help");
 	useOption("threads");
+	useOption("numa");
+	useOption("cache");
+	useOption("stats");
 //	useOption("minCov");
-//    addOption("saturation", Option(Option::Boolean, "s", "", "Include saturation curve in output. Each line will have an additional field representing the absolute number of k-mers seen at each Jaccard increase, formatted as a comma-separated list.", ""));
+    addOption("saturation", Option(Option::Boolean, "s", "Saturation", "Include saturation curve in output. Each line will have an additional field with the query's identity estimate at each check (see -interval), formatted as a comma-separated list.", ""));
+    addOption("converge", Option(Option::Number, "converge", "Saturation", "Stop reading the mixture once no query's identity estimate has changed by more than this between two checks in a row (see -interval), and report the results so far. 0 reads the whole mixture.", "0", 0., 1.));
+    addOption("interval", Option(Option::Size, "interval", "Saturation", "Amount of mixture (raw bytes or with K/M/G/T) read between checks of identity estimates for -s and -converge.", "100M"));
     addOption("winning!", Option(Option::Boolean, "w", "", "Winner-takes-all strategy for identity estimates. After counting hashes for each query, hashes that appear in multiple queries will be removed from all except the one with the best identity (ties broken by larger query), and other identities will be reduced. This removes output redundancy, providing a rough compositional outline.", ""));
 	//useSketchOptions();
+    addOption("batch", Option(Option::File, "batch", "", "Screen many samples against the queries (loaded once) in turn. Each line of this file is an output file for a sample's results, then the sample's <mixture> files, separated by tabs, and no <mixture> is given on the command line. The files of each sample are read ahead while the one before it is screened.", ""));
+    addOption("readers", Option(Option::Integer, "readers", "", "Number of <mixture> files to read and decompress at once, for example the lanes of a sample. Their chunks are hashed in turn by the same threads, and the memory for chunks is split between them rather than growing. At most one file per thread (-p) is read at once.", "1", 1, 1024));
+    addOption("index", Option(Option::Boolean, "index", "", "Use the screen index of <queries> (<queries>.msi, next to it), which is mapped instead of building the index of query hashes for every run. It is built and written first if missing or out of date.", ""));
     addOption("identity", Option(Option::Number, "i", "Output", "Minimum identity to report. Inclusive unless set to zero, in which case only identities greater than zero (i.e. with at least one shared hash) will be reported. Set to -1 to output everything.", "0", -1., 1.));
     addOption("pvalue", Option(Option::Number, "v", "Output", "Maximum p-value to report.", "1.0", 0., 1.));
 }
 
 int CommandScreen::run() const
 {
-	if ( arguments.size() < 2 || options.at("help").active )
+	if ( arguments.size() < (options.at("batch").active ? 1 : 2) || options.at("help").active )
 	{
 		print();
 		return 0;
 	}
 	
+	if ( options.at("batch").active && arguments.size() > 1 )
+	{
+		cerr << "ERROR: The mixtures are given in the file for -" << options.at("batch").identifier << ", not on the command line." << endl;
+		return 1;
+	}
+	
 	if ( ! hasSuffix(arguments[0], suffixSketch) )
 	{
 		cerr << "ERROR: " << arguments[0] << " does not look like a sketch (.msh)" << endl;
 		exit(1);
 	}
 	
-	bool sat = false;//options.at("saturation").active;
-
-	bool isFQ = false;
-	bool isFA = true;
-	bool isGZ = false;
-
-    double pValueMax = options.at("pvalue").getArgumentAsNumber();
-    double identityMin = options.at("identity").getArgumentAsNumber();
-    
     vector<string> refArgVector;
-    refArgVector.push_back(arguments[0]);
+    refArgVector.push_back(options.at("cache").active ? getSketchCache(arguments[0], options.at("cache").argument, options.at("threads").getArgumentAsNumber()) : arguments[0]);
 	
 	Sketch sketch;
     Sketch::Parameters parameters;
 	
+	parameters.mapped = ! getNumaEnabled(); // see CommandDistance
     sketch.initFromFiles(refArgVector, parameters);
     
     string alphabet;
@@ -101,35 +117,151 @@ int CommandScreen::run() const
 	parameters.seed = sketch.getHashSeed();
 	parameters.minHashesPerWindow = sketch.getMinHashesPerWindow();
 	
-	HashTable hashTable;
-	unordered_map<uint64_t, std::atomic<uint32_t>> hashCounts;
-	unordered_map<uint64_t, list<uint32_t> > saturationByIndex;
+	ScreenIndex index;
 	
 	cerr << "Loading " << arguments[0] << "..." << endl;
 	
-	for ( int i = 0; i < sketch.getReferenceCount(); i++ )
+	if ( options.at("index").active )
 	{
-		const HashList & hashes = sketch.getReference(i).hashesSorted;
+		string indexFile = ScreenIndex::indexFile(arguments[0]);
+		string error;
 		
-		for ( int j = 0; j < hashes.size(); j++ )
+		if ( index.open(indexFile, sketch, error) )
 		{
-			uint64_t hash = hashes.get64() ? hashes.at(j).hash64 : hashes.at(j).hash32;
+			cerr << "   Using " << indexFile << endl;
+		}
+		else
+		{
+			cerr << "   " << error << "; writing it..." << endl;
+			
+			index.build(sketch, parameters.parallelism);
 			
-			if ( hashTable.count(hash) == 0 )
+			if ( ! index.write(indexFile, sketch) )
 			{
-				hashCounts[hash] = 0;
+				cerr << "WARNING: could not write " << indexFile << "." << endl;
 			}
-			
-			hashTable[hash].insert(i);
 		}
 	}
+	else
+	{
+		index.build(sketch, parameters.parallelism);
+	}
 	
-	cerr << "   " << hashTable.size() << " distinct hashes." << endl;
-	
-	unordered_set<MinHashHeap *> minHashHeaps;
+	cerr << "   " << index.getSlotCount() << " distinct hashes." << endl;
 	
 	bool trans = (alphabet == alphabetProtein);
 	
+	if ( options.at("batch").active )
+	{
+		return screenBatch(sketch, index, parameters, trans);
+	}
+	
+	vector<string> mixtures(arguments.begin() + 1, arguments.end());
+	OutputWriter writer;
+	
+	return screen(sketch, index, mixtures, parameters, trans, writer);
+}
+
+int CommandScreen::screenBatch(const Sketch & sketch, ScreenIndex & index, const Sketch::Parameters & parameters, bool trans) const
+{
+	const string & manifest = options.at("batch").argument;
+	std::ifstream input(manifest);
+	vector<string> outputs;
+	vector<vector<string>> samples;
+	string line;
+	
+	if ( ! input.is_open() )
+	{
+		cerr << "ERROR: could not open " << manifest << "." << endl;
+		return 1;
+	}
+	
+	while ( getline(input, line) )
+	{
+		vector<string> fields;
+		string::size_type start = 0;
+		string::size_type end;
+		
+		if ( line.empty() )
+		{
+			continue;
+		}
+		
+		do
+		{
+			end = line.find('\t', start);
+			fields.push_back(line.substr(start, end == string::npos ? string::npos : end - start));
+			start = end + 1;
+		}
+		while ( end != string::npos );
+		
+		if ( fields.size() < 2 )
+		{
+			cerr << "ERROR: line " << outputs.size() + 1 << " of " << manifest << " must give an output file and at least one mixture, separated by tabs." << endl;
+			return 1;
+		}
+		
+		outputs.push_back(fields[0]);
+		samples.push_back(vector<string>(fields.begin() + 1, fields.end()));
+	}
+	
+	for ( uint64_t i = 0; i < samples.size(); i++ )
+	{
+		if ( i + 1 < samples.size() )
+		{
+			readAhead(samples[i + 1]);
+		}
+		
+		cerr << "Sample " << i + 1 << "/" << samples.size() << " (" << outputs[i] << ")" << endl;
+		
+		FILE * output = fopen(outputs[i].c_str(), "w");
+		int result;
+		
+		if ( output == NULL )
+		{
+			cerr << "ERROR: could not open " << outputs[i] << " for writing." << endl;
+			return 1;
+		}
+		
+		{
+			OutputWriter writer(fileno(output));
+			
+			result = screen(sketch, index, samples[i], parameters, trans, writer);
+		}
+		
+		if ( fclose(output) != 0 )
+		{
+			cerr << "ERROR: could not write to " << outputs[i] << "." << endl;
+			return 1;
+		}
+		
+		if ( result != 0 )
+		{
+			return result;
+		}
+		
+		index.clearCounts(parameters.parallelism);
+	}
+	
+	return 0;
+}
+
+int CommandScreen::screen(const Sketch & sketch, ScreenIndex & index, const vector<string> & mixtures, const Sketch::Parameters & parameters, bool trans, OutputWriter & writer) const
+{
+	bool sat = options.at("saturation").active;
+	double converge = options.at("converge").getArgumentAsNumber();
+	uint64_t checkInterval = (sat || converge > 0) ? options.at("interval").getArgumentAsNumber() : 0;
+
+	bool isFQ = false;
+	bool isFA = true;
+	bool isGZ = false;
+
+    double pValueMax = options.at("pvalue").getArgumentAsNumber();
+    double identityMin = options.at("identity").getArgumentAsNumber();
+    
+	vector<list<double> > saturationByIndex(sat ? sketch.getReferenceCount() : 0);
+	unordered_set<MinHashHeap *> minHashHeaps;
+	
 /*	if ( ! trans )
 	{
 		if ( alphabet != alphabetNucleotide )
@@ -145,12 +277,12 @@ int CommandScreen::run() const
 		}
 	}
 */	
-	int queryCount = arguments.size() - 1;
+	int queryCount = mixtures.size();
 	cerr << (trans ? "Translating from " : "Streaming from ");
 	
 	if ( queryCount == 1 )
 	{
-		cerr << arguments[1];
+		cerr << mixtures[0];
 	}
 	else
 	{
@@ -162,23 +294,57 @@ int CommandScreen::run() const
 	int kmerSize = parameters.kmerSize;
 	int minCov = 1;//options.at("minCov").getArgumentAsNumber();
 	
+	uint64_t * shared = new uint64_t[sketch.getReferenceCount()];
+	vector<uint64_t> * depths = new vector<uint64_t>[sketch.getReferenceCount()];
+	
 	ThreadPool<CommandScreen::HashInput, CommandScreen::HashOutput> threadPool(hashSequenceChunk, parameters.parallelism);
 	
-	// open all query files for FAST fasta IO 
-	mash::fa::FastaDataPool *fastaPool    = new mash::fa::FastaDataPool(parameters.parallelism, 1<<20); //1MB block size
-	mash::fq::FastqDataPool *fastqPool    = new mash::fq::FastqDataPool(parameters.parallelism, 1<<22); //4MB block size at least 2MB for fastq file
-
-	std::vector<FILE *> inStreams;
+	// For -s and -converge, every checkInterval bytes of mixture; the threads
+	// catch up first, so that each check is of the same prefix of it however
+	// they were scheduled.
+	//
+	vector<double> identities(sketch.getReferenceCount(), 0.);
+	uint64_t bytesRead = 0;
+	uint64_t checks = 0;
+	
+	auto checkSaturation = [&]() -> bool
+	{
+		double change = 0;
+		
+		while ( threadPool.running() )
+		{
+			useThreadOutput(threadPool.popOutputWhenAvailable(), minHashHeaps);
+		}
+		
+		gatherDepths(sketch, index, minCov, 0, shared, 0, parameters.parallelism);
+		
+		for ( int i = 0; i < sketch.getReferenceCount(); i++ )
+		{
+			double identity = estimateIdentity(shared[i], sketch.getReference(i).hashesSorted.size(), kmerSize, sketch.getKmerSpace());
+			
+			change = std::max(change, fabs(identity - identities[i]));
+			identities[i] = identity;
+			
+			if ( sat )
+			{
+				saturationByIndex[i].push_back(identity);
+			}
+		}
+		
+		checks++;
+		
+		return converge > 0 && checks > 1 && change <= converge;
+	};
+	
+	// mixtures are only open while they are read (see openMixture), so that
+	// screening many samples with -batch does not hold on to their files, but
+	// one that cannot be read is reported before reading any
+	//
 	std::vector<std::string> queryNames;
-	for(int i = 1; i <= queryCount; i++){
-		inStreams.push_back( fopen(arguments[i].c_str(), "r"));
-		queryNames.push_back( arguments[i] );
-	}
-
-	//check file open status
-	for(int i = 0; i < inStreams.size(); i++){
+	for(int i = 0; i < queryCount; i++){
+		queryNames.push_back( mixtures[i] );
 
-		if(inStreams[i] == NULL){
+		if(access(queryNames[i].c_str(), R_OK) != 0){
 			std::cerr << "Can not open " << queryNames[i] << std::endl;
 			exit(1);
 		}
@@ -267,7 +433,7 @@ int CommandScreen::run() const
 	//			minHashHeaps.emplace(new MinHashHeap(sketch.getUse64(), sketch.getMinHashesPerWindow()));
 	//		}
 	//		
-	//		threadPool.runWhenThreadAvailable(new HashInput(hashCounts, *minHashHeaps.begin(), seqCopy, input.length(), parameters, trans));
+	//		threadPool.runWhenThreadAvailable(new HashInput(index, *minHashHeaps.begin(), seqCopy, input.length(), parameters, trans));
 	//	
 	//		input = "";
 	//	
@@ -306,14 +472,37 @@ int CommandScreen::run() const
 	//	exit(1);
 	//}
 
-	mash::fa::FastaFileReader *faFileReader ;
-	mash::fa::FastaReader     *fastaReader;
-	mash::fq::FastqFileReader *fqFileReader;
-	mash::fq::FastqReader     *fastqReader;
-
-	for(int i = 0; i < inStreams.size(); i++)
+	// Up to -readers mixture files are read (and decompressed) at once, each by
+	// its own chain of readers into its own pool, and their chunks are taken in
+	// turn for the same threads and counts. Taking them in a fixed order keeps
+	// the checks for -s and -converge at the same points of the mixture
+	// however fast each file is read. The chunks of the pools together are
+	// bounded as they were for one file (a chunk for each thread and one read
+	// ahead for each), so more readers only split them between files; there
+	// is at most a reader for each thread, so each has at least two parts.
+	//
+	int readerCount = std::min<int>(std::min<int>(options.at("readers").getArgumentAsNumber(), queryNames.size()), parameters.parallelism);
+	int partsPerReader = 2 * parameters.parallelism / readerCount;
+	int gzipThreads = std::max(1, parameters.parallelism / readerCount);
+	
+	struct MixtureReader
 	{
+		FILE * stream;
+		bool isFA;
+		
+		mash::fa::FastaDataPool * fastaPool;
+		mash::fa::FastaFileReader * faFileReader;
+		mash::fa::FastaReader * fastaReader;
+		mash::fa::FastaChunkReader * faChunkReader;
+		
+		mash::fq::FastqDataPool * fastqPool;
+		mash::fq::FastqFileReader * fqFileReader;
+		mash::fq::FastqReader * fastqReader;
+		mash::fq::FastqChunkReader * fqChunkReader;
+	};
 	
+	auto openMixture = [&](int i) -> MixtureReader *
+	{
 		isFA = hasSuffix(queryNames[i], ".fa") || hasSuffix(queryNames[i], ".fasta") || hasSuffix(queryNames[i], ".fna") || hasSuffix(queryNames[i], ".faa");
 		isFA |= hasSuffix(queryNames[i], ".fa.gz") || hasSuffix(queryNames[i], ".fasta.gz") || hasSuffix(queryNames[i], ".fna.gz") || hasSuffix(queryNames[i], ".faa.gz");
 
@@ -339,70 +528,169 @@ int CommandScreen::run() const
 		if(isFQ && !isGZ)
 			cerr << "query file is in plain FASTQ format" << endl;
 
+		MixtureReader * mixture = new MixtureReader();
+		mixture->isFA = isFA;
+		mixture->stream = fopen(queryNames[i].c_str(), "r");
+		
+		if(mixture->stream == NULL){
+			std::cerr << "Can not open " << queryNames[i] << std::endl;
+			exit(1);
+		}
+		
+		// file readers of plain files take over (and close) the descriptor
+		// they are given, so they are given their own
+		//
+		int fd = isGZ ? fileno(mixture->stream) : dup(fileno(mixture->stream));
+		
 		if(isFA){
-			faFileReader = new mash::fa::FastaFileReader(fileno(inStreams[i]), parameters.kmerSize - 1, isGZ);
-			fastaReader  = new mash::fa::FastaReader(*faFileReader, *fastaPool);
-		}else if(isFQ){
+			mixture->fastaPool = new mash::fa::FastaDataPool(partsPerReader, 1<<20); //1MB block size
+			mixture->faFileReader = new mash::fa::FastaFileReader(fd, parameters.kmerSize - 1, isGZ, gzipThreads);
+			mixture->fastaReader  = new mash::fa::FastaReader(*mixture->faFileReader, *mixture->fastaPool);
+			mixture->faChunkReader = new mash::fa::FastaChunkReader(*mixture->fastaReader, *mixture->fastaPool, partsPerReader);
+		}else{
+			mixture->fastqPool = new mash::fq::FastqDataPool(partsPerReader, 1<<22); //4MB block size at least 2MB for fastq file
+			mixture->fqFileReader = new mash::fq::FastqFileReader(fd, isGZ, gzipThreads);
+			mixture->fastqReader  = new mash::fq::FastqReader(*mixture->fqFileReader, *mixture->fastqPool);
+			mixture->fqChunkReader = new mash::fq::FastqChunkReader(*mixture->fastqReader, *mixture->fastqPool, partsPerReader);
+		}
+		
+		return mixture;
+	};
+	
+	// chunks still being hashed are in the pools, not the readers, so the pools
+	// are kept (in donePools) until the threads are done; on convergence, those
+	// read ahead are dropped
+	//
+	vector<MixtureReader *> donePools;
+	
+	auto closeMixture = [&](MixtureReader * mixture)
+	{
+		if(mixture->isFA){
+			delete mixture->faChunkReader;
+			delete mixture->fastaReader;
+			delete mixture->faFileReader;
+		}else{
+			delete mixture->fqChunkReader;
+			delete mixture->fastqReader;
+			delete mixture->fqFileReader;
+		}
+		
+		fclose(mixture->stream);
+		donePools.push_back(mixture);
+	};
+	
+	list<MixtureReader *> mixtureReaders;
+	int nextMixture = 0;
+	
+	while ( nextMixture < readerCount )
+	{
+		mixtureReaders.push_back(openMixture(nextMixture++));
+	}
+	
+	list<MixtureReader *>::iterator it = mixtureReaders.begin();
+	
+	while ( it != mixtureReaders.end() )
+	{
+		MixtureReader * mixture = *it;
+		mash::fa::FastaChunk *fachunk;
+		mash::fq::FastqChunk *fqchunk;
+		bool end;
+		
+		if(mixture->isFA){
+			fachunk = mixture->faChunkReader->Next();
+			end = fachunk == NULL;
+		}else{
+			mash::fq::FastqDataChunk *chunk = mixture->fqChunkReader->Next();
+			end = chunk == NULL;
 			
-			fqFileReader = new mash::fq::FastqFileReader(fileno(inStreams[i]), isGZ);
-			fastqReader  = new mash::fq::FastqReader(*fqFileReader, *fastqPool);
+			if ( ! end )
+			{
+				fqchunk = new mash::fq::FastqChunk;
+				fqchunk->chunk = chunk;
+			}
 		}
-		int nChunks = 0;
-		while(true)
+		
+		if ( end )
 		{
-			mash::fa::FastaChunk *fachunk;
-			mash::fq::FastqChunk *fqchunk = new mash::fq::FastqChunk;
-
-			if(isFA){
-				fachunk = fastaReader->readNextChunk();
-				if(fachunk == NULL) break;
-			}else if(isFQ){
-				fqchunk->chunk = fastqReader->readNextChunk();
-				if(fqchunk->chunk == NULL) break;
-			}
-				
-			nChunks++;	
+			// the next file takes the place of this one in the turns
+			//
+			closeMixture(mixture);
 			
-			//cerr << "nChunks: " << nChunks << endl << std::flush;
-			if ( minHashHeaps.begin() == minHashHeaps.end() )
+			if ( nextMixture < int(queryNames.size()) )
 			{
-				minHashHeaps.emplace(new MinHashHeap(sketch.getUse64(), sketch.getMinHashesPerWindow()));
+				*it = openMixture(nextMixture++);
 			}
-			//HashInput chunk type
-			if(isFA)
-				threadPool.runWhenThreadAvailable(new HashInput(fachunk, fastaPool, hashCounts, *minHashHeaps.begin(), parameters, trans, isFA, isFQ));
-			else if(isFQ)
-				threadPool.runWhenThreadAvailable(new HashInput(fqchunk, fastqPool, hashCounts, *minHashHeaps.begin(), parameters, trans, isFA, isFQ));
-
-			minHashHeaps.erase(minHashHeaps.begin());
-
-			while ( threadPool.outputAvailable() )
+			else
 			{
-				useThreadOutput(threadPool.popOutputWhenAvailable(), minHashHeaps);
+				it = mixtureReaders.erase(it);
+				
+				if ( it == mixtureReaders.end() )
+				{
+					it = mixtureReaders.begin();
+				}
 			}
+			
+			continue;
 		}
-
-		while( fastaPool->partNum != 0 || fastqPool->partNum != 0)
+		
+		bytesRead += mixture->isFA ? fachunk->chunk->size : fqchunk->chunk->size;
+		
+		if ( minHashHeaps.begin() == minHashHeaps.end() )
 		{
+			minHashHeaps.emplace(new MinHashHeap(sketch.getUse64(), sketch.getMinHashesPerWindow()));
 		}
-
-		if(isFA){
-			delete fastaReader;
-			delete faFileReader;
-		}else if(isFQ){
-			delete fastqReader;
-			delete fqFileReader;
+		
+		//HashInput chunk type
+		if(mixture->isFA)
+			threadPool.runWhenThreadAvailable(new HashInput(fachunk, mixture->fastaPool, index, *minHashHeaps.begin(), parameters, trans, true, false));
+		else
+			threadPool.runWhenThreadAvailable(new HashInput(fqchunk, mixture->fastqPool, index, *minHashHeaps.begin(), parameters, trans, false, true));
+		
+		minHashHeaps.erase(minHashHeaps.begin());
+		
+		while ( threadPool.outputAvailable() )
+		{
+			useThreadOutput(threadPool.popOutputWhenAvailable(), minHashHeaps);
+		}
+		
+		if ( checkInterval != 0 && bytesRead >= (checks + 1) * checkInterval && checkSaturation() )
+		{
+			cerr << "   Identity estimates converged after " << bytesRead << " bytes of mixture." << endl;
+			break;
+		}
+		
+		if ( ++it == mixtureReaders.end() )
+		{
+			it = mixtureReaders.begin();
 		}
 	}
+	
+	for ( list<MixtureReader *>::iterator i = mixtureReaders.begin(); i != mixtureReaders.end(); ++i )
+	{
+		closeMixture(*i);
+	}
     
-	delete fastaPool;
-	delete fastqPool;
-
+	// every chunk is back in its pool once the threads are done with it
+	//
 	while ( threadPool.running() )
 	{
 		useThreadOutput(threadPool.popOutputWhenAvailable(), minHashHeaps);
 	}
 	
+	for ( size_t i = 0; i < donePools.size(); i++ )
+	{
+		if ( donePools[i]->isFA )
+		{
+			delete donePools[i]->fastaPool;
+		}
+		else
+		{
+			delete donePools[i]->fastqPool;
+		}
+		
+		delete donePools[i];
+	}
+	
 	//for ( int i = 0; i < queryCount; i++ )
 	//{
 	//	gzclose(fps[i]);
@@ -413,15 +701,10 @@ int CommandScreen::run() const
 	//i++ to ++i see https://github.com/martinus/robin-hood-hashing/issues/15
 	for ( unordered_set<MinHashHeap *>::const_iterator i = minHashHeaps.begin(); i != minHashHeaps.end(); ++i )
 	{
-		HashList hashList(parameters.use64);
-		
-		(*i)->toHashList(hashList);
-		
-		for ( int i = 0; i < hashList.size(); i++ )
-		{
-			minHashHeap.tryInsert(hashList.at(i));
-		}
-		
+		// only the set size is estimated from the merged heap, so merging
+		// the sorted bottom hashes is the same as inserting them
+		//
+		minHashHeap.merge(**i);
 		delete *i;
 	}
 	
@@ -454,61 +737,30 @@ int CommandScreen::run() const
 	
 	cerr << "Summing shared..." << endl;
 	
-	uint64_t * shared = new uint64_t[sketch.getReferenceCount()];
-	vector<uint64_t> * depths = new vector<uint64_t>[sketch.getReferenceCount()];
-	
-	memset(shared, 0, sizeof(uint64_t) * sketch.getReferenceCount());
-	
-	for ( unordered_map<uint64_t, std::atomic<uint32_t> >::const_iterator i = hashCounts.begin(); i != hashCounts.end(); ++i )
-	{
-		if ( i->second >= minCov )
-		{
-			const unordered_set<uint64_t> & indeces = hashTable.at(i->first);
-
-			for ( unordered_set<uint64_t>::const_iterator k = indeces.begin(); k != indeces.end(); ++k )
-			{
-				shared[*k]++;
-				depths[*k].push_back(i->second);
-			
-				if ( sat )
-				{
-					saturationByIndex[*k].push_back(0);// TODO kmersTotal);
-				}
-			}
-		}
-	}
+	gatherDepths(sketch, index, minCov, 0, shared, depths, parameters.parallelism);
 	
 	if ( options.at("winning!").active )
 	{
 		cerr << "Reallocating to winners..." << endl;
 		
 		double * scores = new double[sketch.getReferenceCount()];
+		uint32_t * winners = new uint32_t[index.getSlotCount()];
 		
 		for ( int i = 0; i < sketch.getReferenceCount(); i ++ )
 		{
 			scores[i] = estimateIdentity(shared[i], sketch.getReference(i).hashesSorted.size(), kmerSize, sketch.getKmerSpace());
 		}
 		
-		memset(shared, 0, sizeof(uint64_t) * sketch.getReferenceCount());
-		
-		for ( int i = 0; i < sketch.getReferenceCount(); i++ )
-		{
-			depths[i].clear();
-		}
-		
-		for ( HashTable::const_iterator i = hashTable.begin(); i != hashTable.end(); ++i )
+		// each hash on its own, so over threads by slot
+		//
+		#pragma omp parallel for schedule(static, 4096) num_threads(parameters.parallelism)
+		for ( int64_t i = 0; i < int64_t(index.getSlotCount()); i++ )
 		{
-			if ( hashCounts.count(i->first) == 0 || hashCounts.at(i->first) < minCov )
-			{
-				continue;
-			}
-			
-			const unordered_set<uint64_t> & indeces = i->second;
 			double maxScore = 0;
 			uint64_t maxLength = 0;
-			uint64_t maxIndex;
+			uint32_t maxIndex = *index.referencesBegin(i);
 			
-			for ( unordered_set<uint64_t>::const_iterator k = indeces.begin(); k != indeces.end(); ++k )
+			for ( const uint32_t * k = index.referencesBegin(i); k != index.referencesEnd(i); k++ )
 			{
 				if ( scores[*k] > maxScore )
 				{
@@ -523,22 +775,29 @@ int CommandScreen::run() const
 				}
 			}
 			
-			shared[maxIndex]++;
-			depths[maxIndex].push_back(hashCounts.at(i->first));
+			winners[i] = maxIndex;
 		}
 		
+		gatherDepths(sketch, index, minCov, winners, shared, depths, parameters.parallelism);
+		
 		delete [] scores;
+		delete [] winners;
 	}
 	
 	cerr << "Computing coverage medians..." << endl;
 	
-	for ( int i = 0; i < sketch.getReferenceCount(); i++ )
+	// only the median is printed, so it is selected rather than sorted
+	//
+	#pragma omp parallel for schedule(dynamic, 16) num_threads(parameters.parallelism)
+	for ( int64_t i = 0; i < int64_t(sketch.getReferenceCount()); i++ )
 	{
-		sort(depths[i].begin(), depths[i].end());
+		nth_element(depths[i].begin(), depths[i].begin() + depths[i].size() / 2, depths[i].end());
 	}
 	
 	cerr << "Writing output..." << endl;
 	
+	string text;
+	
 	for ( int i = 0; i < sketch.getReferenceCount(); i++ )
 	{
 		if ( shared[i] != 0 || identityMin < 0.0)
@@ -557,32 +816,116 @@ int CommandScreen::run() const
 				continue;
 			}
 			
-			cout << identity << '\t' << shared[i] << '/' << sketch.getReference(i).hashesSorted.size() << '\t' << (shared[i] > 0 ? depths[i].at(shared[i] / 2) : 0) << '\t' << pValue << '\t' << sketch.getReference(i).name << '\t' << sketch.getReference(i).comment;
+			appendDouble(text, identity);
+			text.push_back('\t');
+			appendInteger(text, shared[i]);
+			text.push_back('/');
+			appendInteger(text, sketch.getReference(i).hashesSorted.size());
+			text.push_back('\t');
+			appendInteger(text, shared[i] > 0 ? depths[i].at(shared[i] / 2) : 0);
+			text.push_back('\t');
+			appendDouble(text, pValue);
+			text.push_back('\t');
+			text.append(sketch.getReference(i).name);
+			text.push_back('\t');
+			text.append(sketch.getReference(i).comment);
 			
 			if ( sat )
 			{
-				cout << '\t';
+				text.push_back('\t');
 				
-				for ( list<uint32_t>::const_iterator j = saturationByIndex.at(i).begin(); j != saturationByIndex.at(i).end(); j++ )
+				for ( list<double>::const_iterator j = saturationByIndex.at(i).begin(); j != saturationByIndex.at(i).end(); j++ )
 				{
 					if ( j != saturationByIndex.at(i).begin() )
 					{
-						cout << ',';
+						text.push_back(',');
 					}
 					
-					cout << *j;
+					appendDouble(text, *j);
 				}
 			}
 			
-			cout << endl;
+			text.push_back('\n');
+			writer.write(text);
 		}
 	}
 	
 	delete [] shared;
+	delete [] depths;
 	
 	return 0;
 }
 
+void gatherDepths(const Sketch & sketch, const ScreenIndex & index, uint32_t minCov, const uint32_t * winners, uint64_t * shared, vector<uint64_t> * depths, int threads)
+{
+	// Each query has its hashes (sorted, so any repeats, which the index
+	// counts once, are next to each other) and only writes its own results,
+	// so queries go to threads without locking.
+	//
+	#pragma omp parallel for schedule(dynamic, 16) num_threads(threads)
+	for ( int64_t i = 0; i < int64_t(sketch.getReferenceCount()); i++ )
+	{
+		const HashList & hashes = sketch.getReference(i).hashesSorted;
+		uint64_t count = 0;
+		
+		if ( depths )
+		{
+			depths[i].clear();
+		}
+		
+		for ( int j = 0; j < hashes.size(); j++ )
+		{
+			uint64_t hash = hashes.get64() ? hashes.at(j).hash64 : hashes.at(j).hash32;
+			
+			if ( j != 0 && hash == (hashes.get64() ? hashes.at(j - 1).hash64 : hashes.at(j - 1).hash32) )
+			{
+				continue;
+			}
+			
+			uint64_t slot = index.find(hash);
+			
+			uint32_t depth = index.getCount(slot);
+			
+			if ( depth >= minCov && (winners == 0 || winners[slot] == i) )
+			{
+				count++;
+				
+				if ( depths )
+				{
+					depths[i].push_back(depth);
+				}
+			}
+		}
+		
+		shared[i] = count;
+	}
+}
+
+void readAhead(const vector<string> & files)
+{
+	// enough to get the next sample's readers started
+	//
+	static const off_t readAheadMax = off_t(1) << 28;
+	
+	for ( uint64_t i = 0; i < files.size(); i++ )
+	{
+		int fd = open(files[i].c_str(), O_RDONLY);
+		struct stat info;
+		
+		if ( fd < 0 )
+		{
+			continue;
+		}
+		
+		if ( fstat(fd, &info) == 0 && S_ISREG(info.st_mode) )
+		{
+			posix_fadvise(fd, 0, std::min(info.st_size, readAheadMax), POSIX_FADV_WILLNEED);
+		}
+		
+		close(fd);
+	}
+}
+
 double estimateIdentity(uint64_t common, uint64_t denom, int kmerSize, double kmerSpace)
 {
 	double identity;
@@ -607,6 +950,7 @@ double estimateIdentity(uint64_t common, uint64_t denom, int kmerSize, double km
 CommandScreen::HashOutput * hashSequence(CommandScreen::HashInput * input)
 {
 	CommandScreen::HashOutput * output = new CommandScreen::HashOutput(input->minHashHeap);
+	ScreenIndex::LocalCounts counts(input->index);
 	
 	int l = input->length;
 	bool trans = input->trans;
@@ -620,12 +964,9 @@ CommandScreen::HashOutput * hashSequence(CommandScreen::HashInput * input)
 	
 	// uppercase
 	//
-	for ( uint64_t i = 0; i < l; i++ )
+	if ( ! input->parameters.preserveCase )
 	{
-		if ( ! input->parameters.preserveCase && seq[i] > 96 && seq[i] < 123 )
-		{
-			seq[i] -= 32;
-		}
+		getSimdKernels().toUpper(seq, l);
 	}
 	
 	char * seqRev;
@@ -636,6 +977,8 @@ CommandScreen::HashOutput * hashSequence(CommandScreen::HashInput * input)
 		reverseComplement(seq, seqRev, l);
 	}
 	
+	char * seqTrans = trans ? new char[l / 3 + 1] : 0; // for each frame in turn
+	
 	for ( int i = 0; i < (trans ? 6 : 1); i++ )
 	{
 		bool useRevComp = false;
@@ -644,11 +987,8 @@ CommandScreen::HashOutput * hashSequence(CommandScreen::HashInput * input)
 		
 		int lenTrans = (l - frame) / 3;
 		
-		char * seqTrans;
-		
 		if ( trans )
 		{
-			seqTrans = new char[lenTrans];
 			translate((rev ? seqRev : seq) + frame, seqTrans, lenTrans);
 		}
 		
@@ -691,17 +1031,21 @@ CommandScreen::HashOutput * hashSequence(CommandScreen::HashInput * input)
 			input->minHashHeap->tryInsert(hash);
 			uint64_t key = use64 ? hash.hash64 : hash.hash32;
 			
-			if ( input->hashCounts.count(key) == 1 )
+			if ( input->index.mayContain(key) )
 			{
-				//cout << "Incrementing " << key << endl;
-				input->hashCounts[key]++;
+				uint64_t slot = input->index.find(key);
+				
+				if ( slot != ScreenIndex::notFound )
+				{
+					counts.increment(slot);
+				}
 			}
 		}
-		
-		if ( trans )
-		{
-			delete [] seqTrans;
-		}
+	}
+	
+	if ( trans )
+	{
+		delete [] seqTrans;
 	}
 	
 	if ( ! noncanonical || trans )
@@ -723,6 +1067,7 @@ CommandScreen::HashOutput * hashSequence(CommandScreen::HashInput * input)
 CommandScreen::HashOutput * hashSequenceChunk(CommandScreen::HashInput * input)
 {
 	CommandScreen::HashOutput * output = new CommandScreen::HashOutput(input->minHashHeap);
+	ScreenIndex::LocalCounts counts(input->index);
 	
 	bool trans = input->trans;
 
@@ -735,41 +1080,57 @@ CommandScreen::HashOutput * hashSequenceChunk(CommandScreen::HashInput * input)
 	bool noncanonical = input->parameters.noncanonical;
 	
 	//char * seq = input->seq;
-	vector<Sketch::Reference> seqs;
+	vector<mash::SequenceView> seqs;
 	//real seqence format
 	assert((isFA && isFQ) == false);
 
-	if(isFA){
-		mash::fa::chunkFormat(*(input->fachunk), seqs); 	
-		input->fastaPool->Release(input->fachunk->chunk);
-	}else if(isFQ){
-		mash::fq::chunkFormat(input->fqchunk, seqs, true); 	
-		input->fastqPool->Release(input->fqchunk->chunk);
+	{
+		Stats::Timer timer(Stats::parsing);
+		
+		if(isFA){
+			mash::fa::chunkFormat(*(input->fachunk), seqs); 	
+		}else if(isFQ){
+			mash::fq::chunkFormat(input->fqchunk, seqs, true); 	
+		}
 	}
+	
+	Stats::count(Stats::sequences, seqs.size());
+	Stats::Timer timer(Stats::hashing);
+	uint64_t hashed = 0;
 
-	string inputSeq="";
-	for(int i = 0; i < seqs.size(); i++)
+	// join the records, separated by '*', straight from the chunk buffer
+	int l = 0;
+	for(size_t i = 0; i < seqs.size(); i++)
 	{
-		if(seqs[i].seq.length() >= kmerSize)
+		if(seqs[i].length >= uint64(kmerSize))
 		{
-			inputSeq.append(1, '*');
-			inputSeq.append(seqs[i].seq);
+			l += seqs[i].length + 1;
 		}
 	}
 
-	int l = inputSeq.length();
-	char * seq = new char[inputSeq.length()];
-	//
-	memcpy(seq, inputSeq.c_str(), inputSeq.length());
+	char * seq = new char[l];
+	uint64_t pos = 0;
+	for(size_t i = 0; i < seqs.size(); i++)
+	{
+		if(seqs[i].length >= uint64(kmerSize))
+		{
+			seq[pos++] = '*';
+			memcpy(seq + pos, seqs[i].seq, seqs[i].length);
+			pos += seqs[i].length;
+		}
+	}
+
+	if(isFA){
+		input->fastaPool->Release(input->fachunk->chunk);
+	}else if(isFQ){
+		input->fastqPool->Release(input->fqchunk->chunk);
+	}
 
 	// uppercase
 	//
-	for ( uint64_t i = 0; i < l; i++ )
+	if ( ! input->parameters.preserveCase )
 	{
-		if ( ! input->parameters.preserveCase && seq[i] > 96 && seq[i] < 123 )
-		{
-			seq[i] -= 32;
-		}
+		getSimdKernels().toUpper(seq, l);
 	}
 	
 	char * seqRev;
@@ -780,6 +1141,8 @@ CommandScreen::HashOutput * hashSequenceChunk(CommandScreen::HashInput * input)
 		reverseComplement(seq, seqRev, l);
 	}
 	
+	char * seqTrans = trans ? new char[l / 3 + 1] : 0; // for each frame in turn
+	
 	for ( int i = 0; i < (trans ? 6 : 1); i++ )
 	{
 		bool useRevComp = false;
@@ -788,11 +1151,8 @@ CommandScreen::HashOutput * hashSequenceChunk(CommandScreen::HashInput * input)
 		
 		int lenTrans = (l - frame) / 3;
 		
-		char * seqTrans;
-		
 		if ( trans )
 		{
-			seqTrans = new char[lenTrans];
 			translate((rev ? seqRev : seq) + frame, seqTrans, lenTrans);
 		}
 		
@@ -831,21 +1191,26 @@ CommandScreen::HashOutput * hashSequenceChunk(CommandScreen::HashInput * input)
 			
 			//cout << kmer << '\t' << kmerSize << endl;
 			hash_u hash = getHash(kmer, kmerSize, seed, use64);
+			hashed++;
 			//cout << kmer << '\t' << hash.hash64 << endl;
 			input->minHashHeap->tryInsert(hash);
 			uint64_t key = use64 ? hash.hash64 : hash.hash32;
 			
-			if ( input->hashCounts.count(key) == 1 )
+			if ( input->index.mayContain(key) )
 			{
-				//cout << "Incrementing " << key << endl;
-				input->hashCounts[key]++;
+				uint64_t slot = input->index.find(key);
+				
+				if ( slot != ScreenIndex::notFound )
+				{
+					counts.increment(slot);
+				}
 			}
 		}
-		
-		if ( trans )
-		{
-			delete [] seqTrans;
-		}
+	}
+	
+	if ( trans )
+	{
+		delete [] seqTrans;
 	}
 	
 	if ( ! noncanonical || trans )
@@ -862,6 +1227,8 @@ CommandScreen::HashOutput * hashSequenceChunk(CommandScreen::HashInput * input)
 	}
 	*/
 	delete [] seq;
+	
+	Stats::count(Stats::kmersHashed, hashed);
 
 	return output;
 }
@@ -881,198 +1248,48 @@ double pValueWithin(uint64_t x, uint64_t setSize, double kmerSpace, uint64_t ske
 #endif
 }
 
-void translate(const char * src, char * dst, uint64_t len)
+// 2-bit codes of the bases for codonAminoAcids; anything else is flagged so
+// that codons with it translate to stops.
+//
+struct CodonBases
 {
-	for ( uint64_t n = 0, a = 0; a < len; a++, n+= 3 )
+	static const uint8_t other = 0x80;
+	
+	uint8_t codes[256];
+	
+	CodonBases()
 	{
-		dst[a] = aaFromCodon(src + n);
+		memset(codes, other, sizeof(codes));
+		codes['A'] = 0;
+		codes['C'] = 1;
+		codes['G'] = 2;
+		codes['T'] = 3;
 	}
-}
+};
 
-char aaFromCodon(const char * codon)
+static const CodonBases codonBases;
+
+void translate(const char * src, char * dst, uint64_t len)
 {
-	string str(codon, 3);
-	/*
-	if ( codons.count(str) == 1 )
-	{
-		return codons.at(str);
-	}
-	else
-	{
-		return 0;
-	}
-	*/
-	char aa = '*';//0;
+	const uint8_t * codes = codonBases.codes;
 	
-	switch (codon[0])
+	for ( uint64_t a = 0; a < len; a++, src += 3 )
 	{
-	case 'A':
-		switch (codon[1])
-		{
-		case 'A':
-			switch (codon[2])
-			{
-				case 'A': aa = 'K'; break;
-				case 'C': aa = 'N'; break;
-				case 'G': aa = 'K'; break;
-				case 'T': aa = 'N'; break;
-			}
-			break;
-		case 'C':
-			switch (codon[2])
-			{
-				case 'A': aa = 'T'; break;
-				case 'C': aa = 'T'; break;
-				case 'G': aa = 'T'; break;
-				case 'T': aa = 'T'; break;
-			}
-			break;
-		case 'G':
-			switch (codon[2])
-			{
-				case 'A': aa = 'R'; break;
-				case 'C': aa = 'S'; break;
-				case 'G': aa = 'R'; break;
-				case 'T': aa = 'S'; break;
-			}
-			break;
-		case 'T':
-			switch (codon[2])
-			{
-				case 'A': aa = 'I'; break;
-				case 'C': aa = 'I'; break;
-				case 'G': aa = 'M'; break;
-				case 'T': aa = 'I'; break;
-			}
-			break;
-		}
-		break;
-	case 'C':
-		switch (codon[1])
-		{
-		case 'A':
-			switch (codon[2])
-			{
-				case 'A': aa = 'Q'; break;
-				case 'C': aa = 'H'; break;
-				case 'G': aa = 'Q'; break;
-				case 'T': aa = 'H'; break;
-			}
-			break;
-		case 'C':
-			switch (codon[2])
-			{
-				case 'A': aa = 'P'; break;
-				case 'C': aa = 'P'; break;
-				case 'G': aa = 'P'; break;
-				case 'T': aa = 'P'; break;
-			}
-			break;
-		case 'G':
-			switch (codon[2])
-			{
-				case 'A': aa = 'R'; break;
-				case 'C': aa = 'R'; break;
-				case 'G': aa = 'R'; break;
-				case 'T': aa = 'R'; break;
-			}
-			break;
-		case 'T':
-			switch (codon[2])
-			{
-				case 'A': aa = 'L'; break;
-				case 'C': aa = 'L'; break;
-				case 'G': aa = 'L'; break;
-				case 'T': aa = 'L'; break;
-			}
-			break;
-		}
-		break;
-	case 'G':
-		switch (codon[1])
-		{
-		case 'A':
-			switch (codon[2])
-			{
-				case 'A': aa = 'E'; break;
-				case 'C': aa = 'D'; break;
-				case 'G': aa = 'E'; break;
-				case 'T': aa = 'D'; break;
-			}
-			break;
-		case 'C':
-			switch (codon[2])
-			{
-				case 'A': aa = 'A'; break;
-				case 'C': aa = 'A'; break;
-				case 'G': aa = 'A'; break;
-				case 'T': aa = 'A'; break;
-			}
-			break;
-		case 'G':
-			switch (codon[2])
-			{
-				case 'A': aa = 'G'; break;
-				case 'C': aa = 'G'; break;
-				case 'G': aa = 'G'; break;
-				case 'T': aa = 'G'; break;
-			}
-			break;
-		case 'T':
-			switch (codon[2])
-			{
-				case 'A': aa = 'V'; break;
-				case 'C': aa = 'V'; break;
-				case 'G': aa = 'V'; break;
-				case 'T': aa = 'V'; break;
-			}
-			break;
-		}
-		break;
-	case 'T':
-		switch (codon[1])
-		{
-		case 'A':
-			switch (codon[2])
-			{
-				case 'A': aa = '*'; break;
-				case 'C': aa = 'Y'; break;
-				case 'G': aa = '*'; break;
-				case 'T': aa = 'Y'; break;
-			}
-			break;
-		case 'C':
-			switch (codon[2])
-			{
-				case 'A': aa = 'S'; break;
-				case 'C': aa = 'S'; break;
-				case 'G': aa = 'S'; break;
-				case 'T': aa = 'S'; break;
-			}
-			break;
-		case 'G':
-			switch (codon[2])
-			{
-				case 'A': aa = '*'; break;
-				case 'C': aa = 'C'; break;
-				case 'G': aa = 'W'; break;
-				case 'T': aa = 'C'; break;
-			}
-			break;
-		case 'T':
-			switch (codon[2])
-			{
-				case 'A': aa = 'L'; break;
-				case 'C': aa = 'F'; break;
-				case 'G': aa = 'L'; break;
-				case 'T': aa = 'F'; break;
-			}
-			break;
-		}
-		break;
+		uint8_t base0 = codes[uint8_t(src[0])];
+		uint8_t base1 = codes[uint8_t(src[1])];
+		uint8_t base2 = codes[uint8_t(src[2])];
+		char aa = codonAminoAcids[(base0 << 4 | base1 << 2 | base2) & 63];
+		
+		dst[a] = ((base0 | base1 | base2) & CodonBases::other) ? '*' : aa;
 	}
+}
+
+char aaFromCodon(const char * codon)
+{
+	char aa;
 	
-	return aa;//(aa == '*') ? 0 : aa;
+	translate(codon, &aa, 1);
+	return aa;
 }
 
 void useThreadOutput(CommandScreen::HashOutput * output, unordered_set<MinHashHeap *> & minHashHeaps)
@@ -19,87 +19,15 @@
 //#include <unordered_map>
 #include "MinHashHeap.h"
 #include "robin_hood.h"
+#include "ScreenIndex.h"
+#include "OutputWriter.h"
 
 namespace mash {
 
-struct HashTableEntry
-{
-	HashTableEntry() : count(0) {}
-	
-	uint32_t count;
-	robin_hood::unordered_set<uint64_t> indices;
-};
-
-//typedef std::unordered_map< uint64_t, HashTableEntry > HashTable;
-typedef robin_hood::unordered_map< uint64_t, robin_hood::unordered_set<uint64_t> > HashTable;
-
-static const robin_hood::unordered_map< std::string, char > codons =
-{
-	{"AAA",	'K'},
-	{"AAC",	'N'},
-	{"AAG",	'K'},
-	{"AAT",	'N'},
-	{"ACA",	'T'},
-	{"ACC",	'T'},
-	{"ACG",	'T'},
-	{"ACT",	'T'},
-	{"AGA",	'R'},
-	{"AGC",	'S'},
-	{"AGG",	'R'},
-	{"AGT",	'S'},
-	{"ATA",	'I'},
-	{"ATC",	'I'},
-	{"ATG",	'M'},
-	{"ATT",	'I'},
-	{"CAA",	'Q'},
-	{"CAC",	'H'},
-	{"CAG",	'Q'},
-	{"CAT",	'H'},
-	{"CCA",	'P'},
-	{"CCC",	'P'},
-	{"CCG",	'P'},
-	{"CCT",	'P'},
-	{"CGA",	'R'},
-	{"CGC",	'R'},
-	{"CGG",	'R'},
-	{"CGT",	'R'},
-	{"CTA",	'L'},
-	{"CTC",	'L'},
-	{"CTG",	'L'},
-	{"CTT",	'L'},
-	{"GAA",	'E'},
-	{"GAC",	'D'},
-	{"GAG",	'E'},
-	{"GAT",	'D'},
-	{"GCA",	'A'},
-	{"GCC",	'A'},
-	{"GCG",	'A'},
-	{"GCT",	'A'},
-	{"GGA",	'G'},
-	{"GGC",	'G'},
-	{"GGG",	'G'},
-	{"GGT",	'G'},
-	{"GTA",	'V'},
-	{"GTC",	'V'},
-	{"GTG",	'V'},
-	{"GTT",	'V'},
-	{"TAA",	'*'},
-	{"TAC",	'Y'},
-	{"TAG",	'*'},
-	{"TAT",	'Y'},
-	{"TCA",	'S'},
-	{"TCC",	'S'},
-	{"TCG",	'S'},
-	{"TCT",	'S'},
-	{"TGA",	'*'},
-	{"TGC",	'C'},
-	{"TGG",	'W'},
-	{"TGT",	'C'},
-	{"TTA",	'L'},
-	{"TTC",	'F'},
-	{"TTG",	'L'},
-	{"TTT",	'F'}
-};
+// The amino acid of each codon, indexed by its bases as 2-bit codes (A, C, G,
+// T as 0-3), first base highest.
+//
+static const char codonAminoAcids[] = "KNKNTTTTRSRSIIMIQHQHPPPPRRRRLLLLEDEDAAAAGGGGVVVV*Y*YSSSS*CWCLFLF";
 
 class CommandScreen : public Command
 {
@@ -107,38 +35,38 @@ public:
     
     struct HashInput
     {
-    	HashInput(robin_hood::unordered_map<uint64_t, std::atomic<uint32_t> > & hashCountsNew, MinHashHeap * minHashHeapNew, char * seqNew, uint64_t lengthNew, const Sketch::Parameters & parametersNew, bool transNew)
+    	HashInput(ScreenIndex & indexNew, MinHashHeap * minHashHeapNew, char * seqNew, uint64_t lengthNew, const Sketch::Parameters & parametersNew, bool transNew)
     	:
-    	hashCounts(hashCountsNew),
-    	minHashHeap(minHashHeapNew),
     	seq(seqNew),
     	length(lengthNew),
+    	trans(transNew),
     	parameters(parametersNew),
-    	trans(transNew)
+    	index(indexNew),
+    	minHashHeap(minHashHeapNew)
     	{}
     	
-    	HashInput(mash::fa::FastaChunk *fachunkNew, mash::fa::FastaDataPool * fastaPoolNew, robin_hood::unordered_map<uint64_t, std::atomic<uint32_t> > & hashCountsNew, MinHashHeap * minHashHeapNew, const Sketch::Parameters & parametersNew, bool transNew, bool isFANew, bool isFQNew)
+    	HashInput(mash::fa::FastaChunk *fachunkNew, mash::fa::FastaDataPool * fastaPoolNew, ScreenIndex & indexNew, MinHashHeap * minHashHeapNew, const Sketch::Parameters & parametersNew, bool transNew, bool isFANew, bool isFQNew)
 		:
-		fachunk(fachunkNew),
-		fastaPool(fastaPoolNew),
-    	hashCounts(hashCountsNew),
-    	minHashHeap(minHashHeapNew),
-    	parameters(parametersNew),
     	trans(transNew),
+    	parameters(parametersNew),
+    	index(indexNew),
+    	minHashHeap(minHashHeapNew),
 		isFA(isFANew),
-		isFQ(isFQNew)
+		isFQ(isFQNew),
+		fachunk(fachunkNew),
+		fastaPool(fastaPoolNew)
 		{}
 
-    	HashInput(mash::fq::FastqChunk *fqchunkNew, mash::fq::FastqDataPool * fastqPoolNew, robin_hood::unordered_map<uint64_t, std::atomic<uint32_t> > & hashCountsNew, MinHashHeap * minHashHeapNew, const Sketch::Parameters & parametersNew, bool transNew, bool isFANew, bool isFQNew)
+    	HashInput(mash::fq::FastqChunk *fqchunkNew, mash::fq::FastqDataPool * fastqPoolNew, ScreenIndex & indexNew, MinHashHeap * minHashHeapNew, const Sketch::Parameters & parametersNew, bool transNew, bool isFANew, bool isFQNew)
 		:
-		fqchunk(fqchunkNew),
-		fastqPool(fastqPoolNew),
-    	hashCounts(hashCountsNew),
-    	minHashHeap(minHashHeapNew),
-    	parameters(parametersNew),
     	trans(transNew),
+    	parameters(parametersNew),
+    	index(indexNew),
+    	minHashHeap(minHashHeapNew),
 		isFA(isFANew),
-		isFQ(isFQNew)
+		isFQ(isFQNew),
+		fqchunk(fqchunkNew),
+		fastqPool(fastqPoolNew)
 		{}
 
     	~HashInput()
@@ -156,7 +84,7 @@ public:
     	bool trans;
     	
     	Sketch::Parameters parameters;
-		robin_hood::unordered_map<uint64_t, std::atomic<uint32_t> > & hashCounts;
+		ScreenIndex & index; // counts the hashes
 		MinHashHeap * minHashHeap;
 
 		bool isFA;
@@ -185,6 +113,12 @@ public:
 
 private:
 	
+	// screens one sample (the hashes of the mixtures against those in index)
+	//
+	int screen(const Sketch & sketch, ScreenIndex & index, const std::vector<std::string> & mixtures, const Sketch::Parameters & parameters, bool trans, OutputWriter & writer) const;
+	
+	int screenBatch(const Sketch & sketch, ScreenIndex & index, const Sketch::Parameters & parameters, bool trans) const;
+	
 	struct Reference
 	{
 		Reference(uint64_t amerCountNew, std::string nameNew, std::string commentNew)
@@ -198,8 +132,16 @@ private:
 
 char aaFromCodon(const char * codon);
 double estimateIdentity(uint64_t common, uint64_t denom, int kmerSize, double kmerSpace);
+
+// Collects the counts (at least minCov) of each query's hashes in the mixture
+// (unless depths is null), giving how many it shares; with winners (by slot),
+// only those of hashes it won.
+//
+void gatherDepths(const Sketch & sketch, const ScreenIndex & index, uint32_t minCov, const uint32_t * winners, uint64_t * shared, std::vector<uint64_t> * depths, int threads);
+
 CommandScreen::HashOutput * hashSequence(CommandScreen::HashInput * input);
 CommandScreen::HashOutput * hashSequenceChunk(CommandScreen::HashInput * input);
+void readAhead(const std::vector<std::string> & files); // starts reading files into the page cache
 double pValueWithin(uint64_t x, uint64_t setSize, double kmerSpace, uint64_t sketchSize);
 void translate(const char * src, char * dst, uint64_t len);
 void useThreadOutput(CommandScreen::HashOutput * output, robin_hood::unordered_set<MinHashHeap *> & minHashHeaps);
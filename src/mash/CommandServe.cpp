@@ -0,0 +1,695 @@
+// Copyright © 2015, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen,
+// Sergey Koren, and Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#include "CommandServe.h"
+#include "CommandDistance.h"
+#include "CommandScreen.h"
+#include "Numa.h"
+#include "OutputWriter.h"
+#include "ScreenIndex.h"
+#include "Sketch.h"
+#include <zlib.h>
+#include "kseq.h"
+#include <algorithm>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+KSEQ_INIT(gzFile, gzread)
+
+using namespace::std;
+
+namespace mash {
+
+static const uint64_t requestLineMax = 1 << 16;
+
+struct Server
+{
+	Server(int threadsNew)
+		:
+		threads(threadsNew),
+		comparePool(compare, threadsNew)
+	{}
+
+	Sketch sketch; // the references
+	Sketch::Parameters parameters; // theirs, for sketching queries
+	int threads;
+
+	// Comparisons run on one pool, a request at a time (each over all of its
+	// threads), while other connections read and sketch their queries.
+	//
+	ThreadPool<CommandDistance::CompareInput, CommandDistance::CompareOutput> comparePool;
+	unique_ptr<CommandDistance::CompareTables> tables; // for queries of the references' sketch size
+	mutex compareMutex;
+
+	// Built (or mapped, if <references>.msi is there) for the first screen.
+	// The index keeps the counts of one mixture, so screens take turns.
+	//
+	ScreenIndex index;
+	bool indexReady = false;
+	bool trans = false;
+	mutex screenMutex;
+	string indexFile;
+};
+
+struct Request
+{
+	string command;
+	vector<string> files; // if none, the sequences follow the request line
+	uint64_t top = 0;
+	double distanceMax = 1;
+	double pValueMax = 1;
+	double identityMin = 0;
+	bool comment = false;
+};
+
+CommandServe::CommandServe()
+: Command()
+{
+	name = "serve";
+	summary = "Answer dist and screen requests against references kept in memory.";
+	description = "Load a reference sketch once and answer requests over a local socket at <socket>, so each query does not pay for loading the references. Each connection is one request: a line with \"dist\" or \"screen\", options and (optionally) query files, then, if no files were given, the query's sequences (fasta or fastq, gzipped or not) until the client shuts down its side of the connection. The reply is the output \"mash dist <references> <query>\" or \"mash screen <references> <mixture>\" would print, or a line starting with \"ERROR:\", and the connection is then closed. Options of dist requests are -top <int>, -d <number>, -v <number> and -C, and of screen requests -i <number> and -v <number>, as those of the commands. Query files are paths readable by the server; for dist they can be sketches (.msh), each of their sketches being a query, or sequence files, each being one query. Requests are handled concurrently: comparisons of each dist request run over all threads, one request at a time, and screens take turns with each other.";
+	argumentString = "<socket> <references>.msh";
+
+	useOption("help");
+	useOption("threads");
+	useOption("numa");
+}
+
+static bool readLine(int fd, string & line)
+{
+	char c;
+
+	while ( true )
+	{
+		ssize_t bytes = read(fd, &c, 1);
+
+		if ( bytes < 0 && errno == EINTR )
+		{
+			continue;
+		}
+
+		if ( bytes <= 0 || line.size() > requestLineMax )
+		{
+			return false;
+		}
+
+		if ( c == '\n' )
+		{
+			if ( line.size() && line.back() == '\r' )
+			{
+				line.pop_back();
+			}
+
+			return true;
+		}
+
+		line.push_back(c);
+	}
+}
+
+static void sendAll(int fd, const string & text)
+{
+	const char * data = text.data();
+	uint64_t left = text.size();
+
+	while ( left > 0 )
+	{
+		ssize_t bytes = send(fd, data, left, MSG_NOSIGNAL);
+
+		if ( bytes < 0 && errno == EINTR )
+		{
+			continue;
+		}
+
+		if ( bytes <= 0 )
+		{
+			return; // client gone
+		}
+
+		data += bytes;
+		left -= bytes;
+	}
+}
+
+static bool parseNumber(const vector<string> & tokens, uint64_t & i, double & value, string & error)
+{
+	if ( i + 1 == tokens.size() )
+	{
+		error = tokens[i] + " requires a value";
+		return false;
+	}
+
+	char * end;
+	value = strtod(tokens[++i].c_str(), &end);
+
+	if ( *end != 0 )
+	{
+		error = "bad value for " + tokens[i - 1] + ": " + tokens[i];
+		return false;
+	}
+
+	return true;
+}
+
+static bool parseRequest(const string & line, Request & request, string & error)
+{
+	istringstream stream(line);
+	vector<string> tokens;
+	string token;
+
+	while ( stream >> token )
+	{
+		tokens.push_back(token);
+	}
+
+	if ( tokens.size() == 0 || (tokens[0] != "dist" && tokens[0] != "screen") )
+	{
+		error = "requests start with \"dist\" or \"screen\"";
+		return false;
+	}
+
+	request.command = tokens[0];
+	bool dist = request.command == "dist";
+
+	for ( uint64_t i = 1; i < tokens.size(); i++ )
+	{
+		const string & option = tokens[i];
+		double value;
+
+		if ( option.size() < 2 || option[0] != '-' )
+		{
+			request.files.push_back(option);
+		}
+		else if ( dist && option == "-C" )
+		{
+			request.comment = true;
+		}
+		else if ( ! parseNumber(tokens, i, value, error) )
+		{
+			return false;
+		}
+		else if ( dist && option == "-top" && value >= 0 && value == uint64_t(value) )
+		{
+			request.top = value;
+		}
+		else if ( dist && option == "-d" && value >= 0 && value <= 1 )
+		{
+			request.distanceMax = value;
+		}
+		else if ( option == "-v" && value >= 0 && value <= 1 )
+		{
+			request.pValueMax = value;
+		}
+		else if ( ! dist && option == "-i" && value >= -1 && value <= 1 )
+		{
+			request.identityMin = value;
+		}
+		else
+		{
+			error = "bad option for " + request.command + ": " + option + " " + tokens[i];
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// Reads the records of file (gzipped or not), calling use(kseq) for each.
+//
+template <class Use>
+static void readSequences(gzFile file, const Use & use)
+{
+	kseq_t * kseq = kseq_init(file);
+
+	while ( kseq_read(kseq) >= 0 )
+	{
+		use(kseq);
+	}
+
+	kseq_destroy(kseq);
+	gzclose(file);
+}
+
+// Sketches the records of file as one query, named as mash sketch names the
+// sketch of a file (or of "-", for the sequences sent after the request).
+//
+static void sketchRecords(gzFile file, const string & name, const Sketch::Parameters & parameters, Sketch::Reference & reference)
+{
+	MinHashHeap minHashHeap(parameters.use64, parameters.minHashesPerWindow);
+	uint64_t count = 0;
+
+	reference.name = name;
+	reference.length = 0;
+	reference.hashesSorted.setUse64(parameters.use64);
+
+	readSequences(file, [&](kseq_t * kseq)
+	{
+		char * seq = kseq->seq.s;
+		uint64_t l = kseq->seq.l;
+
+		if ( l < uint64_t(parameters.kmerSize) )
+		{
+			return;
+		}
+
+		if ( ! parameters.preserveCase )
+		{
+			for ( uint64_t i = 0; i < l; i++ )
+			{
+				if ( seq[i] > 96 && seq[i] < 123 )
+				{
+					seq[i] -= 32;
+				}
+			}
+		}
+
+		if ( count == 0 && name == "-" )
+		{
+			reference.name = kseq->name.s;
+			reference.comment = kseq->comment.s ? kseq->comment.s : "";
+		}
+		else if ( count == 0 )
+		{
+			reference.comment = kseq->name.s;
+			reference.comment.append(" ");
+			reference.comment.append(kseq->comment.s ? kseq->comment.s : "");
+		}
+
+		addMinHashes(minHashHeap, seq, l, parameters);
+		reference.length += l;
+		count++;
+	});
+
+	if ( count > 1 )
+	{
+		reference.comment.insert(0, "[" + to_string(count) + " seqs] ");
+		reference.comment.append(" [...]");
+	}
+
+	setMinHashesForReference(reference, minHashHeap);
+}
+
+// Gives the queries of a dist request, or why it cannot be answered. Query
+// sequences are read here rather than by Sketch::initFromFiles(), which
+// exits on unreadable input, and query sketches are checked before it loads
+// them.
+//
+static string loadQueries(const Server & server, const Request & request, int fd, Sketch & sketchQuery)
+{
+	Sketch::Parameters parameters = server.parameters;
+	vector<Sketch::Reference> references;
+
+	parameters.parallelism = 1; // sketching queries does not hold up the others
+	parameters.mapped = false; // the references are copied out
+
+	if ( request.files.size() == 0 )
+	{
+		references.resize(1);
+		sketchRecords(gzdopen(dup(fd), "r"), "-", parameters, references[0]);
+	}
+
+	for ( size_t i = 0; i < request.files.size(); i++ )
+	{
+		const string & file = request.files[i];
+
+		if ( access(file.c_str(), R_OK) != 0 )
+		{
+			return "could not read " + file;
+		}
+
+		if ( ! hasSuffix(file, suffixSketch) )
+		{
+			references.resize(references.size() + 1);
+			sketchRecords(gzopen(file.c_str(), "r"), file, parameters, references.back());
+			continue;
+		}
+
+		// checked before loading, which exits on a bad file or skips (with
+		// only a warning) one with different parameters
+		//
+		Sketch sketchTest;
+		Sketch sketch;
+		vector<string> files(1, file);
+		string alphabet;
+		string alphabetRef;
+		string error;
+
+		if ( ! Sketch::checkCapnp(file.c_str(), error) )
+		{
+			return file + " " + error;
+		}
+
+		sketchTest.initParametersFromCapnp(file.c_str());
+		sketchTest.getAlphabetAsString(alphabet);
+		server.sketch.getAlphabetAsString(alphabetRef);
+
+		if ( sketchTest.getKmerSize() != server.sketch.getKmerSize() || sketchTest.getHashSeed() != server.sketch.getHashSeed() || alphabet != alphabetRef || sketchTest.getNoncanonical() != server.sketch.getNoncanonical() )
+		{
+			return file + " was sketched with different options (k-mer size, seed or alphabet) than the references";
+		}
+
+		if ( sketchTest.getMinHashesPerWindow() < parameters.minHashesPerWindow )
+		{
+			return file + " has a smaller sketch size than the references";
+		}
+
+		sketch.initFromFiles(files, parameters);
+
+		for ( uint64_t j = 0; j < sketch.getReferenceCount(); j++ )
+		{
+			references.push_back(sketch.getReference(j));
+		}
+	}
+
+	sketchQuery.initFromReferences(references, parameters);
+	return "";
+}
+
+static string dist(Server & server, const Request & request, int fd)
+{
+	const Sketch & sketchRef = server.sketch;
+	const Sketch::Parameters & parameters = server.parameters;
+	Sketch sketchQuery;
+	string error = loadQueries(server, request, fd, sketchQuery);
+
+	if ( error.size() )
+	{
+		return "ERROR: " + error + "\n";
+	}
+
+
+	uint64_t pairTotal = sketchRef.getReferenceCount() * sketchQuery.getReferenceCount();
+	uint64_t pairsPerThread = max(pairTotal / server.threads, uint64_t(1));
+	uint64_t sketchSize = min(sketchRef.getMinHashesPerWindow(), sketchQuery.getMinHashesPerWindow());
+
+	if ( pairsPerThread > 0x10000 )
+	{
+		pairsPerThread = 0x10000;
+	}
+
+	unique_ptr<CommandDistance::CompareTables> tablesOwn;
+	const CommandDistance::CompareTables * tables = server.tables.get();
+
+	if ( sketchSize != tables->sketchSize )
+	{
+		tablesOwn.reset(new CommandDistance::CompareTables(sketchSize, sketchRef.getKmerSize()));
+		tables = tablesOwn.get();
+	}
+
+	string text;
+	vector<CommandDistance::CompareOutput::BestPair> pending;
+
+	auto useOutput = [&](CommandDistance::CompareOutput * output, bool last)
+	{
+		if ( request.top != 0 )
+		{
+			mergeBest(output, pending, request.top, last);
+		}
+
+		formatOutput(output, false, request.comment);
+		text.append(output->text);
+		delete output;
+	};
+
+	lock_guard<mutex> lock(server.compareMutex);
+
+	for ( uint64_t pair = 0; pair < pairTotal; pair += pairsPerThread )
+	{
+		CommandDistance::CompareInput * input = new CommandDistance::CompareInput(sketchRef, sketchQuery, pair % sketchRef.getReferenceCount(), pair / sketchRef.getReferenceCount(), min(pairsPerThread, pairTotal - pair), parameters, request.distanceMax, request.pValueMax);
+
+		input->top = request.top;
+		input->tables = tables;
+
+		server.comparePool.runWhenThreadAvailable(input);
+
+		while ( server.comparePool.outputAvailable() )
+		{
+			useOutput(server.comparePool.popOutputWhenAvailable(), false);
+		}
+	}
+
+	while ( server.comparePool.running() )
+	{
+		useOutput(server.comparePool.popOutputWhenAvailable(), false);
+	}
+
+	if ( pending.size() )
+	{
+		useOutput(new CommandDistance::CompareOutput(sketchRef, sketchQuery, 0, 0, 0), true);
+	}
+
+	return text;
+}
+
+static string screen(Server & server, const Request & request, int fd)
+{
+	const Sketch & sketch = server.sketch;
+	const Sketch::Parameters & parameters = server.parameters;
+
+	for ( size_t i = 0; i < request.files.size(); i++ )
+	{
+		if ( access(request.files[i].c_str(), R_OK) != 0 )
+		{
+			return "ERROR: could not read " + request.files[i] + "\n";
+		}
+	}
+
+	lock_guard<mutex> lock(server.screenMutex);
+
+	if ( ! server.indexReady )
+	{
+		string error;
+
+		if ( ! server.index.open(server.indexFile, sketch, error) )
+		{
+			server.index.build(sketch, server.threads);
+		}
+
+		server.indexReady = true;
+	}
+
+	ScreenIndex & index = server.index;
+	MinHashHeap minHashHeap(parameters.use64, parameters.minHashesPerWindow);
+
+	auto hash = [&](kseq_t * kseq)
+	{
+		// the input takes the copy (and uppercases it)
+		//
+		char * seq = new char[kseq->seq.l];
+		memcpy(seq, kseq->seq.s, kseq->seq.l);
+
+		CommandScreen::HashInput input(index, &minHashHeap, seq, kseq->seq.l, parameters, server.trans);
+		delete hashSequence(&input);
+	};
+
+	for ( size_t i = 0; i < request.files.size(); i++ )
+	{
+		readSequences(gzopen(request.files[i].c_str(), "r"), hash);
+	}
+
+	if ( request.files.size() == 0 )
+	{
+		readSequences(gzdopen(dup(fd), "r"), hash);
+	}
+
+	uint64_t count = sketch.getReferenceCount();
+	vector<uint64_t> shared(count);
+	vector<vector<uint64_t>> depths(count);
+
+	gatherDepths(sketch, index, 1, 0, shared.data(), depths.data(), server.threads);
+	index.clearCounts(server.threads);
+
+	uint64_t setSize = minHashHeap.estimateSetSize();
+	string text;
+
+	for ( uint64_t i = 0; i < count; i++ )
+	{
+		const Sketch::Reference & reference = sketch.getReference(i);
+
+		if ( shared[i] == 0 && request.identityMin >= 0 )
+		{
+			continue;
+		}
+
+		double identity = estimateIdentity(shared[i], reference.hashesSorted.size(), sketch.getKmerSize(), sketch.getKmerSpace());
+
+		if ( identity < request.identityMin )
+		{
+			continue;
+		}
+
+		double pValue = pValueWithin(shared[i], setSize, sketch.getKmerSpace(), reference.hashesSorted.size());
+
+		if ( pValue > request.pValueMax )
+		{
+			continue;
+		}
+
+		uint64_t median = 0;
+
+		if ( shared[i] > 0 )
+		{
+			nth_element(depths[i].begin(), depths[i].begin() + shared[i] / 2, depths[i].end());
+			median = depths[i][shared[i] / 2];
+		}
+
+		appendDouble(text, identity);
+		text.push_back('\t');
+		appendInteger(text, shared[i]);
+		text.push_back('/');
+		appendInteger(text, reference.hashesSorted.size());
+		text.push_back('\t');
+		appendInteger(text, median);
+		text.push_back('\t');
+		appendDouble(text, pValue);
+		text.push_back('\t');
+		text.append(reference.name);
+		text.push_back('\t');
+		text.append(reference.comment);
+		text.push_back('\n');
+	}
+
+	return text;
+}
+
+static void handleConnection(Server * server, int fd)
+{
+	string line;
+	Request request;
+	string error;
+
+	if ( ! readLine(fd, line) )
+	{
+		sendAll(fd, "ERROR: no request line\n");
+	}
+	else if ( ! parseRequest(line, request, error) )
+	{
+		sendAll(fd, "ERROR: " + error + "\n");
+	}
+	else if ( request.command == "dist" )
+	{
+		sendAll(fd, dist(*server, request, fd));
+	}
+	else
+	{
+		sendAll(fd, screen(*server, request, fd));
+	}
+
+	close(fd);
+}
+
+int CommandServe::run() const
+{
+	if ( arguments.size() != 2 || options.at("help").active )
+	{
+		print();
+		return 0;
+	}
+
+	const string & socketFile = arguments[0];
+	const string & fileReference = arguments[1];
+
+	if ( ! hasSuffix(fileReference, suffixSketch) )
+	{
+		cerr << "ERROR: " << fileReference << " does not look like a sketch (.msh)" << endl;
+		return 1;
+	}
+
+	sockaddr_un address;
+
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+
+	if ( socketFile.size() >= sizeof(address.sun_path) )
+	{
+		cerr << "ERROR: The socket path " << socketFile << " is too long." << endl;
+		return 1;
+	}
+
+	strcpy(address.sun_path, socketFile.c_str());
+
+	int threads = options.at("threads").getArgumentAsNumber();
+	Server server(threads);
+	Sketch::Parameters & parameters = server.parameters;
+
+	cerr << "Loading " << fileReference << "..." << endl;
+
+	parameters.parallelism = threads;
+	parameters.mapped = ! getNumaEnabled(); // see CommandDistance
+
+	vector<string> refArgVector(1, fileReference);
+
+	if ( server.sketch.initFromFiles(refArgVector, parameters) )
+	{
+		return 1;
+	}
+
+	const Sketch & sketch = server.sketch;
+	string alphabet;
+
+	sketch.getAlphabetAsString(alphabet);
+	setAlphabetFromString(parameters, alphabet.c_str());
+
+	parameters.minHashesPerWindow = sketch.getMinHashesPerWindow();
+	parameters.kmerSize = sketch.getKmerSize();
+	parameters.noncanonical = sketch.getNoncanonical();
+	parameters.preserveCase = sketch.getPreserveCase();
+	parameters.seed = sketch.getHashSeed();
+	parameters.use64 = sketch.getUse64();
+
+	server.tables.reset(new CommandDistance::CompareTables(sketch.getMinHashesPerWindow(), sketch.getKmerSize()));
+	server.trans = alphabet == alphabetProtein;
+	server.indexFile = ScreenIndex::indexFile(fileReference);
+
+	int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	struct stat existing;
+
+	if ( stat(socketFile.c_str(), &existing) == 0 && S_ISSOCK(existing.st_mode) )
+	{
+		unlink(socketFile.c_str()); // left by a server that is gone
+	}
+
+	if ( listener < 0 || ::bind(listener, (sockaddr *)&address, sizeof(address)) != 0 || listen(listener, 64) != 0 )
+	{
+		cerr << "ERROR: Could not listen on " << socketFile << " (" << strerror(errno) << ")." << endl;
+		return 1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	cerr << "Serving " << sketch.getReferenceCount() << " references on " << socketFile << endl;
+
+	while ( true )
+	{
+		int fd = accept(listener, 0, 0);
+
+		if ( fd < 0 )
+		{
+			if ( errno == EINTR || errno == ECONNABORTED )
+			{
+				continue;
+			}
+
+			cerr << "ERROR: Could not accept connections (" << strerror(errno) << ")." << endl;
+			close(listener);
+			return 1;
+		}
+
+		thread(handleConnection, &server, fd).detach();
+	}
+}
+
+} // namespace mash
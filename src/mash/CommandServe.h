@@ -0,0 +1,32 @@
+// Copyright © 2015, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen,
+// Sergey Koren, and Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#ifndef INCLUDED_CommandServe
+#define INCLUDED_CommandServe
+
+#include "Command.h"
+
+namespace mash {
+
+// Keeps a reference sketch loaded and answers dist and screen requests
+// against it over a local (Unix domain) socket, so on-demand queries do not
+// pay for loading it each time. Each connection is one request: a line of
+// the request and its options, then (unless it names query files) the
+// query's sequences until the client shuts down its side; the reply is the
+// output the command would give, and the server closes the connection.
+
+class CommandServe : public Command
+{
+public:
+
+    CommandServe();
+
+    int run() const; // override
+};
+
+} // namespace mash
+
+#endif
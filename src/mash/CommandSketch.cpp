@@ -6,7 +6,10 @@
 
 #include "CommandSketch.h"
 #include "Sketch.h"
+#include "HyperLogLog.h"
+#include "fastx/ChunkSizer.h"
 #include "sketchParameterSetup.h"
+#include "simd.h"
 #include <iostream>
 #include <sys/time.h>
 
@@ -31,30 +34,28 @@ CommandSketch::CommandSketch()
     addOption("id", Option(Option::File, "I", "Sketch", "ID field for sketch of reads (instead of first sequence ID).", ""));
     addOption("comment", Option(Option::File, "C", "Sketch", "Comment for a sketch of reads (instead of first sequence comment).", ""));
 	addOption("freeMemory", Option(Option::Boolean, "fw", "Output", "free the memory by writeToCpanp to several subfiles intermediately.", ""));
+    addOption("pack", Option(Option::Boolean, "pack", "Output", "Write the hashes delta-encoded and bit-packed, which makes the sketch file smaller (by more for larger sketches, e.g. about 10% at -s 1000 and 20% at -s 100000 for 64-bit hashes) and is decoded with SIMD instructions when loaded. Such files start with a marker that versions of Mash before this option fail to read, rather than reading empty sketches. Cannot be appended (-append) to files written without it.", ""));
+    addOption("prefetch", Option(Option::Integer, "prefetch", "Input", "Read up to this many input files into memory ahead of sketching them, which helps when there are many files on storage with high latency (e.g. network file systems). Files split into chunks and standard input are read as usual. 0 to read each file as it is sketched.", "0", 0, 1024));
+    addOption("hll", Option(Option::Integer, "hll", "Sketch", "Also keep HyperLogLog registers of all k-mers of each sketch, 2^<int> bytes (4-16; 12 for about 1.6% error), which estimate distinct k-mers however small the sketch is. With dist -prefilter, pairs whose sizes differ too much to pass -d are then skipped, and within -hll scores containment with them. 0 for none.", "0", 0, 16));
+    addOption("chunk", Option(Option::Size, "chunk", "Input", "Size of the chunks that large files are split into for threads (raw bytes or with K/M/G/T), rather than adapting it to how fast they are hashed and shrinking it toward the end of each file. For benchmarking. 0 to adapt.", "0"));
+    addOption("chunkMemory", Option(Option::Size, "chunkmem", "Input", "Memory for the chunks of large files being read and sketched (raw bytes or with K/M/G/T). More lets chunks of long sequences grow (up to 16M) while keeping one read ahead for each thread. -stats reports the sizes used.", "256M"));
+    useOption("index");
+    useOption("append");
     useSketchOptions();
 }
 
 int CommandSketch::run() const
 {
-#if defined __AVX512F__ && defined __AVX512CD__
-		cerr << "Using AVX512 instructions" << endl;
-#else 
-#if defined __AVX2__
-		cerr << "Using AVX2 instructions" << endl;
-		//TODO: implement by avx2
-#else
-#if defined __SSE4_1__
-		//cerr << "Using SSE4 instructions" << endl;
-		//cerr << "Not implemented yet! Please use:" << endl;
-		//cerr << "./configure --disable-simd" << endl;
-		cerr << "No SIMD instructions used" << endl;
-		//TODO:implement by sse
-#else
+	// sketching has no SSE4 kernel
+	//
+	if ( getSimdKernels().hashWidth == 1 )
+	{
 		cerr << "No SIMD instructions used" << endl;
-		//implement without optimization
-#endif
-#endif
-#endif
+	}
+	else
+	{
+		cerr << "Using " << getSimdLevelName(getSimdKernels().level) << " instructions" << endl;
+	}
 
     if ( arguments.size() == 0 || options.at("help").active )
     {
@@ -74,6 +75,24 @@ int CommandSketch::run() const
    
    	if(getOption("freeMemory").active)
 		parameters.freeMemory = true;
+	
+	parameters.packed = getOption("pack").active;
+	parameters.prefetch = getOption("prefetch").getArgumentAsNumber();
+	parameters.hll = getOption("hll").getArgumentAsNumber();
+	parameters.chunkSize = getOption("chunk").getArgumentAsNumber();
+	parameters.chunkMemory = getOption("chunkMemory").getArgumentAsNumber();
+	
+	if ( parameters.chunkSize != 0 && (parameters.chunkSize < mash::core::ChunkSizer::MinSize || parameters.chunkSize > mash::core::ChunkSizer::MaxSize) )
+	{
+		cerr << "ERROR: -" << getOption("chunk").identifier << " must be 0 or from " << mash::core::ChunkSizer::MinSize << " to " << mash::core::ChunkSizer::MaxSize << "." << endl;
+		return 1;
+	}
+	
+	if ( parameters.hll != 0 && parameters.hll < hllPrecisionMin )
+	{
+		cerr << "ERROR: -hll must be 0 or from " << hllPrecisionMin << " to " << hllPrecisionMax << "." << endl;
+		return 1;
+	}
 
     for ( int i = 0; i < arguments.size(); i++ )
     {
@@ -114,12 +133,62 @@ int CommandSketch::run() const
     	}
     }
     
+    string prefix;
+    
+    if ( options.at("prefix").argument.length() > 0 )
+    {
+        prefix = options.at("prefix").argument;
+    }
+    else
+    {
+        if ( arguments[0] == "-" )
+        {
+            prefix = "stdin";
+        }
+        else
+        {
+            prefix = arguments[0];
+        }
+    }
+    
+    string suffix = parameters.windowed ? suffixSketchWindowed : suffixSketch;
+    
+    if ( ! hasSuffix(prefix, suffix) )
+    {
+        prefix += suffix;
+    }
+    
+    bool append = getOption("append").active;
+    
+    if ( append && (parameters.windowed || parameters.freeMemory) )
+    {
+    	cerr << "ERROR: -append cannot be used with -W or -fw." << endl;
+    	return 1;
+    }
+    
+    // write sketches out as they finish rather than holding them all
+    //
+    bool stream = ! parameters.reads && ! parameters.windowed && ! parameters.freeMemory;
+    
     if ( parameters.reads )
     {
     	sketch.initFromReads(files, parameters);
+    	
+    	if ( append )
+    	{
+    		// written by finishStream() all at once
+    		//
+    		sketch.setStreamFile(prefix, true);
+    		stream = true;
+    	}
     }
     else
     {
+    	if ( stream )
+    	{
+    		sketch.setStreamFile(prefix, append);
+    	}
+    	
 	    sketch.initFromFiles(files, parameters, verbosity);
 	}
 	
@@ -153,34 +222,29 @@ int CommandSketch::run() const
 		}
 	}
 	
-    string prefix;
-    
-    if ( options.at("prefix").argument.length() > 0 )
-    {
-        prefix = options.at("prefix").argument;
-    }
-    else
-    {
-        if ( arguments[0] == "-" )
-        {
-            prefix = "stdin";
-        }
-        else
-        {
-            prefix = arguments[0];
-        }
-    }
-    
-    string suffix = parameters.windowed ? suffixSketchWindowed : suffixSketch;
-    
-    if ( ! hasSuffix(prefix, suffix) )
-    {
-        prefix += suffix;
-    }
-    
-    cerr << "Writing to " << prefix << "..." << endl;
+    cerr << (append ? "Appending to " : "Writing to ") << prefix << "..." << endl;
    	double t1 = get_sec(); 
-    sketch.writeToCapnp(prefix.c_str());
+   	
+   	if ( stream )
+   	{
+   		sketch.finishStream();
+   	}
+   	else
+   	{
+	    sketch.writeToCapnp(prefix.c_str());
+	}
+	
+	if ( getOption("index").active )
+	{
+		if ( append )
+		{
+			Sketch::writeIndexFromFile(prefix.c_str());
+		}
+		else
+		{
+			sketch.writeIndex(prefix.c_str());
+		}
+	}
    	double t2 = get_sec(); 
 	//cerr << "the time of writeToCapnp is: " << t2 - t1 << endl;
     
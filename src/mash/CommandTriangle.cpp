@@ -7,11 +7,20 @@
 #include "CommandDistance.h"
 #include "CommandTriangle.h"
 #include "Sketch.h"
+#include "HyperLogLog.h"
 #include <iostream>
 #include <zlib.h>
 #include "ThreadPool.h"
 #include "sketchParameterSetup.h"
+#include "Shard.h"
+#include "Condensed.h"
+#include "Checkpoint.h"
 #include <math.h>
+#include <deque>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #ifdef USE_BOOST
     #include <boost/math/distributions/binomial.hpp>
@@ -25,6 +34,276 @@ using namespace::std;
 
 namespace mash {
 
+// Checks that file is the Result output of a triangle run over the first
+// countOld inputs with the same output options, for -extend.
+//
+static bool checkExtendResults(const string & file, uint64_t countOld, bool edge, double distanceMax, double pValueMax)
+{
+    if ( isCondensedFile(file) || isShardFile(file) )
+    {
+        cerr << "ERROR: " << file << " is a condensed matrix or a shard, and can only be extended by a run with the same options (see -condensed)." << endl;
+        return false;
+    }
+    
+    FILE * stream = fopen(file.c_str(), "rb");
+    struct stat fileInfo;
+    uint64_t isEdge;
+    double distanceMaxOld;
+    double pValueMaxOld;
+    
+    if ( stream == NULL || fstat(fileno(stream), &fileInfo) != 0 )
+    {
+        cerr << "ERROR: could not open " << file << "." << endl;
+        return false;
+    }
+    
+    bool header =
+        fread(&isEdge, sizeof(uint64_t), 1, stream) == 1 &&
+        fread(&distanceMaxOld, sizeof(double), 1, stream) == 1 &&
+        fread(&pValueMaxOld, sizeof(double), 1, stream) == 1;
+    
+    uint64_t headerSize = sizeof(uint64_t) + 2 * sizeof(double);
+    uint64_t records = header ? (fileInfo.st_size - headerSize) / sizeof(CommandTriangle::Result) : 0;
+    CommandTriangle::Result last;
+    
+    last.refID = 0;
+    
+    if ( header && records > 0 )
+    {
+        fseek(stream, headerSize + (records - 1) * sizeof(CommandTriangle::Result), SEEK_SET);
+        header = fread(&last, sizeof(CommandTriangle::Result), 1, stream) == 1;
+    }
+    
+    fclose(stream);
+    
+    if ( ! header || (fileInfo.st_size - headerSize) % sizeof(CommandTriangle::Result) != 0 )
+    {
+        cerr << "ERROR: " << file << " is incomplete or not the binary output of triangle." << endl;
+        return false;
+    }
+    
+    if ( isEdge != (edge ? 1 : 0) || distanceMaxOld != distanceMax || pValueMaxOld != pValueMax )
+    {
+        cerr << "ERROR: " << file << " was made with different output options (-E, -d, -v); extend it with the same ones." << endl;
+        return false;
+    }
+    
+    if ( edge ? uint64_t(last.refID) >= countOld : records != countOld * (countOld - 1) / 2 )
+    {
+        cerr << "ERROR: " << file << " is not the output of the first " << countOld << " inputs." << endl;
+        return false;
+    }
+    
+    return true;
+}
+
+// Checks that file is a condensed matrix of the first countOld inputs, made
+// with the same options as header (the layout for all of them), and moves
+// its p-value plane (if any) to where the header puts it, for -extend.
+//
+static bool extendCondensed(const string & file, uint64_t countOld, const CondensedHeader & header)
+{
+    CondensedHeader old;
+    
+    {
+        CondensedMatrix matrix;
+        
+        if ( ! matrix.open(file) )
+        {
+            cerr << "ERROR: " << matrix.getError() << "." << endl;
+            return false;
+        }
+        
+        old = matrix.getHeader();
+    }
+    
+    if ( old.distanceType != header.distanceType || (old.pValueOffset != 0) != (header.pValueOffset != 0) || old.kmerSize != header.kmerSize || old.sketchSize != header.sketchSize || old.seed != header.seed )
+    {
+        cerr << "ERROR: " << file << " was made with different options (-condensed, -pplane or sketching); extend it with the same ones." << endl;
+        return false;
+    }
+    
+    if ( old.count != countOld )
+    {
+        cerr << "ERROR: " << file << " holds " << old.count << " sketches, not " << countOld << "." << endl;
+        return false;
+    }
+    
+    if ( old.pValueOffset == 0 || old.pValueOffset == header.pValueOffset )
+    {
+        return true;
+    }
+    
+    // the plane only moves later in the file, so copy from its end
+    //
+    int fd = open(file.c_str(), O_RDWR);
+    vector<char> buffer(1 << 20);
+    uint64_t remaining = old.pairCount * sizeof(double);
+    bool good = fd >= 0;
+    
+    while ( good && remaining > 0 )
+    {
+        uint64_t bytes = min(remaining, uint64_t(buffer.size()));
+        
+        remaining -= bytes;
+        good =
+            pread(fd, buffer.data(), bytes, old.pValueOffset + remaining) == ssize_t(bytes) &&
+            pwrite(fd, buffer.data(), bytes, header.pValueOffset + remaining) == ssize_t(bytes);
+    }
+    
+    if ( fd >= 0 )
+    {
+        close(fd);
+    }
+    
+    if ( ! good )
+    {
+        cerr << "ERROR: could not move the p-values in " << file << "." << endl;
+        return false;
+    }
+    
+    return true;
+}
+
+// Pages the hashes of sketches [first, last) in or out of memory (for
+// -budget), with one madvise for each run of sketches that are next to each
+// other in a mapped file. They are released with MADV_PAGEOUT, which (unlike
+// MADV_DONTNEED) is safe even for hashes that are not backed by the file.
+//
+static void adviseHashes(const Sketch & sketch, uint64_t first, uint64_t last, int advice)
+{
+    static const uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t start = 0;
+    uintptr_t end = 0;
+    
+    for ( uint64_t i = first; i < last; i++ )
+    {
+        const HashList & hashes = sketch.getReference(i).hashesSorted;
+        
+        if ( ! hashes.isView() || hashes.size() == 0 )
+        {
+            continue;
+        }
+        
+        uintptr_t data = hashes.get64() ? uintptr_t(hashes.data64()) : uintptr_t(hashes.data32());
+        uintptr_t bytes = hashes.size() * (hashes.get64() ? sizeof(hash64_t) : sizeof(hash32_t));
+        
+        if ( end != 0 && (data < start || data > end + page) )
+        {
+            madvise((void *)start, end - start, advice);
+            end = 0;
+        }
+        
+        if ( end == 0 )
+        {
+            start = data / page * page;
+        }
+        
+        end = max(end, data + bytes);
+    }
+    
+    if ( end != 0 )
+    {
+        madvise((void *)start, end - start, advice);
+    }
+}
+
+static void releaseHashes(const Sketch & sketch, uint64_t first, uint64_t last)
+{
+#ifdef MADV_PAGEOUT
+    adviseHashes(sketch, first, last, MADV_PAGEOUT);
+#endif
+}
+
+// Writes the results of a band of tiles (in column order) to their places in
+// a matrix or condensed output, one write per row, since with -budget the
+// rows are not written in order; false if a write fails.
+//
+static bool writePlaced(vector<CommandTriangle::TriangleOutput *> & band, const CondensedHeader * header, int fd, double & pValuePeakToSet)
+{
+    static const uint64_t resultsOffset = sizeof(uint64_t) + 2 * sizeof(double); // after the matrix header
+    
+    uint64_t distanceBytes = header ? header->distanceBytes() : 0;
+    vector<char> distances;
+    vector<double> pValues;
+    vector<CommandTriangle::Result> results;
+    bool good = true;
+    
+    for ( uint64_t row = band[0]->rowStart; row < band[0]->rowEnd && good; row++ )
+    {
+        uint64_t first;
+        uint64_t end;
+        
+        band[0]->pairColumns(row, first, end);
+        
+        distances.clear();
+        pValues.clear();
+        results.clear();
+        
+        for ( uint64_t t = 0; t < band.size(); t++ )
+        {
+            const CommandTriangle::TriangleOutput * output = band[t];
+            uint64_t start;
+            
+            output->pairColumns(row, start, end);
+            
+            for ( uint64_t i = start; i < end; i++ )
+            {
+                const CommandDistance::CompareOutput::PairOutput & pair = output->getPair(row, i);
+                
+                if ( header )
+                {
+                    distances.resize(distances.size() + distanceBytes);
+                    encodeDistance(pair.distance, header->distanceType, &distances[distances.size() - distanceBytes]);
+                    
+                    if ( header->pValueOffset )
+                    {
+                        pValues.push_back(pair.pValue);
+                    }
+                }
+                else
+                {
+                    CommandTriangle::Result result;
+                    
+                    result.refID = row;
+                    result.queryID = i;
+                    result.numer = pair.numer;
+                    result.denom = pair.denom;
+                    result.distance = pair.distance;
+                    result.pValue = pair.pValue;
+                    results.push_back(result);
+                }
+            }
+        }
+        
+        uint64_t pair = condensedPair(row, first);
+        
+        if ( header )
+        {
+            good =
+                pwrite(fd, distances.data(), distances.size(), header->distanceOffset + pair * distanceBytes) == ssize_t(distances.size()) &&
+                pwrite(fd, pValues.data(), pValues.size() * sizeof(double), header->pValueOffset + pair * sizeof(double)) == ssize_t(pValues.size() * sizeof(double));
+        }
+        else
+        {
+            good = pwrite(fd, results.data(), results.size() * sizeof(CommandTriangle::Result), resultsOffset + pair * sizeof(CommandTriangle::Result)) == ssize_t(results.size() * sizeof(CommandTriangle::Result));
+        }
+    }
+    
+    for ( uint64_t t = 0; t < band.size(); t++ )
+    {
+        if ( band[t]->pValuePeak > pValuePeakToSet )
+        {
+            pValuePeakToSet = band[t]->pValuePeak;
+        }
+        
+        delete band[t];
+    }
+    
+    band.clear();
+    return good;
+}
+
 CommandTriangle::CommandTriangle()
 : Command()
 {
@@ -40,6 +319,17 @@ CommandTriangle::CommandTriangle()
     addOption("pvalue", Option(Option::Number, "v", "Output", "Maximum p-value to report in edge list. Implies -" + getOption("edge").identifier + ".", "1.0", 0., 1.));
     addOption("distance", Option(Option::Number, "d", "Output", "Maximum distance to report in edge list. Implies -" + getOption("edge").identifier + ".", "1.0", 0., 1.));
 	addOption("outBin", Option(Option::String, "o", "Output", "output results to binary phylip format for better performance. If -o is not specified, results will be redirected to stdout. This will be slow.", ""));
+    addOption("prefilter", Option(Option::Boolean, "prefilter", "Output", "With -d, first compare the smallest 128-512 hashes of each pair and skip the rest of pairs that share too few of them to pass. A passing pair is skipped with probability at most 1e-9; faster when most pairs are far apart. Has no effect for distances above about 0.12 (k = 21).", ""));
+    addOption("weighted", Option(Option::Boolean, "weighted", "Output", "Weight the Jaccard index by the counts of hashes in each sketch (see dist -weighted). Sketches must keep counts (sketch -r), or be sketched here.", ""));
+    addOption("condensed", Option(Option::String, "condensed", "Output", "With -o, write the whole matrix in the condensed format, with distances stored by their position in the triangle as 32-bit floats (f32) or 16-bit fixed point (u16, to within 1e-5), for random access and a fraction of the size. Incompatible with -E, -d, -v and -shard.", ""));
+    addOption("pplane", Option(Option::Boolean, "pplane", "Output", "With -condensed, also store the p-values (as doubles).", ""));
+    addOption("extend", Option(Option::Integer, "extend", "Output", "Add to the existing output of -o, from a run over the first <int> inputs with the same options, the rows of the inputs after them (which are only compared to the earlier ones and each other). New sketches can then be added to a collection without recomputing the matrix.", "0"));
+    addOption("budget", Option(Option::Size, "budget", "Output", "Compare within about this much memory for hashes (raw bytes or with K/M/G/T), for collections larger than RAM. The sketch files (.msh, required) are mapped rather than loaded, and the sketches compared in blocks that fit, each paged in once for every block after it. Requires -o and writes the matrix or -condensed (not -E, -d, -v, -shard, -extend or -resume).", ""));
+    addOption("checkpoint", Option(Option::Integer, "checkpoint", "Output", "Seconds between checkpoints of the progress of -o output, for -resume (0 for none).", "600"));
+    addOption("resume", Option(Option::Boolean, "resume", "Output", "Continue a run with -o that was stopped part way from its last checkpoint, with the same inputs and options (including -shard and -condensed). Starts from the beginning if there is no checkpoint. Incompatible with -extend.", ""));
+    addOption("checkpointStop", Option(Option::Integer, "checkpointstop", "Testing", "For testing -resume: checkpoint after every write and exit right after the <int>-th checkpoint, as if killed.", "0")); // not in help (its category is not added)
+    addOption("shard", Option(Option::String, "shard", "Output", "Only compare shard <i>/<n> of the pairs (1 <= i <= n), so a run can be spread over processes or nodes. The shards are balanced and depend only on the inputs, <i> and <n>. Requires -o; combine the outputs with \"mash merge\".", ""));
+    useOption("numa");
 	//addOption("outBin", Option(Option::String, "o", "Output", "output to the binary format with a higher speed.", "./rabbit-mash-output.bin"));
     //addOption("log", Option(Option::Boolean, "L", "Output", "Log scale distances and divide by k-mer size to provide a better analog to phylogenetic distance. The special case of zero shared min-hashes will result in a distance of 1.", ""));
     useSketchOptions();
@@ -74,9 +364,111 @@ int CommandTriangle::run() const
 		outBin = false;
 	}
 
+    uint64_t shardIndex = 0;
+    uint64_t shardCount = 1;
+    bool shard = options.at("shard").active;
+    
+    if ( shard )
+    {
+        if ( ! parseShard(options.at("shard").argument, shardIndex, shardCount) )
+        {
+            cerr << "ERROR: The option -" << options.at("shard").identifier << " must be <i>/<n>, with 1 <= <i> <= <n>." << endl;
+            return 1;
+        }
+        
+        if ( ! outBin )
+        {
+            cerr << "ERROR: The option -" << options.at("shard").identifier << " requires -" << options.at("outBin").identifier << "." << endl;
+            return 1;
+        }
+    }
+
+    bool condensed = options.at("condensed").active;
+    bool pPlane = options.at("pplane").active;
+    CondensedHeader condensedHeader;
+    CondensedHeader::DistanceType condensedType = CondensedHeader::distanceFloat32;
+    
+    if ( condensed )
+    {
+        const string & type = options.at("condensed").argument;
+        
+        if ( type == "u16" )
+        {
+            condensedType = CondensedHeader::distanceFixed16;
+        }
+        else if ( type != "f32" )
+        {
+            cerr << "ERROR: The option -" << options.at("condensed").identifier << " must be f32 or u16." << endl;
+            return 1;
+        }
+        
+        if ( ! outBin )
+        {
+            cerr << "ERROR: The option -" << options.at("condensed").identifier << " requires -" << options.at("outBin").identifier << "." << endl;
+            return 1;
+        }
+        
+        if ( edge || options.at("pvalue").active || options.at("distance").active || shard )
+        {
+            cerr << "ERROR: The option -" << options.at("condensed").identifier << " is for whole matrices and cannot be used with -" << options.at("edge").identifier << ", -" << options.at("distance").identifier << ", -" << options.at("pvalue").identifier << " or -" << options.at("shard").identifier << "." << endl;
+            return 1;
+        }
+    }
+    else if ( pPlane )
+    {
+        cerr << "ERROR: The option -" << options.at("pplane").identifier << " requires -" << options.at("condensed").identifier << "." << endl;
+        return 1;
+    }
+    
+    bool extend = options.at("extend").active;
+    uint64_t countOld = 0;
+    
+    if ( extend )
+    {
+        if ( options.at("extend").getArgumentAsNumber() < 1 )
+        {
+            cerr << "ERROR: The option -" << options.at("extend").identifier << " must be at least 1." << endl;
+            return 1;
+        }
+        
+        if ( ! outBin || shard )
+        {
+            cerr << "ERROR: The option -" << options.at("extend").identifier << " requires -" << options.at("outBin").identifier << " and cannot be used with -" << options.at("shard").identifier << "." << endl;
+            return 1;
+        }
+        
+        countOld = options.at("extend").getArgumentAsNumber();
+    }
+    
+    bool resume = options.at("resume").active;
+    
+    if ( resume && (! outBin || extend) )
+    {
+        cerr << "ERROR: The option -" << options.at("resume").identifier << " requires -" << options.at("outBin").identifier << " and cannot be used with -" << options.at("extend").identifier << "." << endl;
+        return 1;
+    }
+    
+    bool budget = options.at("budget").active;
+    double budgetBytes = options.at("budget").getArgumentAsNumber();
+    
+    if ( budget )
+    {
+        if ( budgetBytes <= 0 )
+        {
+            cerr << "ERROR: The option -" << options.at("budget").identifier << " must be positive." << endl;
+            return 1;
+        }
+        
+        if ( ! outBin || edge || options.at("pvalue").active || options.at("distance").active || shard || extend || resume )
+        {
+            cerr << "ERROR: The option -" << options.at("budget").identifier << " requires -" << options.at("outBin").identifier << " and cannot be used with -" << options.at("edge").identifier << ", -" << options.at("distance").identifier << ", -" << options.at("pvalue").identifier << ", -" << options.at("shard").identifier << ", -" << options.at("extend").identifier << " or -" << options.at("resume").identifier << "." << endl;
+            return 1;
+        }
+    }
+    
 	ofstream oFile;
 
-	if(outBin)
+	if(outBin && ! extend && ! resume) // an extended or resumed output is opened once checked
 	{
 		oFile.open(oFileName, ios::out | ios::binary | ios::trunc);
 		if(!oFile.is_open()){
@@ -90,21 +482,7 @@ int CommandTriangle::run() const
     {
         edge = true;
     }
-   
-	//write header to binary
-	if( edge )
-	{
-		uint64_t isEdge = 0x1;
-		oFile.write((char *)&isEdge, sizeof(uint64_t));
-		oFile.write((char *)&distanceMax, sizeof(double));
-		oFile.write((char *)&pValueMax, sizeof(double));
-	} else {
-		uint64_t isEdge = 0x0;
-		oFile.write((char *)&isEdge, sizeof(uint64_t));
-		oFile.write((char *)&distanceMax, sizeof(double));
-		oFile.write((char *)&pValueMax, sizeof(double));
-	}
-
+    
     Sketch::Parameters parameters;
     
     if ( sketchParameterSetup(parameters, *(Command *)this) )
@@ -139,8 +517,30 @@ int CommandTriangle::run() const
         }
     }
     
+    if ( budget )
+    {
+        for ( uint64_t i = 0; i < queryFiles.size(); i++ )
+        {
+            if ( ! hasSuffix(queryFiles[i], suffixSketch) )
+            {
+                cerr << "ERROR: The option -" << options.at("budget").identifier << " needs sketches as input, but " << queryFiles[i] << " is not a sketch file (" << suffixSketch << "); sketch it first with \"mash sketch\"." << endl;
+                return 1;
+            }
+        }
+        
+        parameters.mapped = true;
+    }
+    
     sketch.initFromFiles(queryFiles, parameters);
     
+    bool weighted = options.at("weighted").active;
+    
+    if ( weighted && ! hasCountsAll(sketch) )
+    {
+        cerr << "ERROR: The option -" << options.at("weighted").identifier << " requires hash counts, which sketch files only keep if sketched with -r." << endl;
+        return 1;
+    }
+    
     double lengthThreshold = (parameters.warning * sketch.getKmerSpace()) / (1. - parameters.warning);
     
 	for ( uint64_t i = 0; i < sketch.getReferenceCount(); i++ )
@@ -168,35 +568,308 @@ int CommandTriangle::run() const
     }
 	
     
+    uint64_t pairTotal = sketch.getReferenceCount() * (sketch.getReferenceCount() - 1) / 2;
+    uint64_t pairBegin = shardBoundary(pairTotal, shardIndex, shardCount);
+    uint64_t pairEnd = shardBoundary(pairTotal, shardIndex + 1, shardCount);
+    
+    if ( condensed )
+    {
+        condensedHeader.layout(sketch.getReferenceCount(), condensedType, pPlane);
+        condensedHeader.kmerSize = sketch.getKmerSize();
+        condensedHeader.sketchSize = sketch.getMinHashesPerWindow();
+        condensedHeader.seed = sketch.getHashSeed();
+    }
+    
+    if ( extend )
+    {
+        if ( countOld > sketch.getReferenceCount() )
+        {
+            cerr << "ERROR: The option -" << options.at("extend").identifier << " is more than the number of inputs (" << sketch.getReferenceCount() << ")." << endl;
+            return 1;
+        }
+        
+        if ( condensed ? ! extendCondensed(oFileName, countOld, condensedHeader) : ! checkExtendResults(oFileName, countOld, edge, distanceMax, pValueMax) )
+        {
+            return 1;
+        }
+        
+        oFile.open(oFileName, ios::in | ios::out | ios::binary);
+        
+        if ( ! oFile.is_open() )
+        {
+            cerr << "ERROR: could not open " << oFileName << " for writing." << endl;
+            return 1;
+        }
+        
+        if ( ! condensed )
+        {
+            oFile.seekp(0, ios::end);
+        }
+        
+        pairBegin = countOld * (countOld - 1) / 2;
+        
+        cerr << "Extending " << oFileName << " from " << countOld << " to " << sketch.getReferenceCount() << " sketches" << endl;
+    }
+    
+    ShardHeader header;
+    
+    header.kind = ShardHeader::kindTriangle;
+    header.index = shardIndex;
+    header.count = shardCount;
+    header.pairTotal = pairTotal;
+    header.pairBegin = pairBegin;
+    header.pairEnd = pairEnd;
+    header.refCount = sketch.getReferenceCount();
+    header.queryCount = sketch.getReferenceCount();
+    header.kmerSize = sketch.getKmerSize();
+    header.sketchSize = sketch.getMinHashesPerWindow();
+    header.seed = sketch.getHashSeed();
+    header.edge = edge;
+    header.distanceMax = distanceMax;
+    header.pValueMax = pValueMax;
+    
+    Checkpoint checkpoint;
+    
+    checkpoint.run = header;
+    checkpoint.format = condensed ? (condensedType + 1) * 2 + pPlane : 0;
+    
+    if ( resume )
+    {
+        if ( ! resumeOutput(oFileName, checkpoint, oFile, ! condensed) )
+        {
+            return 1;
+        }
+        
+        pairBegin = checkpoint.pairDone;
+        pValuePeakToSet = checkpoint.pValuePeak;
+    }
+    
+    //write header to binary (a sharded or condensed run writes its own header instead)
+    if ( outBin && ! condensed && pairBegin == header.pairBegin )
+    {
+        if ( shard )
+        {
+            oFile.write((char *)&header, sizeof(ShardHeader));
+            
+            cerr << "Shard " << shardIndex + 1 << "/" << shardCount << ": pairs " << pairBegin << "-" << pairEnd << " of " << pairTotal << endl;
+        }
+        else if ( ! extend )
+        {
+            uint64_t isEdge = edge ? 0x1 : 0x0;
+            oFile.write((char *)&isEdge, sizeof(uint64_t));
+            oFile.write((char *)&distanceMax, sizeof(double));
+            oFile.write((char *)&pValueMax, sizeof(double));
+        }
+    }
+    
+    if ( condensed )
+    {
+        vector<char> padding(condensedHeader.distanceOffset - sizeof(CondensedHeader), 0);
+        
+        oFile.seekp(0);
+        oFile.write((char *)&condensedHeader, sizeof(CondensedHeader));
+        oFile.write(padding.data(), padding.size());
+    }
+    
     ThreadPool<TriangleInput, TriangleOutput> threadPool(compare, threads);
+    OutputWriter writer;
 	
-
-    for ( uint64_t i = 1; i < sketch.getReferenceCount(); i++ )
+    CommandDistance::CompareTables tables(sketch.getMinHashesPerWindow(), sketch.getKmerSize());
+    
+    if ( options.at("prefilter").active )
+    {
+        tables.enablePrefilter(distanceMax);
+        tables.enableSizeFilter(distanceMax, sketch.getReferenceCount() ? hllGetPrecision(sketch.getReference(0).hll.size()) : 0);
+    }
+    
+    tables.weighted = weighted;
+    
+    uint64_t rowFirst = 1;
+    uint64_t rowLast = 0;
+    uint64_t columnFirst = 0;
+    uint64_t columnLast = 0;
+    
+    if ( pairEnd > pairBegin )
+    {
+        trianglePair(pairBegin, rowFirst, columnFirst);
+        trianglePair(pairEnd - 1, rowLast, columnLast);
+    }
+    
+    // The rows are split into bands of tileSize rows, and each band into
+    // square tiles along its columns, which are submitted in row order and
+    // balanced by the pool handing them to whichever thread is free.
+    //
+    uint64_t tileSize = getTileSize(pairEnd - pairBegin, threads);
+    
+    vector<TriangleOutput *> band;
+    deque<uint64_t> bandTiles; // of the bands submitted and not yet written
+    bool checkpointed = outBin && ! budget;
+    CheckpointTimer timer(checkpointed ? options.at("checkpoint").getArgumentAsNumber() : 0, checkpointed ? options.at("checkpointStop").getArgumentAsNumber() : 0);
+    
+    // with -budget, results are placed with writes to their own descriptor
+    //
+    int placedFile = -1;
+    bool placedGood = true;
+    
+    if ( budget )
     {
-        threadPool.runWhenThreadAvailable(new TriangleInput(sketch, i, parameters, distanceMax, pValueMax));
+        oFile.flush();
+        placedFile = open(oFileName.c_str(), O_WRONLY);
+        placedGood = placedFile >= 0;
+    }
+    
+    auto popTile = [&]()
+    {
+        band.push_back(threadPool.popOutputWhenAvailable());
         
-        while ( threadPool.outputAvailable() )
+        if ( band.size() == bandTiles.front() )
         {
-			if(outBin){	
-            	writeOutput(threadPool.popOutputWhenAvailable(), comment, edge, pValuePeakToSet, oFile);
-			}
-			else{
-            	writeOutput(threadPool.popOutputWhenAvailable(), comment, edge, pValuePeakToSet);
-			}
-
+            uint64_t done = min(condensedPair(band[0]->rowEnd, 0), pairEnd); // pairs before are written
+            
+            if ( budget )
+            {
+                placedGood = writePlaced(band, condensed ? &condensedHeader : 0, placedFile, pValuePeakToSet) && placedGood;
+            }
+            else if ( condensed )
+            {
+                writeCondensed(band, condensedHeader, pValuePeakToSet, oFile);
+            }
+            else if ( outBin )
+            {
+                writeOutput(band, comment, edge, pValuePeakToSet, oFile);
+            }
+            else
+            {
+                writeOutput(band, comment, edge, pValuePeakToSet, writer);
+            }
+            
+            bandTiles.pop_front();
+            
+            if ( timer.due() )
+            {
+                oFile.flush();
+                checkpoint.pairDone = done;
+                checkpoint.bytes = oFile.tellp();
+                checkpoint.pValuePeak = pValuePeakToSet;
+                
+                if ( ! writeCheckpoint(oFileName, checkpoint) )
+                {
+                    cerr << "WARNING: could not write " << checkpointFile(oFileName) << "." << endl;
+                }
+                
+                timer.written();
+            }
+        }
+    };
+    
+    // submits a band of tiles of rows [rowStart, rowEnd) across columns
+    // [columnFirst, columnEnd)
+    //
+    auto submitBand = [&](uint64_t rowStart, uint64_t rowEnd, uint64_t columnFirst, uint64_t columnEnd)
+    {
+        bandTiles.push_back((columnEnd - columnFirst + tileSize - 1) / tileSize);
+        
+        for ( uint64_t columnStart = columnFirst; columnStart < columnEnd; columnStart += tileSize )
+        {
+            TriangleInput * input = new TriangleInput(sketch, rowStart, rowEnd, columnStart, min(columnStart + tileSize, columnEnd), parameters, distanceMax, pValueMax);
+            
+            input->pairBegin = pairBegin;
+            input->pairEnd = pairEnd;
+            input->tables = &tables;
+            input->format = ! outBin;
+            input->comment = comment;
+            input->edge = edge;
+            threadPool.runWhenThreadAvailable(input);
+            
+            while ( threadPool.outputAvailable() )
+            {
+                popTile();
+            }
+        }
+    };
+    
+    if ( budget )
+    {
+        // With -budget, the sketches are split into blocks, sized so that two
+        // (of rows and of columns) and the outputs of a band across them are
+        // within the budget. Each block of rows is compared to the blocks up
+        // to it in turn, paging each in (and out again once its tiles are
+        // done), so the hashes are read about (blocks + 1) / 2 times in all.
+        //
+        uint64_t count = sketch.getReferenceCount();
+        uint64_t sketchBytes = sketch.getMinHashesPerWindow() * (parameters.use64 ? sizeof(hash64_t) : sizeof(hash32_t)) + sysconf(_SC_PAGESIZE);
+        uint64_t columnBytes = 2 * tileSize * (sizeof(CommandDistance::CompareOutput::PairOutput) + sizeof(Result));
+        uint64_t blockSize = min(max(uint64_t(budgetBytes / (2 * sketchBytes + columnBytes)), tileSize), count);
+        
+        cerr << "Comparing in blocks of up to " << blockSize << " sketches (" << (count + blockSize - 1) / blockSize << " blocks)" << endl;
+        
+        for ( uint64_t rowBlock = 0; rowBlock < count && placedGood; rowBlock += blockSize )
+        {
+            uint64_t rowBlockEnd = min(rowBlock + blockSize, count);
+            
+            adviseHashes(sketch, rowBlock, rowBlockEnd, MADV_WILLNEED);
+            
+            for ( uint64_t columnBlock = 0; columnBlock <= rowBlock && placedGood; columnBlock += blockSize )
+            {
+                uint64_t columnBlockEnd = min(columnBlock + blockSize, count);
+                
+                if ( columnBlock != rowBlock )
+                {
+                    adviseHashes(sketch, columnBlock, columnBlockEnd, MADV_WILLNEED);
+                }
+                
+                for ( uint64_t rowStart = max(rowBlock, uint64_t(1)); rowStart < rowBlockEnd; rowStart += tileSize )
+                {
+                    uint64_t rowEnd = min(rowStart + tileSize, rowBlockEnd);
+                    uint64_t columnEnd = min(columnBlockEnd, rowEnd - 1);
+                    
+                    if ( columnEnd > columnBlock )
+                    {
+                        submitBand(rowStart, rowEnd, columnBlock, columnEnd);
+                    }
+                }
+                
+                while ( threadPool.running() )
+                {
+                    popTile();
+                }
+                
+                if ( columnBlock != rowBlock )
+                {
+                    releaseHashes(sketch, columnBlock, columnBlockEnd);
+                }
+            }
+            
+            releaseHashes(sketch, rowBlock, rowBlockEnd);
+        }
+    }
+    else
+    {
+        for ( uint64_t rowStart = rowFirst; rowStart <= rowLast; rowStart += tileSize )
+        {
+            uint64_t rowEnd = min(rowStart + tileSize, rowLast + 1);
+            
+            submitBand(rowStart, rowEnd, 0, rowEnd - 1); // to the last row's columns
         }
     }
     
     while ( threadPool.running() )
     {
-		if(outBin){
-        	writeOutput(threadPool.popOutputWhenAvailable(), comment, edge, pValuePeakToSet, oFile);
-		}
-		else{
-        	writeOutput(threadPool.popOutputWhenAvailable(), comment, edge, pValuePeakToSet);
-		}	
-
-
+        popTile();
+    }
+    
+    if ( budget )
+    {
+        if ( placedFile >= 0 && close(placedFile) != 0 )
+        {
+            placedGood = false;
+        }
+        
+        if ( ! placedGood )
+        {
+            cerr << "ERROR: could not write to " << oFileName << "." << endl;
+            return 1;
+        }
     }
     
     if ( !edge )
@@ -211,103 +884,278 @@ int CommandTriangle::run() const
 
   	if(outBin){ 
 		oFile.close();
+		removeCheckpoint(oFileName);
 	}
     return 0;
 }
 
 
-void CommandTriangle::writeOutput(TriangleOutput * output, bool comment, bool edge, double & pValuePeakToSet, ofstream &oFile) const
+uint64_t CommandTriangle::getTileSize(uint64_t pairs, int threads)
 {
-    const Sketch & sketch = output->sketch;
-    const Sketch::Reference & ref = sketch.getReference(output->index);
+    uint64_t tileSize = tileSizeMax;
+    
+    while ( tileSize > tileSizeMin && pairs / (tileSize * tileSize) < tilesPerThread * threads )
+    {
+        tileSize /= 2;
+    }
+    
+    return tileSize;
+}
 
-	//CommandDistance::CompareOutput::PairOutput * bufferPair = new CommandDistance::CompareOutput::PairOutput[output->index];
-	Result * bufferPair = new Result[output->index];
-   	uint64_t passCount = 0; 
-    for ( uint64_t i = 0; i < output->index; i++ )
-    {
-        const CommandDistance::CompareOutput::PairOutput * pair = &output->pairs[i];
-		if(pair->pass){
-			bufferPair[passCount].refID = output->index;
-			bufferPair[passCount].queryID = i;
-			bufferPair[passCount].numer = pair->numer;
-			bufferPair[passCount].denom = pair->denom;
-			bufferPair[passCount].distance = pair->distance;
-			bufferPair[passCount].pValue = pair->pValue;
-			passCount++;
-		}
-        if ( pair->pValue > pValuePeakToSet )
+void CommandTriangle::writeOutput(vector<TriangleOutput *> & band, bool, bool, double & pValuePeakToSet, ofstream &oFile) const
+{
+    uint64_t rowStart = band[0]->rowStart;
+    uint64_t rowEnd = band[0]->rowEnd;
+    vector<Result> buffer;
+    
+    for ( uint64_t row = rowStart; row < rowEnd; row++ )
+    {
+        for ( uint64_t t = 0; t < band.size(); t++ )
         {
-            pValuePeakToSet = pair->pValue;
+            const TriangleOutput * output = band[t];
+            uint64_t start;
+            uint64_t end;
+            
+            output->pairColumns(row, start, end);
+            
+            for ( uint64_t i = start; i < end; i++ )
+            {
+                const CommandDistance::CompareOutput::PairOutput & pair = output->getPair(row, i);
+                
+                if ( pair.pass )
+                {
+                    Result result;
+                    
+                    result.refID = row;
+                    result.queryID = i;
+                    result.numer = pair.numer;
+                    result.denom = pair.denom;
+                    result.distance = pair.distance;
+                    result.pValue = pair.pValue;
+                    buffer.push_back(result);
+                }
+            }
         }
     }
-
-	//oFile.write((char*)bufferPair, output->index * sizeof(CommandDistance::CompareOutput::PairOutput));
-	oFile.write((char*)bufferPair, passCount * sizeof(Result));
-	oFile.flush();
-	delete bufferPair;
-    delete output;
+    
+    oFile.write((char*)buffer.data(), buffer.size() * sizeof(Result));
+    
+    for ( uint64_t t = 0; t < band.size(); t++ )
+    {
+        if ( band[t]->pValuePeak > pValuePeakToSet )
+        {
+            pValuePeakToSet = band[t]->pValuePeak;
+        }
+        
+        delete band[t];
+    }
+    
+    band.clear();
 }
 
-
-
-
-void CommandTriangle::writeOutput(TriangleOutput * output, bool comment, bool edge, double & pValuePeakToSet) const
+void CommandTriangle::writeCondensed(vector<TriangleOutput *> & band, const CondensedHeader & header, double & pValuePeakToSet, ofstream & oFile) const
 {
-    const Sketch & sketch = output->sketch;
-    const Sketch::Reference & ref = sketch.getReference(output->index);
+    // the band's pairs are contiguous in each plane
+    //
+    uint64_t rowStart = band[0]->rowStart;
+    uint64_t rowEnd = band[0]->rowEnd;
+    uint64_t pairFirst = condensedPair(rowStart, 0);
+    uint64_t pairCount = condensedPair(rowEnd, 0) - pairFirst;
+    uint64_t distanceBytes = header.distanceBytes();
     
-    if ( !edge )
-    {
-        cout << (comment ? ref.comment : ref.name);
-    }
+    vector<char> distances(pairCount * distanceBytes);
+    vector<double> pValues(header.pValueOffset ? pairCount : 0);
     
-    for ( uint64_t i = 0; i < output->index; i++ )
+    for ( uint64_t t = 0; t < band.size(); t++ )
     {
-        const CommandDistance::CompareOutput::PairOutput * pair = &output->pairs[i];
+        const TriangleOutput * output = band[t];
         
-        if ( edge )
+        for ( uint64_t row = rowStart; row < rowEnd; row++ )
         {
-            if ( pair->pass )
+            uint64_t start;
+            uint64_t end;
+            
+            output->pairColumns(row, start, end);
+            
+            for ( uint64_t i = start; i < end; i++ )
             {
-                const Sketch::Reference & qry = sketch.getReference(i);
-                cout << (comment ? ref.comment : ref.name) << '\t'<< (comment ? qry.comment : qry.name) << '\t' << pair->distance << '\t' << pair->pValue << '\t' << pair->numer << '/' << pair->denom << endl;
+                const CommandDistance::CompareOutput::PairOutput & pair = output->getPair(row, i);
+                uint64_t index = condensedPair(row, i) - pairFirst;
+                
+                encodeDistance(pair.distance, header.distanceType, &distances[index * distanceBytes]);
+                
+                if ( pValues.size() )
+                {
+                    pValues[index] = pair.pValue;
+                }
             }
         }
-        else
+        
+        if ( output->pValuePeak > pValuePeakToSet )
         {
-            cout << '\t' << pair->distance;
+            pValuePeakToSet = output->pValuePeak;
         }
+        
+        delete output;
+    }
+    
+    band.clear();
+    
+    oFile.seekp(header.distanceOffset + pairFirst * distanceBytes);
+    oFile.write(distances.data(), distances.size());
+    
+    if ( pValues.size() )
+    {
+        oFile.seekp(header.pValueOffset + pairFirst * sizeof(double));
+        oFile.write((char *)pValues.data(), pValues.size() * sizeof(double));
+    }
+}
 
-		//TODO
-       	//outputBuffer[i] = pair->distance;
-
-        if ( pair->pValue > pValuePeakToSet )
+void CommandTriangle::writeOutput(vector<TriangleOutput *> & band, bool comment, bool edge, double & pValuePeakToSet, OutputWriter & writer) const
+{
+    for ( uint64_t t = 0; t < band.size(); t++ )
+    {
+        if ( ! band[t]->formatted )
         {
-            pValuePeakToSet = pair->pValue;
+            formatOutput(band[t], comment, edge);
+        }
+        
+        if ( band[t]->pValuePeak > pValuePeakToSet )
+        {
+            pValuePeakToSet = band[t]->pValuePeak;
         }
     }
     
-    if ( !edge )
+    for ( uint64_t row = 0; row < band[0]->text.size(); row++ )
     {
-        cout << endl;
+        for ( uint64_t t = 0; t < band.size(); t++ )
+        {
+            writer.write(band[t]->text[row]);
+        }
     }
     
-    delete output;
+    for ( uint64_t t = 0; t < band.size(); t++ )
+    {
+        delete band[t];
+    }
+    
+    band.clear();
+}
+
+void formatOutput(CommandTriangle::TriangleOutput * output, bool comment, bool edge)
+{
+    const Sketch & sketch = output->sketch;
+    
+    output->text.resize(output->rowEnd - output->rowStart);
+    
+    for ( uint64_t row = output->rowStart; row < output->rowEnd; row++ )
+    {
+        const Sketch::Reference & ref = sketch.getReference(row);
+        string & text = output->text[row - output->rowStart];
+        uint64_t start;
+        uint64_t end;
+        
+        output->pairColumns(row, start, end);
+        
+        if ( !edge && output->columnStart == 0 )
+        {
+            text.append(comment ? ref.comment : ref.name);
+        }
+        
+        for ( uint64_t i = start; i < end; i++ )
+        {
+            const CommandDistance::CompareOutput::PairOutput * pair = &output->getPair(row, i);
+            
+            if ( edge )
+            {
+                if ( pair->pass )
+                {
+                    const Sketch::Reference & qry = sketch.getReference(i);
+                    
+                    text.append(comment ? ref.comment : ref.name);
+                    text.push_back('\t');
+                    text.append(comment ? qry.comment : qry.name);
+                    text.push_back('\t');
+                    appendDouble(text, pair->distance);
+                    text.push_back('\t');
+                    appendDouble(text, pair->pValue);
+                    text.push_back('\t');
+                    appendInteger(text, pair->numer);
+                    text.push_back('/');
+                    appendInteger(text, pair->denom);
+                    text.push_back('\n');
+                }
+            }
+            else
+            {
+                text.push_back('\t');
+                appendDouble(text, pair->distance);
+            }
+        }
+        
+        if ( !edge && row > output->columnStart && row <= output->columnEnd )
+        {
+            text.push_back('\n'); // the tile ends the row
+        }
+    }
+    
+    output->formatted = true;
 }
 
+void CommandTriangle::TriangleOutput::pairColumns(uint64_t row, uint64_t & start, uint64_t & end) const
+{
+    uint64_t rowPair = row * (row - 1) / 2; // of the first column
+    
+    start = columnStart;
+    end = min(columnEnd, row);
+    
+    if ( pairBegin > rowPair + start )
+    {
+        start = pairBegin - rowPair;
+    }
+    
+    if ( pairEnd < rowPair + end )
+    {
+        end = pairEnd > rowPair ? pairEnd - rowPair : 0;
+    }
+    
+    if ( start > end )
+    {
+        start = end;
+    }
+}
 
 CommandTriangle::TriangleOutput * compare(CommandTriangle::TriangleInput * input)
 {
     const Sketch & sketch = input->sketch;
     
-    CommandTriangle::TriangleOutput * output = new CommandTriangle::TriangleOutput(input->sketch, input->index);
+    CommandTriangle::TriangleOutput * output = new CommandTriangle::TriangleOutput(*input);
     
     uint64_t sketchSize = sketch.getMinHashesPerWindow();
     
-    for ( uint64_t i = 0; i < input->index; i++ )
+    for ( uint64_t row = output->rowStart; row < output->rowEnd; row++ )
+    {
+        uint64_t start;
+        uint64_t end;
+        
+        output->pairColumns(row, start, end);
+        
+        for ( uint64_t i = start; i < end; i++ )
+        {
+            CommandDistance::CompareOutput::PairOutput * pair = &output->getPair(row, i);
+            
+            compareSketches(pair, sketch.getReference(row), sketch.getReference(i), sketchSize, sketch.getKmerSize(), sketch.getKmerSpace(), input->maxDistance, input->maxPValue, input->tables);
+            
+            if ( pair->pass && pair->pValue > output->pValuePeak )
+            {
+                output->pValuePeak = pair->pValue;
+            }
+        }
+    }
+    
+    if ( input->format )
     {
-        compareSketches(&output->pairs[i], sketch.getReference(input->index), sketch.getReference(i), sketchSize, sketch.getKmerSize(), sketch.getKmerSpace(), input->maxDistance, input->maxPValue);
+        formatOutput(output, input->comment, input->edge);
     }
     
     return output;
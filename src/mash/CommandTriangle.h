@@ -9,9 +9,13 @@
 
 #include "Command.h"
 #include "CommandDistance.h"
+#include "Condensed.h"
 #include "Sketch.h"
 
 #include <fstream>
+#include <stdint.h>
+#include <string>
+#include <vector>
 
 namespace mash {
 
@@ -28,32 +32,63 @@ public:
 		int denom = 0;
 	};
     
+    // A tile of the lower triangle: rows [rowStart, rowEnd) against columns
+    // [columnStart, columnEnd), of which only the pairs below the diagonal
+    // and within [pairBegin, pairEnd) are compared (see pairColumns()).
+    // Tiles are square so that each costs about the same, however far down
+    // the triangle it is.
+    //
     struct TriangleInput
     {
-        TriangleInput(const Sketch & sketchNew, uint64_t indexNew, const Sketch::Parameters & parametersNew, double maxDistanceNew, double maxPValueNew)
+        TriangleInput(const Sketch & sketchNew, uint64_t rowStartNew, uint64_t rowEndNew, uint64_t columnStartNew, uint64_t columnEndNew, const Sketch::Parameters & parametersNew, double maxDistanceNew, double maxPValueNew)
             :
             sketch(sketchNew),
-            index(indexNew),
+            rowStart(rowStartNew),
+            rowEnd(rowEndNew),
+            columnStart(columnStartNew),
+            columnEnd(columnEndNew),
             parameters(parametersNew),
             maxDistance(maxDistanceNew),
             maxPValue(maxPValueNew)
             {}
         
         const Sketch & sketch;
-        uint64_t index;
+        uint64_t rowStart;
+        uint64_t rowEnd;
+        uint64_t columnStart;
+        uint64_t columnEnd;
         const Sketch::Parameters & parameters;
         double maxDistance;
         double maxPValue;
+        
+        // pairs to compare, numbered along the rows (all of them unless
+        // sharded)
+        //
+        uint64_t pairBegin = 0;
+        uint64_t pairEnd = UINT64_MAX;
+        
+        const CommandDistance::CompareTables * tables = 0;
+        
+        // if set, the worker also formats its part of each row as text
+        //
+        bool format = false;
+        bool comment = false;
+        bool edge = false;
     };
     
     struct TriangleOutput
     {
-        TriangleOutput(const Sketch & sketchNew, uint64_t indexNew)
+        TriangleOutput(const TriangleInput & input)
             :
-            sketch(sketchNew),
-            index(indexNew)
+            sketch(input.sketch),
+            rowStart(input.rowStart),
+            rowEnd(input.rowEnd),
+            columnStart(input.columnStart),
+            columnEnd(input.columnEnd),
+            pairBegin(input.pairBegin),
+            pairEnd(input.pairEnd)
         {
-            pairs = new CommandDistance::CompareOutput::PairOutput[index];
+            pairs = new CommandDistance::CompareOutput::PairOutput[(rowEnd - rowStart) * (columnEnd - columnStart)];
         }
         
         ~TriangleOutput()
@@ -61,28 +96,65 @@ public:
             delete [] pairs;
         }
         
+        // the columns of the tile compared for a row
+        //
+        void pairColumns(uint64_t row, uint64_t & start, uint64_t & end) const;
+        
+        CommandDistance::CompareOutput::PairOutput & getPair(uint64_t row, uint64_t column) const
+        {
+            return pairs[(row - rowStart) * (columnEnd - columnStart) + column - columnStart];
+        }
+        
         const Sketch & sketch;
-        uint64_t index;
+        uint64_t rowStart;
+        uint64_t rowEnd;
+        uint64_t columnStart;
+        uint64_t columnEnd;
+        uint64_t pairBegin;
+        uint64_t pairEnd;
+        
+        CommandDistance::CompareOutput::PairOutput * pairs; // by row, then column
         
-        CommandDistance::CompareOutput::PairOutput * pairs;
+        double pValuePeak = 0;
+        
+        // with TriangleInput::format, the tile's part of each row, to be
+        // written after those of the tiles to its left
+        //
+        std::vector<std::string> text;
+        bool formatted = false;
     };
     
     CommandTriangle();
     
     int run() const; // override
     
+    // Side of the tiles for comparing pairs of the triangle, made smaller
+    // for small inputs so there are enough tiles to go around.
+    //
+    static uint64_t getTileSize(uint64_t pairs, int threads);
+    
 private:
     
+    static const uint64_t tileSizeMax = 64; // rows and columns
+    static const uint64_t tileSizeMin = 8;
+    static const uint64_t tilesPerThread = 16; // before shrinking tiles
+    
     double pValueMax;
     bool comment;
     
 //void writeOutput(TriangleOutput * output, bool comment, bool edge, double & pValuePeakToSet, char * output1Buffer, std::fstream &output1File, double * output2Buffer, std::fstream & output2File) const;
     //void writeOutput(TriangleOutput * output, bool comment, bool edge, double & pValuePeakToSet, double * outputBuffer, std::fstream & outputFile) const;
-void writeOutput(TriangleOutput * output, bool comment, bool edge, double & pValuePeakToSet, std::ofstream &oFile) const;
-void writeOutput(TriangleOutput * output, bool comment, bool edge, double & pValuePeakToSet) const;
+    // Tiles are written a band (one tile row) at a time, once the band's last
+    // tile is done, so that the output is in row order without depending on
+    // the tile size or thread count.
+    //
+    void writeOutput(std::vector<TriangleOutput *> & band, bool comment, bool edge, double & pValuePeakToSet, std::ofstream &oFile) const;
+    void writeOutput(std::vector<TriangleOutput *> & band, bool comment, bool edge, double & pValuePeakToSet, OutputWriter & writer) const;
+    void writeCondensed(std::vector<TriangleOutput *> & band, const CondensedHeader & header, double & pValuePeakToSet, std::ofstream & oFile) const;
 };
 
 CommandTriangle::TriangleOutput * compare(CommandTriangle::TriangleInput * input);
+void formatOutput(CommandTriangle::TriangleOutput * output, bool comment, bool edge);
 
 } // namespace mash
 
@@ -0,0 +1,187 @@
+// Copyright © 2015, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen,
+// Sergey Koren, and Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#include "Condensed.h"
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace::std;
+
+static uint64_t alignPlane(uint64_t offset)
+{
+    return (offset + CondensedHeader::planeAlign - 1) / CondensedHeader::planeAlign * CondensedHeader::planeAlign;
+}
+
+void CondensedHeader::layout(uint64_t countNew, DistanceType distanceTypeNew, bool pValues)
+{
+    count = countNew;
+    pairCount = count < 2 ? 0 : count * (count - 1) / 2;
+    distanceType = distanceTypeNew;
+    distanceOffset = alignPlane(sizeof(CondensedHeader));
+    pValueOffset = pValues ? alignPlane(distanceOffset + pairCount * distanceBytes()) : 0;
+}
+
+uint64_t CondensedHeader::distanceBytes() const
+{
+    return distanceType == distanceFixed16 ? sizeof(uint16_t) : sizeof(float);
+}
+
+uint64_t CondensedHeader::fileSize() const
+{
+    if ( pValueOffset != 0 )
+    {
+        return pValueOffset + pairCount * sizeof(double);
+    }
+
+    return distanceOffset + pairCount * distanceBytes();
+}
+
+void encodeDistance(double distance, uint64_t distanceType, void * value)
+{
+    if ( distanceType == CondensedHeader::distanceFixed16 )
+    {
+        uint16_t fixed = lround(distance * 65535);
+        memcpy(value, &fixed, sizeof(uint16_t));
+    }
+    else
+    {
+        float single = distance;
+        memcpy(value, &single, sizeof(float));
+    }
+}
+
+CondensedMatrix::CondensedMatrix()
+    :
+    data(0),
+    size(0)
+{
+}
+
+CondensedMatrix::~CondensedMatrix()
+{
+    close();
+}
+
+bool CondensedMatrix::open(const string & file)
+{
+    close();
+
+    int fd = ::open(file.c_str(), O_RDONLY);
+    struct stat fileInfo;
+
+    if ( fd < 0 || fstat(fd, &fileInfo) != 0 )
+    {
+        if ( fd >= 0 )
+        {
+            ::close(fd);
+        }
+
+        error = "could not open " + file;
+        return false;
+    }
+
+    if ( uint64_t(fileInfo.st_size) < sizeof(CondensedHeader) || pread(fd, &header, sizeof(CondensedHeader), 0) != ssize_t(sizeof(CondensedHeader)) || header.magic != CondensedHeader::magicValue )
+    {
+        ::close(fd);
+        error = file + " is not a condensed triangle matrix";
+        return false;
+    }
+
+    if ( header.version != CondensedHeader::versionCurrent )
+    {
+        ::close(fd);
+        error = file + " is from a different version of the condensed format";
+        return false;
+    }
+
+    if ( uint64_t(fileInfo.st_size) < header.fileSize() )
+    {
+        ::close(fd);
+        error = file + " is incomplete";
+        return false;
+    }
+
+    size = fileInfo.st_size;
+    void * mapped = size == 0 ? MAP_FAILED : mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+
+    if ( mapped == MAP_FAILED )
+    {
+        size = 0;
+        error = "could not map " + file;
+        return false;
+    }
+
+    data = (const char *)mapped;
+    return true;
+}
+
+double CondensedMatrix::getDistance(uint64_t row, uint64_t column) const
+{
+    if ( row == column )
+    {
+        return 0;
+    }
+
+    uint64_t pair = row > column ? condensedPair(row, column) : condensedPair(column, row);
+    const char * value = data + header.distanceOffset + pair * header.distanceBytes();
+
+    if ( header.distanceType == CondensedHeader::distanceFixed16 )
+    {
+        uint16_t fixed;
+        memcpy(&fixed, value, sizeof(uint16_t));
+        return fixed / 65535.;
+    }
+
+    float single;
+    memcpy(&single, value, sizeof(float));
+    return single;
+}
+
+double CondensedMatrix::getPValue(uint64_t row, uint64_t column) const
+{
+    if ( row == column )
+    {
+        return 0;
+    }
+
+    uint64_t pair = row > column ? condensedPair(row, column) : condensedPair(column, row);
+    double pValue;
+
+    memcpy(&pValue, data + header.pValueOffset + pair * sizeof(double), sizeof(double));
+    return pValue;
+}
+
+void CondensedMatrix::close()
+{
+    if ( data != 0 )
+    {
+        munmap((void *)data, size);
+        data = 0;
+        size = 0;
+    }
+}
+
+bool isCondensedFile(const string & file)
+{
+    FILE * stream = fopen(file.c_str(), "rb");
+
+    if ( stream == NULL )
+    {
+        return false;
+    }
+
+    uint64_t magic = 0;
+    bool condensed = fread(&magic, sizeof(uint64_t), 1, stream) == 1 && magic == CondensedHeader::magicValue;
+
+    fclose(stream);
+    return condensed;
+}
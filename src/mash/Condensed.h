@@ -0,0 +1,112 @@
+// Copyright © 2015, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen,
+// Sergey Koren, and Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#ifndef Condensed_h
+#define Condensed_h
+
+#include <stdint.h>
+#include <string>
+
+// The condensed binary format for triangle matrices (triangle -o with
+// -condensed). Rather than a Result record per pair, the file holds planes of
+// values for every pair, in the order triangle writes them (row by row over
+// the row > column half, rows from 1; see condensedPair()), so the sketch
+// indices are implied by position and any pair can be read directly:
+//
+//   CondensedHeader, padded to planeAlign bytes
+//   distances: pairCount 32-bit floats, or 16-bit fixed point (distance is
+//     value / 65535)
+//   p-values (with -pplane): pairCount doubles, from the next multiple of
+//     planeAlign
+//
+// Values are in host byte order. The names and other sketch information are
+// not repeated; they come from the sketches triangle was run on (checked
+// against the header by readers such as dumptri).
+
+struct CondensedHeader
+{
+    static const uint64_t magicValue = 0x534e444e4348534d; // "MSHCNDNS" in file order
+    static const uint64_t versionCurrent = 1;
+    static const uint64_t planeAlign = 4096; // so planes can be mapped page-aligned
+
+    enum DistanceType
+    {
+        distanceFloat32 = 0,
+        distanceFixed16 = 1
+    };
+
+    uint64_t magic = magicValue;
+    uint64_t version = versionCurrent;
+
+    uint64_t count = 0; // of sketches (rows and columns)
+    uint64_t pairCount = 0;
+    uint64_t distanceType = distanceFloat32;
+    uint64_t distanceOffset = 0; // in the file
+    uint64_t pValueOffset = 0; // 0 if there is no p-value plane
+
+    // of the sketches, for checking that they match
+    //
+    uint64_t kmerSize = 0;
+    uint64_t sketchSize = 0;
+    uint64_t seed = 0;
+
+    // Sets count, pairCount and the offsets (and the distance type and
+    // whether there are p-values).
+    //
+    void layout(uint64_t countNew, DistanceType distanceTypeNew, bool pValues);
+
+    uint64_t distanceBytes() const; // per pair
+    uint64_t fileSize() const;
+};
+
+// Position of the pair (row, column) in a plane; row must be greater than
+// column.
+//
+inline uint64_t condensedPair(uint64_t row, uint64_t column)
+{
+    return row * (row - 1) / 2 + column;
+}
+
+// Stores distance as the header's type at value.
+//
+void encodeDistance(double distance, uint64_t distanceType, void * value);
+
+// Read-only mapped condensed matrix, giving the values for any pair of
+// sketches (in either order).
+//
+class CondensedMatrix
+{
+public:
+
+    CondensedMatrix();
+    ~CondensedMatrix();
+
+    // Maps the file; false (with error set) if it cannot be read or is not
+    // a complete condensed matrix.
+    //
+    bool open(const std::string & file);
+
+    const CondensedHeader & getHeader() const {return header;}
+    const std::string & getError() const {return error;}
+    bool hasPValues() const {return header.pValueOffset != 0;}
+
+    double getDistance(uint64_t row, uint64_t column) const;
+    double getPValue(uint64_t row, uint64_t column) const; // requires hasPValues()
+
+private:
+
+    void close();
+
+    CondensedHeader header;
+    std::string error;
+
+    const char * data;
+    uint64_t size;
+};
+
+bool isCondensedFile(const std::string & file);
+
+#endif
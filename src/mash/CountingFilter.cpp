@@ -0,0 +1,134 @@
+// Copyright © 2015, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen,
+// Sergey Koren, and Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#include "CountingFilter.h"
+#include <new>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace::std;
+
+CountingFilter::CountingFilter(uint64_t bytes)
+{
+	blocks = bytes / (blockWords * sizeof(uint64_t));
+
+	if ( blocks == 0 )
+	{
+		blocks = 1;
+	}
+
+	// blocks on cache lines
+	//
+	void * memory = 0;
+
+	if ( posix_memalign(&memory, blockWords * sizeof(uint64_t), getBytes()) != 0 )
+	{
+		throw bad_alloc();
+	}
+
+	table = (atomic<uint64_t> *)memory;
+	clear();
+}
+
+CountingFilter::~CountingFilter()
+{
+	free(table);
+}
+
+uint32_t CountingFilter::add(uint64_t hash)
+{
+	Probe probe;
+	uint32_t counts[probes];
+	uint32_t count = countMax;
+
+	locate(hash, probe);
+
+	for ( int i = 0; i < probes; i++ )
+	{
+		counts[i] = probe.words[i]->load(memory_order_relaxed) >> probe.shifts[i] & countMax;
+
+		if ( counts[i] < count )
+		{
+			count = counts[i];
+		}
+	}
+
+	if ( count == countMax )
+	{
+		return count;
+	}
+
+	// Only the minimum counters are incremented (the others already count
+	// more than this hash's occurrences). Another thread can increment one
+	// in between, which can only over-count.
+	//
+	for ( int i = 0; i < probes; i++ )
+	{
+		if ( counts[i] != count )
+		{
+			continue;
+		}
+
+		atomic<uint64_t> & word = *probe.words[i];
+		uint64_t value = word.load(memory_order_relaxed);
+
+		while
+		(
+			(value >> probe.shifts[i] & countMax) != countMax &&
+			! word.compare_exchange_weak(value, value + ((uint64_t)1 << probe.shifts[i]), memory_order_relaxed)
+		);
+	}
+
+	return count + 1;
+}
+
+uint32_t CountingFilter::count(uint64_t hash) const
+{
+	Probe probe;
+	uint32_t count = countMax;
+
+	locate(hash, probe);
+
+	for ( int i = 0; i < probes; i++ )
+	{
+		uint32_t counter = probe.words[i]->load(memory_order_relaxed) >> probe.shifts[i] & countMax;
+
+		if ( counter < count )
+		{
+			count = counter;
+		}
+	}
+
+	return count;
+}
+
+void CountingFilter::clear()
+{
+	memset((void *)table, 0, getBytes());
+}
+
+void CountingFilter::locate(uint64_t hash, Probe & probe) const
+{
+	// The hashes counted are the smallest of a sketch, so their high bits are
+	// mostly 0; mix them (the MurmurHash3 finalizer) before picking the block
+	// from the high bits and counters from the low ones.
+	//
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+	hash *= 0xc4ceb9fe1a85ec53ULL;
+	hash ^= hash >> 33;
+
+	atomic<uint64_t> * block = table + ((unsigned __int128)hash * blocks >> 64) * blockWords;
+
+	// one of each pair of words, so the probes are in different words
+	//
+	for ( int i = 0; i < probes; i++ )
+	{
+		probe.words[i] = block + 2 * i + (hash >> (5 * i) & 1);
+		probe.shifts[i] = (hash >> (5 * i + 1) & 15) * 4;
+	}
+}
@@ -0,0 +1,59 @@
+// Copyright © 2015, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen,
+// Sergey Koren, and Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#ifndef CountingFilter_h
+#define CountingFilter_h
+
+#include <atomic>
+#include <stdint.h>
+
+// Approximate counts of hashes in a fixed amount of memory (a count-min
+// sketch), for filtering out k-mers of reads seen fewer than a minimum number
+// of times without storing each one. Counters are 4 bits (saturating at
+// countMax) and each hash has one in each of 4 words of a 64-byte block, so
+// counting or looking up a hash touches one cache line. Counts can be over
+// (when other hashes share all 4 counters) but never under, and counters are
+// only incremented if they hold the minimum (conservative update), which
+// keeps over-counting down.
+//
+// Counting is thread-safe, so threads sketching one sample can share a
+// filter.
+
+class CountingFilter
+{
+public:
+
+	static const uint32_t countMax = 15;
+
+	CountingFilter(uint64_t bytes); // at least one block
+	~CountingFilter();
+
+	// counts hash, returning its count so far (including this one)
+	//
+	uint32_t add(uint64_t hash);
+
+	uint32_t count(uint64_t hash) const;
+	uint64_t getBytes() const {return blocks * blockWords * sizeof(uint64_t);}
+	void clear();
+
+private:
+
+	static const int blockWords = 8;
+	static const int probes = 4;
+
+	struct Probe
+	{
+		std::atomic<uint64_t> * words[probes];
+		int shifts[probes];
+	};
+
+	void locate(uint64_t hash, Probe & probe) const;
+
+	uint64_t blocks;
+	std::atomic<uint64_t> * table;
+};
+
+#endif
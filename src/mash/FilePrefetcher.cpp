@@ -0,0 +1,182 @@
+// Copyright © 2015, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen,
+// Sergey Koren, and Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#include "FilePrefetcher.h"
+#include "Stats.h"
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace::std;
+
+static const int threadsMax = 16;
+
+FilePrefetcher::FilePrefetcher(int depthNew)
+	:
+	depth(depthNew)
+{
+	// the reads are I/O bound, so a thread for each of the first few
+	//
+	int threadCount = depth < threadsMax ? depth : threadsMax;
+	
+	for ( int i = 0; i < threadCount; i++ )
+	{
+		threads.push_back(thread(&FilePrefetcher::run, this));
+	}
+}
+
+FilePrefetcher::~FilePrefetcher()
+{
+	{
+		lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	
+	condition.notify_all();
+	
+	for ( size_t i = 0; i < threads.size(); i++ )
+	{
+		threads[i].join();
+	}
+	
+	for ( size_t i = 0; i < slots.size(); i++ )
+	{
+		delete slots[i].file;
+	}
+	
+	for ( size_t i = 0; i < spare.size(); i++ )
+	{
+		delete spare[i];
+	}
+}
+
+uint64_t FilePrefetcher::add(const string & file)
+{
+	lock_guard<std::mutex> lock(mutex);
+	
+	slots.push_back(Slot());
+	slots.back().name = file;
+	condition.notify_all();
+	
+	return slotFirst + slots.size() - 1;
+}
+
+FilePrefetcher::File * FilePrefetcher::take(uint64_t id)
+{
+	unique_lock<std::mutex> lock(mutex);
+	Slot & slot = slots[id - slotFirst];
+	
+	if ( ! slot.ready )
+	{
+		Stats::Timer timer(Stats::reading);
+		
+		condition.wait(lock, [&slot]{return slot.ready;});
+	}
+	
+	File * file = slot.file;
+	
+	slot.file = 0;
+	slot.taken = true;
+	
+	while ( slots.size() != 0 && slots.front().taken )
+	{
+		slots.pop_front();
+		slotFirst++;
+	}
+	
+	return file;
+}
+
+void FilePrefetcher::release(File * file)
+{
+	{
+		lock_guard<std::mutex> lock(mutex);
+		
+		spare.push_back(file);
+		reading--;
+	}
+	
+	condition.notify_all();
+}
+
+void FilePrefetcher::read(const string & name, File & file) const
+{
+	Stats::Timer timer(Stats::reading);
+	int fd = open(name.c_str(), O_RDONLY);
+	struct stat fileInfo;
+	
+	file.good = false;
+	
+	if ( fd < 0 )
+	{
+		return;
+	}
+	
+	if ( fstat(fd, &fileInfo) == 0 && S_ISREG(fileInfo.st_mode) )
+	{
+		uint64_t size = fileInfo.st_size;
+		uint64_t done = 0;
+		
+		file.data.resize(size);
+		
+		while ( done < size )
+		{
+			ssize_t bytes = ::read(fd, file.data.data() + done, size - done);
+			
+			if ( bytes <= 0 )
+			{
+				break;
+			}
+			
+			done += bytes;
+		}
+		
+		file.good = done == size;
+	}
+	
+	close(fd);
+}
+
+void FilePrefetcher::run()
+{
+	unique_lock<std::mutex> lock(mutex);
+	
+	while ( true )
+	{
+		condition.wait(lock, [this]{return stopping || (slotNext < slotFirst + slots.size() && reading < depth);});
+		
+		if ( stopping )
+		{
+			return;
+		}
+		
+		uint64_t id = slotNext++;
+		string name = slots[id - slotFirst].name;
+		File * file;
+		
+		reading++;
+		
+		if ( spare.size() != 0 )
+		{
+			file = spare.back();
+			spare.pop_back();
+		}
+		else
+		{
+			file = new File();
+		}
+		
+		lock.unlock();
+		read(name, *file);
+		lock.lock();
+		
+		Slot & slot = slots[id - slotFirst];
+		
+		slot.file = file;
+		slot.ready = true;
+		condition.notify_all();
+	}
+}
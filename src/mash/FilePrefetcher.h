@@ -0,0 +1,73 @@
+// Copyright © 2015, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen,
+// Sergey Koren, and Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#ifndef FilePrefetcher_h
+#define FilePrefetcher_h
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Reads input files into memory ahead of the threads that sketch them, for
+// sketch -prefetch, so those threads do not wait on storage with high
+// latency (e.g. network file systems) when there are many files. Files are
+// added in the order they are submitted for sketching and read in that
+// order by a few I/O threads of their own, up to depth files ahead of the
+// ones taken and not yet released. Buffers are reused once released.
+//
+// Each file must be taken (once) and released before the next one added,
+// by the same task, is taken. Since thread pools start tasks in submission
+// order, the files a task waits for are then always being read or next.
+
+class FilePrefetcher
+{
+public:
+	
+	struct File
+	{
+		std::vector<char> data;
+		bool good; // read whole; if not, the file should be opened as usual
+	};
+	
+	FilePrefetcher(int depthNew);
+	~FilePrefetcher();
+	
+	uint64_t add(const std::string & file); // returns its id for take()
+	File * take(uint64_t id); // waits until the file has been read
+	void release(File * file);
+	
+private:
+	
+	struct Slot
+	{
+		std::string name;
+		File * file = 0;
+		bool ready = false;
+		bool taken = false;
+	};
+	
+	void read(const std::string & name, File & file) const;
+	void run();
+	
+	int depth;
+	
+	std::deque<Slot> slots; // from id slotFirst
+	uint64_t slotFirst = 0;
+	uint64_t slotNext = 0; // to read
+	int reading = 0; // files being read or read but not yet released
+	std::vector<File *> spare;
+	bool stopping = false;
+	
+	std::mutex mutex;
+	std::condition_variable condition; // for everything; waits are few
+	std::vector<std::thread> threads;
+};
+
+#endif
@@ -5,13 +5,96 @@
 // See the LICENSE.txt file included with this software for license information.
 
 #include "HashList.h"
+#include "simd.h"
 #include <algorithm>
+#include <stdexcept>
+#include <string.h>
+
+#ifdef SIMD_X86
+#include <immintrin.h>
+#endif
+
+using namespace::std;
+
+// Packed layout (words are little-endian, as in the rest of the file):
+//
+//   header   one word: hash count (low 32 bits), tail width (next 8 bits)
+//   widths   one byte per full block (bits per delta), padded to a word
+//   blocks   hashPackLanes * width words each; value i of the block is bits
+//            [(i / lanes) * width, + width) of lane i % lanes, and word j of
+//            lane l is word j * lanes + l
+//   tail     the count % hashPackBlock values left, width bits each, in order
+//
+// Each value is the difference from the hash before it (the first from 0).
+
+static int bitWidth(uint64_t value)
+{
+    return value == 0 ? 0 : 64 - __builtin_clzll(value);
+}
+
+static uint64_t bitMask(int width)
+{
+    return width == 64 ? ~uint64_t(0) : (uint64_t(1) << width) - 1;
+}
+
+static void putBits(uint64_t * words, int stride, uint64_t bit, int width, uint64_t value)
+{
+    uint64_t word = bit / 64;
+    int shift = bit % 64;
+    
+    words[word * stride] |= value << shift;
+    
+    if ( shift + width > 64 )
+    {
+        words[(word + 1) * stride] |= value >> (64 - shift);
+    }
+}
+
+static uint64_t getBits(const uint64_t * words, int stride, uint64_t bit, int width)
+{
+    if ( width == 0 )
+    {
+        return 0;
+    }
+    
+    uint64_t word = bit / 64;
+    int shift = bit % 64;
+    uint64_t value = words[word * stride] >> shift;
+    
+    if ( shift + width > 64 )
+    {
+        value |= words[(word + 1) * stride] << (64 - shift);
+    }
+    
+    return value & bitMask(width);
+}
+
+static uint64_t tailWords(uint64_t count, int width)
+{
+    return ((count % hashPackBlock) * width + 63) / 64;
+}
 
 hash_u HashList::at(int index) const
 {
     hash_u hash;
     
-    if ( use64 )
+    if ( isView() )
+    {
+        if ( index < 0 || index >= viewSize )
+        {
+            throw std::out_of_range("HashList::at");
+        }
+        
+        if ( use64 )
+        {
+            hash.hash64 = view64[index];
+        }
+        else
+        {
+            hash.hash32 = view32[index];
+        }
+    }
+    else if ( use64 )
     {
         hash.hash64 = hashes64.at(index);
     }
@@ -25,6 +108,10 @@ hash_u HashList::at(int index) const
 
 void HashList::clear()
 {
+    view32 = 0;
+    view64 = 0;
+    viewSize = 0;
+    
     if ( use64 )
     {
         hashes64.clear();
@@ -47,6 +134,22 @@ void HashList::resize(int size)
     }
 }
 
+void HashList::setView32(const hash32_t * hashes, int count)
+{
+    hashes32.clear();
+    view32 = hashes;
+    view64 = 0;
+    viewSize = count;
+}
+
+void HashList::setView64(const hash64_t * hashes, int count)
+{
+    hashes64.clear();
+    view32 = 0;
+    view64 = hashes;
+    viewSize = count;
+}
+
 void HashList::set32(int index, uint32_t value)
 {
     hashes32[index] = value;
@@ -68,3 +171,204 @@ void HashList::sort()
         std::sort(hashes32.begin(), hashes32.end());
     }
 }
+
+void HashList::pack(vector<uint64_t> & words) const
+{
+    uint64_t count = size();
+    uint64_t blocks = count / hashPackBlock;
+    vector<uint64_t> deltas(count);
+    uint64_t previous = 0;
+    
+    for ( uint64_t i = 0; i < count; i++ )
+    {
+        uint64_t hash = use64 ? data64()[i] : data32()[i];
+        
+        deltas[i] = hash - previous;
+        previous = hash;
+    }
+    
+    // the last width is the tail's
+    //
+    vector<uint8_t> widths(blocks + 1, 0);
+    
+    for ( uint64_t i = 0; i < count; i++ )
+    {
+        widths[i / hashPackBlock] = max(widths[i / hashPackBlock], uint8_t(bitWidth(deltas[i])));
+    }
+    
+    int tailWidth = widths[blocks];
+    
+    words.assign(1 + (blocks + 7) / 8, 0);
+    words[0] = count | uint64_t(tailWidth) << 32;
+    
+    if ( blocks != 0 )
+    {
+        memcpy(words.data() + 1, widths.data(), blocks);
+    }
+    
+    for ( uint64_t i = 0; i < blocks; i++ )
+    {
+        int width = widths[i];
+        uint64_t start = words.size();
+        
+        words.resize(start + hashPackLanes * width, 0);
+        
+        for ( int j = 0; j < hashPackBlock; j++ )
+        {
+            putBits(words.data() + start + j % hashPackLanes, hashPackLanes, uint64_t(j / hashPackLanes) * width, width, deltas[i * hashPackBlock + j]);
+        }
+    }
+    
+    uint64_t start = words.size();
+    
+    words.resize(start + tailWords(count, tailWidth), 0);
+    
+    for ( uint64_t i = blocks * hashPackBlock; i < count; i++ )
+    {
+        putBits(words.data() + start, 1, (i - blocks * hashPackBlock) * tailWidth, tailWidth, deltas[i]);
+    }
+}
+
+bool HashList::unpack(const void * data, uint64_t bytes, uint64_t limit)
+{
+    const uint64_t * words = (const uint64_t *)data;
+    uint64_t wordCount = bytes / 8;
+    
+    if ( bytes % 8 != 0 || wordCount == 0 )
+    {
+        return false;
+    }
+    
+    uint64_t count = words[0] & 0xffffffff;
+    int tailWidth = (words[0] >> 32) & 0xff;
+    uint64_t blocks = count / hashPackBlock;
+    const uint8_t * widths = (const uint8_t *)(words + 1);
+    uint64_t expected = 1 + (blocks + 7) / 8;
+    
+    if ( expected > wordCount )
+    {
+        return false;
+    }
+    
+    for ( uint64_t i = 0; i < blocks; i++ )
+    {
+        if ( widths[i] > 64 )
+        {
+            return false;
+        }
+        
+        expected += hashPackLanes * widths[i];
+    }
+    
+    if ( tailWidth > 64 || expected + tailWords(count, tailWidth) != wordCount )
+    {
+        return false;
+    }
+    
+    // 32-bit hashes are decoded as 64-bit and narrowed
+    //
+    vector<uint64_t> wide;
+    
+    clear();
+    
+    if ( use64 )
+    {
+        hashes64.resize(count);
+    }
+    else
+    {
+        wide.resize(count);
+    }
+    
+    uint64_t * out = use64 ? hashes64.data() : wide.data();
+    const SimdKernels & kernels = getSimdKernels();
+    const uint64_t * block = words + 1 + (blocks + 7) / 8;
+    uint64_t hash = 0;
+    
+    for ( uint64_t i = 0; i < blocks; i++ )
+    {
+        kernels.unpackBlock(block, widths[i], hash, out + i * hashPackBlock);
+        hash = out[(i + 1) * hashPackBlock - 1];
+        block += hashPackLanes * widths[i];
+    }
+    
+    for ( uint64_t i = blocks * hashPackBlock; i < count; i++ )
+    {
+        hash += getBits(block, 1, (i - blocks * hashPackBlock) * tailWidth, tailWidth);
+        out[i] = hash;
+    }
+    
+    if ( count > limit )
+    {
+        count = limit;
+    }
+    
+    if ( use64 )
+    {
+        hashes64.resize(count);
+    }
+    else
+    {
+        hashes32.assign(wide.begin(), wide.begin() + count);
+    }
+    
+    return true;
+}
+
+uint64_t HashList::getPackedCount(const void * data, uint64_t bytes)
+{
+    return bytes < 8 ? 0 : *(const uint64_t *)data & 0xffffffff;
+}
+
+void unpackBlockScalar(const uint64_t * words, int width, uint64_t base, uint64_t * out)
+{
+    for ( int i = 0; i < hashPackBlock; i++ )
+    {
+        base += getBits(words + i % hashPackLanes, hashPackLanes, uint64_t(i / hashPackLanes) * width, width);
+        out[i] = base;
+    }
+}
+
+#ifdef SIMD_X86
+SIMD_TARGET_BEGIN(SIMD_TARGET_AVX2)
+void unpackBlockAvx2(const uint64_t * words, int width, uint64_t base, uint64_t * out)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i mask = _mm256_set1_epi64x(bitMask(width));
+    __m256i sum = _mm256_set1_epi64x(base);
+    
+    for ( int j = 0; j < hashPackBlock / hashPackLanes; j++ )
+    {
+        // one delta from each lane, i.e. the next four in order
+        
+        __m256i v = zero;
+        
+        if ( width != 0 )
+        {
+            uint64_t bit = uint64_t(j) * width;
+            uint64_t word = bit / 64;
+            int shift = bit % 64;
+            
+            v = _mm256_srl_epi64(_mm256_loadu_si256((const __m256i *)(words + word * hashPackLanes)), _mm_cvtsi32_si128(shift));
+            
+            if ( shift + width > 64 )
+            {
+                __m256i next = _mm256_loadu_si256((const __m256i *)(words + (word + 1) * hashPackLanes));
+                v = _mm256_or_si256(v, _mm256_sll_epi64(next, _mm_cvtsi32_si128(64 - shift)));
+            }
+            
+            v = _mm256_and_si256(v, mask);
+        }
+        
+        // prefix sum across the lanes, then carry in the last hash
+        
+        v = _mm256_add_epi64(v, _mm256_blend_epi32(_mm256_permute4x64_epi64(v, _MM_SHUFFLE(2, 1, 0, 0)), zero, 0x03));
+        v = _mm256_add_epi64(v, _mm256_permute2x128_si256(v, v, 0x08));
+        v = _mm256_add_epi64(v, sum);
+        
+        _mm256_storeu_si256((__m256i *)(out + j * hashPackLanes), v);
+        sum = _mm256_permute4x64_epi64(v, _MM_SHUFFLE(3, 3, 3, 3));
+    }
+}
+SIMD_TARGET_END
+#endif
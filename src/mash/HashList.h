@@ -11,6 +11,13 @@
 #include <vector>
 #include <algorithm>
 
+// Packed hashes (see HashList::pack()) are delta-encoded in blocks of
+// hashPackBlock, each bit-packed into hashPackLanes interleaved lanes so a
+// vector register decodes one value from every lane at a time.
+//
+static const int hashPackBlock = 256;
+static const int hashPackLanes = 4;
+
 class HashList
 {
 public:
@@ -20,15 +27,29 @@ public:
     
     hash_u at(int index) const;
     void clear();
+    const hash32_t * data32() const {return view32 != 0 ? view32 : hashes32.data();}
+    const hash64_t * data64() const {return view64 != 0 ? view64 : hashes64.data();}
     void resize(int size);
     void set32(int index, uint32_t value);
     void set64(int index, uint64_t value);
     void setUse64(bool use64New) {use64 = use64New;}
-    int size() const {return use64 ? hashes64.size() : hashes32.size();}
+    void setView32(const hash32_t * hashes, int count);
+    void setView64(const hash64_t * hashes, int count);
+    int size() const {return isView() ? viewSize : use64 ? hashes64.size() : hashes32.size();}
+    bool isView() const {return view32 != 0 || view64 != 0;}
     void sort();
     void push_back32(hash32_t hash) {hashes32.push_back(hash);}
     void push_back64(hash64_t hash) {hashes64.push_back(hash);}
     bool get64() const {return use64;}
+    
+    // The (sorted) hashes as the hashesPacked field of a sketch file, and
+    // back, decoding at most limit of them; unpack() returns false if the
+    // data are malformed.
+    //
+    void pack(std::vector<uint64_t> & words) const;
+    bool unpack(const void * data, uint64_t bytes, uint64_t limit);
+    static uint64_t getPackedCount(const void * data, uint64_t bytes);
+    
 	void merge(HashList & that)
 	{
 		if(use64){
@@ -54,6 +75,22 @@ public:
     bool use64;
     std::vector<hash32_t> hashes32;
     std::vector<hash64_t> hashes64;
+    
+private:
+    
+    // Read-only hashes owned elsewhere (e.g. a memory-mapped sketch file),
+    // used instead of the vectors while set. Modifying the list (other than
+    // clear(), which drops the view) is not supported.
+    //
+    const hash32_t * view32 = 0;
+    const hash64_t * view64 = 0;
+    int viewSize = 0;
 };
 
+// Decode one block of packed deltas with the given bit width, adding them up
+// from base into hashPackBlock hashes (see SimdKernels::unpackBlock).
+//
+void unpackBlockScalar(const uint64_t * words, int width, uint64_t base, uint64_t * out);
+void unpackBlockAvx2(const uint64_t * words, int width, uint64_t base, uint64_t * out);
+
 #endif
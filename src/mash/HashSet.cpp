@@ -5,31 +5,13 @@
 // See the LICENSE.txt file included with this software for license information.
 
 #include "HashSet.h"
+#include <algorithm>
+
+using namespace::std;
 
 uint32_t HashSet::count(hash_u hash) const
 {
-	if ( use64 )
-	{
-		if ( hashes64.count(hash.hash64) )
-		{
-			return hashes64.at(hash.hash64);
-		}
-		else
-		{
-			return 0;
-		}
-	}
-	else
-	{
-		if ( hashes32.count(hash.hash32) )
-		{
-			return hashes32.at(hash.hash32);
-		}
-		else
-		{
-			return 0;
-		}
-	}
+	return use64 ? hashes64.count(hash.hash64) : hashes32.count(hash.hash32);
 }
 
 void HashSet::erase(hash_u hash)
@@ -48,47 +30,23 @@ void HashSet::insert(hash_u hash, uint32_t count)
 {
     if ( use64 )
     {
-    	hash64_t hash64 = hash.hash64;
-    	
-    	if ( hashes64.count(hash64) )
-    	{
-    		hashes64[hash64] = hashes64.at(hash64) + count;
-    	}
-    	else
-    	{
-	        hashes64[hash64] = count;
-	    }
+        hashes64.insert(hash.hash64, count);
     }
     else
     {
-    	hash32_t hash32 = hash.hash32;
-    	
-    	if ( hashes32.count(hash32) )
-    	{
-    		hashes32[hash32] = hashes32.at(hash32) + count;
-    	}
-    	else
-    	{
-	        hashes32[hash32] = count;
-	    }
+        hashes32.insert(hash.hash32, count);
     }
 }
 
-void HashSet::toCounts(std::vector<uint32_t> & counts) const
+void HashSet::toCounts(vector<uint32_t> & counts) const
 {
     if ( use64 )
     {
-        for ( robin_hood::unordered_map<hash64_t, uint32_t>::const_iterator i = hashes64.begin(); i != hashes64.end(); ++i )
-        {
-            counts.push_back(i->second);
-        }
+        hashes64.forEach([&](hash64_t, uint32_t count) {counts.push_back(count);});
     }
     else
     {
-        for ( robin_hood::unordered_map<hash32_t, uint32_t>::const_iterator i = hashes32.begin(); i != hashes32.end(); ++i )
-        {
-            counts.push_back(i->second);
-        }
+        hashes32.forEach([&](hash32_t, uint32_t count) {counts.push_back(count);});
     }
 }
 
@@ -96,16 +54,42 @@ void HashSet::toHashList(HashList & hashList) const
 {
     if ( use64 )
     {
-        for ( robin_hood::unordered_map<hash64_t, uint32_t>::const_iterator i = hashes64.begin(); i != hashes64.end(); ++i )
-        {
-            hashList.push_back64(i->first);
-        }
+        hashes64.forEach([&](hash64_t hash, uint32_t) {hashList.push_back64(hash);});
+    }
+    else
+    {
+        hashes32.forEach([&](hash32_t hash, uint32_t) {hashList.push_back32(hash);});
+    }
+}
+
+void HashSet::toSortedHashList(HashList & hashList, vector<uint32_t> & counts) const
+{
+    vector<pair<uint64_t, uint32_t>> entries;
+    entries.reserve(size());
+
+    if ( use64 )
+    {
+        hashes64.forEach([&](hash64_t hash, uint32_t count) {entries.push_back(make_pair(hash, count));});
     }
     else
     {
-        for ( robin_hood::unordered_map<hash32_t, uint32_t>::const_iterator i = hashes32.begin(); i != hashes32.end(); ++i )
+        hashes32.forEach([&](hash32_t hash, uint32_t count) {entries.push_back(make_pair(hash, count));});
+    }
+
+    sort(entries.begin(), entries.end());
+    counts.reserve(counts.size() + entries.size());
+
+    for ( uint64_t i = 0; i < entries.size(); i++ )
+    {
+        if ( use64 )
         {
-            hashList.push_back32(i->first);
+            hashList.push_back64(entries[i].first);
         }
+        else
+        {
+            hashList.push_back32(entries[i].first);
+        }
+
+        counts.push_back(entries[i].second);
     }
 }
@@ -8,29 +8,245 @@
 #define HashSet_h
 
 #include "HashList.h"
-//#include <unordered_map>
+#include <stdint.h>
 #include <vector>
-#include "robin_hood.h"
+
+// Open-addressing table of hashes with a count each, in flat arrays of keys
+// and counts (linear probing, at most half full). Slots are chosen by a
+// multiplicative mix of the key, since the keys kept by a MinHashHeap are the
+// smallest hashes and so share their high bits. Key 0 marks empty slots, so
+// hash 0 is held beside the table. Erasing shifts the rest of the probe run
+// back rather than leaving tombstones, so lookups stay short however many
+// hashes pass through (as they do in the pending set of a heap).
+//
+// Without counted, there is no array of counts and every key present counts
+// as 1, for sets that never need multiplicity.
+//
+template <class Key>
+class FlatHashTable
+{
+public:
+
+	FlatHashTable(bool countedNew = true) : counted(countedNew), used(0), hasZero(false), zeroCount(0), shift(64) {}
+
+	uint64_t size() const {return used + hasZero;}
+
+	void clear()
+	{
+		std::fill(keys.begin(), keys.end(), 0);
+		used = 0;
+		hasZero = false;
+	}
+
+	// sized for count keys without growing
+	//
+	void reserve(uint64_t count)
+	{
+		uint64_t capacity = 16;
+
+		while ( capacity < 2 * count )
+		{
+			capacity *= 2;
+		}
+
+		if ( capacity > keys.size() )
+		{
+			rehash(capacity);
+		}
+	}
+
+	uint32_t count(Key key) const
+	{
+		if ( key == 0 )
+		{
+			return hasZero ? zeroCount : 0;
+		}
+
+		if ( used == 0 )
+		{
+			return 0;
+		}
+
+		for ( uint64_t slot = home(key); keys[slot] != 0; slot = (slot + 1) & mask() )
+		{
+			if ( keys[slot] == key )
+			{
+				return counted ? counts[slot] : 1;
+			}
+		}
+
+		return 0;
+	}
+
+	void insert(Key key, uint32_t count)
+	{
+		if ( key == 0 )
+		{
+			zeroCount = ! counted ? 1 : hasZero ? zeroCount + count : count;
+			hasZero = true;
+			return;
+		}
+
+		if ( 2 * (used + 1) > keys.size() )
+		{
+			rehash(keys.size() ? 2 * keys.size() : 16);
+		}
+
+		uint64_t slot = home(key);
+
+		while ( keys[slot] != 0 && keys[slot] != key )
+		{
+			slot = (slot + 1) & mask();
+		}
+
+		if ( keys[slot] == 0 )
+		{
+			keys[slot] = key;
+			used++;
+
+			if ( counted )
+			{
+				counts[slot] = count;
+			}
+		}
+		else if ( counted )
+		{
+			counts[slot] += count;
+		}
+	}
+
+	void erase(Key key)
+	{
+		if ( key == 0 )
+		{
+			hasZero = false;
+			return;
+		}
+
+		if ( used == 0 )
+		{
+			return;
+		}
+
+		uint64_t slot = home(key);
+
+		while ( keys[slot] != key )
+		{
+			if ( keys[slot] == 0 )
+			{
+				return;
+			}
+
+			slot = (slot + 1) & mask();
+		}
+
+		// move back later keys of the run that may not skip the hole
+		//
+		for ( uint64_t next = (slot + 1) & mask(); keys[next] != 0; next = (next + 1) & mask() )
+		{
+			uint64_t nextHome = home(keys[next]);
+
+			if ( ((next - nextHome) & mask()) >= ((next - slot) & mask()) )
+			{
+				keys[slot] = keys[next];
+
+				if ( counted )
+				{
+					counts[slot] = counts[next];
+				}
+
+				slot = next;
+			}
+		}
+
+		keys[slot] = 0;
+		used--;
+	}
+
+	// visits (key, count) in slot order, which is the same for every call
+	// until the table changes
+	//
+	template <class Visit>
+	void forEach(const Visit & visit) const
+	{
+		if ( hasZero )
+		{
+			visit(Key(0), zeroCount);
+		}
+
+		for ( uint64_t slot = 0; slot < keys.size(); slot++ )
+		{
+			if ( keys[slot] != 0 )
+			{
+				visit(keys[slot], counted ? counts[slot] : 1);
+			}
+		}
+	}
+
+private:
+
+	uint64_t mask() const {return keys.size() - 1;}
+	uint64_t home(Key key) const {return uint64_t(key) * 0x9e3779b97f4a7c15ULL >> shift;}
+
+	void rehash(uint64_t capacity)
+	{
+		std::vector<Key> keysOld(capacity, 0);
+		std::vector<uint32_t> countsOld(counted ? capacity : 0);
+
+		keys.swap(keysOld);
+		counts.swap(countsOld);
+		used = 0;
+		shift = 64 - __builtin_ctzll(capacity);
+
+		for ( uint64_t slot = 0; slot < keysOld.size(); slot++ )
+		{
+			if ( keysOld[slot] != 0 )
+			{
+				insert(keysOld[slot], counted ? countsOld[slot] : 1);
+			}
+		}
+	}
+
+	bool counted;
+	std::vector<Key> keys; // size is 0 or a power of 2
+	std::vector<uint32_t> counts; // empty if not counted
+	uint64_t used; // nonzero keys
+
+	bool hasZero;
+	uint32_t zeroCount;
+
+	int shift;
+};
 
 class HashSet
 {
 public:
 
-    HashSet(bool use64New) : use64(use64New) {}
-    
+    // see FlatHashTable for counted
+    //
+    HashSet(bool use64New, bool countedNew = true) : use64(use64New), hashes32(countedNew), hashes64(countedNew) {}
+
     int size() const {return use64 ? hashes64.size() : hashes32.size();}
     void clear() {use64 ? hashes64.clear() : hashes32.clear();}
+    void reserve(uint64_t count) {use64 ? hashes64.reserve(count) : hashes32.reserve(count);}
     uint32_t count(hash_u hash) const;
     void erase(hash_u hash);
     void insert(hash_u hash, uint32_t count = 1);
+
+    // in the same (unsorted) order
+    //
     void toHashList(HashList & hashList) const;
     void toCounts(std::vector<uint32_t> & counts) const;
-    
+
+    // the hashes in increasing order, with their counts (sorted as pairs)
+    //
+    void toSortedHashList(HashList & hashList, std::vector<uint32_t> & counts) const;
+
 private:
-    
+
     bool use64;
-    robin_hood::unordered_map<hash32_t, uint32_t> hashes32;
-    robin_hood::unordered_map<hash64_t, uint32_t> hashes64;
+    FlatHashTable<hash32_t> hashes32;
+    FlatHashTable<hash64_t> hashes64;
 };
 
 #endif
@@ -0,0 +1,131 @@
+// Copyright © 2015, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen,
+// Sergey Koren, and Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#include "HyperLogLog.h"
+#include "simd.h"
+#include <math.h>
+
+#ifdef SIMD_X86
+#include <immintrin.h>
+#endif
+
+using namespace::std;
+
+int hllGetPrecision(uint64_t count)
+{
+	for ( int precision = hllPrecisionMin; precision <= hllPrecisionMax; precision++ )
+	{
+		if ( count == uint64_t(1) << precision )
+		{
+			return precision;
+		}
+	}
+	
+	return 0;
+}
+
+void hllMerge(vector<uint8_t> & registers, const vector<uint8_t> & other)
+{
+	if ( registers.size() == 0 )
+	{
+		registers = other;
+		return;
+	}
+	
+	if ( registers.size() != other.size() )
+	{
+		return;
+	}
+	
+	for ( uint64_t i = 0; i < registers.size(); i++ )
+	{
+		registers[i] = max(registers[i], other[i]);
+	}
+}
+
+double hllEstimate(const uint8_t * a, const uint8_t * b, uint64_t count)
+{
+	uint64_t zeros;
+	double sum = getSimdKernels().hllSum(a, b, count, &zeros);
+	double m = count;
+	double alpha =
+		count == 16 ? 0.673 :
+		count == 32 ? 0.697 :
+		count == 64 ? 0.709 :
+		0.7213 / (1. + 1.079 / m);
+	double estimate = alpha * m * m / sum;
+	
+	// linear counting is more accurate while many registers are empty (the
+	// hashes are 64 bits, so there is no correction for large sets)
+	//
+	if ( estimate <= 2.5 * m && zeros != 0 )
+	{
+		estimate = m * log(m / zeros);
+	}
+	
+	return estimate;
+}
+
+double hllSumScalar(const uint8_t * a, const uint8_t * b, uint64_t count, uint64_t * zeros)
+{
+	double sum = 0;
+	
+	*zeros = 0;
+	
+	for ( uint64_t i = 0; i < count; i++ )
+	{
+		int reg = max(a[i], b[i]);
+		
+		sum += ldexp(1., -reg);
+		*zeros += reg == 0;
+	}
+	
+	return sum;
+}
+
+#ifdef SIMD_X86
+SIMD_TARGET_BEGIN(SIMD_TARGET_AVX2)
+double hllSumAvx2(const uint8_t * a, const uint8_t * b, uint64_t count, uint64_t * zeros)
+{
+	// 2^-r is made as a float with the exponent 127 - r (there are at most
+	// 65 - hllPrecisionMin ranks), and summed as doubles
+	//
+	const __m256i bias = _mm256_set1_epi32(127);
+	const __m256i zero = _mm256_setzero_si256();
+	__m256d sum0 = _mm256_setzero_pd();
+	__m256d sum1 = _mm256_setzero_pd();
+	uint64_t zeroCount = 0;
+	uint64_t i = 0;
+	
+	for ( ; i + 32 <= count; i += 32 )
+	{
+		__m256i regs = _mm256_max_epu8(_mm256_loadu_si256((const __m256i *)(a + i)), _mm256_loadu_si256((const __m256i *)(b + i)));
+		
+		zeroCount += __builtin_popcount(_mm256_movemask_epi8(_mm256_cmpeq_epi8(regs, zero)));
+		
+		for ( int j = 0; j < 4; j++ )
+		{
+			__m128i half = j < 2 ? _mm256_castsi256_si128(regs) : _mm256_extracti128_si256(regs, 1);
+			__m256i ranks = _mm256_cvtepu8_epi32(j % 2 ? _mm_srli_si128(half, 8) : half);
+			__m256 powers = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_sub_epi32(bias, ranks), 23));
+			
+			sum0 = _mm256_add_pd(sum0, _mm256_cvtps_pd(_mm256_castps256_ps128(powers)));
+			sum1 = _mm256_add_pd(sum1, _mm256_cvtps_pd(_mm256_extractf128_ps(powers, 1)));
+		}
+	}
+	
+	double sums[4];
+	
+	_mm256_storeu_pd(sums, _mm256_add_pd(sum0, sum1));
+	
+	double sum = hllSumScalar(a + i, b + i, count - i, zeros);
+	
+	*zeros += zeroCount;
+	
+	return sum + sums[0] + sums[1] + sums[2] + sums[3];
+}
+SIMD_TARGET_END
+#endif
@@ -0,0 +1,56 @@
+// Copyright © 2015, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen,
+// Sergey Koren, and Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#ifndef HyperLogLog_h
+#define HyperLogLog_h
+
+#include <stdint.h>
+#include <vector>
+
+// HyperLogLog registers of every k-mer hash of a reference (sketch -hll), a
+// byte for each of 2^precision buckets, from which the number of distinct
+// k-mers of a reference, or of the union of two, is estimated to a relative
+// error of about 1.04 / sqrt(2^precision), however large the sketch is.
+
+static const int hllPrecisionMin = 4;
+static const int hllPrecisionMax = 16;
+
+inline void hllAdd(uint8_t * registers, int precision, uint64_t hash)
+{
+	// the bucket is the top bits; the rank is the position of the first set
+	// bit after them (with a sentinel bit, so at most 65 - precision)
+	//
+	uint64_t rest = hash << precision | uint64_t(1) << (precision - 1);
+	uint8_t rank = __builtin_clzll(rest) + 1;
+	uint8_t & reg = registers[hash >> (64 - precision)];
+	
+	if ( rank > reg )
+	{
+		reg = rank;
+	}
+}
+
+// precision of registers, or 0 if their count is not a power of two in range
+//
+int hllGetPrecision(uint64_t count);
+
+// Adds the registers of other (as if its hashes had been added), which are
+// copied if there are none yet, and ignored if their precision differs.
+//
+void hllMerge(std::vector<uint8_t> & registers, const std::vector<uint8_t> & other);
+
+// Distinct hashes of a, or of the union of a and b (which can be a), with
+// count registers each.
+//
+double hllEstimate(const uint8_t * a, const uint8_t * b, uint64_t count);
+
+// Sum of 2^-max(a[i], b[i]), setting zeros to the registers that are 0 in
+// both (see SimdKernels::hllSum).
+//
+double hllSumScalar(const uint8_t * a, const uint8_t * b, uint64_t count, uint64_t * zeros);
+double hllSumAvx2(const uint8_t * a, const uint8_t * b, uint64_t count, uint64_t * zeros);
+
+#endif
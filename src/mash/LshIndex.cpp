@@ -0,0 +1,311 @@
+// Copyright © 2015, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen,
+// Sergey Koren, and Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#include "LshIndex.h"
+#include <algorithm>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+using namespace::std;
+
+static const uint64_t mixMultiplier = 0x9e3779b97f4a7c15;
+
+bool LshIndex::chooseShape(uint64_t sketchSize, double jaccardMin, double recall, Shape & shape)
+{
+	// about four hashes per bin, leaving e^-4 (2%) of them empty, which
+	// lowers the chance of a bin matching by as much
+	//
+	shape.bins = max(sketchSize / 4, uint64_t(1));
+	shape.rows = 1;
+	shape.bands = shape.bins;
+
+	double p = jaccardMin * (1. - exp(-double(sketchSize) / shape.bins));
+
+	if ( p <= 0 || recall >= 1 )
+	{
+		return recall <= 0;
+	}
+
+	bool found = false;
+
+	for ( uint64_t rows = 1; rows <= shape.bins; rows++ )
+	{
+		double bands = ceil(log(1. - recall) / log1p(-pow(p, rows)));
+
+		if ( bands * rows > shape.bins )
+		{
+			break;
+		}
+
+		shape.rows = rows;
+		shape.bands = bands;
+		found = true;
+	}
+
+	return found;
+}
+
+void LshIndex::getBandKeys(const HashList & hashes, uint64_t * keysBand) const
+{
+	vector<uint64_t> mins(shape.bins, UINT64_MAX);
+	bool use64 = hashes.get64();
+
+	for ( int i = 0; i < hashes.size(); i++ )
+	{
+		uint64_t hash = use64 ? hashes.at(i).hash64 : hashes.at(i).hash32;
+		uint64_t bin = (unsigned __int128)(hash * mixMultiplier) * shape.bins >> 64;
+
+		if ( hash < mins[bin] )
+		{
+			mins[bin] = hash;
+		}
+	}
+
+	for ( uint64_t b = 0; b < shape.bands; b++ )
+	{
+		uint64_t key = b + 1;
+		bool empty = false;
+
+		for ( uint64_t r = b * shape.rows; r < (b + 1) * shape.rows; r++ )
+		{
+			empty |= mins[r] == UINT64_MAX;
+			key = (key ^ mins[r]) * mixMultiplier;
+			key ^= key >> 29;
+		}
+
+		keysBand[b] = empty ? keyNone : key == keyNone ? 1 : key;
+	}
+}
+
+void LshIndex::build(const Sketch & sketch, const Shape & shapeNew, int threads)
+{
+	shape = shapeNew;
+
+	uint64_t referenceCount = sketch.getReferenceCount();
+	vector<uint64_t> keysAll(referenceCount * shape.bands);
+
+	#pragma omp parallel for schedule(dynamic, 64) num_threads(threads)
+	for ( int64_t i = 0; i < int64_t(referenceCount); i++ )
+	{
+		getBandKeys(sketch.getReference(i).hashesSorted, keysAll.data() + i * shape.bands);
+	}
+
+	offsets.assign(shape.bands + 1, 0);
+
+	for ( uint64_t i = 0; i < keysAll.size(); i++ )
+	{
+		if ( keysAll[i] != keyNone )
+		{
+			offsets[i % shape.bands + 1]++;
+		}
+	}
+
+	for ( uint64_t b = 0; b < shape.bands; b++ )
+	{
+		offsets[b + 1] += offsets[b];
+	}
+
+	keys.resize(offsets[shape.bands]);
+	references.resize(offsets[shape.bands]);
+
+	// each band on its own, by key then reference
+	//
+	#pragma omp parallel for schedule(dynamic, 1) num_threads(threads)
+	for ( int64_t b = 0; b < int64_t(shape.bands); b++ )
+	{
+		vector<pair<uint64_t, uint32_t>> entries;
+
+		entries.reserve(offsets[b + 1] - offsets[b]);
+
+		for ( uint64_t i = 0; i < referenceCount; i++ )
+		{
+			uint64_t key = keysAll[i * shape.bands + b];
+
+			if ( key != keyNone )
+			{
+				entries.push_back(pair<uint64_t, uint32_t>(key, i));
+			}
+		}
+
+		sort(entries.begin(), entries.end());
+
+		for ( uint64_t i = 0; i < entries.size(); i++ )
+		{
+			keys[offsets[b] + i] = entries[i].first;
+			references[offsets[b] + i] = entries[i].second;
+		}
+	}
+}
+
+void LshIndex::findCandidates(const HashList & query, vector<uint32_t> & candidates) const
+{
+	vector<uint64_t> keysQuery(shape.bands);
+
+	getBandKeys(query, keysQuery.data());
+	candidates.clear();
+
+	for ( uint64_t b = 0; b < shape.bands; b++ )
+	{
+		if ( keysQuery[b] == keyNone )
+		{
+			continue;
+		}
+
+		const uint64_t * begin = keys.data() + offsets[b];
+		const uint64_t * end = keys.data() + offsets[b + 1];
+		const uint64_t * found = lower_bound(begin, end, keysQuery[b]);
+
+		for ( ; found != end && *found == keysQuery[b]; found++ )
+		{
+			candidates.push_back(references[found - keys.data()]);
+		}
+	}
+
+	sort(candidates.begin(), candidates.end());
+	candidates.erase(unique(candidates.begin(), candidates.end()), candidates.end());
+}
+
+bool LshIndex::open(const string & file, const Sketch & sketch, const Shape & shapeNew, string & error)
+{
+	FILE * stream = fopen(file.c_str(), "rb");
+
+	if ( stream == NULL )
+	{
+		error = file + " does not exist";
+		return false;
+	}
+
+	FileHeader header;
+	FileHeader expected;
+
+	expected.identify(sketch);
+
+	if ( fread(&header, sizeof(FileHeader), 1, stream) != 1 || header.magic != FileHeader::magicValue || header.version != FileHeader::versionCurrent )
+	{
+		error = file + " is not an LSH index (of this version of Mash)";
+	}
+	else if ( ! header.sameSketch(expected) )
+	{
+		error = file + " is the index of other references";
+	}
+	else if ( header.bins != shapeNew.bins || header.rows != shapeNew.rows || header.bands != shapeNew.bands )
+	{
+		error = file + " is for another distance or recall";
+	}
+
+	if ( error.empty() )
+	{
+		shape = shapeNew;
+		offsets.resize(shape.bands + 1);
+		keys.resize(header.entryCount);
+		references.resize(header.entryCount);
+
+		if
+		(
+			fread(offsets.data(), sizeof(uint64_t), offsets.size(), stream) != offsets.size() ||
+			fread(keys.data(), sizeof(uint64_t), keys.size(), stream) != keys.size() ||
+			fread(references.data(), sizeof(uint32_t), references.size(), stream) != references.size() ||
+			offsets[shape.bands] != header.entryCount
+		)
+		{
+			error = file + " is truncated";
+		}
+	}
+
+	fclose(stream);
+
+	if ( ! error.empty() )
+	{
+		offsets.clear();
+		keys.clear();
+		references.clear();
+		return false;
+	}
+
+	return true;
+}
+
+bool LshIndex::write(const string & file, const Sketch & sketch) const
+{
+	FileHeader header;
+
+	header.identify(sketch);
+	header.bins = shape.bins;
+	header.rows = shape.rows;
+	header.bands = shape.bands;
+	header.entryCount = keys.size();
+
+	string fileNew = file + ".new";
+	FILE * stream = fopen(fileNew.c_str(), "wb");
+
+	if ( stream == NULL )
+	{
+		return false;
+	}
+
+	bool good =
+		fwrite(&header, sizeof(FileHeader), 1, stream) == 1 &&
+		fwrite(offsets.data(), sizeof(uint64_t), offsets.size(), stream) == offsets.size() &&
+		fwrite(keys.data(), sizeof(uint64_t), keys.size(), stream) == keys.size() &&
+		fwrite(references.data(), sizeof(uint32_t), references.size(), stream) == references.size();
+
+	if ( fclose(stream) != 0 || ! good || rename(fileNew.c_str(), file.c_str()) != 0 )
+	{
+		remove(fileNew.c_str());
+		return false;
+	}
+
+	return true;
+}
+
+string LshIndex::indexFile(const string & sketchFile)
+{
+	string file = sketchFile;
+
+	if ( hasSuffix(file, suffixSketch) )
+	{
+		file.resize(file.length() - strlen(suffixSketch));
+	}
+
+	return file + ".msl";
+}
+
+void LshIndex::FileHeader::identify(const Sketch & sketch)
+{
+	referenceCount = sketch.getReferenceCount();
+	kmerSize = sketch.getKmerSize();
+	seed = sketch.getHashSeed();
+	use64 = sketch.getUse64();
+	hashTotal = 0;
+	hashSum = 0;
+
+	for ( uint64_t i = 0; i < referenceCount; i++ )
+	{
+		const HashList & hashes = sketch.getReference(i).hashesSorted;
+		uint64_t size = hashes.size();
+
+		hashTotal += size;
+		hashSum = hashSum * mixMultiplier + size;
+
+		if ( size != 0 )
+		{
+			hashSum = hashSum * mixMultiplier + (use64 ? hashes.at(0).hash64 : hashes.at(0).hash32);
+			hashSum = hashSum * mixMultiplier + (use64 ? hashes.at(size - 1).hash64 : hashes.at(size - 1).hash32);
+		}
+	}
+}
+
+bool LshIndex::FileHeader::sameSketch(const FileHeader & other) const
+{
+	return
+		referenceCount == other.referenceCount &&
+		hashTotal == other.hashTotal &&
+		hashSum == other.hashSum &&
+		kmerSize == other.kmerSize &&
+		seed == other.seed &&
+		use64 == other.use64;
+}
@@ -0,0 +1,113 @@
+// Copyright © 2015, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen,
+// Sergey Koren, and Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#ifndef LshIndex_h
+#define LshIndex_h
+
+#include "Sketch.h"
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Locality-sensitive index of the references of a sketch, for finding those
+// likely to be within a distance of a query without comparing it to all of
+// them (dist -lsh). The hashes of each sketch are divided into bins by a
+// mix of their value (one-permutation hashing), and the smallest of each bin
+// kept. Since a bottom-k sketch has every hash of its set below its largest,
+// the smallest hash of a bin it has any of is the smallest of that bin in
+// the whole set, so two sets have the same one with probability about their
+// Jaccard index J. The bins are grouped into bands of rows, and references
+// sharing all the rows of any band with a query are its candidates, found
+// with probability 1 - (1 - J^rows)^bands. Bands with an empty bin are left
+// out (for small sequences, whose sketches are not full).
+//
+// The shape (rows and bands) is chosen for a Jaccard index and recall, and
+// a built index can be written next to the sketch (<references>.msl; see
+// indexFile()) for later runs with the same shape to read.
+
+class LshIndex
+{
+public:
+
+	struct Shape
+	{
+		uint64_t bins = 0;
+		uint64_t rows = 0;
+		uint64_t bands = 0;
+
+		bool operator==(const Shape & other) const {return bins == other.bins && rows == other.rows && bands == other.bands;}
+	};
+
+	// The most rows per band (so the fewest candidates) with which pairs of
+	// at least jaccardMin are found with probability recall, for sketches of
+	// sketchSize. False if no shape reaches it (giving the one closest).
+	//
+	static bool chooseShape(uint64_t sketchSize, double jaccardMin, double recall, Shape & shape);
+
+	void build(const Sketch & sketch, const Shape & shapeNew, int threads);
+
+	// Reads an index written for sketch with shape; false (with the reason
+	// in error) if file is missing, not an index, or for other references or
+	// another shape.
+	//
+	bool open(const std::string & file, const Sketch & sketch, const Shape & shapeNew, std::string & error);
+
+	// Writes the index of sketch to file (replacing it atomically); false if
+	// it could not.
+	//
+	bool write(const std::string & file, const Sketch & sketch) const;
+
+	static std::string indexFile(const std::string & sketchFile);
+
+	// the references sharing a band with query, sorted
+	//
+	void findCandidates(const HashList & query, std::vector<uint32_t> & candidates) const;
+
+	const Shape & getShape() const {return shape;}
+
+private:
+
+	static const uint64_t keyNone = 0; // of bands with an empty bin
+
+	struct FileHeader
+	{
+		static const uint64_t magicValue = 0x584948534c48534d; // "MSHLSHIX" in file order
+		static const uint64_t versionCurrent = 1;
+
+		uint64_t magic = magicValue;
+		uint64_t version = versionCurrent;
+
+		// of the sketch indexed, as for screen indices
+		//
+		uint64_t referenceCount = 0;
+		uint64_t hashTotal = 0;
+		uint64_t hashSum = 0;
+		uint64_t kmerSize = 0;
+		uint64_t seed = 0;
+		uint64_t use64 = 0;
+
+		uint64_t bins = 0;
+		uint64_t rows = 0;
+		uint64_t bands = 0;
+		uint64_t entryCount = 0;
+
+		void identify(const Sketch & sketch);
+		bool sameSketch(const FileHeader & other) const;
+	};
+
+	void getBandKeys(const HashList & hashes, uint64_t * keys) const; // one per band
+
+	Shape shape;
+
+	// The (key, reference) entries of each band, sorted by key, band b
+	// being entries[offsets[b]] up to entries[offsets[b + 1]].
+	//
+	std::vector<uint64_t> offsets;
+	std::vector<uint64_t> keys;
+	std::vector<uint32_t> references;
+};
+
+#endif
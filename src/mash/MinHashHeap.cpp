@@ -1,6 +1,15 @@
 
 #include "MinHashHeap.h"
+#include "HyperLogLog.h"
+#include <algorithm>
 #include <iostream>
+#include <limits>
+#include "simd.h"
+#include "Stats.h"
+
+#ifdef SIMD_X86
+#include <immintrin.h>
+#endif
 
 using namespace::std;
 
@@ -16,43 +25,64 @@ MinHashHeap::MinHashHeap(bool use64New, uint64_t cardinalityMaximumNew, uint64_t
 	
 	multiplicitySum = 0;
 	
+	bottomK = multiplicityMinimum == 1 && memoryBoundBytes == 0;
+	stagedCount = 0;
+	threshold = numeric_limits<uint64_t>::max();
+	
+	if ( bottomK )
+	{
+		// slack lets a full vector of survivors be stored past capacity
+		//
+		staged.resize(cardinalityMaximum + 16);
+	}
+	else
+	{
+		// one past the sketch size before the largest is dropped
+		//
+		hashes.reserve(cardinalityMaximum + 1);
+	}
+	
 	if ( memoryBoundBytes == 0 )
 	{
-		bloomFilter = 0;
+		countingFilter = 0;
 	}
 	else
 	{
-		bloom_parameters bloomParams;
-		
-		bloomParams.projected_element_count = 1000000000;//(uint64_t)parameters.genomeSize * 10l; // TODO: error rate based on platform and coverage
-		bloomParams.false_positive_probability = 0;//parameters.bloomError;
-		bloomParams.maximum_size = memoryBoundBytes * 8l;
-		bloomParams.compute_optimal_parameters();
-		
-		kmersTotal = 0;
-		kmersUsed = 0;
-		
-		//if ( i == 0 && verbosity > 0 )
+		countingFilter = new CountingFilter(memoryBoundBytes);
+	}
+	
+	countingFilterShared = false;
+}
+
+MinHashHeap::MinHashHeap(bool use64New, uint64_t cardinalityMaximumNew, uint64_t multiplicityMinimumNew, CountingFilter * countingFilterNew) :
+	MinHashHeap(use64New, cardinalityMaximumNew, multiplicityMinimumNew)
+{
+	if ( countingFilterNew != 0 )
+	{
+		if ( bottomK )
 		{
-			//cerr << "   Bloom table size (bytes): " << bloomParams.optimal_parameters.table_size / 8 << endl;
+			vector<uint64_t>().swap(staged);
+			hashes.reserve(cardinalityMaximum + 1);
 		}
 		
-		bloomFilter = new bloom_filter(bloomParams);
+		bottomK = false;
+		countingFilter = countingFilterNew;
+		countingFilterShared = true;
 	}
 }
 
 MinHashHeap::~MinHashHeap()
 {
-	if ( bloomFilter != 0 )
+	if ( countingFilter != 0 && ! countingFilterShared )
 	{
-		delete bloomFilter;
+		delete countingFilter;
 	}
 }
 
 void MinHashHeap::computeStats()
 {
 	vector<uint32_t> counts;
-	hashes.toCounts(counts);
+	toCounts(counts);
 	
 	for ( int i = 0; i < counts.size(); i++ )
 	{
@@ -68,15 +98,311 @@ void MinHashHeap::clear()
 	hashesPending.clear();
 	hashesQueuePending.clear();
 	
-	if ( bloomFilter != 0 )
+	if ( countingFilter != 0 && ! countingFilterShared )
+	{
+		countingFilter->clear();
+	}
+	
+	bottom.clear();
+	bottomCounts.clear();
+	stagedCount = 0;
+	threshold = numeric_limits<uint64_t>::max();
+	
+	multiplicitySum = 0;
+	fill(hll.begin(), hll.end(), 0);
+}
+
+double MinHashHeap::estimateMultiplicity() const
+{
+	if ( bottomK )
+	{
+		flushBottom();
+		return bottom.size() ? (double)multiplicitySum / bottom.size() : 0;
+	}
+	
+	return hashes.size() ? (double)multiplicitySum / hashes.size() : 0;
+}
+
+double MinHashHeap::estimateSetSize() const
+{
+	if ( bottomK )
+	{
+		flushBottom();
+		return bottom.size() ? pow(2.0, use64 ? 64.0 : 32.0) * (double)bottom.size() / (double)bottom.back() : 0;
+	}
+	
+	return hashes.size() ? pow(2.0, use64 ? 64.0 : 32.0) * (double)hashes.size() / (use64 ? (double)hashesQueue.top().hash64 : (double)hashesQueue.top().hash32) : 0;
+}
+
+void MinHashHeap::toCounts(vector<uint32_t> & counts) const
+{
+	if ( bottomK )
+	{
+		flushBottom();
+		counts.insert(counts.end(), bottomCounts.begin(), bottomCounts.end());
+	}
+	else
+	{
+		hashes.toCounts(counts);
+	}
+}
+
+void MinHashHeap::toHashList(HashList & hashList) const
+{
+	if ( ! bottomK )
+	{
+		hashes.toHashList(hashList);
+		return;
+	}
+	
+	flushBottom();
+	
+	for ( uint64_t i = 0; i < bottom.size(); i++ )
+	{
+		if ( use64 )
+		{
+			hashList.push_back64(bottom[i]);
+		}
+		else
+		{
+			hashList.push_back32(bottom[i]);
+		}
+	}
+}
+
+void MinHashHeap::toSortedHashList(HashList & hashList, vector<uint32_t> & counts) const
+{
+	if ( ! bottomK )
+	{
+		hashes.toSortedHashList(hashList, counts);
+		return;
+	}
+	
+	// already sorted
+	//
+	toHashList(hashList);
+	toCounts(counts);
+}
+
+void MinHashHeap::flushBottom() const
+{
+	if ( stagedCount == 0 )
+	{
+		return;
+	}
+	
+	Stats::Timer timer(Stats::mergingHeap);
+	sort(staged.begin(), staged.begin() + stagedCount);
+	
+	// merge staged hashes (with repeats) into the sorted bottom-k, summing
+	// counts for repeats and keeping at most cardinalityMaximum
+	//
+	vector<uint64_t> merged;
+	vector<uint32_t> mergedCounts;
+	
+	merged.reserve(cardinalityMaximum);
+	mergedCounts.reserve(cardinalityMaximum);
+	
+	uint64_t i = 0;
+	uint64_t j = 0;
+	
+	while ( merged.size() < cardinalityMaximum && (i < bottom.size() || j < stagedCount) )
 	{
-		bloomFilter->clear();
+		uint64_t hash;
+		uint32_t count = 0;
+		
+		if ( j == stagedCount || (i < bottom.size() && bottom[i] <= staged[j]) )
+		{
+			hash = bottom[i];
+			count = bottomCounts[i];
+			i++;
+		}
+		else
+		{
+			hash = staged[j];
+		}
+		
+		while ( j < stagedCount && staged[j] == hash )
+		{
+			count++;
+			j++;
+		}
+		
+		merged.push_back(hash);
+		mergedCounts.push_back(count);
 	}
 	
+	bottom.swap(merged);
+	bottomCounts.swap(mergedCounts);
+	stagedCount = 0;
+	
 	multiplicitySum = 0;
+	
+	for ( uint64_t k = 0; k < bottomCounts.size(); k++ )
+	{
+		multiplicitySum += bottomCounts[k];
+	}
+	
+	if ( bottom.size() == cardinalityMaximum )
+	{
+		threshold = bottom.back();
+	}
+}
+
+void MinHashHeap::tryInsert(const hash_u * hashesNew, int count)
+{
+	if ( ! bottomK )
+	{
+		for ( int i = 0; i < count; i++ )
+		{
+			tryInsert(hashesNew[i]);
+		}
+		
+		return;
+	}
+	
+	int i = 0;
+	
+	if ( use64 )
+	{
+		const uint64_t * values = (const uint64_t *)hashesNew;
+		const SimdKernels & kernels = getSimdKernels();
+		
+		// chunks fit in the slack past capacity
+		//
+		for ( ; i < count; i += 16 )
+		{
+			int chunk = count - i < 16 ? count - i : 16;
+			int passed = kernels.filterBelow(values + i, chunk, threshold, staged.data() + stagedCount);
+			
+			stagedCount += passed;
+			Stats::count(Stats::heapRejects, chunk - passed);
+			
+			if ( stagedCount >= cardinalityMaximum )
+			{
+				flushBottom();
+			}
+		}
+	}
+	
+	for ( ; i < count; i++ )
+	{
+		tryInsert(hashesNew[i]);
+	}
 }
 
 void MinHashHeap::tryInsert(hash_u hash)
+{
+	if ( bottomK )
+	{
+		uint64_t value = use64 ? hash.hash64 : hash.hash32;
+		
+		if ( value <= threshold )
+		{
+			staged[stagedCount++] = value;
+			
+			if ( stagedCount >= cardinalityMaximum )
+			{
+				flushBottom();
+			}
+		}
+		else
+		{
+			Stats::count(Stats::heapRejects);
+		}
+		
+		return;
+	}
+	
+	insert(hash, 1, false);
+}
+
+uint8_t * MinHashHeap::getHll(int precision)
+{
+	if ( hll.size() == 0 )
+	{
+		hll.resize(uint64_t(1) << precision, 0);
+	}
+	
+	return hll.data();
+}
+
+void MinHashHeap::merge(const MinHashHeap & other)
+{
+	hllMerge(hll, other.hll);
+	
+	if ( bottomK )
+	{
+		other.flushBottom();
+		flushBottom();
+		
+		// merge the sorted bottom-k lists, summing counts of shared hashes
+		//
+		vector<uint64_t> merged;
+		vector<uint32_t> mergedCounts;
+		uint64_t i = 0;
+		uint64_t j = 0;
+		
+		while ( merged.size() < cardinalityMaximum && (i < bottom.size() || j < other.bottom.size()) )
+		{
+			if ( j == other.bottom.size() || (i < bottom.size() && bottom[i] < other.bottom[j]) )
+			{
+				merged.push_back(bottom[i]);
+				mergedCounts.push_back(bottomCounts[i++]);
+			}
+			else if ( i == bottom.size() || other.bottom[j] < bottom[i] )
+			{
+				merged.push_back(other.bottom[j]);
+				mergedCounts.push_back(other.bottomCounts[j++]);
+			}
+			else
+			{
+				merged.push_back(bottom[i]);
+				mergedCounts.push_back(bottomCounts[i++] + other.bottomCounts[j++]);
+			}
+		}
+		
+		bottom.swap(merged);
+		bottomCounts.swap(mergedCounts);
+		multiplicitySum = 0;
+		
+		for ( uint64_t k = 0; k < bottomCounts.size(); k++ )
+		{
+			multiplicitySum += bottomCounts[k];
+		}
+		
+		if ( bottom.size() == cardinalityMaximum )
+		{
+			threshold = bottom.back();
+		}
+		
+		return;
+	}
+	
+	HashList list(use64);
+	vector<uint32_t> counts;
+	
+	other.hashes.toHashList(list);
+	other.hashes.toCounts(counts);
+	
+	for ( uint64_t i = 0; i < counts.size(); i++ )
+	{
+		insert(list.at(i), counts[i], true);
+	}
+	
+	list.clear();
+	counts.clear();
+	
+	other.hashesPending.toHashList(list);
+	other.hashesPending.toCounts(counts);
+	
+	for ( uint64_t i = 0; i < counts.size(); i++ )
+	{
+		insert(list.at(i), counts[i], false);
+	}
+}
+
+void MinHashHeap::insert(hash_u hash, uint32_t copies, bool confirmed)
 {
 	if
 	(
@@ -86,31 +412,31 @@ void MinHashHeap::tryInsert(hash_u hash)
 	{
 		if ( hashes.count(hash) == 0 )
 		{
-			if ( bloomFilter != 0 )
+			uint32_t pending = countingFilter != 0 || multiplicityMinimum == 1 ? 0 : hashesPending.count(hash);
+			
+			if ( ! confirmed && countingFilter != 0 )
 			{
-                const unsigned char * data = use64 ? (const unsigned char *)&hash.hash64 : (const unsigned char *)&hash.hash32;
-            	size_t length = use64 ? 8 : 4;
-            	
-                if ( bloomFilter->contains(data, length) )
-                {
-					hashes.insert(hash, 2);
+				uint32_t count = countingFilter->add(use64 ? hash.hash64 : hash.hash32);
+				
+				if ( count >= multiplicityMinimum )
+				{
+					// if shared, other heaps have counted the copies before
+					// this one
+					//
+					copies = countingFilterShared && count > multiplicityMinimum ? 1 : multiplicityMinimum;
+					
+					hashes.insert(hash, copies);
 					hashesQueue.push(hash);
-					multiplicitySum += 2;
-	                kmersUsed++;
-                }
-            	else
-            	{
-	                bloomFilter->insert(data, length);
-	                kmersTotal++;
-	            }
+					multiplicitySum += copies;
+				}
 			}
-			else if ( multiplicityMinimum == 1 || hashesPending.count(hash) == multiplicityMinimum - 1 )
+			else if ( confirmed || pending + copies >= multiplicityMinimum )
 			{
-				hashes.insert(hash, multiplicityMinimum);
+				hashes.insert(hash, pending + copies);
 				hashesQueue.push(hash);
-				multiplicitySum += multiplicityMinimum;
+				multiplicitySum += pending + copies;
 				
-				if ( multiplicityMinimum > 1 )
+				if ( pending != 0 )
 				{
 					// just remove from set for now; will be removed from
 					// priority queue when it's on top
@@ -120,18 +446,18 @@ void MinHashHeap::tryInsert(hash_u hash)
 			}
 			else
 			{
-				if ( hashesPending.count(hash) == 0 )
+				if ( pending == 0 )
 				{
 					hashesQueuePending.push(hash);
 				}
 			
-				hashesPending.insert(hash, 1);
+				hashesPending.insert(hash, copies);
 			}
 		}
 		else
 		{
-			hashes.insert(hash, 1);
-			multiplicitySum++;
+			hashes.insert(hash, copies);
+			multiplicitySum += copies;
 		}
 		
 		if ( hashes.size() > cardinalityMaximum )
@@ -154,4 +480,76 @@ void MinHashHeap::tryInsert(hash_u hash)
 			hashesQueue.pop();
 		}
 	}
+	else
+	{
+		Stats::count(Stats::heapRejects);
+	}
+}
+
+int filterBelowScalar(const uint64_t * values, int count, uint64_t threshold, uint64_t * out)
+{
+	int passed = 0;
+	
+	for ( int i = 0; i < count; i++ )
+	{
+		if ( values[i] <= threshold )
+		{
+			out[passed++] = values[i];
+		}
+	}
+	
+	return passed;
+}
+
+#ifdef SIMD_X86
+SIMD_TARGET_BEGIN(SIMD_TARGET_AVX512)
+int filterBelowAvx512(const uint64_t * values, int count, uint64_t threshold, uint64_t * out)
+{
+	const __m512i t = _mm512_set1_epi64(threshold);
+	int passed = 0;
+	int i = 0;
+	
+	for ( ; i + 8 <= count; i += 8 )
+	{
+		__m512i v = _mm512_loadu_si512((const void *)(values + i));
+		__mmask8 pass = _mm512_cmple_epu64_mask(v, t);
+		
+		_mm512_mask_compressstoreu_epi64(out + passed, pass, v);
+		passed += __builtin_popcount(pass);
+	}
+	
+	return passed + filterBelowScalar(values + i, count - i, threshold, out + passed);
+}
+SIMD_TARGET_END
+
+SIMD_TARGET_BEGIN(SIMD_TARGET_AVX2)
+int filterBelowAvx2(const uint64_t * values, int count, uint64_t threshold, uint64_t * out)
+{
+	// no unsigned 64-bit compare; flip sign bits and compare signed
+	//
+	const __m256i sign = _mm256_set1_epi64x(0x8000000000000000ULL);
+	const __m256i t = _mm256_xor_si256(_mm256_set1_epi64x(threshold), sign);
+	int passed = 0;
+	int i = 0;
+	
+	for ( ; i + 4 <= count; i += 4 )
+	{
+		__m256i v = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(values + i)), sign);
+		int fail = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(v, t)));
+		
+		if ( fail != 0xf )
+		{
+			for ( int j = 0; j < 4; j++ )
+			{
+				if ( ! (fail & (1 << j)) )
+				{
+					out[passed++] = values[i + j];
+				}
+			}
+		}
+	}
+	
+	return passed + filterBelowScalar(values + i, count - i, threshold, out + passed);
 }
+SIMD_TARGET_END
+#endif
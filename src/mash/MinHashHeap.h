@@ -1,30 +1,81 @@
 #ifndef HashHeapCounted_h
 #define HashHeapCounted_h
 
+#include "CountingFilter.h"
 #include "HashList.h"
 #include "HashPriorityQueue.h"
 #include "HashSet.h"
 #include <math.h>
-#include "bloom_filter.hpp"
+#include <vector>
 
 class MinHashHeap
 {
 public:
 
 	MinHashHeap(bool use64New, uint64_t cardinalityMaximumNew, uint64_t multiplicityMinimumNew = 1, uint64_t memoryBoundBytes = 0);
+	
+	// Counts pending copies in countingFilterNew, which is not owned and can
+	// be shared by the heaps of several threads sketching one sample (see
+	// merge()).
+	//
+	MinHashHeap(bool use64New, uint64_t cardinalityMaximumNew, uint64_t multiplicityMinimumNew, CountingFilter * countingFilterNew);
+	
 	~MinHashHeap();
 	void computeStats();
 	void clear();
 	double estimateMultiplicity() const;
 	double estimateSetSize() const;
+	CountingFilter * getCountingFilter() const {return countingFilter;}
 	void toCounts(std::vector<uint32_t> & counts) const;
     void toHashList(HashList & hashList) const;
+    
+    // the hashes in increasing order with their counts (already in order for
+    // bottom-k; otherwise sorted together, as pairs)
+    //
+    void toSortedHashList(HashList & hashList, std::vector<uint32_t> & counts) const;
 	void tryInsert(hash_u hash);
+	void tryInsert(const hash_u * hashesNew, int count);
+	
+	// Adds the hashes of other (with the same parameters), as if its inputs
+	// had been inserted here, so threads can each fill a heap from part of a
+	// sample and combine them. Exact: every hash other could be pending
+	// for while it is below the sketch threshold is still kept, with its
+	// count, so copies split between heaps add up. With a shared counting
+	// filter, a hash is counted with the minimum copies only by the heap that
+	// saw it reach the minimum, and as 1 copy by the others.
+	//
+	void merge(const MinHashHeap & other);
+	
+	// HyperLogLog registers of every hash added from here on (see
+	// KmerHashBatch), created at the precision given on the first call.
+	// They are zeroed by clear() and combined by merge().
+	//
+	uint8_t * getHll(int precision);
+	const std::vector<uint8_t> & getHllRegisters() const {return hll;}
 
 private:
 
+	// inserts copies of hash, which has the minimum multiplicity if
+	// confirmed, or otherwise is pending until it does
+	//
+	void insert(hash_u hash, uint32_t copies, bool confirmed);
+	void flushBottom() const;
+	
 	bool use64;
 	
+	// Single-copy sketching (no multiplicity or bloom filter) keeps a flat,
+	// sorted bottom-k array instead of the set and queue below. Candidates
+	// that pass the threshold (the current k-th smallest hash) are staged in
+	// a fixed-capacity buffer and merged in when it fills. Merging is lazy,
+	// so these are mutable to allow it from the const accessors.
+	//
+	bool bottomK;
+	mutable std::vector<uint64_t> bottom;
+	mutable std::vector<uint32_t> bottomCounts;
+	mutable std::vector<uint64_t> staged;
+	mutable uint64_t stagedCount;
+	mutable uint64_t threshold;
+	
 	HashSet hashes;
 	HashPriorityQueue hashesQueue;
 	
@@ -34,17 +85,22 @@ private:
 	uint64_t cardinalityMaximum;
 	uint64_t multiplicityMinimum;
 	
-	uint64_t multiplicitySum;
+	mutable uint64_t multiplicitySum;
 	
-    bloom_filter * bloomFilter;
-    
-    uint64_t kmersTotal;
-    uint64_t kmersUsed;
+	// With a memory bound, the copies of hashes not yet in the sketch are
+	// counted approximately in this, rather than exactly in hashesPending.
+	//
+	CountingFilter * countingFilter;
+	bool countingFilterShared;
+	
+	std::vector<uint8_t> hll;
 };
 
-inline double MinHashHeap::estimateMultiplicity() const {return hashes.size() ? (double)multiplicitySum / hashes.size() : 0;}
-inline double MinHashHeap::estimateSetSize() const {return hashes.size() ? pow(2.0, use64 ? 64.0 : 32.0) * (double)hashes.size() / (use64 ? (double)hashesQueue.top().hash64 : (double)hashesQueue.top().hash32) : 0;}
-inline void MinHashHeap::toHashList(HashList & hashList) const {hashes.toHashList(hashList);}
-inline void MinHashHeap::toCounts(std::vector<uint32_t> & counts) const {hashes.toCounts(counts);}
+// Copy the values <= threshold to out, returning how many were copied (see
+// SimdKernels::filterBelow).
+//
+int filterBelowScalar(const uint64_t * values, int count, uint64_t threshold, uint64_t * out);
+int filterBelowAvx512(const uint64_t * values, int count, uint64_t threshold, uint64_t * out);
+int filterBelowAvx2(const uint64_t * values, int count, uint64_t threshold, uint64_t * out);
 
 #endif
@@ -8,10 +8,7 @@
 // non-native version will be less than optimal.
 
 #include "MurmurHash3.h"
-
-//#if defined (__ICC) || defined (__INTEL_COMPILER)
-#include <immintrin.h>
-//#endif
+#include <string.h>
 
 //-----------------------------------------------------------------------------
 // Platform-specific functions and macros
@@ -336,14 +333,13 @@ void MurmurHash3_x64_128 ( const void * key, const int len,
 }
 
 //#if defined (__ICC) || defined (__INTEL_COMPILER)
-#if defined __AVX512F__ && defined __AVX512CD__
-void MurmurHash3_x64_128_avx512_8x16 ( __m512i  * vkey1, __m512i * vkey2, int pend_len, int len, uint32_t seed, void * out )
+#ifdef SIMD_X86
+SIMD_TARGET_BEGIN(SIMD_TARGET_AVX512)
+static inline __attribute__((always_inline)) void murmurHash3Avx512_8x16 ( __m512i  * vkey1, __m512i * vkey2, int pend_len, int len, uint32_t seed, void * out )
 {
 	const int nblocks = len / 16; //real blocks
 	__m512i v5 = _mm512_set1_epi64(5);
 	__m512i vlen = _mm512_set1_epi64(len);
-	uint64_t h1[8];
-	uint64_t h2[8];
 
 	__m512i vh1_1;	
 	__m512i vh2_1;	
@@ -546,6 +542,11 @@ void MurmurHash3_x64_128_avx512_8x16 ( __m512i  * vkey1, __m512i * vkey2, int pe
 
 }
 
+void MurmurHash3_x64_128_avx512_8x16 ( __m512i  * vkey1, __m512i * vkey2, int pend_len, int len, uint32_t seed, void * out )
+{
+	murmurHash3Avx512_8x16(vkey1, vkey2, pend_len, len, seed, out);
+}
+
 
 void MurmurHash3_x64_128_avx512_8x32 ( __m512i  * vkey1, __m512i * vkey2, __m512i * vkey3, __m512i * vkey4, int pend_len, int len, uint32_t seed, void * out )
 {
@@ -887,8 +888,6 @@ void MurmurHash3_x64_128_avx512_8x8 ( __m512i  * vkey, int pend_len, int len, ui
 	const int nblocks = len / 16; //real blocks
 	__m512i v5 = _mm512_set1_epi64(5);
 	__m512i vlen = _mm512_set1_epi64(len);
-	uint64_t h1[8];
-	uint64_t h2[8];
 	__m512i vh1;	
 	__m512i vh2;	
 
@@ -1000,8 +999,95 @@ void MurmurHash3_x64_128_avx512_8x8 ( __m512i  * vkey, int pend_len, int len, ui
 	//}
 
 }
-#else 
-#ifdef __AVX2__
+
+void inline transpose8_epi64(__m512i *row0, __m512i* row1, __m512i* row2,__m512i* row3, __m512i* row4, __m512i * row5,__m512i* row6,__m512i * row7)
+{
+	__m512i __t0,__t1,__t2,__t3,__t4,__t5,__t6,__t7;
+	__m512i __tt0,__tt1,__tt2,__tt3,__tt4,__tt5,__tt6,__tt7;
+
+	__m512i idx1,idx2;
+	idx1 = _mm512_set_epi64(0xD,0xC,0x5,0x4,0x9,0x8,0x1,0x0);
+	idx2 = _mm512_set_epi64(0xF,0xE,0x7,0x6,0xB,0xA,0x3,0x2);
+
+	__t0 = _mm512_unpacklo_epi64(*row0,*row1);
+	__t1 = _mm512_unpackhi_epi64(*row0,*row1);
+	__t2 = _mm512_unpacklo_epi64(*row2,*row3);
+	__t3 = _mm512_unpackhi_epi64(*row2,*row3);
+	__t4 = _mm512_unpacklo_epi64(*row4,*row5);
+	__t5 = _mm512_unpackhi_epi64(*row4,*row5);
+	__t6 = _mm512_unpacklo_epi64(*row6,*row7);
+	__t7 = _mm512_unpackhi_epi64(*row6,*row7);
+
+
+	__tt0 = _mm512_permutex2var_epi64(__t0,idx1,__t2);
+	__tt2 = _mm512_permutex2var_epi64(__t0,idx2,__t2);
+	__tt1 = _mm512_permutex2var_epi64(__t1,idx1,__t3);
+	__tt3 = _mm512_permutex2var_epi64(__t1,idx2,__t3);
+	__tt4 = _mm512_permutex2var_epi64(__t4,idx1,__t6);
+	__tt6 = _mm512_permutex2var_epi64(__t4,idx2,__t6);
+	__tt5 = _mm512_permutex2var_epi64(__t5,idx1,__t7);
+	__tt7 = _mm512_permutex2var_epi64(__t5,idx2,__t7);
+
+	*row0 = _mm512_shuffle_i64x2(__tt0,__tt4,0x44);
+	*row1 = _mm512_shuffle_i64x2(__tt1,__tt5,0x44);
+	*row2 = _mm512_shuffle_i64x2(__tt2,__tt6,0x44);
+	*row3 = _mm512_shuffle_i64x2(__tt3,__tt7,0x44);
+
+	*row4 = _mm512_shuffle_i64x2(__tt0,__tt4,0xEE);
+	*row5 = _mm512_shuffle_i64x2(__tt1,__tt5,0xEE);
+	*row6 = _mm512_shuffle_i64x2(__tt2,__tt6,0xEE);
+	*row7 = _mm512_shuffle_i64x2(__tt3,__tt7,0xEE);
+}
+
+static inline __attribute__((always_inline)) void hashKmersAvx512 ( const char * const * keys, int len, uint32_t seed, uint64_t * out )
+{
+	// 16 keys of up to 64 bytes, loaded as rows and transposed into the
+	// column layout of the 8x16 kernel
+
+	int pend_len = ((len - 1) / 16 + 1) * 16;
+	__m512i vi[8];
+	__m512i vj[8];
+	__m512i vzero = _mm512_setzero_si512();
+	__mmask64 mask_load = 0xffffffffffffffff;
+	mask_load >>= (64 - len);
+
+	for ( int i = 0; i < 8; i++ )
+	{
+		vi[i] = _mm512_mask_loadu_epi8(vzero, mask_load, keys[i]);
+		vj[i] = _mm512_mask_loadu_epi8(vzero, mask_load, keys[i + 8]);
+	}
+
+	transpose8_epi64(&vi[0], &vi[1], &vi[2], &vi[3], &vi[4], &vi[5], &vi[6], &vi[7]);
+	transpose8_epi64(&vj[0], &vj[1], &vj[2], &vj[3], &vj[4], &vj[5], &vj[6], &vj[7]);
+	murmurHash3Avx512_8x16(vi, vj, pend_len, len, seed, out);
+}
+
+void MurmurHash3_x64_128_kmers_avx512 ( const char * const * keys, int len, uint32_t seed, uint64_t * out )
+{
+	hashKmersAvx512(keys, len, seed, out);
+}
+
+template <int len>
+static void hashKmersAvx512Fixed ( const char * const * keys, int, uint32_t seed, uint64_t * out )
+{
+	hashKmersAvx512(keys, len, seed, out);
+}
+
+HashKmers MurmurHash3_x64_128_kmers_avx512_sized ( int len )
+{
+	switch ( len )
+	{
+		case 16: return hashKmersAvx512Fixed<16>;
+		case 21: return hashKmersAvx512Fixed<21>;
+		case 25: return hashKmersAvx512Fixed<25>;
+		case 31: return hashKmersAvx512Fixed<31>;
+		case 32: return hashKmersAvx512Fixed<32>;
+		default: return MurmurHash3_x64_128_kmers_avx512;
+	}
+}
+SIMD_TARGET_END
+
+SIMD_TARGET_BEGIN(SIMD_TARGET_AVX2)
 // implement by avx2
 inline __m256i avx2_mullo_epi64(__m256i a1, __m256i b1) 
 {
@@ -1027,18 +1113,13 @@ inline __m256i avx2_mullo_epi64(__m256i a1, __m256i b1)
 
 }
 
-void MurmurHash3_x64_128_avx2_8x4 (__m256i * vkey, int pend_len, int len, uint32_t seed, void *out)
+static inline __attribute__((always_inline)) void murmurHash3Avx2_8x4 (__m256i * vkey, int pend_len, int len, uint32_t seed, void *out)
 {
 	const int nblocks = len / 16;
 
 	__m256i v5 = _mm256_set1_epi64x(5);
 	__m256i vlen = _mm256_set1_epi64x(len);
 
-
-	uint64_t h1[4];
-	uint64_t h2[4];
-	uint64_t tarr1[4];
-	uint64_t tarr2[4];
 	__m256i vh1;
 	__m256i vh2;
 	
@@ -1046,7 +1127,6 @@ void MurmurHash3_x64_128_avx2_8x4 (__m256i * vkey, int pend_len, int len, uint32
 	__m256i vk2;
 	__m256i vtmp1;
 	__m256i vtmp2;
-	__m256i vmul;
 
 	vh1 = _mm256_set1_epi64x(seed);
 	vh2 = _mm256_set1_epi64x(seed);
@@ -1061,9 +1141,6 @@ void MurmurHash3_x64_128_avx2_8x4 (__m256i * vkey, int pend_len, int len, uint32
 	__m256i vc3 = _mm256_set1_epi64x(c3);
 	__m256i vc4 = _mm256_set1_epi64x(c4);
 
-	__m256i idx1 = _mm256_set_epi64x(0x6, 0x2, 0x4, 0x0);
-	__m256i idx2 = _mm256_set_epi64x(0x7, 0x3, 0x5, 0x1);
-
 //body
 	for(int i = 0; i < nblocks; i++)
 	{
@@ -1189,13 +1266,95 @@ void MurmurHash3_x64_128_avx2_8x4 (__m256i * vkey, int pend_len, int len, uint32
 
 }
 
-	#else
-		#ifdef __SSE4_1__
-		// implement by sse
-		#else
-		//implement without optimization
-		#endif
-	#endif
+void MurmurHash3_x64_128_avx2_8x4 (__m256i * vkey, int pend_len, int len, uint32_t seed, void *out)
+{
+	murmurHash3Avx2_8x4(vkey, pend_len, len, seed, out);
+}
+
+
+void inline transpose4_epi64(__m256i *row1, __m256i *row2, __m256i *row3, __m256i *row4)
+{
+	__m256i vt1, vt2, vt3, vt4;
+
+	vt1 = _mm256_unpacklo_epi64(*row1, *row2);
+	vt2 = _mm256_unpackhi_epi64(*row1, *row2);
+	vt3 = _mm256_unpacklo_epi64(*row3, *row4);
+	vt4 = _mm256_unpackhi_epi64(*row3, *row4);
+
+	*row1 =_mm256_permute2x128_si256(vt1, vt3, 0x20);
+	*row2 =_mm256_permute2x128_si256(vt2, vt4, 0x20);
+	*row3 =_mm256_permute2x128_si256(vt1, vt3, 0x31);
+	*row4 =_mm256_permute2x128_si256(vt2, vt4, 0x31);
+}
+
+static inline __attribute__((always_inline)) void hashKmersAvx2 ( const char * const * keys, int len, uint32_t seed, uint64_t * out )
+{
+	// 4 keys of up to 32 bytes. Keys can end a buffer (the last k-mer of a
+	// sequence or its reverse complement), so no byte past len is read: whole
+	// words are masked loads, which do not touch the lanes left out, and a
+	// partial last word is copied into its lane.
+
+	int pend_len = ((len - 1) / 16 + 1) * 16;
+	int words = len / 8;
+	int tailBytes = len % 8;
+	__m256i vi[4];
+	int64_t wordMaskArr[4];
+	int64_t tailMaskArr[4];
+
+	for ( int i = 0; i < 4; i++ )
+	{
+		wordMaskArr[i] = i < words ? -1 : 0;
+		tailMaskArr[i] = i == words && tailBytes ? -1 : 0;
+	}
+
+	__m256i vwordMask = _mm256_loadu_si256((__m256i *)wordMaskArr);
+	__m256i vtailMask = _mm256_loadu_si256((__m256i *)tailMaskArr);
+
+	for ( int i = 0; i < 4; i++ )
+	{
+		uint64_t tail = 0;
+
+		if ( tailBytes )
+		{
+			memcpy(&tail, keys[i] + words * 8, tailBytes);
+		}
+
+		vi[i] = _mm256_or_si256(
+			_mm256_maskload_epi64((const long long *)keys[i], vwordMask),
+			_mm256_and_si256(_mm256_set1_epi64x(tail), vtailMask));
+	}
+
+	transpose4_epi64(&vi[0], &vi[1], &vi[2], &vi[3]);
+	murmurHash3Avx2_8x4(vi, pend_len, len, seed, out);
+}
+
+void MurmurHash3_x64_128_kmers_avx2 ( const char * const * keys, int len, uint32_t seed, uint64_t * out )
+{
+	hashKmersAvx2(keys, len, seed, out);
+}
+
+// With len fixed, the block loop is unrolled and the tail and mask resolved
+// at compile time.
+//
+template <int len>
+static void hashKmersAvx2Fixed ( const char * const * keys, int, uint32_t seed, uint64_t * out )
+{
+	hashKmersAvx2(keys, len, seed, out);
+}
+
+HashKmers MurmurHash3_x64_128_kmers_avx2_sized ( int len )
+{
+	switch ( len )
+	{
+		case 16: return hashKmersAvx2Fixed<16>;
+		case 21: return hashKmersAvx2Fixed<21>;
+		case 25: return hashKmersAvx2Fixed<25>;
+		case 31: return hashKmersAvx2Fixed<31>;
+		case 32: return hashKmersAvx2Fixed<32>;
+		default: return MurmurHash3_x64_128_kmers_avx2;
+	}
+}
+SIMD_TARGET_END
 #endif
 
 
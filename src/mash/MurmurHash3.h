@@ -32,29 +32,30 @@ void MurmurHash3_x86_128 ( const void * key, int len, uint32_t seed, void * out
 
 void MurmurHash3_x64_128 ( const void * key, int len, uint32_t seed, void * out );
 
-//#if defined(__ICC) || defined(__INTEL_COMPILER)
+#include "simd.h"
+
+#ifdef SIMD_X86
 #include <immintrin.h>
-#if defined __AVX512F__ && __AVX512CD__ 
+
+// Vectorized variants, compiled for their own instruction sets (see simd.h);
+// only call them when getSimdKernels() reports the matching level.
+
 void MurmurHash3_x64_128_avx512_8x16 ( __m512i  * vkey1, __m512i * vkey2, int pend_len, int len, uint32_t seed, void * out );
 
 void MurmurHash3_x64_128_avx512_8x32 ( __m512i  * vkey1, __m512i * vkey2, __m512i * vkey3, __m512i * vkey4, int pend_len, int len, uint32_t seed, void * out );
 
 void MurmurHash3_x64_128_avx512_8x8 ( __m512i * vkey, int pend_len, int len, uint32_t seed, void * out );
-#else
-	#ifdef __AVX2__
-	// implement by avx2
+
+void MurmurHash3_x64_128_kmers_avx512 ( const char * const * keys, int len, uint32_t seed, uint64_t * out );
+
+HashKmers MurmurHash3_x64_128_kmers_avx512_sized ( int len );
+
 void MurmurHash3_x64_128_avx2_8x4 (__m256i * vkey, int pend_len, int len, uint32_t seed, void *out);
 
-	#else
-		#ifdef __SSE4_1__
-		// implement by sse
-		#else
-		//implement without optimization
-		#endif
-	#endif
-#endif
+void MurmurHash3_x64_128_kmers_avx2 ( const char * const * keys, int len, uint32_t seed, uint64_t * out );
 
-//#endif
+HashKmers MurmurHash3_x64_128_kmers_avx2_sized ( int len );
+#endif
 
 //-----------------------------------------------------------------------------
 
@@ -0,0 +1,184 @@
+// Copyright © 2015, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen,
+// Sergey Koren, and Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#include "Numa.h"
+#include <fstream>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#endif
+
+using namespace::std;
+
+static bool numaEnabled = false;
+
+#ifdef __linux__
+
+static const int nodesMax = 1024;
+
+// nodes or CPUs in the list format of sysfs (e.g. "0-15,32-47")
+//
+static vector<int> readList(const string & file)
+{
+	vector<int> values;
+	string line;
+	ifstream in(file);
+
+	if ( ! getline(in, line) )
+	{
+		return values;
+	}
+
+	size_t position = 0;
+
+	while ( position < line.size() )
+	{
+		size_t end = line.find(',', position);
+
+		if ( end == string::npos )
+		{
+			end = line.size();
+		}
+
+		string range = line.substr(position, end - position);
+		size_t dash = range.find('-');
+
+		if ( range.size() != 0 )
+		{
+			int first = stoi(range);
+			int last = dash == string::npos ? first : stoi(range.substr(dash + 1));
+
+			for ( int i = first; i <= last; i++ )
+			{
+				values.push_back(i);
+			}
+		}
+
+		position = end + 1;
+	}
+
+	return values;
+}
+
+struct NumaNodes
+{
+	vector<vector<int>> cpus; // of each node with any
+	vector<int> memory; // nodes with memory
+};
+
+static NumaNodes readNodes()
+{
+	NumaNodes nodes;
+
+	for ( int node : readList("/sys/devices/system/node/online") )
+	{
+		vector<int> cpus = readList("/sys/devices/system/node/node" + to_string(node) + "/cpulist");
+
+		if ( cpus.size() != 0 )
+		{
+			nodes.cpus.push_back(cpus);
+		}
+	}
+
+	for ( int node : readList("/sys/devices/system/node/has_memory") )
+	{
+		if ( node < nodesMax )
+		{
+			nodes.memory.push_back(node);
+		}
+	}
+
+	return nodes;
+}
+
+static const NumaNodes & getNodes()
+{
+	static const NumaNodes nodes = readNodes();
+	return nodes;
+}
+
+bool enableNuma()
+{
+	const NumaNodes & nodes = getNodes();
+
+	if ( nodes.cpus.size() < 2 )
+	{
+		return false;
+	}
+
+	if ( nodes.memory.size() > 1 )
+	{
+		// inherited by the threads created from here on
+		//
+		unsigned long mask[nodesMax / (8 * sizeof(unsigned long))] = {0};
+
+		for ( int node : nodes.memory )
+		{
+			mask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+		}
+
+		syscall(SYS_set_mempolicy, MPOL_INTERLEAVE, mask, nodesMax + 1);
+	}
+
+	numaEnabled = true;
+	return true;
+}
+
+int getNumaNodeCount()
+{
+	return getNodes().cpus.size() > 0 ? getNodes().cpus.size() : 1;
+}
+
+void pinThreadToNumaNode(uint64_t index)
+{
+	if ( ! numaEnabled )
+	{
+		return;
+	}
+
+	const vector<int> & cpus = getNodes().cpus[index % getNodes().cpus.size()];
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+
+	for ( int cpu : cpus )
+	{
+		if ( cpu < CPU_SETSIZE )
+		{
+			CPU_SET(cpu, &set);
+		}
+	}
+
+	sched_setaffinity(0, sizeof(set), &set);
+}
+
+#else
+
+bool enableNuma()
+{
+	return false;
+}
+
+int getNumaNodeCount()
+{
+	return 1;
+}
+
+void pinThreadToNumaNode(uint64_t index)
+{
+}
+
+#endif
+
+bool getNumaEnabled()
+{
+	return numaEnabled;
+}
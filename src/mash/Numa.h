@@ -0,0 +1,33 @@
+// Copyright © 2015, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen,
+// Sergey Koren, and Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#ifndef INCLUDED_Numa
+#define INCLUDED_Numa
+
+#include <stdint.h>
+
+// Placement on machines with several NUMA nodes (sockets), for -numa. By
+// default the sketches every thread compares against are allocated on the
+// node of whichever thread loaded them, and threads on the other nodes read
+// them remotely. Once enabled, memory allocated from then on (by any thread
+// created after) is interleaved over the nodes page by page, so each node's
+// threads find an even share of it local, and the threads of thread pools
+// are pinned to the nodes in turn, so they are spread evenly and stay where
+// their share is.
+//
+// Only on Linux; elsewhere, and on machines with one node, enabling does
+// nothing (and returns false).
+
+bool enableNuma();
+bool getNumaEnabled();
+int getNumaNodeCount(); // nodes with CPUs
+
+// Pins the calling thread to the CPUs of node index % getNumaNodeCount(), if
+// enabled (thread pools give their threads consecutive indices).
+//
+void pinThreadToNumaNode(uint64_t index);
+
+#endif
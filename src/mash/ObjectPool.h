@@ -0,0 +1,40 @@
+// Copyright © 2015, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen,
+// Sergey Koren, and Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#ifndef ObjectPool_h
+#define ObjectPool_h
+
+#include <pthread.h>
+#include <vector>
+
+// Keeps released objects for reuse, so work that repeatedly creates and
+// destroys the same type does not go back to the allocator each time.
+// Objects are handed back out as they were put (not reset), so callers clear
+// what they need; buffers they own keep their capacity. Thread safe.
+
+template <class Type>
+class ObjectPool
+{
+public:
+    
+    ObjectPool(unsigned int capacityNew = 1024);
+    ObjectPool(const ObjectPool &) = delete;
+    ~ObjectPool();
+    
+    Type * get(); // a recycled object if available, otherwise a new one
+    void put(Type * object); // deleted if the pool is full
+    
+private:
+    
+    std::vector<Type *> objects;
+    unsigned int capacity;
+    
+    pthread_mutex_t mutex;
+};
+
+#include "ObjectPool.hxx"
+
+#endif
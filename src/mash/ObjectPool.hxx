@@ -0,0 +1,68 @@
+// Copyright © 2015, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen,
+// Sergey Koren, and Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#include "ObjectPool.h"
+
+template <class Type>
+ObjectPool<Type>::ObjectPool(unsigned int capacityNew)
+    :
+    capacity(capacityNew)
+{
+    pthread_mutex_init(&mutex, NULL);
+}
+
+template <class Type>
+ObjectPool<Type>::~ObjectPool()
+{
+    for ( size_t i = 0; i < objects.size(); i++ )
+    {
+        delete objects[i];
+    }
+    
+    pthread_mutex_destroy(&mutex);
+}
+
+template <class Type>
+Type * ObjectPool<Type>::get()
+{
+    Type * object = 0;
+    
+    pthread_mutex_lock(&mutex);
+    
+    if ( objects.size() > 0 )
+    {
+        object = objects.back();
+        objects.pop_back();
+    }
+    
+    pthread_mutex_unlock(&mutex);
+    
+    if ( object == 0 )
+    {
+        object = new Type();
+    }
+    
+    return object;
+}
+
+template <class Type>
+void ObjectPool<Type>::put(Type * object)
+{
+    pthread_mutex_lock(&mutex);
+    
+    if ( objects.size() < capacity )
+    {
+        objects.push_back(object);
+        object = 0;
+    }
+    
+    pthread_mutex_unlock(&mutex);
+    
+    if ( object != 0 )
+    {
+        delete object;
+    }
+}
@@ -0,0 +1,277 @@
+// Copyright © 2015, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen,
+// Sergey Koren, and Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#include "OutputWriter.h"
+#include <errno.h>
+#include <iostream>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+using namespace::std;
+
+OutputWriter::OutputWriter(int fdNew)
+	:
+	fd(fdNew),
+	queuedBytes(0),
+	writing(false),
+	stopping(false)
+{
+	cout.flush();
+	writer = thread(&OutputWriter::writerMain, this);
+}
+
+OutputWriter::~OutputWriter()
+{
+	flush();
+
+	{
+		lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+
+	queueCondition.notify_all();
+	writer.join();
+}
+
+void OutputWriter::write(string & text)
+{
+	if ( pending.empty() && text.size() >= pendingMax )
+	{
+		pending.swap(text);
+	}
+	else
+	{
+		pending.append(text);
+	}
+
+	text.clear();
+
+	if ( pending.size() >= pendingMax )
+	{
+		queuePending();
+	}
+}
+
+void OutputWriter::flush()
+{
+	queuePending();
+
+	unique_lock<std::mutex> lock(mutex);
+	spaceCondition.wait(lock, [this]{ return queue.empty() && ! writing; });
+}
+
+void OutputWriter::queuePending()
+{
+	if ( pending.empty() )
+	{
+		return;
+	}
+
+	unique_lock<std::mutex> lock(mutex);
+	spaceCondition.wait(lock, [this]{ return queuedBytes < queuedMax; });
+
+	queuedBytes += pending.size();
+	queue.push_back(string());
+	queue.back().swap(pending);
+	queueCondition.notify_one();
+}
+
+void OutputWriter::writerMain()
+{
+	unique_lock<std::mutex> lock(mutex);
+
+	while ( true )
+	{
+		queueCondition.wait(lock, [this]{ return ! queue.empty() || stopping; });
+
+		if ( queue.empty() )
+		{
+			break;
+		}
+
+		string text;
+		text.swap(queue.front());
+		queue.pop_front();
+		writing = true;
+
+		lock.unlock();
+
+		const char * data = text.data();
+		uint64_t size = text.size();
+
+		while ( size > 0 )
+		{
+			ssize_t written = ::write(fd, data, size);
+
+			if ( written < 0 && errno == EINTR )
+			{
+				continue;
+			}
+
+			if ( written <= 0 )
+			{
+				cerr << "ERROR: could not write output." << endl;
+				exit(1);
+			}
+
+			data += written;
+			size -= written;
+		}
+
+		lock.lock();
+
+		queuedBytes -= text.size();
+		writing = false;
+		spaceCondition.notify_all();
+	}
+}
+
+// exact as doubles
+//
+static const double powersOf10[] =
+{
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static double scaleByPowerOf10(double value, int exponent)
+{
+	while ( exponent > 22 )
+	{
+		value *= 1e22;
+		exponent -= 22;
+	}
+
+	while ( exponent < -22 )
+	{
+		value /= 1e22;
+		exponent += 22;
+	}
+
+	return exponent >= 0 ? value * powersOf10[exponent] : value / powersOf10[-exponent];
+}
+
+static bool nearHalf(double scaled)
+{
+	// the scaling is accurate to far better than this, so anything further
+	// from a tie rounds the same way as the exact value
+	//
+	return fabs(scaled - floor(scaled) - 0.5) < 1e-6;
+}
+
+void appendDouble(string & text, double value)
+{
+	if ( value == 0 )
+	{
+		text.append(signbit(value) ? "-0" : "0");
+		return;
+	}
+
+	double magnitude = fabs(value);
+	int exponent = 0;
+	double scaled = 0;
+	bool exact = isfinite(value) && magnitude > 1e-300 && magnitude < 1e300;
+
+	if ( exact )
+	{
+		// six significant digits, as an integer in [100000, 999999]; log10
+		// can be off by one next to powers of 10
+
+		exponent = floor(log10(magnitude));
+		scaled = scaleByPowerOf10(magnitude, 5 - exponent);
+		exact = ! nearHalf(scaled);
+
+		if ( exact && (scaled < 99999.5 || scaled >= 999999.5) )
+		{
+			exponent += scaled < 99999.5 ? -1 : 1;
+			scaled = scaleByPowerOf10(magnitude, 5 - exponent);
+			exact = ! nearHalf(scaled) && scaled >= 99999.5 && scaled < 999999.5;
+		}
+	}
+
+	if ( ! exact )
+	{
+		char buffer[32];
+		snprintf(buffer, sizeof(buffer), "%g", value);
+		text.append(buffer);
+		return;
+	}
+
+	uint32_t number = floor(scaled + 0.5);
+	char digits[6];
+
+	for ( int i = 5; i >= 0; i-- )
+	{
+		digits[i] = '0' + number % 10;
+		number /= 10;
+	}
+
+	int last = 5; // last significant digit
+
+	while ( last > 0 && digits[last] == '0' )
+	{
+		last--;
+	}
+
+	if ( value < 0 )
+	{
+		text.push_back('-');
+	}
+
+	if ( exponent < -4 || exponent >= 6 )
+	{
+		text.push_back(digits[0]);
+
+		if ( last > 0 )
+		{
+			text.push_back('.');
+			text.append(digits + 1, last);
+		}
+
+		text.push_back('e');
+		text.push_back(exponent < 0 ? '-' : '+');
+
+		if ( abs(exponent) < 10 )
+		{
+			text.push_back('0');
+		}
+
+		appendInteger(text, abs(exponent));
+	}
+	else if ( exponent >= 0 )
+	{
+		text.append(digits, exponent + 1);
+
+		if ( last > exponent )
+		{
+			text.push_back('.');
+			text.append(digits + exponent + 1, last - exponent);
+		}
+	}
+	else
+	{
+		text.append("0.");
+		text.append(-exponent - 1, '0');
+		text.append(digits, last + 1);
+	}
+}
+
+void appendInteger(string & text, uint64_t value)
+{
+	char buffer[20];
+	int size = 0;
+
+	do
+	{
+		buffer[sizeof(buffer) - ++size] = '0' + value % 10;
+		value /= 10;
+	}
+	while ( value != 0 );
+
+	text.append(buffer + sizeof(buffer) - size, size);
+}
@@ -0,0 +1,71 @@
+// Copyright © 2015, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen,
+// Sergey Koren, and Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#ifndef OutputWriter_h
+#define OutputWriter_h
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <thread>
+
+// Writes text output from a dedicated thread, in large write() calls, so the
+// thread that drains a ThreadPool does not wait on the output. The text is
+// usually formatted by the compare workers themselves (with the append
+// functions below), so the main thread only hands buffers over.
+//
+// The writer takes over the file descriptor (standard output by default);
+// cout is flushed when it starts, and should not be used again until the
+// writer is flushed or destroyed.
+
+class OutputWriter
+{
+public:
+
+    OutputWriter(int fdNew = 1);
+    ~OutputWriter(); // flushes
+
+    // Takes the contents of text (leaving it empty) to be written after
+    // everything given before it.
+    //
+    void write(std::string & text);
+
+    // waits until everything given so far has been written
+    //
+    void flush();
+
+private:
+
+    static const uint64_t pendingMax = 1 << 20; // collected before queueing
+    static const uint64_t queuedMax = 1 << 26; // bytes queued before write() waits
+
+    void queuePending();
+    void writerMain();
+
+    int fd;
+    std::string pending; // only touched by the calling thread
+
+    std::deque<std::string> queue;
+    uint64_t queuedBytes;
+    bool writing;
+    bool stopping;
+
+    std::mutex mutex;
+    std::condition_variable queueCondition;
+    std::condition_variable spaceCondition;
+
+    std::thread writer;
+};
+
+// Append value as iostreams would with their default formatting (%g with a
+// precision of 6), without the locale and stream machinery.
+//
+void appendDouble(std::string & text, double value);
+void appendInteger(std::string & text, uint64_t value);
+
+#endif
@@ -0,0 +1,376 @@
+// Copyright © 2015, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen,
+// Sergey Koren, and Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#include "PackedDist.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <iostream>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+using namespace::std;
+using mash::CommandDistance;
+
+static const uint64_t blockHeaderBytes = 8;
+
+static void appendVarint(string & packed, uint64_t value)
+{
+	while ( value >= 0x80 )
+	{
+		packed.push_back(char(value | 0x80));
+		value >>= 7;
+	}
+
+	packed.push_back(char(value));
+}
+
+static bool readVarint(const char *& position, const char * end, uint64_t & value)
+{
+	value = 0;
+
+	for ( int shift = 0; shift < 64 && position < end; shift += 7 )
+	{
+		uint8_t byte = *position++;
+
+		value |= uint64_t(byte & 0x7f) << shift;
+
+		if ( byte < 0x80 )
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static void appendRecord(string & packed, uint64_t pair, uint64_t & previous, const CommandDistance::CompareOutput::PairOutput & output)
+{
+	int64_t delta = int64_t(pair - previous);
+	float distance = output.distance;
+
+	appendVarint(packed, uint64_t(delta) << 1 ^ uint64_t(delta >> 63));
+	packed.append((const char *)&distance, sizeof(float));
+	packed.append((const char *)&output.pValue, sizeof(double));
+	appendVarint(packed, output.numer);
+	appendVarint(packed, output.denom);
+
+	previous = pair;
+}
+
+void packOutput(const CommandDistance::CompareOutput * output, string & packed)
+{
+	uint64_t refCount = output->sketchRef.getReferenceCount();
+	uint64_t queryCount = output->sketchQuery.getReferenceCount();
+	uint64_t count = 0;
+
+	if ( output->best.size() )
+	{
+		uint64_t first = output->best[0].indexQuery * refCount + output->best[0].indexRef;
+		uint64_t previous = first;
+
+		appendVarint(packed, first);
+		appendVarint(packed, output->best.size());
+
+		for ( uint64_t k = 0; k < output->best.size(); k++ )
+		{
+			const CommandDistance::CompareOutput::BestPair & best = output->best[k];
+
+			appendRecord(packed, best.indexQuery * refCount + best.indexRef, previous, best.pair);
+		}
+
+		return;
+	}
+
+	for ( uint64_t k = 0; k < output->pairCount; k++ )
+	{
+		count += output->pairs[k].pass;
+	}
+
+	if ( count == 0 )
+	{
+		return;
+	}
+
+	uint64_t first = output->indexQuery * refCount + output->indexRef;
+	uint64_t previous = first;
+
+	appendVarint(packed, first);
+	appendVarint(packed, count);
+
+	for ( uint64_t k = 0; k < output->pairCount && first + k < refCount * queryCount; k++ )
+	{
+		if ( output->pairs[k].pass )
+		{
+			appendRecord(packed, first + k, previous, output->pairs[k]);
+		}
+	}
+}
+
+PackedDistWriter::PackedDistWriter(const string & fileNew, const PackedDistHeader & header)
+	:
+	file(fileNew),
+	stopping(false)
+{
+	fd = open(file.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0644);
+
+	if ( fd < 0 )
+	{
+		cerr << "ERROR: could not open " << file << " for writing." << endl;
+		exit(1);
+	}
+
+	writeAll(&header, sizeof(PackedDistHeader));
+	writer = thread(&PackedDistWriter::writerMain, this);
+}
+
+PackedDistWriter::~PackedDistWriter()
+{
+	close();
+}
+
+void PackedDistWriter::write(string & packed)
+{
+	pending.append(packed);
+	packed.clear();
+
+	if ( pending.size() >= blockMax )
+	{
+		queuePending();
+	}
+}
+
+void PackedDistWriter::close()
+{
+	if ( fd < 0 )
+	{
+		return;
+	}
+
+	queuePending();
+
+	{
+		lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+
+	queueCondition.notify_all();
+	writer.join();
+
+	uint32_t end[2] = {0, 0};
+	writeAll(end, sizeof(end));
+
+	::close(fd);
+	fd = -1;
+}
+
+void PackedDistWriter::queuePending()
+{
+	if ( pending.empty() )
+	{
+		return;
+	}
+
+	unique_lock<std::mutex> lock(mutex);
+	spaceCondition.wait(lock, [this]{ return queue.size() < queuedMax; });
+
+	queue.push_back(string());
+	queue.back().swap(pending);
+	queueCondition.notify_one();
+}
+
+void PackedDistWriter::writerMain()
+{
+	vector<Bytef> compressed;
+	unique_lock<std::mutex> lock(mutex);
+
+	while ( true )
+	{
+		queueCondition.wait(lock, [this]{ return ! queue.empty() || stopping; });
+
+		if ( queue.empty() )
+		{
+			break;
+		}
+
+		string raw;
+		raw.swap(queue.front());
+		queue.pop_front();
+		spaceCondition.notify_all();
+
+		lock.unlock();
+
+		uLongf compressedBytes = compressBound(raw.size());
+		compressed.resize(blockHeaderBytes + compressedBytes);
+
+		if ( compress2(compressed.data() + blockHeaderBytes, &compressedBytes, (const Bytef *)raw.data(), raw.size(), Z_BEST_SPEED) != Z_OK )
+		{
+			cerr << "ERROR: could not compress output for " << file << "." << endl;
+			exit(1);
+		}
+
+		uint32_t blockHeader[2] = {uint32_t(compressedBytes), uint32_t(raw.size())};
+		memcpy(compressed.data(), blockHeader, blockHeaderBytes);
+		writeAll(compressed.data(), blockHeaderBytes + compressedBytes);
+
+		lock.lock();
+	}
+}
+
+void PackedDistWriter::writeAll(const void * data, uint64_t size)
+{
+	const char * bytes = (const char *)data;
+
+	while ( size > 0 )
+	{
+		ssize_t written = ::write(fd, bytes, size);
+
+		if ( written < 0 && errno == EINTR )
+		{
+			continue;
+		}
+
+		if ( written <= 0 )
+		{
+			cerr << "ERROR: could not write to " << file << "." << endl;
+			exit(1);
+		}
+
+		bytes += written;
+		size -= written;
+	}
+}
+
+bool PackedDistReader::open(const char * dataNew, uint64_t size)
+{
+	data = dataNew;
+	blocks.clear();
+
+	if ( size < sizeof(PackedDistHeader) )
+	{
+		error = "too small for a packed dist header";
+		return false;
+	}
+
+	memcpy(&header, data, sizeof(PackedDistHeader));
+
+	if ( header.magic != PackedDistHeader::magicValue || header.version != PackedDistHeader::versionCurrent )
+	{
+		error = "not packed dist output of this version";
+		return false;
+	}
+
+	uint64_t offset = sizeof(PackedDistHeader);
+
+	while ( true )
+	{
+		uint32_t blockHeader[2];
+
+		if ( size - offset < blockHeaderBytes )
+		{
+			error = "incomplete (the run did not finish)";
+			return false;
+		}
+
+		memcpy(blockHeader, data + offset, blockHeaderBytes);
+
+		if ( blockHeader[0] == 0 )
+		{
+			break;
+		}
+
+		if ( size - offset - blockHeaderBytes < blockHeader[0] )
+		{
+			error = "incomplete (the run did not finish)";
+			return false;
+		}
+
+		blocks.push_back(offset);
+		offset += blockHeaderBytes + blockHeader[0];
+	}
+
+	return true;
+}
+
+bool PackedDistReader::decodeBlock(uint64_t block, vector<CommandDistance::Result> & results) const
+{
+	uint32_t blockHeader[2];
+	memcpy(blockHeader, data + blocks[block], blockHeaderBytes);
+
+	string raw(blockHeader[1], 0);
+	uLongf rawBytes = raw.size();
+
+	if ( uncompress((Bytef *)&raw[0], &rawBytes, (const Bytef *)data + blocks[block] + blockHeaderBytes, blockHeader[0]) != Z_OK || rawBytes != raw.size() )
+	{
+		return false;
+	}
+
+	const char * position = raw.data();
+	const char * end = position + raw.size();
+	uint64_t pairTotal = header.refCount * header.queryCount;
+
+	while ( position < end )
+	{
+		uint64_t pair;
+		uint64_t count;
+
+		if ( ! readVarint(position, end, pair) || ! readVarint(position, end, count) )
+		{
+			return false;
+		}
+
+		for ( uint64_t i = 0; i < count; i++ )
+		{
+			uint64_t zigzag;
+			uint64_t numer;
+			uint64_t denom;
+			float distance;
+			CommandDistance::Result result;
+
+			if ( ! readVarint(position, end, zigzag) || uint64_t(end - position) < sizeof(float) + sizeof(double) )
+			{
+				return false;
+			}
+
+			pair += (zigzag >> 1) ^ -(zigzag & 1);
+			memcpy(&distance, position, sizeof(float));
+			memcpy(&result.pValue, position + sizeof(float), sizeof(double));
+			position += sizeof(float) + sizeof(double);
+
+			if ( ! readVarint(position, end, numer) || ! readVarint(position, end, denom) || pair >= pairTotal )
+			{
+				return false;
+			}
+
+			result.refID = pair % header.refCount;
+			result.queryID = pair / header.refCount;
+			result.distance = distance;
+			result.number = numer;
+			result.denom = denom;
+
+			results.push_back(result);
+		}
+	}
+
+	return true;
+}
+
+bool isPackedDistFile(const string & file)
+{
+	FILE * stream = fopen(file.c_str(), "rb");
+
+	if ( stream == NULL )
+	{
+		return false;
+	}
+
+	uint64_t magic = 0;
+	bool packed = fread(&magic, sizeof(uint64_t), 1, stream) == 1 && magic == PackedDistHeader::magicValue;
+
+	fclose(stream);
+	return packed;
+}
@@ -0,0 +1,135 @@
+// Copyright © 2015, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen,
+// Sergey Koren, and Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#ifndef PackedDist_h
+#define PackedDist_h
+
+#include "CommandDistance.h"
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+// The packed binary format for dist (dist -o with -pack). Only passing pairs
+// are kept, and rather than a Result record each, they are delta-coded and
+// compressed with zlib (at its fastest level) in independent blocks:
+//
+//   PackedDistHeader
+//   blocks: uint32 compressed bytes, uint32 raw bytes, deflate data
+//   end: a block header of zeros (missing if the run did not finish)
+//
+// Raw block data is a series of runs, each from one compare block, in the
+// order dist writes them:
+//
+//   run      varint first pair, varint record count, records
+//   record   zigzag varint pair - previous pair (the first from the run's
+//            first pair), float32 distance, double p-value, varint numerator,
+//            varint denominator
+//
+// where pairs are numbered query-major (query * references + reference).
+// Pairs only decrease within a run with -top, whose pairs are by rank. Values
+// are in host byte order.
+
+struct PackedDistHeader
+{
+    static const uint64_t magicValue = 0x5453444b5048534d; // "MSHPKDST" in file order
+    static const uint64_t versionCurrent = 1;
+
+    uint64_t magic = magicValue;
+    uint64_t version = versionCurrent;
+
+    uint64_t refCount = 0;
+    uint64_t queryCount = 0;
+
+    // of the run, for information and checking against the sketches
+    //
+    uint64_t kmerSize = 0;
+    uint64_t sketchSize = 0;
+    uint64_t seed = 0;
+    double distanceMax = 1;
+    double pValueMax = 1;
+};
+
+// Appends a run of the passing pairs of output (or its best pairs with -top)
+// to packed.
+//
+void packOutput(const mash::CommandDistance::CompareOutput * output, std::string & packed);
+
+// Writes packed dist output, compressing and writing blocks of runs on a
+// dedicated thread, as OutputWriter does for text.
+//
+class PackedDistWriter
+{
+public:
+
+    PackedDistWriter(const std::string & fileNew, const PackedDistHeader & header);
+    ~PackedDistWriter(); // closes
+
+    // Takes the runs in packed (leaving it empty) to be written after
+    // everything given before it.
+    //
+    void write(std::string & packed);
+
+    void close(); // writes the rest and the end
+
+private:
+
+    static const uint64_t blockMax = 1 << 20; // raw bytes per block (at least)
+    static const uint64_t queuedMax = 64; // blocks queued before write() waits
+
+    void queuePending();
+    void writerMain();
+    void writeAll(const void * data, uint64_t size);
+
+    std::string file;
+    int fd;
+    std::string pending; // only touched by the calling thread
+
+    std::deque<std::string> queue;
+    bool stopping;
+
+    std::mutex mutex;
+    std::condition_variable queueCondition;
+    std::condition_variable spaceCondition;
+
+    std::thread writer;
+};
+
+// Read-only view of mapped packed dist output.
+//
+class PackedDistReader
+{
+public:
+
+    // Finds the blocks; false (with error set) if data is not complete
+    // packed output.
+    //
+    bool open(const char * data, uint64_t size);
+
+    const PackedDistHeader & getHeader() const {return header;}
+    const std::string & getError() const {return error;}
+    uint64_t getBlockCount() const {return blocks.size();}
+
+    // Appends the records of a block to results; false if it is corrupt.
+    // Blocks can be decoded concurrently.
+    //
+    bool decodeBlock(uint64_t block, std::vector<mash::CommandDistance::Result> & results) const;
+
+private:
+
+    PackedDistHeader header;
+    std::string error;
+
+    const char * data = 0;
+    std::vector<uint64_t> blocks; // offsets of block headers
+};
+
+bool isPackedDistFile(const std::string & file);
+
+#endif
@@ -0,0 +1,420 @@
+// Copyright © 2015, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen,
+// Sergey Koren, and Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#include "ScreenIndex.h"
+#include <algorithm>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace::std;
+
+const uint32_t ScreenIndex::filterSalts[filterWords] =
+{
+	0x47b6137b, 0x44974d91, 0x8824ad5b, 0xa2b7289d,
+	0x705495c7, 0x2df1424b, 0x9efc4947, 0x5c6bfb31
+};
+
+ScreenIndex::~ScreenIndex()
+{
+	if ( mapped != 0 )
+	{
+		munmap(mapped, mappedSize);
+	}
+	else
+	{
+		delete [] keys;
+		delete [] filter;
+		delete [] slots;
+		delete [] offsets;
+		delete [] references;
+	}
+	
+	delete [] counts;
+}
+
+void ScreenIndex::build(const Sketch & sketch, int threads)
+{
+	int64_t referenceCount = sketch.getReferenceCount();
+	uint64_t total = 0;
+	
+	for ( int64_t i = 0; i < referenceCount; i++ )
+	{
+		total += sketch.getReference(i).hashesSorted.size();
+	}
+	
+	// at most 2/3 full (there are fewer distinct hashes than total)
+	//
+	capacity = total + total / 2 + 1;
+	keys = new atomic<uint64_t>[capacity + 1]();
+	
+	atomic<uint32_t> * positionCounts = new atomic<uint32_t>[capacity + 1]();
+	
+	// A reference's hashes are sorted, so any repeats (which only count once)
+	// are next to each other.
+	//
+	#pragma omp parallel for schedule(dynamic, 16) num_threads(threads)
+	for ( int64_t i = 0; i < referenceCount; i++ )
+	{
+		const HashList & hashes = sketch.getReference(i).hashesSorted;
+		
+		for ( int j = 0; j < hashes.size(); j++ )
+		{
+			uint64_t hash = hashes.get64() ? hashes.at(j).hash64 : hashes.at(j).hash32;
+			
+			if ( j == 0 || hash != (hashes.get64() ? hashes.at(j - 1).hash64 : hashes.at(j - 1).hash32) )
+			{
+				positionCounts[insert(hash)]++;
+			}
+		}
+	}
+	
+	// number the used positions, and lay out their references by slot
+	//
+	slots = new uint32_t[capacity + 1];
+	slotCount = 0;
+	
+	for ( uint64_t i = 0; i <= capacity; i++ )
+	{
+		slots[i] = positionCounts[i] != 0 ? slotCount++ : slotNone;
+	}
+	
+	offsets = new uint64_t[slotCount + 1];
+	offsets[0] = 0;
+	
+	for ( uint64_t i = 0; i <= capacity; i++ )
+	{
+		if ( slots[i] != slotNone )
+		{
+			offsets[slots[i] + 1] = offsets[slots[i]] + positionCounts[i];
+			positionCounts[i] = 0; // now the number filled
+		}
+	}
+	
+	references = new uint32_t[offsets[slotCount]];
+	
+	#pragma omp parallel for schedule(dynamic, 16) num_threads(threads)
+	for ( int64_t i = 0; i < referenceCount; i++ )
+	{
+		const HashList & hashes = sketch.getReference(i).hashesSorted;
+		
+		for ( int j = 0; j < hashes.size(); j++ )
+		{
+			uint64_t hash = hashes.get64() ? hashes.at(j).hash64 : hashes.at(j).hash32;
+			
+			if ( j == 0 || hash != (hashes.get64() ? hashes.at(j - 1).hash64 : hashes.at(j - 1).hash32) )
+			{
+				uint64_t position = probe(hash);
+				
+				references[offsets[slots[position]] + positionCounts[position]++] = i;
+			}
+		}
+	}
+	
+	delete [] positionCounts;
+	
+	filterBlocks = slotCount * 16 / (filterWords * 32) + 1;
+	filter = new atomic<uint32_t>[filterBlocks * filterWords]();
+	
+	#pragma omp parallel for schedule(static, 4096) num_threads(threads)
+	for ( int64_t i = 0; i < int64_t(capacity); i++ )
+	{
+		if ( keys[i] != 0 )
+		{
+			addToFilter(keys[i]);
+		}
+	}
+	
+	if ( slots[capacity] != slotNone )
+	{
+		addToFilter(0);
+	}
+	
+	#pragma omp parallel for schedule(dynamic, 4096) num_threads(threads)
+	for ( int64_t i = 0; i < int64_t(slotCount); i++ )
+	{
+		sort(references + offsets[i], references + offsets[i + 1]);
+	}
+	
+	counts = new atomic<uint32_t>[slotCount]();
+}
+
+ScreenIndex::LocalCounts::LocalCounts(ScreenIndex & indexNew)
+	: index(indexNew)
+{
+}
+
+ScreenIndex::LocalCounts::~LocalCounts()
+{
+	for ( uint64_t i = 0; i <= entryMask; i++ )
+	{
+		evict(entries[i]);
+	}
+}
+
+void ScreenIndex::LocalCounts::evict(Entry & entry)
+{
+	if ( entry.count != 0 )
+	{
+		index.add(entry.slot, entry.count);
+		entry.count = 0;
+	}
+}
+
+void ScreenIndex::addToFilter(uint64_t hash)
+{
+	uint64_t mixed = hash * filterMultiplier;
+	atomic<uint32_t> * block = filter + ((unsigned __int128)mixed * filterBlocks >> 64) * filterWords;
+	uint32_t key = mixed;
+	
+	for ( int i = 0; i < filterWords; i++ )
+	{
+		block[i].fetch_or(uint32_t(1) << (key * filterSalts[i] >> 27), memory_order_relaxed);
+	}
+}
+
+void ScreenIndex::clearCounts(int threads)
+{
+	#pragma omp parallel for schedule(static, 1 << 16) num_threads(threads)
+	for ( int64_t i = 0; i < int64_t(slotCount); i++ )
+	{
+		counts[i].store(0, memory_order_relaxed);
+	}
+}
+
+bool ScreenIndex::open(const string & file, const Sketch & sketch, string & error)
+{
+	int fd = ::open(file.c_str(), O_RDONLY);
+	struct stat info;
+	
+	if ( fd < 0 || fstat(fd, &info) != 0 )
+	{
+		if ( fd >= 0 )
+		{
+			close(fd);
+		}
+		
+		error = file + " does not exist";
+		return false;
+	}
+	
+	void * data = uint64_t(info.st_size) >= sizeof(FileHeader) ? mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+	
+	close(fd);
+	
+	if ( data == MAP_FAILED )
+	{
+		error = file + " is not a screen index";
+		return false;
+	}
+	
+	const FileHeader & header = *(const FileHeader *)data;
+	FileHeader expected;
+	
+	expected.identify(sketch);
+	
+	if ( header.magic != FileHeader::magicValue || header.version != FileHeader::versionCurrent || header.fileSize != uint64_t(info.st_size) )
+	{
+		error = file + " is not a screen index (of this version of Mash)";
+	}
+	else if ( ! header.sameSketch(expected) )
+	{
+		error = file + " is the index of other queries";
+	}
+	
+	if ( ! error.empty() )
+	{
+		munmap(data, info.st_size);
+		return false;
+	}
+	
+	char * base = (char *)data;
+	
+	mapped = data;
+	mappedSize = info.st_size;
+	capacity = header.capacity;
+	filterBlocks = header.filterBlocks;
+	slotCount = header.slotCount;
+	keys = (atomic<uint64_t> *)(base + header.keysOffset);
+	filter = (atomic<uint32_t> *)(base + header.filterOffset);
+	slots = (uint32_t *)(base + header.slotsOffset);
+	offsets = (uint64_t *)(base + header.offsetsOffset);
+	references = (uint32_t *)(base + header.referencesOffset);
+	counts = new atomic<uint32_t>[slotCount]();
+	
+	return true;
+}
+
+bool ScreenIndex::write(const string & file, const Sketch & sketch) const
+{
+	FileHeader header;
+	
+	header.identify(sketch);
+	header.capacity = capacity;
+	header.filterBlocks = filterBlocks;
+	header.slotCount = slotCount;
+	
+	const void * arrays[] = {keys, filter, slots, offsets, references};
+	uint64_t sizes[] =
+	{
+		(capacity + 1) * sizeof(uint64_t),
+		filterBlocks * filterWords * sizeof(uint32_t),
+		(capacity + 1) * sizeof(uint32_t),
+		(slotCount + 1) * sizeof(uint64_t),
+		offsets[slotCount] * sizeof(uint32_t)
+	};
+	uint64_t * arrayOffsets[] = {&header.keysOffset, &header.filterOffset, &header.slotsOffset, &header.offsetsOffset, &header.referencesOffset};
+	uint64_t offset = FileHeader::align;
+	
+	for ( int i = 0; i < 5; i++ )
+	{
+		*arrayOffsets[i] = offset;
+		offset = (offset + sizes[i] + FileHeader::align - 1) / FileHeader::align * FileHeader::align;
+	}
+	
+	header.fileSize = offset;
+	
+	string fileNew = file + ".new";
+	FILE * stream = fopen(fileNew.c_str(), "wb");
+	
+	if ( stream == NULL )
+	{
+		return false;
+	}
+	
+	vector<char> padding(FileHeader::align, 0);
+	bool good = fwrite(&header, sizeof(FileHeader), 1, stream) == 1;
+	uint64_t position = sizeof(FileHeader);
+	
+	for ( int i = 0; i < 5 && good; i++ )
+	{
+		good =
+			fwrite(padding.data(), 1, *arrayOffsets[i] - position, stream) == *arrayOffsets[i] - position &&
+			fwrite(arrays[i], 1, sizes[i], stream) == sizes[i];
+		position = *arrayOffsets[i] + sizes[i];
+	}
+	
+	good = good && fwrite(padding.data(), 1, header.fileSize - position, stream) == header.fileSize - position;
+	
+	if ( fclose(stream) != 0 || ! good || rename(fileNew.c_str(), file.c_str()) != 0 )
+	{
+		remove(fileNew.c_str());
+		return false;
+	}
+	
+	return true;
+}
+
+string ScreenIndex::indexFile(const string & sketchFile)
+{
+	string file = sketchFile;
+	
+	if ( hasSuffix(file, suffixSketch) )
+	{
+		file.resize(file.length() - strlen(suffixSketch));
+	}
+	
+	return file + ".msi";
+}
+
+void ScreenIndex::FileHeader::identify(const Sketch & sketch)
+{
+	referenceCount = sketch.getReferenceCount();
+	kmerSize = sketch.getKmerSize();
+	seed = sketch.getHashSeed();
+	use64 = sketch.getUse64();
+	hashTotal = 0;
+	hashSum = 0;
+	
+	for ( uint64_t i = 0; i < referenceCount; i++ )
+	{
+		const HashList & hashes = sketch.getReference(i).hashesSorted;
+		uint64_t size = hashes.size();
+		
+		hashTotal += size;
+		hashSum = hashSum * 0x9e3779b97f4a7c15 + size;
+		
+		if ( size != 0 )
+		{
+			hashSum = hashSum * 0x9e3779b97f4a7c15 + (use64 ? hashes.at(0).hash64 : hashes.at(0).hash32);
+			hashSum = hashSum * 0x9e3779b97f4a7c15 + (use64 ? hashes.at(size - 1).hash64 : hashes.at(size - 1).hash32);
+		}
+	}
+}
+
+bool ScreenIndex::FileHeader::sameSketch(const FileHeader & other) const
+{
+	return
+		referenceCount == other.referenceCount &&
+		hashTotal == other.hashTotal &&
+		hashSum == other.hashSum &&
+		kmerSize == other.kmerSize &&
+		seed == other.seed &&
+		use64 == other.use64;
+}
+
+uint64_t ScreenIndex::find(uint64_t hash) const
+{
+	uint32_t slot = slots[probe(hash)];
+	
+	return slot == slotNone ? notFound : slot;
+}
+
+uint64_t ScreenIndex::position(uint64_t hash) const
+{
+	// spread (for 32-bit hashes) and scale to the capacity
+	//
+	return (unsigned __int128)(hash * 0x9e3779b97f4a7c15) * capacity >> 64;
+}
+
+uint64_t ScreenIndex::probe(uint64_t hash) const
+{
+	if ( hash == 0 )
+	{
+		return capacity;
+	}
+	
+	uint64_t i = position(hash);
+	uint64_t key;
+	
+	while ( (key = keys[i].load(memory_order_relaxed)) != hash && key != 0 )
+	{
+		i = i + 1 == capacity ? 0 : i + 1;
+	}
+	
+	return i;
+}
+
+uint64_t ScreenIndex::insert(uint64_t hash)
+{
+	if ( hash == 0 )
+	{
+		return capacity;
+	}
+	
+	uint64_t i = position(hash);
+	
+	while ( true )
+	{
+		uint64_t key = keys[i].load(memory_order_relaxed);
+		
+		if ( key == 0 && keys[i].compare_exchange_strong(key, hash) )
+		{
+			return i;
+		}
+		
+		if ( key == hash )
+		{
+			return i;
+		}
+		
+		i = i + 1 == capacity ? 0 : i + 1;
+	}
+}
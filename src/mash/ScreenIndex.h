@@ -0,0 +1,197 @@
+// Copyright © 2015, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen,
+// Sergey Koren, and Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#ifndef ScreenIndex_h
+#define ScreenIndex_h
+
+#include "Sketch.h"
+#include <atomic>
+#include <stdint.h>
+#include <string>
+
+// The hashes of the queries of a screen, and which queries have each, for
+// counting their occurrences in the mixture. Each distinct hash has a slot,
+// found through an open-addressing table of flat arrays, and by slot are the
+// queries that have it (in compressed sparse row form: references[offsets[s]]
+// up to references[offsets[s + 1]], in increasing order) and its count in the
+// mixture so far. A lookup touches a few cache lines, and there are no nodes
+// or per-hash allocations, so the index takes a fraction of the memory of
+// hashed sets.
+//
+// A built index can be written to a file (<queries>.msi; see indexFile()) in
+// the same layout, for later screens against the same queries to map and use
+// as it is rather than build again.
+
+class ScreenIndex
+{
+public:
+
+	static const uint64_t notFound = UINT64_MAX;
+
+	~ScreenIndex();
+
+	// indexes the hashes of every reference of sketch, using threads
+	//
+	void build(const Sketch & sketch, int threads);
+	
+	// Maps an index written for sketch; false (with the reason in error) if
+	// file is missing, not an index, or for other queries.
+	//
+	bool open(const std::string & file, const Sketch & sketch, std::string & error);
+	
+	// Writes the index of sketch to file (replacing it atomically, so runs
+	// can share it while another writes it); false if it could not.
+	//
+	bool write(const std::string & file, const Sketch & sketch) const;
+	
+	static std::string indexFile(const std::string & sketchFile);
+
+	uint64_t find(uint64_t hash) const; // slot, or notFound
+	
+	// false if hash is not in the index; true for some (about 0.15%) that are
+	// not, as well as those that are. This checks a small filter (a split
+	// block Bloom filter: 16 bits per hash, one bit set in each word of a
+	// 32-byte block), so misses, which are most of the hashes of a mixture,
+	// cost one cache line in a structure a tenth the size of the table.
+	//
+	bool mayContain(uint64_t hash) const
+	{
+		uint64_t mixed = hash * filterMultiplier;
+		const std::atomic<uint32_t> * block = filter + ((unsigned __int128)mixed * filterBlocks >> 64) * filterWords;
+		uint32_t key = mixed;
+		bool found = true;
+		
+		for ( int i = 0; i < filterWords; i++ )
+		{
+			found &= block[i].load(std::memory_order_relaxed) >> (key * filterSalts[i] >> 27) & 1;
+		}
+		
+		return found;
+	}
+	
+	uint64_t getSlotCount() const {return slotCount;}
+
+	const uint32_t * referencesBegin(uint64_t slot) const {return references + offsets[slot];}
+	const uint32_t * referencesEnd(uint64_t slot) const {return references + offsets[slot + 1];}
+
+	uint32_t getCount(uint64_t slot) const {return counts[slot];}
+	void add(uint64_t slot, uint32_t count) {counts[slot] += count;} // thread-safe
+	void clearCounts(int threads); // for the next mixture
+	
+	// Counts hashes for one worker, combining the repeats of each slot in a
+	// small direct-mapped table of its own before adding them to the shared
+	// counts, so that popular hashes (conserved regions, contaminants) do not
+	// keep their count's cache line moving between threads. Added when a
+	// slot is evicted and on destruction.
+	//
+	class LocalCounts
+	{
+	public:
+		
+		LocalCounts(ScreenIndex & indexNew);
+		~LocalCounts();
+		
+		void increment(uint64_t slot)
+		{
+			Entry & entry = entries[slot & entryMask];
+			
+			if ( entry.slot != slot )
+			{
+				evict(entry);
+				entry.slot = slot;
+			}
+			
+			entry.count++;
+		}
+		
+	private:
+		
+		static const uint64_t entryMask = (1 << 12) - 1;
+		
+		struct Entry
+		{
+			uint32_t slot = slotNone;
+			uint32_t count = 0;
+		};
+		
+		void evict(Entry & entry);
+		
+		ScreenIndex & index;
+		Entry entries[entryMask + 1];
+	};
+
+private:
+
+	static const uint32_t slotNone = UINT32_MAX;
+	
+	// Starts an index file; the arrays follow at the offsets given (each
+	// aligned to a page), as laid out in memory.
+	//
+	struct FileHeader
+	{
+		static const uint64_t magicValue = 0x584952435348534d; // "MSHSCRIX" in file order
+		static const uint64_t versionCurrent = 1;
+		static const uint64_t align = 4096;
+		
+		uint64_t magic = magicValue;
+		uint64_t version = versionCurrent;
+		
+		// of the sketch indexed
+		//
+		uint64_t referenceCount = 0;
+		uint64_t hashTotal = 0;
+		uint64_t hashSum = 0; // of the sizes and ends of each reference's hashes
+		uint64_t kmerSize = 0;
+		uint64_t seed = 0;
+		uint64_t use64 = 0;
+		
+		uint64_t capacity = 0;
+		uint64_t filterBlocks = 0;
+		uint64_t slotCount = 0;
+		
+		uint64_t keysOffset = 0;
+		uint64_t filterOffset = 0;
+		uint64_t slotsOffset = 0;
+		uint64_t offsetsOffset = 0;
+		uint64_t referencesOffset = 0;
+		uint64_t fileSize = 0;
+		
+		void identify(const Sketch & sketch);
+		bool sameSketch(const FileHeader & other) const;
+	};
+
+	uint64_t position(uint64_t hash) const; // to start probing from
+	uint64_t probe(uint64_t hash) const; // of hash, or the empty one where it would go
+	uint64_t insert(uint64_t hash); // thread-safe; returns its position
+
+	// The table, of capacity positions plus one for the hash 0 (0 marks
+	// empty positions).
+	//
+	uint64_t capacity = 0;
+	std::atomic<uint64_t> * keys = 0;
+	uint32_t * slots = 0;
+
+	static const int filterWords = 8;
+	static const uint64_t filterMultiplier = 0xd6e8feb86659fd93;
+	static const uint32_t filterSalts[filterWords];
+	
+	void addToFilter(uint64_t hash);
+	
+	uint64_t filterBlocks = 0;
+	std::atomic<uint32_t> * filter = 0;
+	
+	uint64_t slotCount = 0;
+	uint64_t * offsets = 0;
+	uint32_t * references = 0;
+	std::atomic<uint32_t> * counts = 0;
+	
+	// if opened from a file, the arrays (other than counts) are in here
+	//
+	void * mapped = 0;
+	uint64_t mappedSize = 0;
+};
+
+#endif
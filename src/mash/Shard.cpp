@@ -0,0 +1,108 @@
+// Copyright © 2015, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen,
+// Sergey Koren, and Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#include "Shard.h"
+#include <ctype.h>
+#include <math.h>
+#include <stdlib.h>
+
+using namespace::std;
+
+bool ShardHeader::sameRun(const ShardHeader & other) const
+{
+	return
+		version == other.version &&
+		kind == other.kind &&
+		count == other.count &&
+		pairTotal == other.pairTotal &&
+		refCount == other.refCount &&
+		queryCount == other.queryCount &&
+		kmerSize == other.kmerSize &&
+		sketchSize == other.sketchSize &&
+		seed == other.seed &&
+		top == other.top &&
+		edge == other.edge &&
+		distanceMax == other.distanceMax &&
+		pValueMax == other.pValueMax;
+}
+
+bool parseShard(const string & text, uint64_t & index, uint64_t & count)
+{
+	const char * start = text.c_str();
+	char * end;
+
+	if ( text.empty() || ! isdigit(text[0]) )
+	{
+		return false;
+	}
+
+	index = strtoull(start, &end, 10);
+
+	if ( *end != '/' || ! isdigit(end[1]) )
+	{
+		return false;
+	}
+
+	count = strtoull(end + 1, &end, 10);
+
+	if ( *end != 0 || index < 1 || index > count )
+	{
+		return false;
+	}
+
+	index--;
+	return true;
+}
+
+uint64_t shardBoundary(uint64_t pairTotal, uint64_t index, uint64_t count)
+{
+	// pairTotal * index / count without overflow
+	//
+	return pairTotal / count * index + pairTotal % count * index / count;
+}
+
+void trianglePair(uint64_t pair, uint64_t & row, uint64_t & column)
+{
+	// row r holds pairs [r(r-1)/2, r(r+1)/2); the estimate can be off by one
+	// from rounding
+	//
+	row = (1 + sqrt(1 + 8 * double(pair))) / 2;
+
+	while ( row > 1 && row * (row - 1) / 2 > pair )
+	{
+		row--;
+	}
+
+	while ( row * (row + 1) / 2 <= pair )
+	{
+		row++;
+	}
+
+	column = pair - row * (row - 1) / 2;
+}
+
+bool readShardHeader(FILE * file, ShardHeader & header)
+{
+	return
+		fread(&header, sizeof(ShardHeader), 1, file) == 1 &&
+		header.magic == ShardHeader::magicValue;
+}
+
+bool isShardFile(const string & file)
+{
+	FILE * stream = fopen(file.c_str(), "rb");
+
+	if ( stream == NULL )
+	{
+		return false;
+	}
+
+	ShardHeader header;
+	bool shard = readShardHeader(stream, header);
+
+	fclose(stream);
+	return shard;
+}
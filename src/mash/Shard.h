@@ -0,0 +1,78 @@
+// Copyright © 2015, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen,
+// Sergey Koren, and Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#ifndef Shard_h
+#define Shard_h
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+
+// Splitting of the pairs of a dist or triangle run (-shard i/n) so that
+// separate processes or nodes can each compute one part. The pairs are
+// numbered in the order the run writes them (query-major for dist, row-major
+// for triangle) and each shard gets a contiguous range of about the same
+// number of pairs, so the shards only depend on i, n and the input sketches,
+// and concatenating their results in shard order gives the unsharded output.
+//
+// A shard's binary output (-o) starts with a ShardHeader, followed by the
+// usual Result records for its range. "mash merge" checks the headers and
+// concatenates the records into an ordinary binary file for dumpdist or
+// dumptri.
+
+struct ShardHeader
+{
+    static const uint64_t magicValue = 0x445241485348534d; // "MSHSHARD" in file order
+    static const uint64_t versionCurrent = 1;
+
+    enum Kind
+    {
+        kindDist = 0,
+        kindTriangle = 1
+    };
+
+    uint64_t magic = magicValue;
+    uint64_t version = versionCurrent;
+    uint64_t kind = kindDist;
+
+    uint64_t index = 0; // 0-based (shown 1-based)
+    uint64_t count = 1;
+    uint64_t pairTotal = 0;
+    uint64_t pairBegin = 0;
+    uint64_t pairEnd = 0;
+
+    // for checking that shards come from the same run
+    //
+    uint64_t refCount = 0;
+    uint64_t queryCount = 0;
+    uint64_t kmerSize = 0;
+    uint64_t sketchSize = 0;
+    uint64_t seed = 0;
+    uint64_t top = 0;
+    uint64_t edge = 0;
+    double distanceMax = 1;
+    double pValueMax = 1;
+
+    bool sameRun(const ShardHeader & other) const;
+};
+
+// Parses "i/n" (1 <= i <= n) into a 0-based index and a count.
+//
+bool parseShard(const std::string & text, uint64_t & index, uint64_t & count);
+
+// First pair of shard index of count (index == count gives the total).
+//
+uint64_t shardBoundary(uint64_t pairTotal, uint64_t index, uint64_t count);
+
+// Row and column of a triangle pair, numbered row by row over the row > column
+// half of the matrix (rows from 1).
+//
+void trianglePair(uint64_t pair, uint64_t & row, uint64_t & column);
+
+bool readShardHeader(FILE * file, ShardHeader & header); // false if not a shard
+bool isShardFile(const std::string & file);
+
+#endif
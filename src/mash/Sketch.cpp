@@ -7,8 +7,14 @@
 #include "fastx/FastxIO.h"
 #include "fastx/FastxStream.h"
 #include "fastx/FastxChunk.h"
+#include "fastx/ChunkReader.h"
+#include "fastx/ChunkSizer.h"
 
 #include "Sketch.h"
+#include "SketchWriter.h"
+#include "Stats.h"
+#include "FilePrefetcher.h"
+#include "HyperLogLog.h"
 #include <unistd.h>
 #include <zlib.h>
 #include <stdio.h>
@@ -23,7 +29,9 @@
 #include <deque>
 #include <set>
 #include "Command.h" // TEMP for column printing
+#include "simd.h"
 #include <sys/stat.h>
+#include <capnp/any.h>
 #include <capnp/message.h>
 #include <capnp/serialize.h>
 #include <sys/mman.h>
@@ -31,19 +39,12 @@
 #include <list>
 #include <string.h>
 #include <sys/time.h>
+#include <functional>
+#include <thread>
+#include <chrono>
 
-#if defined __AVX512F__ && defined __AVX512CD__
+#ifdef SIMD_X86
 #include <immintrin.h>
-#else 
-#if defined __AVX2__
-#include <immintrin.h>
-#else
-#if defined __SSE4_1__
-#include <nmmintrin.h>
-#else
-
-#endif
-#endif
 #endif
 
 //#if defined (__ICC) || defined (__INTEL_COMPILER)
@@ -52,8 +53,143 @@
 
 #define SET_BINARY_MODE(file)
 #define CHUNK 16384
+#define CHUNK_FILE_MIN (1 << 22) // smallest file split into chunks when sketching whole files
+#define SMALL_FILE_MAX (1 << 20) // largest file batched with others when sketching whole files
+#define SMALL_BATCH_BYTES (1 << 22)
+#define SMALL_BATCH_FILES 1024
+#define CHUNK_MEMORY_DEFAULT (1 << 28) // for chunks of files split for threads
+#define CHUNK_PART_MAX (1 << 24) // largest chunk when adapting their size
 #define MEMORYBOUND 10000
-KSEQ_INIT(gzFile, gzread)
+
+// gzread, counted and timed for -stats (decompression is included)
+//
+static int gzreadCounted(gzFile file, void * buffer, unsigned int length)
+{
+	Stats::Timer timer(Stats::reading);
+	int bytes = gzread(file, buffer, length);
+	
+	if ( bytes > 0 )
+	{
+		Stats::count(Stats::bytesRead, bytes);
+	}
+	
+	return bytes;
+}
+
+// An input for kseq, either opened as usual or already read whole by the
+// prefetcher for -prefetch (and inflated here if gzipped)
+//
+struct InputStream
+{
+	InputStream(gzFile fileNew) : file(fileNew), buffer(0) {}
+	InputStream(FilePrefetcher::File * bufferNew);
+	~InputStream();
+	
+	gzFile file;
+	FilePrefetcher::File * buffer;
+	uint64_t offset;
+	z_stream stream;
+	bool inflating;
+};
+
+static bool isGzip(const FilePrefetcher::File * buffer, uint64_t offset)
+{
+	return
+		buffer->data.size() >= offset + 2 &&
+		(unsigned char)buffer->data[offset] == 0x1f &&
+		(unsigned char)buffer->data[offset + 1] == 0x8b;
+}
+
+InputStream::InputStream(FilePrefetcher::File * bufferNew)
+	:
+	file(0),
+	buffer(bufferNew),
+	offset(0)
+{
+	inflating = isGzip(buffer, 0);
+	
+	if ( inflating )
+	{
+		memset(&stream, 0, sizeof(stream));
+		
+		if ( inflateInit2(&stream, 15 + 16) != Z_OK )
+		{
+			std::cerr << "ERROR: could not initialize zlib" << std::endl;
+			exit(1);
+		}
+	}
+}
+
+InputStream::~InputStream()
+{
+	if ( buffer != 0 && inflating )
+	{
+		inflateEnd(&stream);
+	}
+}
+
+static int readInput(InputStream * input, void * buffer, unsigned int length)
+{
+	if ( input->buffer == 0 )
+	{
+		return gzreadCounted(input->file, buffer, length);
+	}
+	
+	const std::vector<char> & data = input->buffer->data;
+	
+	if ( ! input->inflating )
+	{
+		uint64_t bytes = data.size() - input->offset;
+		
+		if ( bytes > length )
+		{
+			bytes = length;
+		}
+		
+		memcpy(buffer, data.data() + input->offset, bytes);
+		input->offset += bytes;
+		return bytes;
+	}
+	
+	Stats::Timer timer(Stats::decompressing);
+	z_stream & stream = input->stream;
+	
+	stream.next_out = (Bytef *)buffer;
+	stream.avail_out = length;
+	
+	while ( stream.avail_out != 0 && input->offset < data.size() )
+	{
+		stream.next_in = (Bytef *)data.data() + input->offset;
+		stream.avail_in = data.size() - input->offset;
+		
+		int ret = inflate(&stream, Z_NO_FLUSH);
+		
+		input->offset = data.size() - stream.avail_in;
+		
+		if ( ret == Z_STREAM_END )
+		{
+			// concatenated members (e.g. bgzip) continue; like gzread,
+			// anything else after the end is ignored
+			//
+			if ( isGzip(input->buffer, input->offset) )
+			{
+				inflateReset(&stream);
+			}
+			else
+			{
+				input->offset = data.size();
+			}
+		}
+		else if ( ret != Z_OK )
+		{
+			return -1;
+		}
+	}
+	
+	return length - stream.avail_out;
+}
+
+KSEQ_INIT(InputStream *, readInput)
 
 using namespace std;
 
@@ -68,81 +204,20 @@ double get_sec()
 
 typedef map < Sketch::hash_t, vector<Sketch::PositionHash> > LociByHash_map;
 
-//#if defined (__ICC) || defined (__INTEL_COMPILER)
-#if defined __AVX512F__ && defined __AVX512CD__
-__m512i inline min512(__m512i v1, __m512i v2){
-	__mmask8 msk_gt, msk_lt;
-	msk_gt = _mm512_cmpgt_epi64_mask(v1, v2);
-	msk_lt = _mm512_cmplt_epi64_mask(v1, v2);
-
-	return (msk_gt < msk_lt) ? v1 : v2;
-}
-
-void inline transpose8_epi64(__m512i *row0, __m512i* row1, __m512i* row2,__m512i* row3, __m512i* row4, __m512i * row5,__m512i* row6,__m512i * row7)
-{
-	__m512i __t0,__t1,__t2,__t3,__t4,__t5,__t6,__t7;
-	__m512i __tt0,__tt1,__tt2,__tt3,__tt4,__tt5,__tt6,__tt7;
-
-	__m512i idx1,idx2;
-	idx1 = _mm512_set_epi64(0xD,0xC,0x5,0x4,0x9,0x8,0x1,0x0);
-	idx2 = _mm512_set_epi64(0xF,0xE,0x7,0x6,0xB,0xA,0x3,0x2);
-
-	__t0 = _mm512_unpacklo_epi64(*row0,*row1);
-	__t1 = _mm512_unpackhi_epi64(*row0,*row1);
-	__t2 = _mm512_unpacklo_epi64(*row2,*row3);
-	__t3 = _mm512_unpackhi_epi64(*row2,*row3);
-	__t4 = _mm512_unpacklo_epi64(*row4,*row5);
-	__t5 = _mm512_unpackhi_epi64(*row4,*row5);
-	__t6 = _mm512_unpacklo_epi64(*row6,*row7);
-	__t7 = _mm512_unpackhi_epi64(*row6,*row7);
-
-
-	__tt0 = _mm512_permutex2var_epi64(__t0,idx1,__t2);
-	__tt2 = _mm512_permutex2var_epi64(__t0,idx2,__t2);
-	__tt1 = _mm512_permutex2var_epi64(__t1,idx1,__t3);
-	__tt3 = _mm512_permutex2var_epi64(__t1,idx2,__t3);
-	__tt4 = _mm512_permutex2var_epi64(__t4,idx1,__t6);
-	__tt6 = _mm512_permutex2var_epi64(__t4,idx2,__t6);
-	__tt5 = _mm512_permutex2var_epi64(__t5,idx1,__t7);
-	__tt7 = _mm512_permutex2var_epi64(__t5,idx2,__t7);
-
-	*row0 = _mm512_shuffle_i64x2(__tt0,__tt4,0x44);
-	*row1 = _mm512_shuffle_i64x2(__tt1,__tt5,0x44);
-	*row2 = _mm512_shuffle_i64x2(__tt2,__tt6,0x44);
-	*row3 = _mm512_shuffle_i64x2(__tt3,__tt7,0x44);
-
-	*row4 = _mm512_shuffle_i64x2(__tt0,__tt4,0xEE);
-	*row5 = _mm512_shuffle_i64x2(__tt1,__tt5,0xEE);
-	*row6 = _mm512_shuffle_i64x2(__tt2,__tt6,0xEE);
-	*row7 = _mm512_shuffle_i64x2(__tt3,__tt7,0xEE);
-}
-#else 
-#ifdef __AVX2__
-	// implement by avx2
-void inline transpose4_epi64(__m256i *row1, __m256i *row2, __m256i *row3, __m256i *row4)
-{
-	__m256i vt1, vt2, vt3, vt4;
-
-	vt1 = _mm256_unpacklo_epi64(*row1, *row2);
-	vt2 = _mm256_unpackhi_epi64(*row1, *row2);
-	vt3 = _mm256_unpacklo_epi64(*row3, *row4);
-	vt4 = _mm256_unpackhi_epi64(*row3, *row4);
-
-	*row1 =_mm256_permute2x128_si256(vt1, vt3, 0x20);
-	*row2 =_mm256_permute2x128_si256(vt2, vt4, 0x20);
-	*row3 =_mm256_permute2x128_si256(vt1, vt3, 0x31);
-	*row4 =_mm256_permute2x128_si256(vt2, vt4, 0x31);
-}
-
-	#else
-		#ifdef __SSE4_1__
-		// implement by sse
-		#else
-		//implement without optimization
-		#endif
-	#endif
-#endif
-//#endif
+static void deleteMessages(vector<capnp::FlatArrayMessageReader *> & messages);
+
+Sketch::~Sketch()
+{
+	// references may still hold views into these
+	
+	references.clear();
+	
+	for ( size_t i = 0; i < mappedFiles.size(); i++ )
+	{
+		deleteMessages(mappedFiles[i].messages);
+		munmap(mappedFiles[i].data, mappedFiles[i].size);
+	}
+}
 
 void Sketch::getAlphabetAsString(string & alphabet) const
 {
@@ -212,14 +287,129 @@ void Sketch::initFromReads(const vector<string> & files, const Parameters & para
     createIndex();
 }
 
+bool hasFastaHeader(const string & file)
+{
+	gzFile fp = gzopen(file.c_str(), "r");
+	
+	if ( fp == 0 )
+	{
+		return false;
+	}
+	
+	bool fasta = gzgetc(fp) == '>';
+	
+	gzclose(fp);
+	return fasta;
+}
+
 int Sketch::initFromFiles(const vector<string> & files, const Parameters & parametersNew, int verbosity, bool enforceParameters, bool contain)
 {
     parameters = parametersNew;
     
 	ThreadPool<Sketch::SketchInput, Sketch::SketchOutput> threadPool(0, parameters.parallelism);
 	
-	bool individual = false;
-
+	// Files, capnp loads and chunks of large files all go through the same
+	// pool in input order, so whichever thread is free takes the next task
+	// and outputs are assembled in order as they complete. Large fasta files
+	// are split into chunks when sketching whole files (they always are with
+	// -i), so a few big genomes among many small ones do not leave the other
+	// threads idle. All chunked files share one chunk pool.
+	//
+	vector<bool> chunked(files.size(), ! parameters.concatenated);
+	mash::fa::FastaDataPool * fastaPool = 0;
+	mash::core::ChunkSizer * chunkSizer = 0;
+	uint32_t chunkQueueDepth = 0;
+	
+	// Small files are sketched a batch at a time by each task (see
+	// sketchFiles()), since opening and sketching one can take less than the
+	// task would. Batches are kept small enough to give each thread several.
+	//
+	bool batching = parameters.concatenated && ! parameters.reads && ! parameters.windowed;
+	vector<uint64_t> sizes(files.size(), 0);
+	uint64_t sizeTotal = 0;
+	vector<string> batch;
+	uint64_t batchBytes = 0;
+	uint64_t batchBytesMax = SMALL_BATCH_BYTES;
+	
+	if ( batching )
+	{
+		// stat over threads, since each call can wait on storage
+		//
+		#pragma omp parallel for schedule(dynamic, 64) num_threads(parameters.parallelism) reduction(+:sizeTotal)
+		for ( int i = 0; i < files.size(); i++ )
+		{
+			struct stat fileInfo;
+			
+			if ( files[i] != "-" && stat(files[i].c_str(), &fileInfo) == 0 )
+			{
+				sizes[i] = fileInfo.st_size;
+				sizeTotal += sizes[i];
+			}
+		}
+		
+		if ( sizeTotal / (4 * parameters.parallelism) < batchBytesMax )
+		{
+			batchBytesMax = sizeTotal / (4 * parameters.parallelism);
+		}
+	}
+	
+	// With -prefetch, whole files are read ahead of the tasks that sketch
+	// them, in the order they are submitted.
+	//
+	FilePrefetcher * prefetcher = parameters.prefetch > 0 ? new FilePrefetcher(parameters.prefetch) : 0;
+	
+	auto prefetch = [&](SketchInput * input)
+	{
+		if ( prefetcher != 0 && input->fileNames[0] != "-" )
+		{
+			input->prefetcher = prefetcher;
+			
+			for ( size_t i = 0; i < input->fileNames.size(); i++ )
+			{
+				uint64_t id = prefetcher->add(input->fileNames[i]);
+				
+				if ( i == 0 )
+				{
+					input->prefetchFirst = id;
+				}
+			}
+		}
+		
+		return input;
+	};
+	
+	auto submitBatch = [&]()
+	{
+		if ( batch.size() == 1 )
+		{
+			threadPool.runWhenThreadAvailable(prefetch(new SketchInput(batch, 0, 0, "", "", parameters)), sketchFile);
+		}
+		else if ( batch.size() > 1 )
+		{
+			SketchInput * input = new SketchInput(batch, 0, 0, "", "", parameters);
+			
+			input->outputPool = &outputPool;
+			threadPool.runWhenThreadAvailable(prefetch(input), sketchFiles);
+		}
+		
+		batch.clear();
+		batchBytes = 0;
+	};
+	
+	if ( batching && parameters.parallelism > 1 )
+	{
+		for ( int i = 0; i < files.size(); i++ )
+		{
+			// worth splitting if it is more than one thread's share
+			//
+			chunked[i] =
+				sizes[i] >= CHUNK_FILE_MIN &&
+				sizes[i] * parameters.parallelism > sizeTotal &&
+				! hasSuffix(files[i], suffixSketch) &&
+				hasFastaHeader(files[i]);
+		}
+	}
+	
     for ( int i = 0; i < files.size(); i++ )
     {
         bool isSketch = hasSuffix(files[i], parameters.windowed ? suffixSketchWindowed : suffixSketch);
@@ -280,11 +470,26 @@ int Sketch::initFromFiles(const vector<string> & files, const Parameters & param
             //
             vector<string> file;
             file.push_back(files[i]);
-			threadPool.runWhenThreadAvailable(new SketchInput(file, 0, 0, "", "", parameters), loadCapnp);
+			SketchInput * input = new SketchInput(file, 0, 0, "", "", parameters);
+			
+			if ( subsetActive )
+			{
+				input->subset = &subset;
+			}
+			
+			if ( files.size() == 1 )
+			{
+				// the pool has nothing else to do
+				//
+				input->threads = parameters.parallelism;
+			}
+			
+			submitBatch();
+			threadPool.runWhenThreadAvailable(input, loadCapnp);
         }
         else
 		{
-			FILE * inStream;
+			FILE * inStream = 0;
 		
 			if ( files[i] == "-" )
 			{
@@ -301,32 +506,73 @@ int Sketch::initFromFiles(const vector<string> & files, const Parameters & param
 				{
 					cerr << "Sketching " << files[i] << "..." << endl;
 				}
-			
-				inStream = fopen(files[i].c_str(), "r");
-			
-				if ( inStream == NULL )
+				
+				// files read by the prefetcher are not opened here too (a
+				// missing one is reported by the task that sketches it)
+				//
+				if ( chunked[i] || prefetcher == 0 )
 				{
-					cerr << "ERROR: could not open " << files[i] << " for reading." << endl;
-					exit(1);
+					inStream = fopen(files[i].c_str(), "r");
+				
+					if ( inStream == NULL )
+					{
+						cerr << "ERROR: could not open " << files[i] << " for reading." << endl;
+						exit(1);
+					}
 				}
 			}
 		
-			if ( parameters.concatenated )
+			if ( ! chunked[i] )
 			{
-				if ( files[i] != "-" )
+				if ( inStream != 0 && files[i] != "-" )
 				{
 					fclose(inStream);
 				}
 				
-				vector<string> file;
-				file.push_back(files[i]);
-				threadPool.runWhenThreadAvailable(new SketchInput(file, 0, 0, "", "", parameters), sketchFile);
+				if ( batching && files[i] != "-" && sizes[i] < SMALL_FILE_MAX )
+				{
+					batch.push_back(files[i]);
+					batchBytes += sizes[i];
+					
+					if ( batchBytes >= batchBytesMax || batch.size() == SMALL_BATCH_FILES )
+					{
+						submitBatch();
+					}
+				}
+				else
+				{
+					submitBatch();
+					threadPool.runWhenThreadAvailable(prefetch(new SketchInput(vector<string>(1, files[i]), 0, 0, "", "", parameters)), sketchFile);
+				}
 			}
 			else
 			{
+				submitBatch();
+				
+				if ( fastaPool == 0 )
+				{
+					// Parts are as large as chunks may grow (for long
+					// sequences), and as many as fit the memory for them, up
+					// to a chunk for each thread and one read ahead for each.
+					// A few are read ahead however little memory is given.
+					// Those past the threads are the depth of the queue.
+					//
+					uint64_t threads = parameters.parallelism;
+					uint64_t memory = parameters.chunkMemory ? parameters.chunkMemory : CHUNK_MEMORY_DEFAULT;
+					uint64_t partSize = parameters.chunkSize ? parameters.chunkSize : std::min<uint64_t>(CHUNK_PART_MAX, std::max<uint64_t>(1 << 20, memory / (2 * threads)));
+					uint64_t parts = std::min(2 * threads, std::max(threads + 2, memory / partSize));
+					
+					fastaPool = new mash::fa::FastaDataPool(parts, partSize);
+					chunkSizer = new mash::core::ChunkSizer(partSize, threads, parameters.chunkSize);
+					chunkQueueDepth = parts - threads;
+					
+					Stats::setting("chunk_part_bytes", partSize);
+					Stats::setting("chunk_parts", parts);
+					Stats::setting("chunk_queue_depth", chunkQueueDepth);
+				}
+				
 				//if ( ! sketchFileBySequence(inStream, &threadPool) )
-				individual = true;
-				if ( ! sketchFileByChunk(inStream, &threadPool) )
+				if ( ! sketchFileByChunk(inStream, &threadPool, fastaPool, chunkSizer, chunkQueueDepth, i, files[i]) )
 				{
 					cerr << "\nERROR: reading " << files[i] << "." << endl;
 					exit(1);
@@ -338,19 +584,32 @@ int Sketch::initFromFiles(const vector<string> & files, const Parameters & param
 
 		while ( threadPool.outputAvailable() )
 		{
-			if(individual)	
-				useThreadOutputChunk(threadPool.popOutputWhenAvailable());
-			else
-				useThreadOutput(threadPool.popOutputWhenAvailable());
+			useThreadOutput(threadPool.popOutputWhenAvailable());
 		}	
     }
     
+    submitBatch();
+    
 	while ( threadPool.running() )
 	{
-		if(individual)	
-			useThreadOutputChunk(threadPool.popOutputWhenAvailable());
-		else
-			useThreadOutput(threadPool.popOutputWhenAvailable());
+		useThreadOutput(threadPool.popOutputWhenAvailable());
+	}
+	
+	if ( prefetcher != 0 )
+	{
+		delete prefetcher;
+	}
+	
+	finishChunkFile();
+	
+	if ( fastaPool != 0 )
+	{
+		Stats::setting("chunk_bytes_min", chunkSizer->GetSmallest());
+		Stats::setting("chunk_bytes_max", chunkSizer->GetLargest());
+		Stats::setting("chunk_hash_bytes_per_second", chunkSizer->GetBytesPerSecond());
+		
+		delete chunkSizer;
+		delete fastaPool;
 	}
 	
     /*
@@ -372,182 +631,512 @@ int Sketch::initFromFiles(const vector<string> & files, const Parameters & param
     return 0;
 }
 
-uint64_t Sketch::initParametersFromCapnp(const char * file)
+void Sketch::initFromReferences(vector<Reference> & referencesNew, const Parameters & parametersNew)
 {
-    int fd = open(file, O_RDONLY);
-    
-    if ( fd < 0 )
-    {
-        cerr << "ERROR: could not open \"" << file << "\" for reading." << endl;
-        exit(1);
-    }
-    
-    struct stat fileInfo;
-    
-    if ( stat(file, &fileInfo) == -1 )
-    {
-        cerr << "ERROR: could not get file stats for \"" << file << "\"." << endl;
-        exit(1);
-    }
-    
-    void * data = mmap(NULL, fileInfo.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    parameters = parametersNew;
+    references.swap(referencesNew);
+    referenceIndecesById.clear();
     
-    if (data == MAP_FAILED)
-    {
-        uint64_t fileSize = fileInfo.st_size;
-        std::cerr << "Error: could not memory-map file " << file << " of size " << fileSize;
-        std::cerr << std::endl;
-        exit(1);
-    }
+    createIndex();
+}
 
-    capnp::ReaderOptions readerOptions;
-    
-    readerOptions.traversalLimitInWords = 1000000000000;
-    readerOptions.nestingLimit = 1000000;
-    
-    //capnp::StreamFdMessageReader * message = new capnp::StreamFdMessageReader(fd, readerOptions);
-    capnp::FlatArrayMessageReader * message = new capnp::FlatArrayMessageReader(kj::ArrayPtr<const capnp::word>(reinterpret_cast<const capnp::word *>(data), fileInfo.st_size / sizeof(capnp::word)), readerOptions);
-    capnp::MinHash::Reader reader = message->getRoot<capnp::MinHash>();
-    
-    parameters.kmerSize = reader.getKmerSize();
-    parameters.error = reader.getError();
-    parameters.minHashesPerWindow = reader.getMinHashesPerWindow();
-    parameters.windowSize = reader.getWindowSize();
-    parameters.concatenated = reader.getConcatenated();
-    parameters.noncanonical = reader.getNoncanonical();
-   	parameters.preserveCase = reader.getPreserveCase();
+// Sketch files keep whole MinHash messages one after another, the first
+// written with the file and the rest added in place (see SketchWriter's
+// append mode), so only the new references are written. For reading, the
+// references of all messages are one list.
+//
+typedef vector<capnp::MinHash::ReferenceList::Reference::Reader> ReferenceReaders;
 
-    capnp::MinHash::ReferenceList::Reader referenceListReader = reader.getReferenceList().getReferences().size() ? reader.getReferenceList() : reader.getReferenceListOld();
-    capnp::List<capnp::MinHash::ReferenceList::Reference>::Reader referencesReader = referenceListReader.getReferences();
-    uint64_t referenceCount = referencesReader.size();
-    
-   	parameters.seed = reader.getHashSeed();
-    
-    if ( reader.hasAlphabet() )
-    {
-    	setAlphabetFromString(parameters, reader.getAlphabet().cStr());
-    }
-    else
-    {
-    	setAlphabetFromString(parameters, alphabetNucleotide);
-    }
-	close(fd);
+static const uint32_t messageSegmentsMax = 512;
+
+static string makePackedMarker()
+{
+	// one segment: a root pointer to a list of bytes, then the text (with
+	// its NUL)
+	//
+	const char text[] = "mash sketch with packed hashes (sketch -pack), version 1";
+	uint64_t textWords = (sizeof(text) + 7) / 8;
+	vector<uint64_t> words(2 + textWords, 0);
 	
-	try
-	{
-		delete message;
-	}
-	catch (exception e) {}
+	words[0] = uint64_t(1 + textWords) << 32; // segment count - 1 = 0, size
+	words[1] = 1 | uint64_t(2) << 32 | uint64_t(sizeof(text)) << 35; // list of bytes
+	memcpy(&words[2], text, sizeof(text));
 	
-	return referenceCount;
+	return string((const char *)words.data(), words.size() * 8);
 }
 
-bool Sketch::sketchFileBySequence(FILE * file, ThreadPool<Sketch::SketchInput, Sketch::SketchOutput> * threadPool)
+const string & getPackedMarker()
 {
-	gzFile fp = gzdopen(fileno(file), "r");
-	kseq_t *seq = kseq_init(fp);
+	static const string marker = makePackedMarker();
+	return marker;
+}
+
+bool hasPackedMarker(const void * data, uint64_t size)
+{
+	const string & marker = getPackedMarker();
 	
-    int l;
-    int count = 0;
-	bool skipped = false;
+	return size >= marker.size() && memcmp(data, marker.data(), marker.size()) == 0;
+}
+
+void getSketchMessages(const void * data, uint64_t size, vector<uint64_t> & offsets)
+{
+	const char * bytes = (const char *)data;
+	uint64_t offset = hasPackedMarker(data, size) ? getPackedMarker().size() : 0;
 	
-	while ((l = kseq_read(seq)) >= 0)
+	offsets.assign(1, offset);
+	
+	while ( size - offset >= 8 )
 	{
-		if ( l < parameters.kmerSize )
+		// stream framing: segment count - 1, then the size of each segment
+		// in words, padded to a word
+		
+		uint32_t segments;
+		memcpy(&segments, bytes + offset, 4);
+		
+		if ( segments >= messageSegmentsMax )
 		{
-			skipped = true;
-			continue;
+			break;
 		}
 		
-		//if ( verbosity > 0 && parameters.windowed ) cout << '>' << seq->name.s << " (" << l << "nt)" << endl << endl;
-		//if (seq->comment.l) printf("comment: %s\n", seq->comment.s);
-		//printf("seq: %s\n", seq->seq.s);
-		//if (seq->qual.l) printf("qual: %s\n", seq->qual.s);
-		
-		// buffer this out since kseq will overwrite (SketchInput will delete)
-		//
-		char * seqCopy = new char[l];
-		//
-		memcpy(seqCopy, seq->seq.s, l);
+		segments++;
 		
-		threadPool->runWhenThreadAvailable(new SketchInput(vector<string>(), seqCopy, l, string(seq->name.s, seq->name.l), string(seq->comment.s, seq->comment.l), parameters), sketchSequence);
+		uint64_t headerBytes = (4 * (segments + 1) + 7) / 8 * 8;
 		
-		while ( threadPool->outputAvailable() )
+		if ( headerBytes > size - offset )
 		{
-			if(parameters.freeMemory){
-				useThreadOutput_FreeMemory(threadPool->popOutputWhenAvailable());
+			break;
+		}
+		
+		uint64_t messageBytes = headerBytes;
+		uint32_t rootWords;
+		
+		for ( uint32_t i = 0; i < segments; i++ )
+		{
+			uint32_t words;
+			memcpy(&words, bytes + offset + 4 * (i + 1), 4);
+			messageBytes += uint64_t(words) * 8;
+			
+			if ( i == 0 )
+			{
+				rootWords = words;
 			}
-			else{
-				useThreadOutput(threadPool->popOutputWhenAvailable());
+		}
+		
+		// an append is framed last, so until then its table is zero
+		//
+		if ( rootWords == 0 || messageBytes > size - offset )
+		{
+			break;
+		}
+		
+		offset += messageBytes;
+		offsets.push_back(offset);
+	}
+	
+	if ( offsets.size() == 1 )
+	{
+		// not framed as expected; left to capnp to report
+		//
+		offsets.push_back(size);
+	}
+}
+
+static capnp::List<capnp::MinHash::ReferenceList::Reference>::Reader getReferencesReader(capnp::MinHash::Reader reader)
+{
+	capnp::MinHash::ReferenceList::Reader referenceListReader = reader.getReferenceList().getReferences().size() ? reader.getReferenceList() : reader.getReferenceListOld();
+	return referenceListReader.getReferences();
+}
+
+// The messages of a mapped sketch file, with the references of all of them.
+// Messages after the first must have its parameters.
+//
+static void readMessages(const char * file, const void * data, uint64_t size, bool warn, vector<capnp::FlatArrayMessageReader *> & messages, ReferenceReaders & references)
+{
+	capnp::ReaderOptions readerOptions;
+	
+	readerOptions.traversalLimitInWords = 1000000000000;
+	readerOptions.nestingLimit = 1000000;
+	
+	vector<uint64_t> offsets;
+	getSketchMessages(data, size, offsets);
+	
+	if ( warn && offsets.back() + 8 <= size )
+	{
+		cerr << "WARNING: ignoring an incomplete append at the end of " << file << " (from an interrupted run); the next append replaces it." << endl;
+	}
+	
+	for ( uint64_t i = 0; i + 1 < offsets.size(); i++ )
+	{
+		const capnp::word * words = reinterpret_cast<const capnp::word *>((const char *)data + offsets[i]);
+		capnp::FlatArrayMessageReader * message = new capnp::FlatArrayMessageReader(kj::ArrayPtr<const capnp::word>(words, (offsets[i + 1] - offsets[i]) / sizeof(capnp::word)), readerOptions);
+		capnp::MinHash::Reader reader = message->getRoot<capnp::MinHash>();
+		
+		if ( i > 0 )
+		{
+			capnp::MinHash::Reader first = messages[0]->getRoot<capnp::MinHash>();
+			
+			if
+			(
+				reader.getKmerSize() != first.getKmerSize() ||
+				reader.getHashSeed() != first.getHashSeed() ||
+				reader.getMinHashesPerWindow() != first.getMinHashesPerWindow() ||
+				reader.getWindowSize() != first.getWindowSize() ||
+				reader.getNoncanonical() != first.getNoncanonical() ||
+				reader.getPreserveCase() != first.getPreserveCase() ||
+				string(reader.getAlphabet().cStr()) != first.getAlphabet().cStr()
+			)
+			{
+				cerr << "ERROR: the sketches appended to " << file << " (part " << i + 1 << ") have different parameters than the rest of it." << endl;
+				exit(1);
 			}
 		}
-    	
-		count++;
+		
+		capnp::List<capnp::MinHash::ReferenceList::Reference>::Reader referencesReader = getReferencesReader(reader);
+		
+		messages.push_back(message);
+		
+		for ( uint64_t j = 0; j < referencesReader.size(); j++ )
+		{
+			references.push_back(referencesReader[j]);
+		}
+	}
+}
+
+static void deleteMessages(vector<capnp::FlatArrayMessageReader *> & messages)
+{
+	for ( uint64_t i = 0; i < messages.size(); i++ )
+	{
+		try
+		{
+			delete messages[i];
+		}
+		catch (exception e) {}
 	}
 	
-	if (  l != -1 )
+	messages.clear();
+}
+
+uint64_t Sketch::initParametersFromCapnp(const char * file)
+{
+    int fd = open(file, O_RDONLY);
+    
+    if ( fd < 0 )
+    {
+        cerr << "ERROR: could not open \"" << file << "\" for reading." << endl;
+        exit(1);
+    }
+    
+    struct stat fileInfo;
+    
+    if ( stat(file, &fileInfo) == -1 )
+    {
+        cerr << "ERROR: could not get file stats for \"" << file << "\"." << endl;
+        exit(1);
+    }
+    
+    void * data = mmap(NULL, fileInfo.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    
+    if (data == MAP_FAILED)
+    {
+        uint64_t fileSize = fileInfo.st_size;
+        std::cerr << "Error: could not memory-map file " << file << " of size " << fileSize;
+        std::cerr << std::endl;
+        exit(1);
+    }
+
+    vector<capnp::FlatArrayMessageReader *> messages;
+    ReferenceReaders referencesReader;
+    
+    readMessages(file, data, fileInfo.st_size, false, messages, referencesReader);
+    capnp::MinHash::Reader reader = messages[0]->getRoot<capnp::MinHash>();
+    
+    parameters.kmerSize = reader.getKmerSize();
+    parameters.error = reader.getError();
+    parameters.minHashesPerWindow = reader.getMinHashesPerWindow();
+    parameters.windowSize = reader.getWindowSize();
+    parameters.concatenated = reader.getConcatenated();
+    parameters.noncanonical = reader.getNoncanonical();
+   	parameters.preserveCase = reader.getPreserveCase();
+
+    uint64_t referenceCount = referencesReader.size();
+    
+   	parameters.seed = reader.getHashSeed();
+    
+    if ( reader.hasAlphabet() )
+    {
+    	setAlphabetFromString(parameters, reader.getAlphabet().cStr());
+    }
+    else
+    {
+    	setAlphabetFromString(parameters, alphabetNucleotide);
+    }
+	close(fd);
+	
+	deleteMessages(messages);
+	munmap(data, fileInfo.st_size);
+	
+	return referenceCount;
+}
+
+bool Sketch::checkCapnp(const char * file, string & error)
+{
+	int fd = open(file, O_RDONLY);
+	struct stat fileInfo;
+	
+	if ( fd < 0 || fstat(fd, &fileInfo) == -1 )
+	{
+		error = "could not be opened";
+		
+		if ( fd >= 0 )
+		{
+			close(fd);
+		}
+		
+		return false;
+	}
+	
+	if ( fileInfo.st_size < 8 )
 	{
+		error = "is not a sketch file";
+		close(fd);
 		return false;
 	}
 	
-	return true;
+	void * data = mmap(NULL, fileInfo.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	
+	if ( data == MAP_FAILED )
+	{
+		error = "could not be mapped";
+		return false;
+	}
+	
+	capnp::ReaderOptions readerOptions;
+	
+	readerOptions.traversalLimitInWords = 1000000000000;
+	readerOptions.nestingLimit = 1000000;
+	
+	vector<uint64_t> offsets;
+	getSketchMessages(data, fileInfo.st_size, offsets);
+	
+	vector<capnp::FlatArrayMessageReader *> messages;
+	
+	error = "";
+	
+	try
+	{
+		for ( uint64_t i = 0; i + 1 < offsets.size() && error.empty(); i++ )
+		{
+			const capnp::word * words = reinterpret_cast<const capnp::word *>((const char *)data + offsets[i]);
+			messages.push_back(new capnp::FlatArrayMessageReader(kj::ArrayPtr<const capnp::word>(words, (offsets[i + 1] - offsets[i]) / sizeof(capnp::word)), readerOptions));
+			
+			// follows every pointer, so the references read later are in
+			// bounds
+			//
+			messages.back()->getRoot<capnp::AnyPointer>().targetSize();
+			
+			capnp::MinHash::Reader reader = messages.back()->getRoot<capnp::MinHash>();
+			capnp::MinHash::Reader readerFirst = messages[0]->getRoot<capnp::MinHash>();
+			
+			if
+			(
+				reader.getKmerSize() != readerFirst.getKmerSize() ||
+				reader.getHashSeed() != readerFirst.getHashSeed() ||
+				reader.getMinHashesPerWindow() != readerFirst.getMinHashesPerWindow() ||
+				reader.getWindowSize() != readerFirst.getWindowSize() ||
+				reader.getNoncanonical() != readerFirst.getNoncanonical() ||
+				reader.getPreserveCase() != readerFirst.getPreserveCase() ||
+				string(reader.getAlphabet().cStr()) != readerFirst.getAlphabet().cStr()
+			)
+			{
+				error = "has appended sketches with different parameters than the rest of it";
+			}
+		}
+	}
+	catch ( const kj::Exception & e )
+	{
+		error = string("is not a valid sketch file (") + e.getDescription().cStr() + ")";
+	}
+	catch ( ... )
+	{
+		error = "is not a valid sketch file";
+	}
+	
+	deleteMessages(messages);
+	munmap(data, fileInfo.st_size);
+	
+	return error.empty();
 }
 
-bool Sketch::sketchFileByChunk(FILE * file, ThreadPool<Sketch::SketchInput, Sketch::SketchOutput> * threadPool)
+bool Sketch::sketchFileBySequence(FILE * file, ThreadPool<Sketch::SketchInput, Sketch::SketchOutput> * threadPool)
 {
-	//gzFile fp = gzdopen(fileno(file), "r");
-	//kseq_t *seq = kseq_init(fp);
+	gzFile fp = gzdopen(fileno(file), "r");
+	InputStream input(fp);
+	kseq_t *seq = kseq_init(&input);
 	
-	mash::fa::FastaDataPool *fastaPool    = new mash::fa::FastaDataPool(parameters.parallelism, 1<<20);
-	mash::fa::FastaFileReader *fileReader = new mash::fa::FastaFileReader(fileno(file), parameters.kmerSize - 1, true);
-	mash::fa::FastaReader *fastaReader    = new mash::fa::FastaReader(*fileReader, *fastaPool);
     int l;
     int count = 0;
 	bool skipped = false;
 	
-	//while ((l = kseq_read(seq)) >= 0)
-	int nChunks = 0;
-	while(true)
+	while ((l = kseq_read(seq)) >= 0)
 	{
-		//if ( l < parameters.kmerSize )
-		//{
-		//	skipped = true;
-		//	continue;
-		//}
+		if ( l < parameters.kmerSize )
+		{
+			skipped = true;
+			continue;
+		}
 		
 		//if ( verbosity > 0 && parameters.windowed ) cout << '>' << seq->name.s << " (" << l << "nt)" << endl << endl;
 		//if (seq->comment.l) printf("comment: %s\n", seq->comment.s);
 		//printf("seq: %s\n", seq->seq.s);
 		//if (seq->qual.l) printf("qual: %s\n", seq->qual.s);
-		mash::fa::FastaChunk *fachunk = fastaReader->readNextChunk();
-		if(fachunk == NULL) break;
-
-		nChunks++;	
+		
+		// buffer this out since kseq will overwrite (SketchInput will delete)
 		//
-		//memcpy(seqCopy, seq->seq.s, l);
+		char * seqCopy = new char[l];
+		//
+		memcpy(seqCopy, seq->seq.s, l);
 		
-		threadPool->runWhenThreadAvailable(new SketchInput(fachunk, fastaPool, parameters), sketchChunk);
+		threadPool->runWhenThreadAvailable(new SketchInput(vector<string>(), seqCopy, l, string(seq->name.s, seq->name.l), string(seq->comment.s, seq->comment.l), parameters), sketchSequence);
 		
 		while ( threadPool->outputAvailable() )
 		{
-			useThreadOutputChunk(threadPool->popOutputWhenAvailable());
+			if(parameters.freeMemory){
+				useThreadOutput_FreeMemory(threadPool->popOutputWhenAvailable());
+			}
+			else{
+				useThreadOutput(threadPool->popOutputWhenAvailable());
+			}
 		}
     	
+		count++;
 	}
-
-	//cerr << "partNum: " << fastaPool->partNum << endl << flush;
-	while( fastaPool->partNum != 0 )
+	
+	if (  l != -1 )
 	{
+		return false;
 	}
+	
+	return true;
+}
+
+// Storage for SketchInput, which the thread pool deletes after each task.
+
+struct SketchInputStorage
+{
+	alignas(Sketch::SketchInput) char bytes[sizeof(Sketch::SketchInput)];
+};
+
+// not freed, since pool threads may still be finishing inputs at exit
+//
+static ObjectPool<SketchInputStorage> * sketchInputStorage = new ObjectPool<SketchInputStorage>();
+
+void * Sketch::SketchInput::operator new(size_t)
+{
+	return sketchInputStorage->get();
+}
 
-	//cerr << "partNum: " << fastaPool->partNum << endl << flush;
-	//cerr << "nChunks: " << nChunks << endl << flush;
+void Sketch::SketchInput::operator delete(void * pointer)
+{
+	sketchInputStorage->put((SketchInputStorage *)pointer);
+}
+
+bool Sketch::sketchFileByChunk(FILE * file, ThreadPool<Sketch::SketchInput, Sketch::SketchOutput> * threadPool, mash::fa::FastaDataPool * fastaPool, mash::core::ChunkSizer * chunkSizer, uint32_t queueDepth, int64_t fileIndex, const string & fileName)
+{
+	// Chunks are released back to the shared pool by sketchChunk, so the next
+	// file can be read while this one is still being sketched. Reading is on
+	// its own thread, so it goes on while outputs are handled here. The size
+	// of gzipped files once inflated is not known, so their chunks do not
+	// shrink toward the end.
+	
+	struct stat fileInfo;
+	
+	chunkSizer->StartFile(! hasSuffix(fileName, ".gz") && fstat(fileno(file), &fileInfo) == 0 && S_ISREG(fileInfo.st_mode) ? fileInfo.st_size : 0);
+	
+	mash::fa::FastaFileReader *fileReader = new mash::fa::FastaFileReader(fileno(file), parameters.kmerSize - 1, true, parameters.parallelism);
+	fileReader->SetChunkSizer(chunkSizer);
+	mash::fa::FastaReader *fastaReader    = new mash::fa::FastaReader(*fileReader, *fastaPool);
+	mash::fa::FastaChunkReader *chunkReader = new mash::fa::FastaChunkReader(*fastaReader, *fastaPool, queueDepth);
+	
+	while(true)
+	{
+		mash::fa::FastaChunk *fachunk = chunkReader->Next();
+		if(fachunk == NULL) break;
+		
+		SketchInput * input = new SketchInput(fachunk, fastaPool, parameters);
+		
+		input->chunkSizer = chunkSizer;
+		input->chunkFile = fileIndex;
+		input->chunkFileName = fileName;
+		input->outputPool = &outputPool;
+		
+		threadPool->runWhenThreadAvailable(input, sketchChunk);
+		
+		while ( threadPool->outputAvailable() )
+		{
+			useThreadOutput(threadPool->popOutputWhenAvailable());
+		}
+	}
+	
+	delete chunkReader;
 	delete fastaReader;
 	delete fileReader;
-	delete fastaPool;
+	
+	return true;
+}
 
+// Adds the HyperLogLog registers of other (another part of the same sequence
+// or file) to those of reference.
+//
+static void mergeHll(Sketch::Reference & reference, const Sketch::Reference & other)
+{
+	if ( other.hll.size() != 0 )
+	{
+		hllMerge(reference.hll, other.hll);
+		reference.hllSize = hllEstimate(reference.hll.data(), reference.hll.data(), reference.hll.size());
+	}
+}
 
-	return true;
+void mergeMinHashes(HashList & hashes, HashList & hashesOther, uint64_t sketchSize)
+{
+	// union of two sorted sketches, keeping the smallest sketchSize
+	
+	hashes.merge(hashesOther);
+	
+	if ( hashes.get64() )
+	{
+		vector<hash64_t> & this64 = hashes.hashes64;
+
+		auto last = unique(this64.begin(), this64.end());
+
+		if(uint64_t(last - this64.begin()) > sketchSize)
+		{
+			vector<hash64_t>::iterator it = ( this64.begin() + sketchSize);
+			this64.erase(it, this64.end());	
+		}else{
+			this64.erase(last, this64.end());
+		}
+	}
+	else
+	{
+		vector<hash32_t> & this32 = hashes.hashes32;
+
+		auto last = unique(this32.begin(), this32.end());
+
+		if(uint64_t(last - this32.begin()) > sketchSize)
+		{
+			vector<hash32_t>::iterator it = ( this32.begin() + sketchSize);
+			this32.erase(it, this32.end());	
+		}else{
+			this32.erase(last, this32.end());
+		}
+	}
+}
+
+void Sketch::recycleOutput(SketchOutput * output)
+{
+	output->clear();
+	outputPool.put(output);
 }
 
 void Sketch::useThreadOutput_FreeMemory(SketchOutput * output)
@@ -574,55 +1163,91 @@ void Sketch::useThreadOutput_FreeMemory(SketchOutput * output)
 
 void Sketch::useThreadOutput(SketchOutput * output)
 {
-	references.insert(references.end(), output->references.begin(), output->references.end());
-	positionHashesByReference.insert(positionHashesByReference.end(), output->positionHashesByReference.begin(), output->positionHashesByReference.end());
-	delete output;
+	Stats::Timer timer(Stats::mergingOutputs);
+	
+	if ( output->chunkFile >= 0 )
+	{
+		useThreadOutputChunk(output);
+		return;
+	}
+	
+	finishChunkFile();
+	
+	if ( output->mapped.data != 0 )
+	{
+		mappedFiles.push_back(output->mapped);
+		output->mapped = MappedFile();
+	}
+	
+	references.insert(references.end(), make_move_iterator(output->references.begin()), make_move_iterator(output->references.end()));
+	positionHashesByReference.insert(positionHashesByReference.end(), make_move_iterator(output->positionHashesByReference.begin()), make_move_iterator(output->positionHashesByReference.end()));
+	recycleOutput(output);
+	
+	streamReferences();
 }
 
 void Sketch::useThreadOutputChunk(SketchOutput * output)
 {
+	bool fileNew = output->chunkFile != chunkMerge.file;
+	
+	if ( fileNew )
+	{
+		finishChunkFile();
+		chunkMerge.file = output->chunkFile;
+	}
+	
+	if ( parameters.concatenated )
+	{
+		if ( fileNew )
+		{
+			chunkMerge.reference = Reference();
+			chunkMerge.reference.name = output->chunkFileName;
+			chunkMerge.reference.length = 0;
+			chunkMerge.reference.hashesSorted.setUse64(parameters.use64);
+		}
+		
+		for ( size_t i = 0; i < output->references.size(); i++ )
+		{
+			Reference & fragment = output->references[i];
+			
+			if ( chunkMerge.sequenceOpen && chunkMerge.sequenceGid == fragment.gid )
+			{
+				// continued from the last chunk after the halo
+				//
+				chunkMerge.sequenceLength += fragment.length - parameters.kmerSize + 1;
+			}
+			else
+			{
+				finishChunkSequence();
+				
+				chunkMerge.sequenceOpen = true;
+				chunkMerge.sequenceGid = fragment.gid;
+				chunkMerge.sequenceLength = fragment.length;
+				chunkMerge.sequenceHeader = fragment.name + " " + fragment.comment;
+			}
+			
+			mergeMinHashes(chunkMerge.reference.hashesSorted, fragment.hashesSorted, parameters.minHashesPerWindow);
+			mergeHll(chunkMerge.reference, fragment);
+		}
+		
+		recycleOutput(output);
+		return;
+	}
+	
 	//cerr << "output size: " << output->references.size() << endl << flush;
 	for(int i = 0; i < output->references.size(); i++)
 	{
-		if(references.empty()){
-			references.push_back(output->references[i]);	
+		if(references.empty() || fileNew){
+			references.push_back(std::move(output->references[i]));
+			fileNew = false;
 			continue;
 		}
 
 		if(references.back().gid == output->references[i].gid)
 		{
 			//merge last end and this begin
-			references.back().hashesSorted.merge(output->references[i].hashesSorted);
-			//unique
-			if(parameters.use64)
-			{
-				vector<hash64_t> & this64 = references.back().hashesSorted.hashes64;
-
-				auto last = unique(this64.begin(), this64.end());
-
-				if((last - this64.begin()) > parameters.minHashesPerWindow)
-				{
-					vector<hash64_t>::iterator it = ( this64.begin() + parameters.minHashesPerWindow);
-					this64.erase(it, this64.end());	
-				}else{
-					this64.erase(last, this64.end());
-				}
-
-
-			}else{
-				vector<hash32_t> & this32 = references.back().hashesSorted.hashes32;
-
-				auto last = unique(this32.begin(), this32.end());
-
-				if((last - this32.begin()) > parameters.minHashesPerWindow)
-				{
-					vector<hash32_t>::iterator it = ( this32.begin() + parameters.minHashesPerWindow);
-					this32.erase(it, this32.end());	
-				}else{
-					this32.erase(last, this32.end());
-				}
-
-			}
+			mergeMinHashes(references.back().hashesSorted, output->references[i].hashesSorted, parameters.minHashesPerWindow);
+			mergeHll(references.back(), output->references[i]);
 
 			//resize remove halo region
 			//halo region is kmerSize - 1
@@ -632,7 +1257,7 @@ void Sketch::useThreadOutputChunk(SketchOutput * output)
 
 
 		}else{
-			references.push_back(output->references[i]);	
+			references.push_back(std::move(output->references[i]));
 		}
 		
 		if(parameters.freeMemory){
@@ -652,12 +1277,142 @@ void Sketch::useThreadOutputChunk(SketchOutput * output)
 		}
 	}
 
-	//TODO imp for positionHashesByReference
-	for(int i = 0; i < output->positionHashesByReference.size(); i++)
+	//TODO imp for positionHashesByReference
+	for(int i = 0; i < output->positionHashesByReference.size(); i++)
+	{
+	}
+
+	recycleOutput(output);
+	
+	streamReferences();
+}
+
+void Sketch::finishChunkFile()
+{
+	if ( chunkMerge.file < 0 )
+	{
+		return;
+	}
+	
+	if ( parameters.concatenated )
+	{
+		// as in sketchFile
+		
+		finishChunkSequence();
+		
+		Reference & reference = chunkMerge.reference;
+		
+		if ( chunkMerge.sequenceCount > 1 )
+		{
+			reference.comment.insert(0, " seqs] ");
+			reference.comment.insert(0, to_string(chunkMerge.sequenceCount));
+			reference.comment.insert(0, "[");
+			reference.comment.append(" [...]");
+		}
+		
+		if ( reference.length == 0 )
+		{
+			if ( chunkMerge.skipped )
+			{
+				cerr << "\nWARNING: All fasta records in " << reference.name << " were shorter than the k-mer size (" << parameters.kmerSize << ")." << endl;
+			}
+			else
+			{
+				cerr << "\nERROR: Did not find fasta records in \"" << reference.name << "\"." << endl;
+			}
+			
+			exit(1);
+		}
+		
+		references.push_back(std::move(reference));
+		
+		chunkMerge.reference = Reference();
+		chunkMerge.sequenceCount = 0;
+		chunkMerge.skipped = false;
+	}
+	
+	chunkMerge.file = -1;
+	
+	streamReferences();
+}
+
+void Sketch::finishChunkSequence()
+{
+	if ( ! chunkMerge.sequenceOpen )
+	{
+		return;
+	}
+	
+	if ( chunkMerge.sequenceLength < uint64_t(parameters.kmerSize) )
 	{
+		chunkMerge.skipped = true;
 	}
+	else
+	{
+		if ( chunkMerge.sequenceCount == 0 )
+		{
+			chunkMerge.reference.comment = chunkMerge.sequenceHeader;
+		}
+		
+		chunkMerge.sequenceCount++;
+		chunkMerge.reference.length += chunkMerge.sequenceLength;
+	}
+	
+	chunkMerge.sequenceOpen = false;
+}
 
-	delete output;
+void Sketch::streamReferences()
+{
+	// the last reference is kept too, since -i chunks may still extend it
+	
+	if ( streamFile.empty() || references.size() < streamNext + 2 )
+	{
+		return;
+	}
+	
+	Stats::Timer timer(Stats::writing);
+	
+	if ( streamWriter == 0 )
+	{
+		string alphabet;
+		getAlphabetAsString(alphabet);
+		streamWriter = new SketchWriter(streamFile, parameters, alphabet, streamAppend);
+	}
+	
+	for ( ; streamNext < references.size() - 1; streamNext++ )
+	{
+		Reference & reference = references[streamNext];
+		
+		streamWriter->addReference(streamNext, reference);
+		
+		reference.hashesSorted = HashList(parameters.use64);
+		vector<uint32_t>().swap(reference.counts);
+	}
+}
+
+void Sketch::finishStream()
+{
+	Stats::Timer timer(Stats::writing);
+	
+	if ( streamWriter == 0 )
+	{
+		string alphabet;
+		getAlphabetAsString(alphabet);
+		streamWriter = new SketchWriter(streamFile, parameters, alphabet, streamAppend);
+	}
+	
+	for ( uint64_t i = 0; i < references.size(); i++ )
+	{
+		if ( i == 0 || i >= streamNext )
+		{
+			streamWriter->addReference(i, references[i]);
+		}
+	}
+	
+	streamNext = references.size();
+	
+	delete streamWriter;
+	streamWriter = 0;
 }
 
 bool Sketch::writeToFile() const
@@ -667,6 +1422,7 @@ bool Sketch::writeToFile() const
 
 int Sketch::writeToCapnp(const char * file) const
 {  
+	Stats::Timer timer(Stats::writing);
 
 	//debug only TODO:remove it
     //for ( uint64_t i = 0; i < references.size(); i++ )
@@ -708,7 +1464,14 @@ int Sketch::writeToCapnp(const char * file) const
         {
             const HashList & hashes = references[i].hashesSorted;
             
-            if ( parameters.use64 )
+            if ( parameters.packed )
+            {
+                vector<uint64_t> words;
+                
+                hashes.pack(words);
+                referenceBuilder.setHashesPacked(capnp::Data::Reader(reinterpret_cast<const kj::byte *>(words.data()), words.size() * sizeof(uint64_t)));
+            }
+            else if ( parameters.use64 )
             {
                 capnp::List<uint64_t>::Builder hashes64Builder = referenceBuilder.initHashes64(hashes.size());
             
@@ -739,6 +1502,11 @@ int Sketch::writeToCapnp(const char * file) const
 				}
 			}
         }
+        
+        if ( references[i].hll.size() != 0 )
+        {
+        	referenceBuilder.setHll(capnp::Data::Reader(references[i].hll.data(), references[i].hll.size()));
+        }
     }
     
     int locusCount = 0;
@@ -780,380 +1548,739 @@ int Sketch::writeToCapnp(const char * file) const
     getAlphabetAsString(alphabet);
     builder.setAlphabet(alphabet);
     
+    if ( parameters.packed )
+    {
+    	const string & marker = getPackedMarker();
+    	
+    	if ( write(fd, marker.data(), marker.size()) != ssize_t(marker.size()) )
+    	{
+    		cerr << "ERROR: could not write to " << file << "." << endl;
+    		exit(1);
+    	}
+    }
+    
     writeMessageToFd(fd, message);
     close(fd);
     
     return 0;
 }
 
-void Sketch::createIndex()
+// Sketch index (<sketch>.idx): a header, then one offset per reference,
+// sorted by name, to a record of its position in the reference list and its
+// name. The header records the sketch file size and reference count so stale
+// indexes are ignored. Little-endian, like the sketch itself.
+//
+//   header   char magic[8], uint64 references, uint64 sketch file size
+//   offsets  uint64 offset (from the start of the file) of each record
+//   records  uint64 position, uint32 name length, name (not terminated)
+
+static const char * indexMagic = "MSHIDX1";
+static const uint64_t indexHeaderBytes = 24;
+
+int Sketch::writeIndex(const char * file) const
+{
+	vector<string> names(references.size());
+	
+	for ( uint64_t i = 0; i < references.size(); i++ )
+	{
+		names[i] = references[i].name;
+	}
+	
+	return writeIndex(file, names);
+}
+
+int Sketch::writeIndex(const char * file, const vector<string> & names)
+{
+	struct stat fileInfo;
+	
+	if ( stat(file, &fileInfo) == -1 )
+	{
+		cerr << "ERROR: could not read " << file << " to index it." << endl;
+		exit(1);
+	}
+	
+	vector<uint64_t> order(names.size());
+	
+	for ( uint64_t i = 0; i < order.size(); i++ )
+	{
+		order[i] = i;
+	}
+	
+	stable_sort(order.begin(), order.end(), [&names](uint64_t a, uint64_t b) {return names[a] < names[b];});
+	
+	uint64_t recordsBytes = 0;
+	
+	for ( uint64_t i = 0; i < names.size(); i++ )
+	{
+		recordsBytes += 12 + names[i].size();
+	}
+	
+	vector<char> data(indexHeaderBytes + names.size() * 8 + recordsBytes);
+	uint64_t header[2] = {names.size(), uint64_t(fileInfo.st_size)};
+	uint64_t record = indexHeaderBytes + names.size() * 8;
+	
+	memcpy(data.data(), indexMagic, 8);
+	memcpy(data.data() + 8, header, sizeof(header));
+	
+	for ( uint64_t i = 0; i < order.size(); i++ )
+	{
+		const string & name = names[order[i]];
+		uint32_t length = name.size();
+		
+		memcpy(data.data() + indexHeaderBytes + i * 8, &record, 8);
+		memcpy(data.data() + record, &order[i], 8);
+		memcpy(data.data() + record + 8, &length, 4);
+		memcpy(data.data() + record + 12, name.c_str(), length);
+		record += 12 + length;
+	}
+	
+	string fileIndex = string(file) + suffixIndex;
+	int fd = open(fileIndex.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0644);
+	
+	if ( fd < 0 || write(fd, data.data(), data.size()) != ssize_t(data.size()) )
+	{
+		cerr << "ERROR: could not write " << fileIndex << "." << endl;
+		exit(1);
+	}
+	
+	close(fd);
+	
+	return 0;
+}
+
+int Sketch::writeIndexFromFile(const char * file)
+{
+	// only the names are needed, so the hashes are left mapped
+	
+	Sketch sketch;
+	sketch.initParametersFromCapnp(file);
+	
+	Parameters parametersFile = sketch.getParameters();
+	parametersFile.parallelism = 1;
+	parametersFile.mapped = true;
+	
+	Sketch all;
+	all.initFromFiles(vector<string>(1, file), parametersFile, 0, true);
+	
+	return all.writeIndex(file);
+}
+
+// Adds the list positions of the given names to positions, using the index of
+// the sketch file if there is a current one; returns false otherwise.
+//
+static bool lookupIndex(const string & file, uint64_t fileSize, const ReferenceReaders & referencesReader, const vector<string> & names, vector<bool> & found, vector<uint64_t> & positions)
+{
+	string fileIndex = file + suffixIndex;
+	int fd = open(fileIndex.c_str(), O_RDONLY);
+	struct stat fileInfo;
+	
+	if ( fd < 0 )
+	{
+		return false;
+	}
+	
+	if ( fstat(fd, &fileInfo) == -1 || uint64_t(fileInfo.st_size) < indexHeaderBytes )
+	{
+		close(fd);
+		return false;
+	}
+	
+	uint64_t size = fileInfo.st_size;
+	const char * data = (const char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	
+	if ( data == MAP_FAILED )
+	{
+		return false;
+	}
+	
+	uint64_t header[2];
+	memcpy(header, data + 8, sizeof(header));
+	
+	uint64_t count = header[0];
+	bool good =
+		memcmp(data, indexMagic, 8) == 0 &&
+		count == referencesReader.size() &&
+		header[1] == fileSize &&
+		indexHeaderBytes + count * 8 <= size;
+	
+	vector<uint64_t> positionsFound;
+	
+	for ( uint64_t i = 0; good && i < names.size(); i++ )
+	{
+		const string & name = names[i];
+		
+		// binary search for the first record not less than the name
+		
+		uint64_t low = 0;
+		uint64_t high = count;
+		
+		while ( good && low < high )
+		{
+			uint64_t mid = (low + high) / 2;
+			uint64_t offset;
+			uint32_t length;
+			
+			memcpy(&offset, data + indexHeaderBytes + mid * 8, 8);
+			
+			if ( offset + 12 > size )
+			{
+				good = false;
+				break;
+			}
+			
+			memcpy(&length, data + offset + 8, 4);
+			
+			if ( offset + 12 + length > size )
+			{
+				good = false;
+				break;
+			}
+			
+			if ( name.compare(0, string::npos, data + offset + 12, length) > 0 )
+			{
+				low = mid + 1;
+			}
+			else
+			{
+				high = mid;
+			}
+		}
+		
+		for ( uint64_t j = low; good && j < count; j++ )
+		{
+			uint64_t offset;
+			uint64_t position;
+			uint32_t length;
+			
+			memcpy(&offset, data + indexHeaderBytes + j * 8, 8);
+			
+			if ( offset + 12 > size )
+			{
+				good = false;
+				break;
+			}
+			
+			memcpy(&position, data + offset, 8);
+			memcpy(&length, data + offset + 8, 4);
+			
+			if ( offset + 12 + length > size || name.compare(0, string::npos, data + offset + 12, length) != 0 )
+			{
+				break;
+			}
+			
+			// the sketch itself has the final say
+			//
+			if ( position >= count || name != referencesReader[position].getName().cStr() )
+			{
+				good = false;
+				break;
+			}
+			
+			positionsFound.push_back(position);
+			found[i] = true;
+		}
+	}
+	
+	munmap((void *)data, size);
+	
+	if ( good )
+	{
+		positions.insert(positions.end(), positionsFound.begin(), positionsFound.end());
+	}
+	else
+	{
+		found.assign(found.size(), false);
+	}
+	
+	return good;
+}
+
+// Sorted list positions of the references of a sketch file to load.
+//
+static void selectReferences(const Sketch::ReferenceSubset & subset, const string & file, uint64_t fileSize, const ReferenceReaders & referencesReader, vector<uint64_t> & positions)
+{
+	uint64_t count = referencesReader.size();
+	uint64_t last = subset.last < count ? subset.last : count - 1;
+	
+	if ( subset.names.size() == 0 )
+	{
+		for ( uint64_t i = subset.first; count > 0 && i <= last; i++ )
+		{
+			positions.push_back(i);
+		}
+		
+		return;
+	}
+	
+	vector<bool> found(subset.names.size(), false);
+	
+	if ( ! lookupIndex(file, fileSize, referencesReader, subset.names, found, positions) )
+	{
+		// no current index; read every name
+		
+		robin_hood::unordered_map<string, vector<uint64_t>> namesWanted;
+		
+		for ( uint64_t i = 0; i < subset.names.size(); i++ )
+		{
+			namesWanted[subset.names[i]].push_back(i);
+		}
+		
+		for ( uint64_t i = 0; i < count; i++ )
+		{
+			auto wanted = namesWanted.find(string(referencesReader[i].getName().cStr()));
+			
+			if ( wanted != namesWanted.end() )
+			{
+				positions.push_back(i);
+				
+				for ( int j = 0; j < wanted->second.size(); j++ )
+				{
+					found[wanted->second[j]] = true;
+				}
+			}
+		}
+	}
+	
+	for ( uint64_t i = 0; i < subset.names.size(); i++ )
+	{
+		if ( ! found[i] )
+		{
+			cerr << "WARNING: \"" << subset.names[i] << "\" not found in " << file << "." << endl;
+		}
+	}
+	
+	sort(positions.begin(), positions.end());
+	positions.erase(unique(positions.begin(), positions.end()), positions.end());
+	
+	// within the range too
+	
+	positions.erase(remove_if(positions.begin(), positions.end(), [&](uint64_t i) {return i < subset.first || i > subset.last;}), positions.end());
+}
+
+void Sketch::createIndex()
+{
+    for ( int i = 0; i < references.size(); i++ )
+    {
+        referenceIndecesById[references[i].name] = i;
+    }
+    
+    for ( int i = 0; i < positionHashesByReference.size(); i++ )
+    {
+        for ( int j = 0; j < positionHashesByReference.at(i).size(); j++ )
+        {
+            const PositionHash & positionHash = positionHashesByReference.at(i).at(j);
+            
+            lociByHash[positionHash.hash].push_back(Locus(i, positionHash.position));
+        }
+    }
+    
+    kmerSpace = pow(parameters.alphabetSize, parameters.kmerSize);
+}
+
+// Lookup tables for the rolling 2-bit nucleotide engine. Codes follow ASCII
+// order (A < C < G < T), so comparing packed k-mers numerically picks the same
+// canonical strand as memcmp on the characters.
+//
+struct TwoBitTables
+{
+	int8_t code[256];
+	char decode[256][4]; // one byte of packed codes (first base high) -> 4 bases
+
+	TwoBitTables()
+	{
+		const char * bases = "ACGT";
+
+		memset(code, -1, sizeof(code));
+
+		for ( int i = 0; i < 4; i++ )
+		{
+			code[(unsigned char)bases[i]] = i;
+		}
+
+		for ( int i = 0; i < 256; i++ )
+		{
+			for ( int j = 0; j < 4; j++ )
+			{
+				decode[i][j] = bases[(i >> (6 - 2 * j)) & 3];
+			}
+		}
+	}
+};
+
+static const TwoBitTables & getTwoBitTables()
+{
+	static const TwoBitTables tables;
+	return tables;
+}
+
+bool getAlphabetTable(const Sketch::Parameters & parameters, uint8_t * table)
+{
+	memset(table, 0, 16);
+	
+	for ( int i = 0; i < 256; i++ )
+	{
+		if ( parameters.alphabet[i] )
+		{
+			if ( i >= 128 )
+			{
+				return false;
+			}
+			
+			table[i & 15] |= 1 << (i >> 4);
+		}
+	}
+	
+	return true;
+}
+
+void toUpperScalar(char * seq, uint64_t length)
 {
-    for ( int i = 0; i < references.size(); i++ )
-    {
-        referenceIndecesById[references[i].name] = i;
-    }
-    
-    for ( int i = 0; i < positionHashesByReference.size(); i++ )
-    {
-        for ( int j = 0; j < positionHashesByReference.at(i).size(); j++ )
-        {
-            const PositionHash & positionHash = positionHashesByReference.at(i).at(j);
-            
-            lociByHash[positionHash.hash].push_back(Locus(i, positionHash.position));
-        }
-    }
-    
-    kmerSpace = pow(parameters.alphabetSize, parameters.kmerSize);
+	for ( uint64_t i = 0; i < length; i++ )
+	{
+	    if ( seq[i] > 96 && seq[i] < 123 )
+	    {
+	        seq[i] -= 32;
+	    }
+	}
 }
 
-void addMinHashes(MinHashHeap & minHashHeap, const char * seq, uint64_t length, const Sketch::Parameters & parameters)
+uint64_t alphabetRunScalar(const char * seq, uint64_t length, const uint8_t * table, bool inAlphabet)
 {
+	for ( uint64_t i = 0; i < length; i++ )
+	{
+		unsigned char c = seq[i];
+		bool in = c < 128 && (table[c & 15] >> (c >> 4) & 1);
+		
+		if ( in != inAlphabet )
+		{
+			return i;
+		}
+	}
+	
+	return length;
+}
 
-    int kmerSize = parameters.kmerSize;
-    uint64_t mins = parameters.minHashesPerWindow;
-    bool noncanonical = parameters.noncanonical;
+#ifdef SIMD_X86
+SIMD_TARGET_BEGIN(SIMD_TARGET_AVX2)
+void toUpperAvx2(char * seq, uint64_t length)
+{
+	const __m256i below = _mm256_set1_epi8(96);
+	const __m256i above = _mm256_set1_epi8(123);
+	const __m256i offset = _mm256_set1_epi8(32);
+	uint64_t i = 0;
+	
+	for ( ; i + 32 <= length; i += 32 )
+	{
+		__m256i v = _mm256_loadu_si256((const __m256i *)(seq + i));
+		__m256i lower = _mm256_and_si256(_mm256_cmpgt_epi8(v, below), _mm256_cmpgt_epi8(above, v));
+		
+		_mm256_storeu_si256((__m256i *)(seq + i), _mm256_sub_epi8(v, _mm256_and_si256(lower, offset)));
+	}
+	
+	toUpperScalar(seq + i, length - i);
+}
 
-    // Determine the 'mins' smallest hashes, including those already provided
-    // (potentially replacing them). This allows min-hash sets across multiple
-    // sequences to be determined.
-    
-    // uppercase TODO: alphabets?
-    //
-    //for ( uint64_t i = 0; i < length; i++ )
-    //{
-    //    if ( ! parameters.preserveCase && seq[i] > 96 && seq[i] < 123 )
-    //    {
-    //        seq[i] -= 32;
-    //    }
-    //}
-    
-    char * seqRev;
-    
-    if ( ! noncanonical )
-    {
-    	seqRev = new char[length];
-        reverseComplement(seq, seqRev, length);
-    }
-//#if defined(__ICC) || defined(__INTEL_COMPILER)
-#if defined __AVX512F__ && defined __AVX512CD__
-//============================================================================================================================================================
-	//cout << "use the intel avx512 " << endl;
-	//exit(0);
-	//addbyxxm
-    //hash_u hash = getHash(kmer, kmerSize, parameters.seed, parameters.use64);
-//  const char * kmer = (noncanonical || memcmp(kmer_fwd, kmer_rev, kmerSize) <= 0) ? kmer_fwd : kmer_rev;
-	int pend_k = ((kmerSize - 1) / 16 + 1) * 16;
-	int n_kmers = length - kmerSize + 1;
-	int n_kmers_body = (n_kmers / 16) * 16;
-	//int n_kmers_body = (n_kmers / 32) * 32;
-	//int n_kmers_body = (n_kmers / 8) * 8;
-	
-	const uint8_t* input8 = (const uint8_t *)seq;
-	const uint8_t* input8_rev = (const uint8_t *)seqRev;
-	//uint64_t* res = (uint64_t* )_mm_malloc(n_kmers * 2 * sizeof(uint64_t), 64);
-	uint64_t res[16 * 2];
-	//uint64_t res[32 * 2];
-	//uint64_t res[8 * 2];
-	uint64_t res2[2];
-	uint8_t kmer_buf[kmerSize];
-//	uint64_t result[16];
-	
-	__m512i v0, v1;
-	__m512i vi[8];
-	__m512i vj[8];
-	__m512i vi_forword[8];
-	__m512i vi_reverse[8];
-	__m512i vj_forword[8];
-	__m512i vj_reverse[8];
-//	__m512i vk[8];
-//	__m512i vl[8];
-	__m512i vzero = _mm512_setzero_si512();
-
-	__mmask64 mask_load = 0xffffffffffffffff;
-	mask_load >>= (64 - kmerSize);
-
-	for(int i = 0; i < n_kmers_body-1; i+=16){
-	
-		vi_forword[0] = _mm512_mask_loadu_epi8(vzero, mask_load, input8 + i + 0);
-		vi_forword[1] = _mm512_mask_loadu_epi8(vzero, mask_load, input8 + i + 1);
-		vi_forword[2] = _mm512_mask_loadu_epi8(vzero, mask_load, input8 + i + 2);
-		vi_forword[3] = _mm512_mask_loadu_epi8(vzero, mask_load, input8 + i + 3);
-		vi_forword[4] = _mm512_mask_loadu_epi8(vzero, mask_load, input8 + i + 4);
-		vi_forword[5] = _mm512_mask_loadu_epi8(vzero, mask_load, input8 + i + 5);
-		vi_forword[6] = _mm512_mask_loadu_epi8(vzero, mask_load, input8 + i + 6);
-		vi_forword[7] = _mm512_mask_loadu_epi8(vzero, mask_load, input8 + i + 7);
-
-
-		vj_forword[0] = _mm512_mask_loadu_epi8(vzero, mask_load, input8 + i + 8);
-		vj_forword[1] = _mm512_mask_loadu_epi8(vzero, mask_load, input8 + i + 9);
-		vj_forword[2] = _mm512_mask_loadu_epi8(vzero, mask_load, input8 + i + 10);
-		vj_forword[3] = _mm512_mask_loadu_epi8(vzero, mask_load, input8 + i + 11);
-		vj_forword[4] = _mm512_mask_loadu_epi8(vzero, mask_load, input8 + i + 12);
-		vj_forword[5] = _mm512_mask_loadu_epi8(vzero, mask_load, input8 + i + 13);
-		vj_forword[6] = _mm512_mask_loadu_epi8(vzero, mask_load, input8 + i + 14);
-		vj_forword[7] = _mm512_mask_loadu_epi8(vzero, mask_load, input8 + i + 15);
-
-		if( !noncanonical){
-
-			vi_reverse[0] = _mm512_mask_loadu_epi8(vzero, mask_load, input8_rev + length - i - 0 - kmerSize);
-			vi_reverse[1] = _mm512_mask_loadu_epi8(vzero, mask_load, input8_rev + length - i - 1 - kmerSize);
-			vi_reverse[2] = _mm512_mask_loadu_epi8(vzero, mask_load, input8_rev + length - i - 2 - kmerSize);
-			vi_reverse[3] = _mm512_mask_loadu_epi8(vzero, mask_load, input8_rev + length - i - 3 - kmerSize);
-			vi_reverse[4] = _mm512_mask_loadu_epi8(vzero, mask_load, input8_rev + length - i - 4 - kmerSize);
-			vi_reverse[5] = _mm512_mask_loadu_epi8(vzero, mask_load, input8_rev + length - i - 5 - kmerSize);
-			vi_reverse[6] = _mm512_mask_loadu_epi8(vzero, mask_load, input8_rev + length - i - 6 - kmerSize);
-			vi_reverse[7] = _mm512_mask_loadu_epi8(vzero, mask_load, input8_rev + length - i - 7 - kmerSize);
-
-			vj_reverse[0] = _mm512_mask_loadu_epi8(vzero, mask_load, input8_rev + length - i - 8 - kmerSize);
-			vj_reverse[1] = _mm512_mask_loadu_epi8(vzero, mask_load, input8_rev + length - i - 9 - kmerSize);
-			vj_reverse[2] = _mm512_mask_loadu_epi8(vzero, mask_load, input8_rev + length - i - 10 - kmerSize);
-			vj_reverse[3] = _mm512_mask_loadu_epi8(vzero, mask_load, input8_rev + length - i - 11 - kmerSize);
-			vj_reverse[4] = _mm512_mask_loadu_epi8(vzero, mask_load, input8_rev + length - i - 12 - kmerSize);
-			vj_reverse[5] = _mm512_mask_loadu_epi8(vzero, mask_load, input8_rev + length - i - 13 - kmerSize);
-			vj_reverse[6] = _mm512_mask_loadu_epi8(vzero, mask_load, input8_rev + length - i - 14 - kmerSize);
-			vj_reverse[7] = _mm512_mask_loadu_epi8(vzero, mask_load, input8_rev + length - i - 15 - kmerSize);
-
-
-			vi[0] = min512(vi_forword[0], vi_reverse[0]);
-			vi[1] = min512(vi_forword[1], vi_reverse[1]);
-			vi[2] = min512(vi_forword[2], vi_reverse[2]);
-			vi[3] = min512(vi_forword[3], vi_reverse[3]);
-			vi[4] = min512(vi_forword[4], vi_reverse[4]);
-			vi[5] = min512(vi_forword[5], vi_reverse[5]);
-			vi[6] = min512(vi_forword[6], vi_reverse[6]);
-			vi[7] = min512(vi_forword[7], vi_reverse[7]);
-
-			vj[0] = min512(vj_forword[0], vj_reverse[0]);
-			vj[1] = min512(vj_forword[1], vj_reverse[1]);
-			vj[2] = min512(vj_forword[2], vj_reverse[2]);
-			vj[3] = min512(vj_forword[3], vj_reverse[3]);
-			vj[4] = min512(vj_forword[4], vj_reverse[4]);
-			vj[5] = min512(vj_forword[5], vj_reverse[5]);
-			vj[6] = min512(vj_forword[6], vj_reverse[6]);
-			vj[7] = min512(vj_forword[7], vj_reverse[7]);
+uint64_t alphabetRunAvx2(const char * seq, uint64_t length, const uint8_t * table, bool inAlphabet)
+{
+	// Each character's low nibble looks up the high nibbles (bits) it is in
+	// the alphabet with, and its high nibble looks up its own bit (none for
+	// 8-15, so characters from 128 are never in it).
+	//
+	const __m256i lows = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)table));
+	const __m256i bits = _mm256_setr_epi8
+	(
+		1, 2, 4, 8, 16, 32, 64, (char)128, 0, 0, 0, 0, 0, 0, 0, 0,
+		1, 2, 4, 8, 16, 32, 64, (char)128, 0, 0, 0, 0, 0, 0, 0, 0
+	);
+	const __m256i nibble = _mm256_set1_epi8(15);
+	const __m256i zero = _mm256_setzero_si256();
+	uint64_t i = 0;
+	
+	for ( ; i + 32 <= length; i += 32 )
+	{
+		__m256i v = _mm256_loadu_si256((const __m256i *)(seq + i));
+		__m256i low = _mm256_shuffle_epi8(lows, _mm256_and_si256(v, nibble));
+		__m256i high = _mm256_shuffle_epi8(bits, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+		uint32_t out = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(low, high), zero));
+		uint32_t stop = inAlphabet ? out : ~out;
+		
+		if ( stop != 0 )
+		{
+			return i + __builtin_ctz(stop);
+		}
+	}
+	
+	return i + alphabetRunScalar(seq + i, length - i, table, inAlphabet);
+}
+SIMD_TARGET_END
+#endif
 
-		}else{
+bool useTwoBitEngine(const Sketch::Parameters & parameters)
+{
+	return
+		parameters.kmerSize <= 32 &&
+		parameters.alphabetSize == 4 &&
+		parameters.alphabet['A'] &&
+		parameters.alphabet['C'] &&
+		parameters.alphabet['G'] &&
+		parameters.alphabet['T'];
+}
 
-			vi[0] = vi_forword[0];
-			vi[1] = vi_forword[1];
-			vi[2] = vi_forword[2];
-			vi[3] = vi_forword[3];
-			vi[4] = vi_forword[4];
-			vi[5] = vi_forword[5];
-			vi[6] = vi_forword[6];
-			vi[7] = vi_forword[7];
-
-			vj[0] = vj_forword[0];
-			vj[1] = vj_forword[1];
-			vj[2] = vj_forword[2];
-			vj[3] = vj_forword[3];
-			vj[4] = vj_forword[4];
-			vj[5] = vj_forword[5];
-			vj[6] = vj_forword[6];
-			vj[7] = vj_forword[7];
-		}
-
-	//	vi[0] = _mm512_mask_loadu_epi8(vzero, mask_load, memcmp(input8 + i + 0, input8_rev + length - i - 0 - kmerSize, kmerSize) <= 0 ? input8 + i + 0 : input8_rev + length - i - 0 - kmerSize);
-	//	vi[1] = _mm512_mask_loadu_epi8(vzero, mask_load, memcmp(input8 + i + 1, input8_rev + length - i - 1 - kmerSize, kmerSize) <= 0 ? input8 + i + 1 : input8_rev + length - i - 1 - kmerSize);
-	//	vi[2] = _mm512_mask_loadu_epi8(vzero, mask_load, memcmp(input8 + i + 2, input8_rev + length - i - 2 - kmerSize, kmerSize) <= 0 ? input8 + i + 2 : input8_rev + length - i - 2 - kmerSize);
-	//	vi[3] = _mm512_mask_loadu_epi8(vzero, mask_load, memcmp(input8 + i + 3, input8_rev + length - i - 3 - kmerSize, kmerSize) <= 0 ? input8 + i + 3 : input8_rev + length - i - 3 - kmerSize);
-	//	vi[4] = _mm512_mask_loadu_epi8(vzero, mask_load, memcmp(input8 + i + 4, input8_rev + length - i - 4 - kmerSize, kmerSize) <= 0 ? input8 + i + 4 : input8_rev + length - i - 4 - kmerSize);
-	//	vi[5] = _mm512_mask_loadu_epi8(vzero, mask_load, memcmp(input8 + i + 5, input8_rev + length - i - 5 - kmerSize, kmerSize) <= 0 ? input8 + i + 5 : input8_rev + length - i - 5 - kmerSize);
-	//	vi[6] = _mm512_mask_loadu_epi8(vzero, mask_load, memcmp(input8 + i + 6, input8_rev + length - i - 6 - kmerSize, kmerSize) <= 0 ? input8 + i + 6 : input8_rev + length - i - 6 - kmerSize);
-	//	vi[7] = _mm512_mask_loadu_epi8(vzero, mask_load, memcmp(input8 + i + 7, input8_rev + length - i - 7 - kmerSize, kmerSize) <= 0 ? input8 + i + 7 : input8_rev + length - i - 7 - kmerSize);
-
-	//	vj[0] = _mm512_mask_loadu_epi8(vzero, mask_load, memcmp(input8 + i + 8, input8_rev + length - i - 8 - kmerSize, kmerSize) <= 0 ? input8 + i + 8 : input8_rev + length - i - 8 - kmerSize);
-	//	vj[1] = _mm512_mask_loadu_epi8(vzero, mask_load, memcmp(input8 + i + 9, input8_rev + length - i - 9 - kmerSize, kmerSize) <= 0 ? input8 + i + 9 : input8_rev + length - i - 9 - kmerSize);
-	//	vj[2] = _mm512_mask_loadu_epi8(vzero, mask_load, memcmp(input8 + i + 10, input8_rev + length - i - 10 - kmerSize, kmerSize) <= 0 ? input8 + i + 10 : input8_rev + length - i - 10 - kmerSize);
-	//	vj[3] = _mm512_mask_loadu_epi8(vzero, mask_load, memcmp(input8 + i + 11, input8_rev + length - i - 11 - kmerSize, kmerSize) <= 0 ? input8 + i + 11 : input8_rev + length - i - 11 - kmerSize);
-	//	vj[4] = _mm512_mask_loadu_epi8(vzero, mask_load, memcmp(input8 + i + 12, input8_rev + length - i - 12 - kmerSize, kmerSize) <= 0 ? input8 + i + 12 : input8_rev + length - i - 12 - kmerSize);
-	//	vj[5] = _mm512_mask_loadu_epi8(vzero, mask_load, memcmp(input8 + i + 13, input8_rev + length - i - 13 - kmerSize, kmerSize) <= 0 ? input8 + i + 13 : input8_rev + length - i - 13 - kmerSize);
-	//	vj[6] = _mm512_mask_loadu_epi8(vzero, mask_load, memcmp(input8 + i + 14, input8_rev + length - i - 14 - kmerSize, kmerSize) <= 0 ? input8 + i + 14 : input8_rev + length - i - 14 - kmerSize);
-	//	vj[7] = _mm512_mask_loadu_epi8(vzero, mask_load, memcmp(input8 + i + 15, input8_rev + length - i - 15 - kmerSize, kmerSize) <= 0 ? input8 + i + 15 : input8_rev + length - i - 15 - kmerSize);
-
-
-
-		transpose8_epi64(&vi[0], &vi[1], &vi[2], &vi[3], &vi[4], &vi[5], &vi[6], &vi[7]); 
-		transpose8_epi64(&vj[0], &vj[1], &vj[2], &vj[3], &vj[4], &vj[5], &vj[6], &vj[7]); 
-	//	transpose8_epi64(&vk[0], &vk[1], &vk[2], &vk[3], &vk[4], &vk[5], &vk[6], &vk[7]); 
-	//	transpose8_epi64(&vl[0], &vl[1], &vl[2], &vl[3], &vl[4], &vl[5], &vl[6], &vl[7]); 
-
-		//MurmurHash3_x64_128_avx512_8x16(vi, vj, pend_k, kmerSize, 42, &res[2 * i]);// the seed in Mash is 42; verified by xxm;
-		MurmurHash3_x64_128_avx512_8x16(vi, vj, pend_k, kmerSize, parameters.seed, res);// the seed in Mash is 42; verified by xxm;
-		//MurmurHash3_x64_128_avx512_8x32(vi, vj, vk, vl, pend_k, kmerSize, 42, res);// the seed in Mash is 42; verified by xxm;
-		//MurmurHash3_x64_128_avx512_8x8(vi, pend_k, kmerSize, 42, res);// the seed in Mash is 42; verified by xxm;
-
-		hash_u hash;
-		for(int j = 0; j < 16; j++){
-		//for(int j = 0; j < 32; j++){
-		//for(int j = 0; j < 8; j++){
-			if(parameters.use64)
-				hash.hash64 = res[j * 2];
-			else
-				hash.hash32 = (uint32_t)res[j * 2];
+// Collects k-mer pointers and hashes them as many at a time as the compiled
+// MurmurHash3 kernel allows, inserting results in the order they were added.
+//
+class KmerHashBatch
+{
+public:
+
+	static const int widthMax = 16;
+
+	KmerHashBatch(MinHashHeap & minHashHeapNew, const Sketch::Parameters & parameters) :
+		kernels(getSimdKernels()),
+		minHashHeap(minHashHeapNew),
+		kmerSize(parameters.kmerSize),
+		seed(parameters.seed),
+		use64(parameters.use64),
+		width(kernels.hashWidth),
+		hashKmers(kernels.hashKmersSized ? kernels.hashKmersSized(kmerSize) : 0),
+		hllPrecision(parameters.hll),
+		hll(hllPrecision ? minHashHeap.getHll(hllPrecision) : 0),
+		count(0),
+		hashed(0)
+	{}
+
+	~KmerHashBatch()
+	{
+		flush();
+		Stats::count(Stats::kmersHashed, hashed);
+	}
 
-			//cout << hash.hash64 << endl;
-			minHashHeap.tryInsert(hash);
+	// scratch space for a k-mer that is not contiguous in the input
+	char * slot() { return scratch[count]; }
+
+	void add(const char * kmer)
+	{
+		kmers[count++] = kmer;
+
+		if ( count == width )
+		{
+			hash();
 		}
 	}
 
-	for(int i = n_kmers_body; i < n_kmers; i++){
-	//	bool noRev = (memcmp(input8 + i, input8_rev + length - i - kmerSize, kmerSize) <= 0) || noncanonical;
-		bool noRev = true;
-		if(!noncanonical && (memcmp(input8 + i, input8_rev + length - i - kmerSize, kmerSize) >= 0)){
-			noRev = false;
-		}
-		if(noRev){
-			for(int j = 0; j < kmerSize; j++){
-				//kmer_buf[j] = input8[i + j];
-				kmer_buf[j] = input8[i + j];
-			}
-		}
-		else{
-			for(int j = 0; j < kmerSize; j++){
-				//kmer_buf[j] = input8[i + j];
-				kmer_buf[j] = input8_rev[length - i - kmerSize + j];
+	void flush()
+	{
+		for ( int i = 0; i < count; i++ )
+		{
+			// the registers take all 64 bits, of which 32-bit hashes are
+			// the low half
+			//
+			hash_u hash = getHash(kmers[i], kmerSize, seed, use64 || hll != 0);
+			
+			if ( hll != 0 )
+			{
+				hllAdd(hll, hllPrecision, hash.hash64);
 			}
-		}
 			
-
-		//MurmurHash3_x64_128(kmer_buf, kmerSize, 42, &res[2 * i]);// the getHash just need the lower 64bit of the total 128bit of res[i];
-		MurmurHash3_x64_128(kmer_buf, kmerSize, parameters.seed, res2);// the getHash just need the lower 64bit of the total 128bit of res[i];
-		hash_u hash;
-		if(parameters.use64)
-			hash.hash64 = res2[0];
-		else
-			hash.hash32 = (uint32_t)res2[0];
-
-		minHashHeap.tryInsert(hash);
-
-	}
-//============================================================================================================================================================
-
-#else
-	#if defined __AVX2__
-	//implement by avx2 
-	int pend_k = ((kmerSize - 1) / 16 + 1) * 16;
-	int n_kmers = length - kmerSize + 1;
-	int n_kmers_body = (n_kmers / 4) * 4;
-	const uint8_t * input8 = (const uint8_t *)seq;
-	const uint8_t * input8_rev = (const uint8_t *)seqRev;
-	uint64_t res[4 * 2];
-	uint64_t res2[2];
-	uint8_t kmer_buf[kmerSize];
-
-	__m256i vi[4];
-	//__m256i vzero = _mm256_set1_epi32(0x0);
-	uint8_t maskArr[32];
-	for(int i = 0; i < kmerSize; i++){
-		maskArr[i] = 0xff;
-	}
-	for(int i = kmerSize; i < 32; i++){
-		maskArr[i] = 0x0;
-	}
-	__m256i vmask = _mm256_loadu_si256((__m256i *)maskArr);
-	for(int i = 0; i < n_kmers_body - 1; i+=4){
-		vi[0] = _mm256_loadu_si256((__m256i *)(noncanonical || memcmp(input8 + i + 0, input8_rev + length - i - 0 - kmerSize, kmerSize) <= 0 ? input8 + i + 0 : input8_rev + length - i - 0 - kmerSize));
-		vi[1] = _mm256_loadu_si256((__m256i *)(noncanonical || memcmp(input8 + i + 1, input8_rev + length - i - 1 - kmerSize, kmerSize) <= 0 ? input8 + i + 1 : input8_rev + length - i - 1 - kmerSize));
-		vi[2] = _mm256_loadu_si256((__m256i *)(noncanonical || memcmp(input8 + i + 2, input8_rev + length - i - 2 - kmerSize, kmerSize) <= 0 ? input8 + i + 2 : input8_rev + length - i - 2 - kmerSize));
-		vi[3] = _mm256_loadu_si256((__m256i *)(noncanonical || memcmp(input8 + i + 3, input8_rev + length - i - 3 - kmerSize, kmerSize) <= 0 ? input8 + i + 3 : input8_rev + length - i - 3 - kmerSize));
-		vi[0] = _mm256_and_si256(vi[0], vmask);
-		vi[1] = _mm256_and_si256(vi[1], vmask);
-		vi[2] = _mm256_and_si256(vi[2], vmask);
-		vi[3] = _mm256_and_si256(vi[3], vmask);
-
-		transpose4_epi64(&vi[0], &vi[1], &vi[2], &vi[3]);
-
-		MurmurHash3_x64_128_avx2_8x4(vi, pend_k, kmerSize, parameters.seed, res);
-
-		hash_u hash;
-		for(int j = 0; j < 4; j++){
-			if(parameters.use64)	
-				hash.hash64 = res[j * 2];
-			else
-				hash.hash32 = (uint32_t)res[j * 2];
-
 			minHashHeap.tryInsert(hash);
 		}
+
+		hashed += count;
+		count = 0;
 	}
 
-	for(int i = n_kmers_body; i < n_kmers; i++){
-		//bool noRev = (memcmp(input8 + i, input8_rev + length -i - kmerSize, kmerSize) <= 0) || noncanonical;
-		bool noRev = true;
-		if(!noncanonical && (memcmp(input8 + i, input8_rev + length - i - kmerSize, kmerSize) >= 0)){
-			noRev = false;
+private:
+
+	void hash();
+
+	const SimdKernels & kernels;
+	MinHashHeap & minHashHeap;
+	int kmerSize;
+	uint32_t seed;
+	bool use64;
+	int width;
+	HashKmers hashKmers;
+	int hllPrecision;
+	uint8_t * hll;
+	int count;
+	uint64_t hashed;
+	const char * kmers[widthMax];
+	char scratch[widthMax][64];
+};
+
+void KmerHashBatch::hash()
+{
+	if ( hashKmers == 0 )
+	{
+		flush();
+		return;
+	}
+	
+	uint64_t res[widthMax * 2];
+	hash_u hashes[widthMax];
+	
+	hashKmers(kmers, kmerSize, seed, res);
+	
+	if ( hll != 0 )
+	{
+		for ( int i = 0; i < width; i++ )
+		{
+			hllAdd(hll, hllPrecision, res[i * 2]);
 		}
-		if(noRev){
-			for(int j = 0; j < kmerSize; j++){
-				kmer_buf[j] = input8[i + j];
-			}
+	}
+	
+	if ( use64 )
+	{
+		for ( int i = 0; i < width; i++ )
+		{
+			hashes[i].hash64 = res[i * 2];
+		}
+	}
+	else
+	{
+		for ( int i = 0; i < width; i++ )
+		{
+			hashes[i].hash32 = (uint32_t)res[i * 2];
+		}
+	}
+	
+	minHashHeap.tryInsert(hashes, width);
+	hashed += width;
+	count = 0;
+}
+
+void addMinHashesTwoBit(MinHashHeap & minHashHeap, const char * seq, uint64_t length, const Sketch::Parameters & parameters)
+{
+	// Roll forward and reverse-complement encodings along the sequence. The
+	// forward k-mer is hashed in place; the reverse complement is unpacked
+	// into batch scratch only when it is the canonical strand, so no
+	// per-sequence reverse-complement copy is needed. Hashes are computed on
+	// the characters, as before, so sketches are unchanged.
+
+	const TwoBitTables & tables = getTwoBitTables();
+	const int kmerSize = parameters.kmerSize;
+	const bool noncanonical = parameters.noncanonical;
+	const int shiftRev = 2 * (kmerSize - 1);
+	const int shiftTop = 64 - 2 * kmerSize;
+	const uint64_t mask = kmerSize == 32 ? ~uint64_t(0) : (uint64_t(1) << (2 * kmerSize)) - 1;
+
+	KmerHashBatch batch(minHashHeap, parameters);
+
+	uint64_t fwd = 0;
+	uint64_t rev = 0;
+	int valid = 0; // bases since the last character outside the alphabet
+
+	for ( uint64_t i = 0; i < length; i++ )
+	{
+		int8_t code = tables.code[(unsigned char)seq[i]];
+
+		if ( code < 0 )
+		{
+			valid = 0;
+			continue;
 		}
-		else{
-			for(int j = 0; j < kmerSize; j++){
-				kmer_buf[j] = input8_rev[length - i - kmerSize + j];
+
+		fwd = ((fwd << 2) | code) & mask;
+		rev = (rev >> 2) | (uint64_t(3 - code) << shiftRev);
+
+		if ( valid < kmerSize )
+		{
+			valid++;
+
+			if ( valid < kmerSize )
+			{
+				continue;
 			}
 		}
 
-		MurmurHash3_x64_128(kmer_buf, kmerSize, parameters.seed, res2);
-		hash_u hash;
-		if(parameters.use64)
-			hash.hash64 = res2[0];
+		if ( noncanonical || fwd <= rev )
+		{
+			batch.add(seq + i + 1 - kmerSize);
+		}
 		else
-			hash.hash32 = (uint32_t)res2[0];
-			
-		minHashHeap.tryInsert(hash);
+		{
+			char * kmer = batch.slot();
+			uint64_t word = rev << shiftTop;
+
+			for ( int j = 0; j < kmerSize; j += 4 )
+			{
+				memcpy(kmer + j, tables.decode[word >> 56], 4);
+				word <<= 8;
+			}
 
+			batch.add(kmer);
+		}
+	}
+}
+
+void addMinHashes(MinHashHeap & minHashHeap, const char * seq, uint64_t length, const Sketch::Parameters & parameters)
+{
+	Stats::Timer timer(Stats::hashing);
+	
+	if ( useTwoBitEngine(parameters) )
+	{
+		addMinHashesTwoBit(minHashHeap, seq, length, parameters);
+		return;
 	}
 
-	#else
-//		#if defined __SSE4_1__
-//			//implement by sse
-//		#else
 
-//implement by no optmization
-//--------------------------------------------------------------------------------------------------------------------
-    for ( uint64_t i = 0; i < length - kmerSize + 1; i++ )
+    int kmerSize = parameters.kmerSize;
+    uint64_t mins = parameters.minHashesPerWindow;
+    bool noncanonical = parameters.noncanonical;
+
+    // Determine the 'mins' smallest hashes, including those already provided
+    // (potentially replacing them). This allows min-hash sets across multiple
+    // sequences to be determined.
+    
+    char * seqRev;
+    
+    if ( ! noncanonical )
     {
-		// repeatedly skip kmers with bad characters
-		//
-		bool bad = false;
-		//
-		for ( uint64_t j = i; j < i + kmerSize && i + kmerSize <= length; j++ )
+    	seqRev = new char[length];
+        reverseComplement(seq, seqRev, length);
+    }
+
+	KmerHashBatch batch(minHashHeap, parameters);
+	
+	// k-mers are taken from runs of characters in the alphabet, which are
+	// found a vector at a time when the alphabet allows (see
+	// getAlphabetTable()), rather than checking each k-mer's characters
+	//
+	const SimdKernels & kernels = getSimdKernels();
+	uint8_t table[16];
+	bool tabled = getAlphabetTable(parameters, table);
+	uint64_t i = 0;
+	
+	while ( i + kmerSize <= length )
+	{
+		uint64_t start;
+		uint64_t end;
+		
+		if ( tabled )
 		{
-			if ( ! parameters.alphabet[seq[j]] )
-			{
-				i = j; // skip to past the bad character
-				bad = true;
-				break;
-			}
+			start = i + kernels.alphabetRun(seq + i, length - i, table, false);
+			end = start + kernels.alphabetRun(seq + start, length - start, table, true);
 		}
-		//
-		if ( bad )
+		else
 		{
-			continue;
+			for ( start = i; start < length && ! parameters.alphabet[(unsigned char)seq[start]]; start++ );
+			for ( end = start; end < length && parameters.alphabet[(unsigned char)seq[end]]; end++ );
 		}
-		//	
-		if ( i + kmerSize > length )
+		
+		for ( i = start; i + kmerSize <= end; i++ )
 		{
-			// skipped to end
-			break;
+			const char *kmer_fwd = seq + i;
+			const char *kmer_rev = seqRev + length - i - kmerSize;
+			const char * kmer = (noncanonical || memcmp(kmer_fwd, kmer_rev, kmerSize) <= 0) ? kmer_fwd : kmer_rev;
+			
+			batch.add(kmer);
 		}
-            
-        const char *kmer_fwd = seq + i;
-        const char *kmer_rev = seqRev + length - i - kmerSize;
-        const char * kmer = (noncanonical || memcmp(kmer_fwd, kmer_rev, kmerSize) <= 0) ? kmer_fwd : kmer_rev;
-        bool filter = false;
-        
-        hash_u hash = getHash(kmer, kmerSize, parameters.seed, parameters.use64);
-        
-		minHashHeap.tryInsert(hash);
-    }
-//		#endif
-	#endif
-#endif
+		
+		i = end;
+	}
     
-//--------------------------------------------------------------------------------------------------------------------
-//#endif
+    batch.flush();
     
     if ( ! noncanonical )
     {
@@ -1161,6 +2288,56 @@ void addMinHashes(MinHashHeap & minHashHeap, const char * seq, uint64_t length,
     }
 }
 
+static int getMinimizerPositions(vector<Sketch::PositionHash> & positionHashes, const char * seq, int kmers, const Sketch::Parameters & parameters, int windowSize)
+{
+    // With one min-hash per window, each window's is the first locus of its
+    // smallest hash. The candidates are kept in a ring (as a monotone queue):
+    // a new locus removes those with larger hashes from the back, since they
+    // can no longer be a window's minimum, so the hashes increase from the
+    // front, which is the current window's min-hash until it leaves. Each
+    // locus is added and removed once, so this is linear in the sequence,
+    // without allocating per k-mer. Returns the windows with distinct
+    // min-hashes, as counted for verbose output.
+    //
+    vector<Sketch::PositionHash> candidates(windowSize + 1, Sketch::PositionHash(0, 0));
+    uint64_t front = 0;
+    uint64_t back = 0;
+    Sketch::PositionHash last(0, 0);
+    int unique = 0;
+    
+    for ( int i = 0; i < kmers; i++ )
+    {
+        Sketch::hash_t hash = getHash(seq + i, parameters.kmerSize, parameters.seed, parameters.use64).hash64; // TODO: dynamic
+        
+        while ( back != front && candidates[(back - 1) % candidates.size()].hash > hash )
+        {
+            back--;
+        }
+        
+        candidates[back++ % candidates.size()] = Sketch::PositionHash(i, hash);
+        
+        if ( candidates[front % candidates.size()].position + windowSize <= uint32_t(i) )
+        {
+            front++;
+        }
+        
+        const Sketch::PositionHash & minmer = candidates[front % candidates.size()];
+        
+        if ( i == windowSize - 1 || (i >= windowSize && minmer.position != last.position) )
+        {
+            if ( i == windowSize - 1 || minmer.hash != last.hash )
+            {
+                unique++;
+            }
+            
+            positionHashes.push_back(minmer);
+            last = minmer;
+        }
+    }
+    
+    return unique;
+}
+
 void getMinHashPositions(vector<Sketch::PositionHash> & positionHashes, char * seq, uint32_t length, const Sketch::Parameters & parameters, int verbosity)
 {
     // Find positions whose hashes are min-hashes in any window of a sequence
@@ -1169,202 +2346,171 @@ void getMinHashPositions(vector<Sketch::PositionHash> & positionHashes, char * s
     int mins = parameters.minHashesPerWindow;
     int windowSize = parameters.windowSize;
     
-    int nextValidKmer = 0;
+    if ( length < uint32_t(kmerSize) )
+    {
+        return;
+    }
+    
+    int kmers = length - kmerSize + 1;
     
-    if ( windowSize > length - kmerSize + 1 )
+    if ( windowSize > kmers )
     {
-        windowSize = length - kmerSize + 1;
+        windowSize = kmers;
     }
     
     if ( verbosity > 1 ) cout << seq << endl << endl;
     
-    // Associate positions with flags so they can be marked as min-hashes
-    // at any point while the window is moved across them
+    int unique = 0;
+    
+    if ( mins == 1 && verbosity <= 1 )
+    {
+        unique = getMinimizerPositions(positionHashes, seq, kmers, parameters, windowSize);
+        
+        if ( verbosity > 0 ) cout << "   " << positionHashes.size() << " minmers across " << length - windowSize - kmerSize + 2 << " windows (" << unique << " windows with distinct minmer sets)." << endl << endl;
+        
+        return;
+    }
+    
+    // The loci of the current window, in a ring (of windowSize + 1, since a
+    // locus is added before the oldest leaves), each with the next locus in
+    // the window that has the same hash and a flag for whether it has been
+    // marked as a min-hash of a window (at any point while the window is
+    // moved across it). These replace a list per hash and a queue of the
+    // window, so moving the window allocates only for new distinct hashes.
     //
-    struct CandidateLocus
+    int ringSize = windowSize + 1;
+    vector<int> nextLocus(ringSize);
+    vector<char> isMinmer(ringSize);
+    
+    // The first and last loci of each hash in the window
+    //
+    struct Candidates
     {
-        CandidateLocus(int positionNew)
+        Candidates(int positionNew)
             :
-            position(positionNew),
-            isMinmer(false)
+            front(positionNew),
+            back(positionNew)
             {}
         
-        int position;
-        bool isMinmer;
+        int front;
+        int back;
     };
     
     // All potential min-hash loci in the current window organized by their
     // hashes so repeats can be grouped and so the sorted keys can be used to
-    // keep track of the current h bottom hashes. A deque is used here (rather
-    // than a standard queue) for each list of candidate loci for the sake of
-    // debug output; the performance difference seems to be negligible.
+    // keep track of the current h bottom hashes.
     //
-    map<Sketch::hash_t, deque<CandidateLocus>> candidatesByHash;
+    typedef map<Sketch::hash_t, Candidates> CandidatesByHash;
+    CandidatesByHash candidatesByHash;
     
-    // Keep references to the candidate loci in the map in the order of the
-    // current window, allowing them to be popped off in the correct order as
-    // the window is incremented.
+    // The candidates of each locus of the window, by position in the ring,
+    // allowing them to be popped off in the correct order as the window is
+    // incremented.
     //
-    queue<map<Sketch::hash_t, deque<CandidateLocus>>::iterator> windowQueue;
+    vector<CandidatesByHash::iterator> window(ringSize);
     
     // Keep a reference to the "hth" min-hash to determine efficiently whether
     // new hashes are min-hashes. It must be decremented when a hash is inserted
     // before it.
     //
-    map<Sketch::hash_t, deque<CandidateLocus>>::iterator maxMinmer = candidatesByHash.end();
-    
-    // A reference to the list of potential candidates that has just been pushed
-    // onto the back of the rolling window. During the loop, it will be assigned
-    // to either an existing list (if the kmer is repeated), a new list, or a
-    // dummy iterator (for invalid kmers).
-    //
-    map<Sketch::hash_t, deque<CandidateLocus>>::iterator newCandidates;
+    CandidatesByHash::iterator maxMinmer = candidatesByHash.end();
     
-    int unique = 0;
-    
-    for ( int i = 0; i < length - kmerSize + 1; i++ )
+    for ( int i = 0; i < kmers; i++ )
     {
-        // Increment the next valid kmer if needed. Invalid kmers must still be
-        // processed to keep the queue filled, but will be associated with a
-        // dummy iterator. (Currently disabled to allow all kmers; see below)
-        //
-        if ( i >= nextValidKmer )
-        {
-            for ( int j = i; j < i + kmerSize; j++ )
-            {
-                char c = seq[j];
-                
-                if ( c != 'A' && c != 'C' && c != 'G' && c != 'T' )
-                {
-                    // Uncomment to skip invalid kmers
-                    //
-                    //nextValidKmer = j + 1;
-                    
-                    break;
-                }
-            }
-        }
+        Sketch::hash_t hash = getHash(seq + i, kmerSize, parameters.seed, parameters.use64).hash64; // TODO: dynamic
         
-        if ( i < nextValidKmer && verbosity > 1 )
+        if ( verbosity > 1 )
         {
-            cout << "  [";
+            cout << "   ";
         
             for ( int j = i; j < i + kmerSize; j++ )
             {
-                cout << seq[j];
+                cout << seq[j]; 
             }
-            
-            cout << "]" << endl;
+        
+            cout << "   " << i << '\t' << hash << endl;
         }
         
-        if ( i >= nextValidKmer )
-        {
-            Sketch::hash_t hash = getHash(seq + i, kmerSize, parameters.seed, parameters.use64).hash64; // TODO: dynamic
-            
-            if ( verbosity > 1 )
-            {
-                cout << "   ";
-            
-                for ( int j = i; j < i + kmerSize; j++ )
-                {
-                    cout << seq[j]; 
-                }
-            
-                cout << "   " << i << '\t' << hash << endl;
-            }
-            
-            // Get the list of candidate loci for the current hash (if it is a
-            // repeat) or insert a new list.
-            //
-            pair<map<Sketch::hash_t, deque<CandidateLocus>>::iterator, bool> inserted =
-                candidatesByHash.insert(pair<Sketch::hash_t, deque<CandidateLocus>>(hash, deque<CandidateLocus>()));
-            newCandidates = inserted.first;
-            
-            // Add the new candidate locus to the list
-            //
-            newCandidates->second.push_back(CandidateLocus(i));
-            
-            if
+        // Get the candidate loci for the current hash (if it is a repeat) or
+        // insert new ones, and add the new locus.
+        //
+        pair<CandidatesByHash::iterator, bool> inserted = candidatesByHash.insert(pair<Sketch::hash_t, Candidates>(hash, Candidates(i)));
+        CandidatesByHash::iterator newCandidates = inserted.first;
+        
+        nextLocus[i % ringSize] = -1;
+        isMinmer[i % ringSize] = false;
+        
+        if ( ! inserted.second )
+        {
+            nextLocus[newCandidates->second.back % ringSize] = i;
+            newCandidates->second.back = i;
+        }
+        
+        if
+        (
+            inserted.second && // inserted; decrement maxMinmer if...
             (
-                inserted.second && // inserted; decrement maxMinmer if...
                 (
-                    (
-                        // ...just reached number of mins
-                        
-                        maxMinmer == candidatesByHash.end() &&
-                        candidatesByHash.size() == mins
-                    ) ||
-                    (
-                        // ...inserted before maxMinmer
-                        
-                        maxMinmer != candidatesByHash.end() &&
-                        newCandidates->first < maxMinmer->first
-                    )
+                    // ...just reached number of mins
+                    
+                    maxMinmer == candidatesByHash.end() &&
+                    candidatesByHash.size() == mins
+                ) ||
+                (
+                    // ...inserted before maxMinmer
+                    
+                    maxMinmer != candidatesByHash.end() &&
+                    newCandidates->first < maxMinmer->first
                 )
             )
-            {
-                maxMinmer--;
-                
-                if ( i >= windowSize )
-                {
-                    unique++;
-                }
-            }
-        }
-        else
+        )
         {
-            // Invalid kmer; use a dummy iterator to pad the queue
+            maxMinmer--;
             
-            newCandidates = candidatesByHash.end();
+            if ( i >= windowSize )
+            {
+                unique++;
+            }
         }
         
-        // Push the new reference to the list of candidate loci for the new kmer
-        // on the back of the window to roll it.
+        // Push the new locus on the back of the window to roll it.
         //
-        windowQueue.push(newCandidates);
+        window[i % ringSize] = newCandidates;
         
-        // A reference to the front of the window, to be popped off if the
-        // window has grown to full size. This reference can be a dummy if the
-        // window is not full size or if the front of the window is a dummy
-        // representing an invalid kmer.
+        // Pop the front of the window (the first locus of its hash) if the
+        // window has grown to full size.
         //
-        map<Sketch::hash_t, deque<CandidateLocus>>::iterator windowFront = candidatesByHash.end();
-        
-        if ( windowQueue.size() > windowSize )
+        if ( i >= windowSize )
         {
-            windowFront = windowQueue.front();
-            windowQueue.pop();
+            int position = i - windowSize;
+            CandidatesByHash::iterator windowFront = window[position % ringSize];
+            Candidates & frontCandidates = windowFront->second;
             
             if ( verbosity > 1 ) cout << "   \tPOP: " << windowFront->first << endl;
-        }
-        
-        if ( windowFront != candidatesByHash.end() )
-        {
-            deque<CandidateLocus> & frontCandidates = windowFront->second;
             
-            if ( frontCandidates.front().isMinmer )
+            if ( isMinmer[position % ringSize] )
             {
-                if ( verbosity > 1 ) cout << "   \t   minmer: " << frontCandidates.front().position << '\t' << windowFront->first << endl;
-                positionHashes.push_back(Sketch::PositionHash(frontCandidates.front().position, windowFront->first));
+                if ( verbosity > 1 ) cout << "   \t   minmer: " << position << '\t' << windowFront->first << endl;
+                positionHashes.push_back(Sketch::PositionHash(position, windowFront->first));
             }
             
-            if ( frontCandidates.size() > 1 )
+            if ( frontCandidates.back != position )
             {
-                frontCandidates.pop_front();
+                frontCandidates.front = nextLocus[position % ringSize];
                 
                 // Since this is a repeated hash, only the locus in the front of
                 // the list was considered min-hash loci. Check if the new front
                 // will become a min-hash so it can be flagged.
                 //
-                if ( maxMinmer == candidatesByHash.end() || ( i >= windowSize && windowFront->first <= maxMinmer->first) )
+                if ( maxMinmer == candidatesByHash.end() || windowFront->first <= maxMinmer->first )
                 {
-                    frontCandidates.front().isMinmer = true;
+                    isMinmer[frontCandidates.front % ringSize] = true;
                 }
             }
             else
             {
-                // The list for this hash is no longer needed; destroy it,
-                // repositioning the reference to the hth min-hash if
+                // The candidates for this hash are no longer needed; destroy
+                // them, repositioning the reference to the hth min-hash if
                 // necessary.
                 
                 if ( maxMinmer != candidatesByHash.end() && windowFront->first <= maxMinmer->first )
@@ -1373,7 +2519,7 @@ void getMinHashPositions(vector<Sketch::PositionHash> & positionHashes, char * s
                     
                     if ( maxMinmer != candidatesByHash.end() )
                     {
-                        maxMinmer->second.front().isMinmer = true;
+                        isMinmer[maxMinmer->second.front % ringSize] = true;
                     }
                     
                     unique++;
@@ -1387,30 +2533,29 @@ void getMinHashPositions(vector<Sketch::PositionHash> & positionHashes, char * s
         {
             // first complete window; mark min-hashes
             
-            for ( map<Sketch::hash_t, deque<CandidateLocus>>::iterator j = candidatesByHash.begin(); j != maxMinmer; j++ )
+            for ( CandidatesByHash::iterator j = candidatesByHash.begin(); j != maxMinmer; j++ )
             {
-                j->second.front().isMinmer = true;
+                isMinmer[j->second.front % ringSize] = true;
             }
             
             if ( maxMinmer != candidatesByHash.end() )
             {
-                maxMinmer->second.front().isMinmer = true;
+                isMinmer[maxMinmer->second.front % ringSize] = true;
             }
             
             unique++;
         }
         
-        // Mark the candidate that was pushed on the back of the window queue
-        // earlier as a min-hash if necessary
+        // Mark the first locus of the new hash as a min-hash if necessary
         //
-        if ( newCandidates != candidatesByHash.end() && i >= windowSize && (maxMinmer == candidatesByHash.end() || newCandidates->first <= maxMinmer->first) )
+        if ( i >= windowSize && (maxMinmer == candidatesByHash.end() || newCandidates->first <= maxMinmer->first) )
         {
-            newCandidates->second.front().isMinmer = true;
+            isMinmer[newCandidates->second.front % ringSize] = true;
         }
         
         if ( verbosity > 1 )
         {
-            for ( map<Sketch::hash_t, deque<CandidateLocus>>::iterator j = candidatesByHash.begin(); j != candidatesByHash.end(); j++ )
+            for ( CandidatesByHash::iterator j = candidatesByHash.begin(); j != candidatesByHash.end(); j++ )
             {
                 cout << "   \t" << j->first;
                 
@@ -1419,11 +2564,11 @@ void getMinHashPositions(vector<Sketch::PositionHash> & positionHashes, char * s
                      cout << "*";
                 }
                 
-                for ( deque<CandidateLocus>::iterator k = j->second.begin(); k != j->second.end(); k++ )
+                for ( int k = j->second.front; k != -1; k = nextLocus[k % ringSize] )
                 {
-                    cout << '\t' << k->position;
+                    cout << '\t' << k;
                     
-                    if ( k->isMinmer )
+                    if ( isMinmer[k % ringSize] )
                     {
                         cout << '!';
                     }
@@ -1436,25 +2581,12 @@ void getMinHashPositions(vector<Sketch::PositionHash> & positionHashes, char * s
     
     // finalize remaining min-hashes from the last window
     //
-    while ( windowQueue.size() > 0 )
+    for ( int position = kmers - windowSize; position < kmers; position++ )
     {
-        map<Sketch::hash_t, deque<CandidateLocus>>::iterator windowFront = windowQueue.front();
-        windowQueue.pop();
-        
-        if ( windowFront != candidatesByHash.end() )
+        if ( isMinmer[position % ringSize] )
         {
-            deque<CandidateLocus> & frontCandidates = windowFront->second;
-            
-            if ( frontCandidates.size() > 0 )
-            {
-                if ( frontCandidates.front().isMinmer )
-                {
-                    if ( verbosity > 1 ) cout << "   \t   minmer:" << frontCandidates.front().position << '\t' << windowFront->first << endl;
-                    positionHashes.push_back(Sketch::PositionHash(frontCandidates.front().position, windowFront->first));
-                }
-                
-                frontCandidates.pop_front();
-            }
+            if ( verbosity > 1 ) cout << "   \t   minmer:" << position << '\t' << window[position % ringSize]->first << endl;
+            positionHashes.push_back(Sketch::PositionHash(position, window[position % ringSize]->first));
         }
     }
     
@@ -1483,6 +2615,15 @@ bool hasSuffix(string const & whole, string const & suffix)
     return false;
 }
 
+// Primitive lists are stored unpacked in the message, so (on little-endian
+// hosts, as assumed by SketchWriter) they can be used in place.
+//
+template <class T>
+static const T * listData(typename capnp::List<T>::Reader reader)
+{
+	return reinterpret_cast<const T *>(capnp::AnyList::Reader(reader).getRawBytes().begin());
+}
+
 Sketch::SketchOutput * loadCapnp(Sketch::SketchInput * input)
 {
 	const char * file = input->fileNames[0].c_str();
@@ -1500,23 +2641,27 @@ Sketch::SketchOutput * loadCapnp(Sketch::SketchInput * input)
 	
     void * data = mmap(NULL, fileInfo.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
     
-    capnp::ReaderOptions readerOptions;
-    
-    readerOptions.traversalLimitInWords = 1000000000000;
-    readerOptions.nestingLimit = 1000000;
-    
-    capnp::FlatArrayMessageReader * message = new capnp::FlatArrayMessageReader(kj::ArrayPtr<const capnp::word>(reinterpret_cast<const capnp::word *>(data), fileInfo.st_size / sizeof(capnp::word)), readerOptions);
-    capnp::MinHash::Reader reader = message->getRoot<capnp::MinHash>();
+    vector<capnp::FlatArrayMessageReader *> messages;
+    ReferenceReaders referencesReader;
     
-    capnp::MinHash::ReferenceList::Reader referenceListReader = reader.getReferenceList().getReferences().size() ? reader.getReferenceList() : reader.getReferenceListOld();
+    readMessages(file, data, fileInfo.st_size, true, messages, referencesReader);
     
-    capnp::List<capnp::MinHash::ReferenceList::Reference>::Reader referencesReader = referenceListReader.getReferences();
+    vector<uint64_t> positions;
     
-    references.resize(referencesReader.size());
+    if ( input->subset != 0 )
+    {
+    	selectReferences(*input->subset, input->fileNames[0], fileInfo.st_size, referencesReader, positions);
+    	references.resize(positions.size());
+    }
+    else
+    {
+	    references.resize(referencesReader.size());
+	}
     
-    for ( uint64_t i = 0; i < referencesReader.size(); i++ )
+    #pragma omp parallel for schedule(dynamic, 1024) num_threads(input->threads)
+    for ( uint64_t i = 0; i < references.size(); i++ )
     {
-        capnp::MinHash::ReferenceList::Reference::Reader referenceReader = referencesReader[i];
+        capnp::MinHash::ReferenceList::Reference::Reader referenceReader = referencesReader[input->subset != 0 ? positions[i] : i];
         
         Sketch::Reference & reference = references[i];
         
@@ -1535,7 +2680,19 @@ Sketch::SketchOutput * loadCapnp(Sketch::SketchInput * input)
         reference.hashesSorted.setUse64(input->parameters.use64);
         uint64_t hashCount;
         
-        if ( input->parameters.use64 )
+        if ( referenceReader.hasHashesPacked() )
+        {
+        	capnp::Data::Reader packedReader = referenceReader.getHashesPacked();
+        	
+        	if ( ! reference.hashesSorted.unpack(packedReader.begin(), packedReader.size(), input->parameters.minHashesPerWindow) )
+        	{
+        		cerr << "ERROR: the packed hashes of " << reference.name << " in " << file << " are malformed." << endl;
+        		exit(1);
+        	}
+        	
+        	hashCount = reference.hashesSorted.size();
+        }
+        else if ( input->parameters.use64 )
         {
             capnp::List<uint64_t>::Reader hashesReader = referenceReader.getHashes64();
         
@@ -1546,12 +2703,19 @@ Sketch::SketchOutput * loadCapnp(Sketch::SketchInput * input)
         		hashCount = input->parameters.minHashesPerWindow;
         	}
         	
-            reference.hashesSorted.resize(hashCount);
-        
-            for ( uint64_t j = 0; j < hashCount; j++ )
-            {
-                reference.hashesSorted.set64(j, hashesReader[j]);
-            }
+        	if ( input->parameters.mapped )
+        	{
+        		reference.hashesSorted.setView64(hashCount ? listData<uint64_t>(hashesReader) : 0, hashCount);
+        	}
+        	else
+        	{
+	            reference.hashesSorted.resize(hashCount);
+	        
+	            for ( uint64_t j = 0; j < hashCount; j++ )
+	            {
+	                reference.hashesSorted.set64(j, hashesReader[j]);
+	            }
+	        }
         }
         else
         {
@@ -1564,12 +2728,19 @@ Sketch::SketchOutput * loadCapnp(Sketch::SketchInput * input)
         		hashCount = input->parameters.minHashesPerWindow;
         	}
         	
-            reference.hashesSorted.resize(hashCount);
-        
-            for ( uint64_t j = 0; j < hashCount; j++ )
-            {
-                reference.hashesSorted.set32(j, hashesReader[j]);
-            }
+        	if ( input->parameters.mapped )
+        	{
+        		reference.hashesSorted.setView32(hashCount ? listData<uint32_t>(hashesReader) : 0, hashCount);
+        	}
+        	else
+        	{
+	            reference.hashesSorted.resize(hashCount);
+	        
+	            for ( uint64_t j = 0; j < hashCount; j++ )
+	            {
+	                reference.hashesSorted.set32(j, hashesReader[j]);
+	            }
+	        }
         }
         
         if ( referenceReader.hasCounts32() )
@@ -1583,9 +2754,25 @@ Sketch::SketchOutput * loadCapnp(Sketch::SketchInput * input)
 				reference.counts[j] = countsReader[j];
 			}
         }
+        
+        if ( referenceReader.hasHll() )
+        {
+        	capnp::Data::Reader hllReader = referenceReader.getHll();
+        	
+        	if ( hllGetPrecision(hllReader.size()) == 0 )
+        	{
+        		cerr << "ERROR: the HyperLogLog registers of " << reference.name << " in " << file << " are malformed." << endl;
+        		exit(1);
+        	}
+        	
+        	reference.hll.assign(hllReader.begin(), hllReader.end());
+        	reference.hllSize = hllEstimate(reference.hll.data(), reference.hll.data(), reference.hll.size());
+        }
     }
     
-    capnp::MinHash::LocusList::Reader locusListReader = reader.getLocusList();
+    // windowed sketches (the only ones with loci) are not appended to
+    //
+    capnp::MinHash::LocusList::Reader locusListReader = messages[0]->getRoot<capnp::MinHash>().getLocusList();
     capnp::List<capnp::MinHash::LocusList::Locus>::Reader lociReader = locusListReader.getLoci();
     
     output->positionHashesByReference.resize(references.size());
@@ -1593,8 +2780,22 @@ Sketch::SketchOutput * loadCapnp(Sketch::SketchInput * input)
     for ( uint64_t i = 0; i < lociReader.size(); i++ )
     {
         capnp::MinHash::LocusList::Locus::Reader locusReader = lociReader[i];
+        uint64_t sequence = locusReader.getSequence();
+        
+        if ( input->subset != 0 )
+        {
+        	vector<uint64_t>::const_iterator position = lower_bound(positions.begin(), positions.end(), sequence);
+        	
+        	if ( position == positions.end() || *position != sequence )
+        	{
+        		continue;
+        	}
+        	
+        	sequence = position - positions.begin();
+        }
+        
         //cout << locusReader.getHash64() << '\t' << locusReader.getSequence() << '\t' << locusReader.getPosition() << endl;
-        output->positionHashesByReference[locusReader.getSequence()].push_back(Sketch::PositionHash(locusReader.getPosition(), locusReader.getHash64()));
+        output->positionHashesByReference[sequence].push_back(Sketch::PositionHash(locusReader.getPosition(), locusReader.getHash64()));
     }
     
     /*
@@ -1636,9 +2837,21 @@ Sketch::SketchOutput * loadCapnp(Sketch::SketchInput * input)
     cout << endl;
     */
     
-    munmap(data, fileInfo.st_size);
     close(fd);
-    delete message;
+    
+    if ( input->parameters.mapped )
+    {
+    	// kept until the Sketch is destroyed (see useThreadOutput)
+    	//
+    	output->mapped.messages.swap(messages);
+    	output->mapped.data = data;
+    	output->mapped.size = fileInfo.st_size;
+    }
+    else
+    {
+	    deleteMessages(messages);
+	    munmap(data, fileInfo.st_size);
+	}
     
     return output;
 }
@@ -1702,21 +2915,84 @@ void setMinHashesForReference(Sketch::Reference & reference, const MinHashHeap &
 {
     HashList & hashList = reference.hashesSorted;
     hashList.clear();
-    hashes.toHashList(hashList);
-    hashes.toCounts(reference.counts);
-    hashList.sort();
+    reference.counts.clear();
+    hashes.toSortedHashList(hashList, reference.counts);
+    
+    if ( hashes.getHllRegisters().size() != 0 )
+    {
+    	reference.hll = hashes.getHllRegisters();
+    	reference.hllSize = hllEstimate(reference.hll.data(), reference.hll.data(), reference.hll.size());
+    }
 }
 
-Sketch::SketchOutput * sketchFile(Sketch::SketchInput * input)
+// Adds the hashes of a read (or a record of a file sketched whole), in pieces
+// between characters outside the alphabet.
+//
+static void addMinHashesRead(MinHashHeap & minHashHeap, string & seq, const Sketch::Parameters & parameters)
 {
-	const Sketch::Parameters & parameters = input->parameters;
-	
-	Sketch::SketchOutput * output = new Sketch::SketchOutput();
+	addMinHashesChunkSequence(minHashHeap, &seq[0], seq.length(), parameters);
+}
+
+static const uint64_t readsBatchBases = 1 << 22;
+
+// Reads of a sample, hashed into one heap per thread: thread t takes reads t,
+// t + threads, ... (see MinHashHeap::merge()).
+//
+static void addMinHashesReads(vector<MinHashHeap *> & heaps, vector<string> & reads, uint64_t count, const Sketch::Parameters & parameters)
+{
+	int threads = heaps.size();
 	
-	output->references.resize(1);
-	Sketch::Reference & reference = output->references[0];
+	#pragma omp parallel for schedule(static, 1) num_threads(threads)
+	for ( int t = 0; t < threads; t++ )
+	{
+		for ( uint64_t i = t; i < count; i += threads )
+		{
+			addMinHashesRead(*heaps[t], reads[i], parameters);
+		}
+	}
+}
+
+static void mergeMinHashes(MinHashHeap & minHashHeap, const vector<MinHashHeap *> & heaps)
+{
+	for ( size_t i = 0; i < heaps.size(); i++ )
+	{
+		minHashHeap.merge(*heaps[i]);
+	}
+}
+
+// of the reads hashed into heaps so far, for -c
+//
+static double estimateMultiplicity(const vector<MinHashHeap *> & heaps, const Sketch::Parameters & parameters)
+{
+	MinHashHeap merged(parameters.use64, parameters.minHashesPerWindow, parameters.minCov, heaps[0]->getCountingFilter());
 	
-    MinHashHeap minHashHeap(parameters.use64, parameters.minHashesPerWindow, parameters.reads ? parameters.minCov : 1, parameters.memoryBound);
+	mergeMinHashes(merged, heaps);
+	return merged.estimateMultiplicity();
+}
+
+// Sketches fileNames as one reference (of reads, or of the records of a file)
+// with minHashHeap, which starts empty; seq is for the records.
+//
+static void sketchFileTo(const vector<string> & fileNames, const Sketch::Parameters & parameters, MinHashHeap & minHashHeap, Sketch::Reference & reference, string & seq, FilePrefetcher::File * buffer = 0)
+{
+    // Reads are hashed by parallelism threads, in batches, into heaps of their
+    // own that are merged when done (or to check the coverage for -c), while
+    // this thread reads the next batch.
+    //
+    vector<MinHashHeap *> heaps;
+    vector<string> batch;
+    vector<string> batchHashing;
+    uint64_t batchCount = 0;
+    uint64_t batchBases = 0;
+    thread hasher;
+    
+    if ( parameters.reads && parameters.parallelism > 1 )
+    {
+    	for ( int i = 0; i < parameters.parallelism; i++ )
+    	{
+    		heaps.push_back(new MinHashHeap(parameters.use64, parameters.minHashesPerWindow, parameters.minCov, minHashHeap.getCountingFilter()));
+    	}
+    }
 
 	reference.length = 0;
 	reference.hashesSorted.setUse64(parameters.use64);
@@ -1725,13 +3001,14 @@ Sketch::SketchOutput * sketchFile(Sketch::SketchInput * input)
     int count = 0;
 	bool skipped = false;
 	
-	int fileCount = input->fileNames.size();
+	int fileCount = fileNames.size();
 	gzFile fps[fileCount];
+	list<InputStream> inputs;
 	list<kseq_t *> kseqs;
 	//
 	for ( int f = 0; f < fileCount; f++ )
 	{
-		if ( input->fileNames[f] == "-" )
+		if ( fileNames[f] == "-" )
 		{
 			if ( f > 1 )
 			{
@@ -1743,28 +3020,42 @@ Sketch::SketchOutput * sketchFile(Sketch::SketchInput * input)
 		}
 		else
 		{
-			if ( reference.name == "" && input->fileNames[f] != "-" )
+			if ( reference.name == "" && fileNames[f] != "-" )
 			{
-				reference.name = input->fileNames[f];
+				reference.name = fileNames[f];
 			}
 			
-			fps[f] = gzopen(input->fileNames[f].c_str(), "r");
+			if ( buffer != 0 && buffer->good )
+			{
+				// already read by the prefetcher (for a single file)
+				//
+				fps[f] = 0;
+				inputs.emplace_back(buffer);
+				kseqs.push_back(kseq_init(&inputs.back()));
+				continue;
+			}
+			
+			fps[f] = gzopen(fileNames[f].c_str(), "r");
 			
 			if ( fps[f] == 0 )
 			{
-				cerr << "ERROR: could not open " << input->fileNames[f] << endl;
+				cerr << "ERROR: could not open " << fileNames[f] << endl;
 				exit(1);
 			}
 		}
 		
-		kseqs.push_back(kseq_init(fps[f]));
+		inputs.emplace_back(fps[f]);
+		kseqs.push_back(kseq_init(&inputs.back()));
 	}
 	
 	list<kseq_t *>::iterator it = kseqs.begin();
 	
 	while ( kseqs.begin() != kseqs.end() )
 	{
-		l = kseq_read(*it);
+		{
+			Stats::Timer timer(Stats::parsing);
+			l = kseq_read(*it);
+		}
 		
 		if ( l < -1 ) // error
 		{
@@ -1790,7 +3081,7 @@ Sketch::SketchOutput * sketchFile(Sketch::SketchInput * input)
 		
 		if ( count == 0 )
 		{
-			if ( input->fileNames[0] == "-" )
+			if ( fileNames[0] == "-" )
 			{
 				reference.name = (*it)->name.s;
 				reference.comment = (*it)->comment.s ? (*it)->comment.s : "";
@@ -1804,7 +3095,7 @@ Sketch::SketchOutput * sketchFile(Sketch::SketchInput * input)
 		}
 		
 		count++;
-		
+		Stats::count(Stats::sequences);
 		
 		//if ( verbosity > 0 && parameters.windowed ) cout << '>' << seq->name.s << " (" << l << "nt)" << endl << endl;
 		//if (seq->comment.l) printf("comment: %s\n", seq->comment.s);
@@ -1816,50 +3107,48 @@ Sketch::SketchOutput * sketchFile(Sketch::SketchInput * input)
 			reference.length += l;
 		}
 
-		//add the badCheck outside.
-		string  seq = (*it)->seq.s;
-		for ( uint64_t k = 0; k < seq.length(); k++ )
-    	{
-    	    if ( ! parameters.preserveCase && seq[k] > 96 && seq[k] < 123 )
-    	    {
-    	        seq[k] -= 32;
-    	    }
-    	}
-
-		int j = 0;
-		int start = 0;
-		while(j < seq.length()){
-			if( parameters.alphabet[seq[j]] )
+		if ( heaps.size() == 0 )
+		{
+			seq.assign((*it)->seq.s, l);
+			addMinHashesRead(minHashHeap, seq, parameters);
+		}
+		else
+		{
+			if ( batchCount == batch.size() )
 			{
-				j++;
-				if(j == seq.length() && j - start >= parameters.kmerSize){
-					string subSeq = seq.substr(start, j - start);	
-    				addMinHashes(minHashHeap, subSeq.c_str(), subSeq.length(), parameters);
-				}
-				continue;
-			}else{
-
-				if(j - start >= parameters.kmerSize)
+				batch.resize(batchCount + 1);
+			}
+			
+			batch[batchCount++].assign((*it)->seq.s, l);
+			batchBases += l;
+			
+			if ( batchBases >= readsBatchBases )
+			{
+				// the threads hash this batch while the next is read
+				//
+				if ( hasher.joinable() )
 				{
-					//get substr without bad char
-					string subSeq = seq.substr(start, j - start);	
-    				addMinHashes(minHashHeap, subSeq.c_str(), subSeq.length(), parameters);
-					j++;
-					while(j < seq.length() && !parameters.alphabet[seq[j]]) j++;
-					if(j >= seq.length()) break;
-					start = j;
-				}else{
-					j++;	
-					while(j < seq.length() && !parameters.alphabet[seq[j]]) j++;
-					if(j >= seq.length()) break;
-					start = j;
+					hasher.join();
+					
+					if ( parameters.targetCov > 0 && estimateMultiplicity(heaps, parameters) >= parameters.targetCov )
+					{
+						count -= batchCount; // not hashed
+						batchCount = 0;
+						l = -1; // success code
+						break;
+					}
 				}
+				
+				batch.swap(batchHashing);
+				hasher = thread(addMinHashesReads, ref(heaps), ref(batchHashing), batchCount, cref(parameters));
+				batchCount = 0;
+				batchBases = 0;
 			}
 		}
 		
 //		addMinHashes(minHashHeap, (*it)->seq.s, l, parameters);
 		
-		if ( parameters.reads && parameters.targetCov > 0 && minHashHeap.estimateMultiplicity() >= parameters.targetCov )
+		if ( parameters.reads && parameters.targetCov > 0 && heaps.size() == 0 && minHashHeap.estimateMultiplicity() >= parameters.targetCov )
 		{
 			l = -1; // success code
 			break;
@@ -1873,6 +3162,33 @@ Sketch::SketchOutput * sketchFile(Sketch::SketchInput * input)
 		}
 	}
 	
+	if ( hasher.joinable() )
+	{
+		hasher.join();
+	}
+	
+	if ( heaps.size() != 0 )
+	{
+		if ( batchCount != 0 )
+		{
+			if ( parameters.targetCov > 0 && estimateMultiplicity(heaps, parameters) >= parameters.targetCov )
+			{
+				count -= batchCount; // not needed
+			}
+			else
+			{
+				addMinHashesReads(heaps, batch, batchCount, parameters);
+			}
+		}
+		
+		mergeMinHashes(minHashHeap, heaps);
+		
+		for ( size_t i = 0; i < heaps.size(); i++ )
+		{
+			delete heaps[i];
+		}
+	}
+	
 	if ( parameters.reads )
 	{
 		if ( parameters.genomeSize != 0 )
@@ -1897,7 +3213,7 @@ Sketch::SketchOutput * sketchFile(Sketch::SketchInput * input)
 	
 	if (  l != -1 )
 	{
-		cerr << "\nERROR: reading " << (input->fileNames.size() > 0 ? "input files" : input->fileNames[0]) << "." << endl;
+		cerr << "\nERROR: reading " << (fileNames.size() > 0 ? "input files" : fileNames[0]) << "." << endl;
 		exit(1);
 	}
 	
@@ -1905,11 +3221,11 @@ Sketch::SketchOutput * sketchFile(Sketch::SketchInput * input)
 	{
 		if ( skipped )
 		{
-			cerr << "\nWARNING: All fasta records in " << (input->fileNames.size() > 0 ? "input files" : input->fileNames[0]) << " were shorter than the k-mer size (" << parameters.kmerSize << ")." << endl;
+			cerr << "\nWARNING: All fasta records in " << (fileNames.size() > 0 ? "input files" : fileNames[0]) << " were shorter than the k-mer size (" << parameters.kmerSize << ")." << endl;
 		}
 		else
 		{
-			cerr << "\nERROR: Did not find fasta records in \"" << (input->fileNames.size() > 0 ? "input files" : input->fileNames[0]) << "\"." << endl;
+			cerr << "\nERROR: Did not find fasta records in \"" << (fileNames.size() > 0 ? "input files" : fileNames[0]) << "\"." << endl;
 		}
 		
 		exit(1);
@@ -1933,12 +3249,81 @@ Sketch::SketchOutput * sketchFile(Sketch::SketchInput * input)
 	
 	for ( int i = 0; i < fileCount; i++ )
 	{
-		gzclose(fps[i]);
+		if ( fps[i] != 0 )
+		{
+			gzclose(fps[i]);
+		}
+	}
+}
+
+Sketch::SketchOutput * sketchFile(Sketch::SketchInput * input)
+{
+	const Sketch::Parameters & parameters = input->parameters;
+	
+	Sketch::SketchOutput * output = new Sketch::SketchOutput();
+	
+	output->references.resize(1);
+	
+    MinHashHeap minHashHeap(parameters.use64, parameters.minHashesPerWindow, parameters.reads ? parameters.minCov : 1, parameters.memoryBound);
+    string seq;
+    
+    FilePrefetcher::File * buffer = 0;
+    
+    if ( input->prefetcher != 0 )
+    {
+    	buffer = input->prefetcher->take(input->prefetchFirst);
+    }
+    
+    sketchFileTo(input->fileNames, parameters, minHashHeap, output->references[0], seq, buffer);
+	
+	if ( buffer != 0 )
+	{
+		input->prefetcher->release(buffer);
 	}
 	
 	return output;
 }
 
+Sketch::SketchOutput * sketchFiles(Sketch::SketchInput * input)
+{
+	const Sketch::Parameters & parameters = input->parameters;
+	
+	Sketch::SketchOutput * output = input->outputPool ? input->outputPool->get() : new Sketch::SketchOutput();
+	
+	output->references.resize(input->fileNames.size());
+	
+	// one heap and record buffer for the batch
+	//
+    MinHashHeap minHashHeap(parameters.use64, parameters.minHashesPerWindow);
+    vector<string> file(1);
+    string seq;
+    
+    for ( size_t i = 0; i < input->fileNames.size(); i++ )
+    {
+    	if ( i > 0 )
+    	{
+    		minHashHeap.clear();
+    	}
+    	
+    	FilePrefetcher::File * buffer = 0;
+    	
+    	if ( input->prefetcher != 0 )
+    	{
+    		buffer = input->prefetcher->take(input->prefetchFirst + i);
+    	}
+    	
+    	file[0] = input->fileNames[i];
+    	sketchFileTo(file, parameters, minHashHeap, output->references[i], seq, buffer);
+    	
+    	if ( buffer != 0 )
+    	{
+    		input->prefetcher->release(buffer);
+    	}
+    }
+	
+	return output;
+}
+
 Sketch::SketchOutput * sketchSequence(Sketch::SketchInput * input)
 {
 	const Sketch::Parameters & parameters = input->parameters;
@@ -1968,96 +3353,115 @@ Sketch::SketchOutput * sketchSequence(Sketch::SketchInput * input)
 	return output;
 }
 
+static void setReferenceFromView(Sketch::Reference & reference, const mash::SequenceView & seq)
+{
+	reference.name.assign(seq.name, seq.nameLength);
+	reference.comment.assign(seq.comment, seq.commentLength);
+	reference.length = seq.length;
+	reference.gid = seq.gid;
+}
+
+void addMinHashesChunkSequence(MinHashHeap & minHashHeap, char * seq, uint64_t length, const Sketch::Parameters & parameters)
+{
+	//dealing with letter's case, in the chunk buffer itself
+	if ( ! parameters.preserveCase )
+	{
+		getSimdKernels().toUpper(seq, length);
+	}
+	
+	// runs without bad chars are found by addMinHashes()
+	//
+	addMinHashes(minHashHeap, seq, length, parameters);
+}
+
 Sketch::SketchOutput * sketchChunk(Sketch::SketchInput * input)
 {
 	const Sketch::Parameters & parameters = input->parameters;
 	
-	Sketch::SketchOutput * output = new Sketch::SketchOutput();
+	Sketch::SketchOutput * output = input->outputPool ? input->outputPool->get() : new Sketch::SketchOutput();
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	
+	output->chunkFile = input->chunkFile;
+	output->chunkFileName = input->chunkFileName;
 	
 	//input->fachunk->print();
 
 	/***********Chunk Format**************/
 
-	mash::fa::chunkFormat(*(input->fachunk), output->references, parameters.kmerSize);
+	// Records are hashed straight from the chunk buffer; only the metadata
+	// kept in the sketch is copied into references.
+	vector<mash::SequenceView> seqs;
+	
+	{
+		Stats::Timer timer(Stats::parsing);
+		mash::fa::chunkFormat(*(input->fachunk), seqs);
+	}
+	
+	Stats::count(Stats::sequences, seqs.size());
 
 	/*************************************/
 
-	input->fastaPool->Release(input->fachunk->chunk);
-
-	for(int i = 0; i < output->references.size(); i++)
+	if ( parameters.concatenated )
 	{
-		if ( parameters.windowed )
+		// one sketch for the chunk, kept with its first sequence; short
+		// sequences are kept so whole lengths can be summed when merging
+		
+	    MinHashHeap minHashHeap(parameters.use64, parameters.minHashesPerWindow);
+	    
+		output->references.resize(seqs.size());
+		
+		for(size_t i = 0; i < seqs.size(); i++)
 		{
-			//TODO: finish it
-			//output->positionHashesByReference.resize(1);
-			//getMinHashPositions(output->positionHashesByReference[0], input->seq, input->length, parameters, 0);
+			setReferenceFromView(output->references[i], seqs[i]);
+			output->references[i].hashesSorted.setUse64(parameters.use64);
+			addMinHashesChunkSequence(minHashHeap, seqs[i].seq, seqs[i].length, parameters);
 		}
-		else
+		
+		if ( output->references.size() > 0 )
 		{
-			//debug only
-			//std::cout << output->references[i].seq << std::endl;
-		    MinHashHeap minHashHeap(parameters.use64, parameters.minHashesPerWindow, parameters.reads ? parameters.minCov : 1);
-
-			string & seq = output->references[i].seq;
-
-			//dealing with letter's case	
-			for ( uint64_t k = 0; k < seq.length(); k++ )
-    		{
-    		    if ( ! parameters.preserveCase && seq[k] > 96 && seq[k] < 123 )
-    		    {
-    		        seq[k] -= 32;
-    		    }
-    		}
-
-			//FIXME: make it more clear
-			//cerr <<"seq: " << seq << endl;
-			//cerr << "seq_len: " << seq.length() << endl;
-			int j = 0;
-			int start = 0;
-			while(j < seq.length()){
-				if( parameters.alphabet[seq[j]] )
-				{
-					j++;
-					if(j == seq.length() && j - start >= parameters.kmerSize){
-						string subSeq = seq.substr(start, j - start);	
-						//cerr << "substr: " << subSeq << endl;
-						//cerr << "j: " << j << endl;
-						//cerr << "start: " << start << endl;
-    	    			addMinHashes(minHashHeap, subSeq.c_str(), subSeq.length(), parameters);
-					}
-					continue;
-				}else{
-
-					if(j - start >= parameters.kmerSize)
-					{
-						//get substr without bad char
-						string subSeq = seq.substr(start, j - start);	
-						//cerr << "substr: " << subSeq << endl;
-						//cerr << "j: " << j << endl;
-						//cerr << "start: " << start << endl;
-    	    			addMinHashes(minHashHeap, subSeq.c_str(), subSeq.length(), parameters);
-						j++;
-						while(j < seq.length() && !parameters.alphabet[seq[j]]) j++;
-						if(j >= seq.length()) break;
-						start = j;
-					}else{
-						j++;	
-						while(j < seq.length() && !parameters.alphabet[seq[j]]) j++;
-						if(j >= seq.length()) break;
-						start = j;
-					}
-				}
+			setMinHashesForReference(output->references[0], minHashHeap);
+		}
+	}
+	else
+	{
+		// one heap for the chunk, cleared per sequence, rather than one
+		// allocated for each (short) record
+		//
+	    MinHashHeap minHashHeap(parameters.use64, parameters.minHashesPerWindow, parameters.reads ? parameters.minCov : 1);
+	    
+		for(size_t i = 0; i < seqs.size(); i++)
+		{
+			if ( seqs[i].length < uint64(parameters.kmerSize) )
+			{
+				continue;
+			}
+			
+			output->references.resize(output->references.size() + 1);
+			Sketch::Reference & reference = output->references.back();
+			setReferenceFromView(reference, seqs[i]);
+			
+			if ( parameters.windowed )
+			{
+				//TODO: finish it
+				//output->positionHashesByReference.resize(1);
+				//getMinHashPositions(output->positionHashesByReference[0], input->seq, input->length, parameters, 0);
+			}
+			else
+			{
+				minHashHeap.clear();
+				addMinHashesChunkSequence(minHashHeap, seqs[i].seq, seqs[i].length, parameters);
+				setMinHashesForReference(reference, minHashHeap);
 			}
-
-    	    //addMinHashes(minHashHeap, output->references[i].seq.c_str(), output->references[i].length, parameters);
-			setMinHashesForReference(output->references[i], minHashHeap);
 		}
 	}
 	
-	//destry seq	
-	for(int i = 0; i < output->references.size(); i++){
-		output->references[i].seq = "";
-	}	
+	if ( input->chunkSizer != 0 )
+	{
+		input->chunkSizer->Record(input->fachunk->chunk->size, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+	}
+	
+	input->fastaPool->Release(input->fachunk->chunk);
+	
 	//delete input;	//segfault
 
 	return output;
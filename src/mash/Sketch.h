@@ -15,6 +15,7 @@
 #include <string>
 #include <string.h>
 #include "MinHashHeap.h"
+#include "ObjectPool.h"
 #include "ThreadPool.h"
 #include "robin_hood.h"
 
@@ -22,11 +23,18 @@
 //#include "fasta/FastaIO.h"
 //#include "fasta/FastaStream.h"
 
+class SketchWriter;
+class FilePrefetcher;
+
+namespace capnp {class FlatArrayMessageReader;}
+namespace mash {namespace core {class ChunkSizer;}}
+
 static const char * capnpHeader = "Cap'n Proto";
 static const int capnpHeaderLength = strlen(capnpHeader);
 
 static const char * suffixSketch = ".msh";
 static const char * suffixSketchWindowed = ".msw";
+static const char * suffixIndex = ".idx"; // appended to the sketch file name
 
 static const char * alphabetNucleotide = "ACGT";
 static const char * alphabetProtein = "ACDEFGHIKLMNPQRSTVWY";
@@ -59,7 +67,13 @@ public:
             minCov(1),
             targetCov(0),
             genomeSize(0),
-			freeMemory(false)
+			freeMemory(false),
+			mapped(false),
+			packed(false),
+			prefetch(0),
+			hll(0),
+			chunkSize(0),
+			chunkMemory(0)
         {
         	memset(alphabet, 0, 256);
         }
@@ -84,11 +98,19 @@ public:
             minCov(other.minCov),
             targetCov(other.targetCov),
             genomeSize(other.genomeSize),
-			freeMemory(other.freeMemory)
+			freeMemory(other.freeMemory),
+			mapped(other.mapped),
+			packed(other.packed),
+			prefetch(other.prefetch),
+			hll(other.hll),
+			chunkSize(other.chunkSize),
+			chunkMemory(other.chunkMemory)
 		{
 			memcpy(alphabet, other.alphabet, 256);
 		}
-        
+
+        Parameters & operator=(const Parameters & other) = default;
+
         int parallelism;
         int kmerSize;
         bool alphabet[256];
@@ -109,6 +131,33 @@ public:
         double targetCov;
         uint64_t genomeSize;
 		bool freeMemory;
+		
+		// Hashes of loaded sketch files point into the mapped files rather
+		// than being copied (for read-only use; see loadCapnp).
+		//
+		bool mapped;
+		
+		// Sketch files are written with the hashes packed (hashesPacked; see
+		// HashList::pack()). They are then decoded rather than mapped.
+		//
+		bool packed;
+		
+		// Input files read ahead of sketching them (see FilePrefetcher);
+		// 0 to read each as it is sketched.
+		//
+		int prefetch;
+		
+		// Precision of HyperLogLog registers kept for each reference (see
+		// HyperLogLog.h), or 0 for none.
+		//
+		int hll;
+		
+		// Size of the chunks large files are split into for threads, or 0
+		// to adapt it to hashing throughput (see ChunkSizer), and memory for
+		// those being read and sketched, or 0 for the default.
+		//
+		uint64_t chunkSize;
+		uint64_t chunkMemory;
     };
     
     struct PositionHash
@@ -149,6 +198,11 @@ public:
         HashList hashesSorted;
         std::vector<uint32_t> counts;
 		uint64_t gid; //for fasta IO
+		
+		// HyperLogLog registers of all k-mers (with -hll) and the distinct
+		// k-mers they estimate
+		std::vector<uint8_t> hll;
+		double hllSize = 0;
 
 		//Reference(std::string nameNew, std::string commentNew, std::string seqNew, std::string strandNew = "", std::string qualityNew = "")
 		//:
@@ -161,6 +215,19 @@ public:
 	
     };
     
+    struct SketchOutput;
+    
+    // References to load from sketch files, by name and/or list position
+    // (both if given). An index written by writeIndex() is used, if present,
+    // to find names without reading the rest of the file.
+    //
+    struct ReferenceSubset
+    {
+    	std::vector<std::string> names; // all if empty
+    	uint64_t first = 0;
+    	uint64_t last = UINT64_MAX; // inclusive
+    };
+    
     class SketchInput
     {
 	public:
@@ -190,6 +257,12 @@ public:
 	    	}
     	}
     	
+    	// inputs are created and deleted once per task, so their storage is
+    	// recycled (see Sketch.cpp)
+    	//
+    	static void * operator new(size_t size);
+    	static void operator delete(void * pointer);
+    	
     	std::vector<std::string> fileNames;
     	
     	char * seq = NULL;
@@ -203,14 +276,58 @@ public:
 		
 		mash::fa::FastaChunk *fachunk;
 		mash::fa::FastaDataPool *fastaPool;
+		mash::core::ChunkSizer * chunkSizer = 0; // told how long the chunk took
+		
+		// input file of a chunk, used to reassemble chunk outputs
+		int64_t chunkFile = -1;
+		std::string chunkFileName;
+		
+		// outputs are taken from here if set (and put back once used)
+		//
+		ObjectPool<SketchOutput> * outputPool = 0;
+		
+		// fileNames are read by this if set, with ids from prefetchFirst
+		//
+		FilePrefetcher * prefetcher = 0;
+		uint64_t prefetchFirst = 0;
+		
+		const ReferenceSubset * subset = 0; // for loadCapnp
+		int threads = 1; // for loadCapnp to read the references with
+    };
+    
+    // a sketch file left mapped for the hash views of its references
+    //
+    struct MappedFile
+    {
+    	std::vector<capnp::FlatArrayMessageReader *> messages; // see getSketchMessages()
+    	void * data = 0;
+    	uint64_t size = 0;
     };
     
     struct SketchOutput
     {
+    	// for reuse from an ObjectPool; vectors keep their capacity
+    	//
+    	void clear()
+    	{
+    		references.clear();
+    		positionHashesByReference.clear();
+    		chunkFile = -1;
+    		chunkFileName.clear();
+    		mapped = MappedFile();
+    	}
+    	
     	std::vector<Reference> references;
 	    std::vector<std::vector<PositionHash>> positionHashesByReference;
+	    
+	    int64_t chunkFile = -1;
+	    std::string chunkFileName;
+	    
+	    MappedFile mapped;
     };
     
+    ~Sketch();
+    
     void getAlphabetAsString(std::string & alphabet) const;
     uint32_t getAlphabetSize() const {return parameters.alphabetSize;}
     bool getConcatenated() const {return parameters.concatenated;}
@@ -220,6 +337,7 @@ public:
     const std::vector<Locus> & getLociByHash(hash_t hash) const;
     float getMinHashesPerWindow() const {return parameters.minHashesPerWindow;}
 	int getMinKmerSize(uint64_t reference) const;
+    const Parameters & getParameters() const {return parameters;}
 	bool getPreserveCase() const {return parameters.preserveCase;}
 	double getRandomKmerChance(uint64_t reference) const;
     const Reference & getReference(uint64_t index) const {return references.at(index);}
@@ -235,22 +353,64 @@ public:
     bool hasLociByHash(hash_t hash) const {return lociByHash.count(hash);}
     int initFromFiles(const std::vector<std::string> & files, const Parameters & parametersNew, int verbosity = 0, bool enforceParameters = false, bool contain = false);
     void initFromReads(const std::vector<std::string> & files, const Parameters & parametersNew);
+    void initFromReferences(std::vector<Reference> & referencesNew, const Parameters & parametersNew); // takes (swaps out) the references
     uint64_t initParametersFromCapnp(const char * file);
+    
+    // Whether file can be loaded (by initParametersFromCapnp or
+    // initFromFiles) without exiting: it is mapped, every message in it is
+    // well formed, and they all have the same parameters. If not, error says
+    // why. For callers that must outlive a bad file (see CommandServe).
+    //
+    static bool checkCapnp(const char * file, std::string & error);
+    void finishStream();
     void setReferenceName(int i, const std::string name) {references[i].name = name;}
+    void setReferenceSubset(const ReferenceSubset & subsetNew) {subset = subsetNew; subsetActive = true;}
     void setReferenceComment(int i, const std::string comment) {references[i].comment = comment;}
+    void setStreamFile(const std::string & fileNew, bool append = false) {streamFile = fileNew; streamAppend = append;}
 	bool sketchFileBySequence(FILE * file, ThreadPool<Sketch::SketchInput, Sketch::SketchOutput> * threadPool);
-	bool sketchFileByChunk(FILE * file, ThreadPool<Sketch::SketchInput, Sketch::SketchOutput> * threadPool);
+	bool sketchFileByChunk(FILE * file, ThreadPool<Sketch::SketchInput, Sketch::SketchOutput> * threadPool, mash::fa::FastaDataPool * fastaPool, mash::core::ChunkSizer * chunkSizer, uint32_t queueDepth, int64_t fileIndex, const std::string & fileName);
 	void useThreadOutput(SketchOutput * output);
 	void useThreadOutput_FreeMemory(SketchOutput * output);
 	void useThreadOutputChunk(SketchOutput * output);
     void warnKmerSize(uint64_t lengthMax, const std::string & lengthMaxName, double randomChance, int kMin, int warningCount) const;
     bool writeToFile() const;
     int writeToCapnp(const char * file) const;
+    int writeIndex(const char * file) const; // for a file just written
+    
+    // for a file just written with references of these names, in order
+    //
+    static int writeIndex(const char * file, const std::vector<std::string> & names);
+    
+    // for a file appended to, from the names of all of its references
+    //
+    static int writeIndexFromFile(const char * file);
     
 private:
     
+    struct ChunkMerge
+    {
+        // Chunk outputs of one input file, merged as they arrive in order.
+        // With -i, sequences split across chunks are joined; otherwise the
+        // whole file is gathered into one reference.
+        
+        int64_t file = -1;
+        Reference reference;
+        uint64_t sequenceCount = 0;
+        bool skipped = false;
+        
+        bool sequenceOpen = false;
+        uint64_t sequenceGid;
+        uint64_t sequenceLength;
+        std::string sequenceHeader;
+    };
+    
     void createIndex();
+    void finishChunkFile();
+    void finishChunkSequence();
+    void recycleOutput(SketchOutput * output);
+    void streamReferences();
     
+    ChunkMerge chunkMerge;
     std::vector<Reference> references;
     robin_hood::unordered_map<std::string, int> referenceIndecesById;
     std::vector<std::vector<PositionHash>> positionHashesByReference;
@@ -259,16 +419,64 @@ private:
     Parameters parameters;
     double kmerSpace;
     std::string file;
+    
+    // With a stream file, finished references are written as they arrive
+    // and only their metadata is kept. The first is held back until
+    // finishStream() so its name and comment can still be set.
+    //
+    std::string streamFile;
+    SketchWriter * streamWriter = 0;
+    bool streamAppend = false; // see SketchWriter
+    uint64_t streamNext = 1;
+    
+    ObjectPool<SketchOutput> outputPool;
+    
+    std::vector<MappedFile> mappedFiles; // released on destruction
+    
+    ReferenceSubset subset;
+    bool subsetActive = false;
 };
 
 void addMinHashes(MinHashHeap & minHashHeap, const char * seq, uint64_t length, const Sketch::Parameters & parameters);
+void addMinHashesTwoBit(MinHashHeap & minHashHeap, const char * seq, uint64_t length, const Sketch::Parameters & parameters);
+void addMinHashesChunkSequence(MinHashHeap & minHashHeap, char * seq, uint64_t length, const Sketch::Parameters & parameters);
+
+// Sets table to the characters of the alphabet, as a bit for each high nibble
+// (0-7) at each low nibble, for SimdKernels::alphabetRun. False if the
+// alphabet has characters from 128, which cannot be represented.
+bool getAlphabetTable(const Sketch::Parameters & parameters, uint8_t * table);
+
+// Kernel variants (see SimdKernels::toUpper and alphabetRun).
+void toUpperScalar(char * seq, uint64_t length);
+void toUpperAvx2(char * seq, uint64_t length);
+uint64_t alphabetRunScalar(const char * seq, uint64_t length, const uint8_t * table, bool inAlphabet);
+uint64_t alphabetRunAvx2(const char * seq, uint64_t length, const uint8_t * table, bool inAlphabet);
+
 void getMinHashPositions(std::vector<Sketch::PositionHash> & loci, char * seq, uint32_t length, const Sketch::Parameters & parameters, int verbosity = 0);
+bool hasFastaHeader(const std::string & file);
+
+// Offsets in a sketch file of each MinHash message that is complete (a file
+// has one, then one for each append; see SketchWriter), and the end of the
+// last. An interrupted append after them is not included.
+//
+void getSketchMessages(const void * data, uint64_t size, std::vector<uint64_t> & offsets);
+
+// Files with packed hashes (sketch -pack) start with this message. Its root
+// is text rather than a MinHash struct, so versions that cannot read packed
+// hashes fail on these files instead of loading them as empty sketches.
+// getSketchMessages() skips it.
+//
+const std::string & getPackedMarker();
+bool hasPackedMarker(const void * data, uint64_t size);
 bool hasSuffix(std::string const & whole, std::string const & suffix);
 Sketch::SketchOutput * loadCapnp(Sketch::SketchInput * input);
+void mergeMinHashes(HashList & hashes, HashList & hashesOther, uint64_t sketchSize);
 void reverseComplement(const char * src, char * dest, int length);
 void setAlphabetFromString(Sketch::Parameters & parameters, const char * characters);
 void setMinHashesForReference(Sketch::Reference & reference, const MinHashHeap & hashes);
+bool useTwoBitEngine(const Sketch::Parameters & parameters);
 Sketch::SketchOutput * sketchFile(Sketch::SketchInput * input);
+Sketch::SketchOutput * sketchFiles(Sketch::SketchInput * input); // a batch of small files, one reference each
 Sketch::SketchOutput * sketchSequence(Sketch::SketchInput * input);
 Sketch::SketchOutput * sketchChunk(Sketch::SketchInput * input);
 
@@ -0,0 +1,165 @@
+// Copyright © 2015, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen,
+// Sergey Koren, and Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#include "SketchCache.h"
+#include "MurmurHash3.h"
+#include "Sketch.h"
+#include "SketchWriter.h"
+#include <dirent.h>
+#include <iostream>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <unistd.h>
+
+using namespace::std;
+
+static string hashName(const string & key)
+{
+	uint64_t hash[2];
+	char name[17];
+	
+	MurmurHash3_x64_128(key.data(), key.size(), 42, hash);
+	snprintf(name, sizeof(name), "%016llx", (unsigned long long)hash[0]);
+	
+	return name;
+}
+
+// the copies of older versions of a file (with the same prefix), but not
+// those still being written, which do not have the suffix yet
+//
+static void removeStale(const string & dir, const string & prefix, const string & current)
+{
+	DIR * entries = opendir(dir.c_str());
+	
+	if ( entries == 0 )
+	{
+		return;
+	}
+	
+	while ( struct dirent * entry = readdir(entries) )
+	{
+		string name = entry->d_name;
+		
+		if ( name.compare(0, prefix.size(), prefix) == 0 && hasSuffix(name, suffixSketch) && name != current )
+		{
+			unlink((dir + "/" + name).c_str());
+		}
+	}
+	
+	closedir(entries);
+}
+
+static bool publish(const string & file, const string & dir, const string & cache, int threads)
+{
+	Sketch header;
+	
+	header.initParametersFromCapnp(file.c_str());
+	
+	Sketch::Parameters parameters = header.getParameters();
+	string alphabet;
+	
+	header.getAlphabetAsString(alphabet);
+	
+	// loaded whole (with every hash and count), whatever this run will use
+	//
+	parameters.mapped = false;
+	parameters.packed = false;
+	parameters.reads = true;
+	
+	Sketch::SketchInput input(vector<string>(1, file), 0, 0, "", "", parameters);
+	input.threads = threads;
+	
+	Sketch::SketchOutput * output = loadCapnp(&input);
+	
+	if ( output == 0 )
+	{
+		return false;
+	}
+	
+	uint64_t bytes = 4096;
+	bool loci = false;
+	
+	for ( uint64_t i = 0; i < output->references.size(); i++ )
+	{
+		const Sketch::Reference & reference = output->references[i];
+		
+		bytes += 128 + reference.name.size() + reference.comment.size();
+		bytes += reference.hashesSorted.size() * (parameters.use64 ? 8 : 4) + reference.counts.size() * 4;
+		loci = loci || output->positionHashesByReference[i].size() != 0;
+	}
+	
+	// SketchWriter gives up on a full disk, so make sure it will fit
+	//
+	struct statvfs space;
+	
+	if ( loci || statvfs(dir.c_str(), &space) != 0 || uint64_t(space.f_bavail) * space.f_frsize < bytes )
+	{
+		delete output;
+		return false;
+	}
+	
+	// written under a name of our own first, since other runs may be
+	// publishing the same file
+	//
+	string fileNew = cache + "." + to_string(getpid());
+	
+	{
+		SketchWriter writer(fileNew, parameters, alphabet);
+		
+		for ( uint64_t i = 0; i < output->references.size(); i++ )
+		{
+			writer.addReference(i, output->references[i]);
+		}
+	}
+	
+	delete output;
+	
+	if ( rename(fileNew.c_str(), cache.c_str()) != 0 )
+	{
+		unlink(fileNew.c_str());
+		return false;
+	}
+	
+	return true;
+}
+
+string getSketchCache(const string & file, const string & dir, int threads)
+{
+	struct stat fileInfo;
+	char path[PATH_MAX];
+	
+	if ( ! hasSuffix(file, suffixSketch) || stat(file.c_str(), &fileInfo) != 0 || realpath(file.c_str(), path) == 0 )
+	{
+		return file;
+	}
+	
+	// the inode too, since a file replaced within a second can have the same
+	// size and time
+	//
+	string key = string(path) + '\n' + to_string(fileInfo.st_size) + '\n' + to_string(fileInfo.st_mtime) + '\n' + to_string(fileInfo.st_ino);
+	string prefix = "mash-" + hashName(path) + "-";
+	string name = prefix + hashName(key) + suffixSketch;
+	string cache = dir + "/" + name;
+	struct stat cacheInfo;
+	
+	if ( stat(cache.c_str(), &cacheInfo) == 0 )
+	{
+		return cache;
+	}
+	
+	if ( ! publish(file, dir, cache, threads) )
+	{
+		cerr << "WARNING: could not cache " << file << " in " << dir << "; it will be read directly." << endl;
+		return file;
+	}
+	
+	removeStale(dir, prefix, name);
+	
+	return cache;
+}
@@ -0,0 +1,26 @@
+// Copyright © 2015, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen,
+// Sergey Koren, and Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#ifndef SketchCache_h
+#define SketchCache_h
+
+#include <string>
+
+// Sketch files shared by concurrent runs on one machine, for -cache. The
+// first run to load a sketch file publishes a copy of it in the cache
+// directory (e.g. /dev/shm), with its hashes unpacked as plain lists, so
+// later runs map that copy instead and all of them compare against the same
+// pages of memory, without reading the original (e.g. from network storage)
+// or decoding it again. Copies are named by the path, size and modification
+// time of the original, so a changed original gets a new copy, which
+// replaces the old one (runs still using that keep their mapping).
+//
+// Only .msh files are cached; the path of the copy is returned, or file
+// itself if it cannot be cached (e.g. there is not enough space).
+
+std::string getSketchCache(const std::string & file, const std::string & dir, int threads);
+
+#endif
@@ -0,0 +1,506 @@
+// Copyright © 2015, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen,
+// Sergey Koren, and Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#include "SketchWriter.h"
+#include <capnp/message.h>
+#include <capnp/serialize.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <iostream>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace::std;
+
+// Words are written in host order, so this assumes a little-endian host (as
+// Cap'n Proto's wire format is little-endian).
+
+static const uint32_t segmentsMax = 64; // entries in the segment table
+static const uint64_t headerBytes = (4 * (segmentsMax + 1) + 7) / 8 * 8;
+static const uint64_t segmentWordsMax = uint64_t(1) << 29; // far pointer offsets are 29 bits
+static const uint64_t bufferWordsMax = 1 << 17;
+
+// MinHash.capnp layouts
+
+static const int minHashDataWords = 3;
+static const int minHashPointers = 4;
+static const int minHashReferenceListOld = 0;
+static const int minHashAlphabet = 2;
+static const int minHashReferenceList = 3;
+static const uint32_t hashSeedDefault = 42;
+
+static const int referenceDataWords = 2;
+static const int referencePointers = 9;
+static const int referenceWords = referenceDataWords + referencePointers;
+static const int referenceLength64 = 1; // data word
+static const int referenceName = 2;
+static const int referenceComment = 3;
+static const int referenceHashes32 = 4;
+static const int referenceHashes64 = 5;
+static const int referenceCounts32 = 6;
+static const int referenceHashesPacked = 7;
+static const int referenceHll = 8;
+
+enum ElementSize
+{
+	elementByte = 2,
+	elementFourBytes = 4,
+	elementEightBytes = 5,
+	elementComposite = 7
+};
+
+static uint64_t pointerOffset(int64_t offset)
+{
+	return uint64_t(uint32_t(offset) << 2);
+}
+
+static uint64_t structPointer(int64_t offset, uint64_t dataWords, uint64_t pointers)
+{
+	return pointerOffset(offset) | dataWords << 32 | pointers << 48;
+}
+
+static uint64_t listPointer(int64_t offset, uint64_t elementSize, uint64_t count)
+{
+	return 1 | pointerOffset(offset) | elementSize << 32 | count << 35;
+}
+
+static uint64_t farPointer(uint64_t segment, uint64_t position)
+{
+	return 2 | position << 3 | segment << 32;
+}
+
+SketchWriter::SketchWriter(const string & fileNew, const Sketch::Parameters & parametersNew, const string & alphabetNew, bool appendNew)
+	:
+	file(fileNew),
+	append(appendNew && access(fileNew.c_str(), F_OK) == 0),
+	fileBase(0),
+	use64(parametersNew.use64),
+	reads(parametersNew.reads),
+	packed(parametersNew.packed),
+	fileOffset(0),
+	segment(1),
+	segmentWords(0),
+	referenceCount(0),
+	parameters(parametersNew),
+	alphabet(alphabetNew),
+	firstLength(0),
+	firstHashCount(0)
+{
+	if ( append )
+	{
+		checkParameters();
+
+		fd = open(file.c_str(), O_RDWR);
+		struct stat fileInfo;
+
+		if ( fd < 0 || fstat(fd, &fileInfo) < 0 )
+		{
+			cerr << "ERROR: could not open " << file << " for appending.\n";
+			exit(1);
+		}
+
+		void * data = mmap(NULL, fileInfo.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+		if ( data == MAP_FAILED )
+		{
+			cerr << "ERROR: could not memory-map " << file << "." << endl;
+			exit(1);
+		}
+
+		// after the last complete message, dropping any interrupted append
+
+		vector<uint64_t> offsets;
+		getSketchMessages(data, fileInfo.st_size, offsets);
+		bool marked = hasPackedMarker(data, fileInfo.st_size);
+		munmap(data, fileInfo.st_size);
+
+		// older versions read only the first message, so they need the
+		// marker to fail on packed appends as well (see getPackedMarker())
+		//
+		if ( packed && ! marked )
+		{
+			cerr << "ERROR: " << file << " was written without -pack, so packed sketches cannot be appended to it." << endl;
+			exit(1);
+		}
+
+		fileBase = offsets.back();
+
+		if ( ftruncate(fd, fileBase) != 0 )
+		{
+			cerr << "ERROR: could not write to " << file << "." << endl;
+			exit(1);
+		}
+	}
+	else
+	{
+		// written under a temporary name, so a failed run leaves no partial
+		// sketch
+		//
+		fd = open((file + ".partial").c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0644);
+
+		if ( fd < 0 )
+		{
+			cerr << "ERROR: could not open " << file << " for writing.\n";
+			exit(1);
+		}
+
+		if ( packed )
+		{
+			const string & marker = getPackedMarker();
+
+			writeAt(0, marker.data(), marker.size());
+			fileBase = marker.size();
+		}
+	}
+
+	// segment 0: root pointer, MinHash struct, ReferenceList struct (whose
+	// pointer is patched to the struct list segment by close()), alphabet
+
+	const uint64_t root = 1;
+	const uint64_t pointers = root + minHashDataWords;
+	const uint64_t referenceList = pointers + minHashPointers;
+	const uint64_t text = referenceList + 1;
+
+	vector<uint64_t> words(text + (alphabet.size() + 1 + 7) / 8, 0);
+
+	// stored as Float32, like builder.setError() in writeToCapnp
+	//
+	float errorFloat = parameters.error;
+	uint32_t error;
+	memcpy(&error, &errorFloat, sizeof(error));
+
+	words[0] = structPointer(0, minHashDataWords, minHashPointers);
+	words[root] = uint64_t(parameters.kmerSize) | uint64_t(parameters.windowSize) << 32;
+	words[root + 1] =
+		uint64_t(parameters.minHashesPerWindow) |
+		uint64_t(parameters.concatenated) << 32 |
+		uint64_t(parameters.noncanonical) << 33 |
+		uint64_t(parameters.preserveCase) << 34;
+	words[root + 2] = uint64_t(error) | uint64_t(parameters.seed ^ hashSeedDefault) << 32;
+
+	// as writeToCapnp, the old list field is used for the default seed
+	//
+	uint64_t slot = pointers + (parameters.seed == 42 ? minHashReferenceListOld : minHashReferenceList);
+	words[slot] = structPointer(referenceList - slot - 1, 0, 1);
+	words[pointers + minHashAlphabet] = listPointer(text - (pointers + minHashAlphabet) - 1, elementByte, alphabet.size() + 1);
+	memcpy(&words[text], alphabet.c_str(), alphabet.size());
+
+	vector<char> header(headerBytes, 0);
+	writeAt(0, header.data(), header.size());
+	writeAt(headerBytes, words.data(), words.size() * 8);
+
+	fileOffset = headerBytes + words.size() * 8;
+	segmentSizes.push_back(words.size());
+}
+
+SketchWriter::~SketchWriter()
+{
+	close();
+}
+
+void SketchWriter::addReference(uint64_t index, const Sketch::Reference & reference)
+{
+	if ( structs.size() < (index + 1) * referenceWords )
+	{
+		structs.resize((index + 1) * referenceWords, 0);
+	}
+
+	uint64_t * body = structs.data() + index * referenceWords;
+	uint64_t * pointers = body + referenceDataWords;
+
+	body[referenceLength64] = reference.length;
+	pointers[referenceName] = addText(reference.name);
+	pointers[referenceComment] = addText(reference.comment);
+
+	const HashList & hashes = reference.hashesSorted;
+
+	if ( hashes.size() != 0 )
+	{
+		if ( packed )
+		{
+			vector<uint64_t> words;
+
+			hashes.pack(words);
+			pointers[referenceHashesPacked] = addList(words.data(), words.size() * 8, elementByte, 1);
+		}
+		else if ( use64 )
+		{
+			pointers[referenceHashes64] = addList(hashes.data64(), hashes.size(), elementEightBytes, 8);
+		}
+		else
+		{
+			pointers[referenceHashes32] = addList(hashes.data32(), hashes.size(), elementFourBytes, 4);
+		}
+
+		if ( reference.counts.size() > 0 && reads )
+		{
+			pointers[referenceCounts32] = addList(reference.counts.data(), reference.counts.size(), elementFourBytes, 4);
+		}
+	}
+
+	if ( reference.hll.size() != 0 )
+	{
+		pointers[referenceHll] = addList(reference.hll.data(), reference.hll.size(), elementByte, 1);
+	}
+
+	if ( index == 0 )
+	{
+		firstName = reference.name;
+		firstLength = reference.length;
+		firstHashCount = hashes.size();
+	}
+
+	if ( index >= referenceCount )
+	{
+		referenceCount = index + 1;
+	}
+}
+
+void SketchWriter::close()
+{
+	if ( fd < 0 )
+	{
+		return;
+	}
+
+	flushBuffer();
+	segmentSizes.push_back(segmentWords);
+
+	// struct list: landing pad, tag, bodies
+
+	uint64_t listSegment = segmentSizes.size();
+	uint64_t listWords = referenceCount * referenceWords;
+
+	structs.resize(listWords, 0);
+
+	uint64_t head[2];
+	head[0] = listPointer(0, elementComposite, listWords);
+	head[1] = structPointer(referenceCount, referenceDataWords, referencePointers);
+
+	writeAt(fileOffset, head, sizeof(head));
+	writeAt(fileOffset + sizeof(head), structs.data(), listWords * 8);
+	segmentSizes.push_back(2 + listWords);
+	vector<uint64_t>().swap(structs);
+
+	// unused table entries are empty segments
+
+	vector<uint32_t> table(headerBytes / 4, 0);
+	table[0] = segmentsMax - 1;
+
+	for ( size_t i = 0; i < segmentSizes.size(); i++ )
+	{
+		table[i + 1] = segmentSizes[i];
+	}
+
+	uint64_t references = farPointer(listSegment, 0);
+	writeAt(headerBytes + (1 + minHashDataWords + minHashPointers) * 8, &references, 8);
+
+	if ( append )
+	{
+		// the table makes the message visible to readers, so everything it
+		// frames must be on disk first
+		//
+		if ( fsync(fd) != 0 )
+		{
+			cerr << "ERROR: could not write to " << file << "." << endl;
+			exit(1);
+		}
+
+		writeAt(0, table.data(), headerBytes);
+		::close(fd);
+		fd = -1;
+	}
+	else
+	{
+		writeAt(0, table.data(), headerBytes);
+		::close(fd);
+		fd = -1;
+
+		if ( rename((file + ".partial").c_str(), file.c_str()) != 0 )
+		{
+			cerr << "ERROR: could not write to " << file << "." << endl;
+			exit(1);
+		}
+	}
+
+	verify();
+}
+
+uint64_t SketchWriter::addList(const void * data, uint64_t count, int elementSize, int elementBytes)
+{
+	uint64_t bytes = count * elementBytes;
+	uint64_t words = (bytes + 7) / 8;
+
+	if ( segmentWords + 1 + words > segmentWordsMax )
+	{
+		flushBuffer();
+		segmentSizes.push_back(segmentWords);
+		segment++;
+		segmentWords = 0;
+
+		if ( segment + 1 >= segmentsMax || 1 + words > segmentWordsMax )
+		{
+			cerr << "ERROR: sketch too large to write to " << file << "." << endl;
+			exit(1);
+		}
+	}
+
+	// landing pad for the far pointer, then the list itself
+
+	uint64_t position = segmentWords;
+	uint64_t start = buffer.size() + 1;
+
+	buffer.push_back(listPointer(0, elementSize, count));
+	buffer.resize(start + words, 0);
+	memcpy(buffer.data() + start, data, bytes);
+	segmentWords += 1 + words;
+
+	if ( buffer.size() >= bufferWordsMax )
+	{
+		flushBuffer();
+	}
+
+	return farPointer(segment, position);
+}
+
+uint64_t SketchWriter::addText(const string & text)
+{
+	if ( text.empty() )
+	{
+		return 0;
+	}
+
+	// includes the NUL terminator
+	//
+	return addList(text.c_str(), text.size() + 1, elementByte, 1);
+}
+
+void SketchWriter::checkParameters() const
+{
+	Sketch existing;
+	existing.initParametersFromCapnp(file.c_str());
+
+	const Sketch::Parameters & parametersExisting = existing.getParameters();
+	string alphabetExisting;
+	existing.getAlphabetAsString(alphabetExisting);
+
+	if
+	(
+		parametersExisting.kmerSize != parameters.kmerSize ||
+		parametersExisting.seed != parameters.seed ||
+		parametersExisting.minHashesPerWindow != parameters.minHashesPerWindow ||
+		parametersExisting.windowSize != parameters.windowSize ||
+		parametersExisting.noncanonical != parameters.noncanonical ||
+		parametersExisting.preserveCase != parameters.preserveCase ||
+		alphabetExisting != alphabet
+	)
+	{
+		cerr << "ERROR: " << file << " was sketched with different parameters (-k " << parametersExisting.kmerSize << ", -s " << parametersExisting.minHashesPerWindow << ", -S " << parametersExisting.seed << ", alphabet " << alphabetExisting << "), so it cannot be appended to." << endl;
+		exit(1);
+	}
+}
+
+void SketchWriter::flushBuffer()
+{
+	writeAt(fileOffset, buffer.data(), buffer.size() * 8);
+	fileOffset += buffer.size() * 8;
+	buffer.clear();
+}
+
+void SketchWriter::verify() const
+{
+	// read the file back through capnp, as initFromCapnp will
+
+	int fdRead = open(file.c_str(), O_RDONLY);
+	struct stat fileInfo;
+
+	if ( fdRead < 0 || fstat(fdRead, &fileInfo) < 0 )
+	{
+		cerr << "ERROR: could not read back " << file << "." << endl;
+		exit(1);
+	}
+
+	void * data = mmap(NULL, fileInfo.st_size, PROT_READ, MAP_PRIVATE, fdRead, 0);
+
+	if ( data == MAP_FAILED )
+	{
+		cerr << "ERROR: could not memory-map " << file << "." << endl;
+		exit(1);
+	}
+
+	bool good;
+
+	try
+	{
+		capnp::ReaderOptions readerOptions;
+
+		readerOptions.traversalLimitInWords = 1000000000000;
+		readerOptions.nestingLimit = 1000000;
+
+		capnp::FlatArrayMessageReader message(kj::ArrayPtr<const capnp::word>(reinterpret_cast<const capnp::word *>((const char *)data + fileBase), (fileInfo.st_size - fileBase) / sizeof(capnp::word)), readerOptions);
+		capnp::MinHash::Reader reader = message.getRoot<capnp::MinHash>();
+		capnp::MinHash::ReferenceList::Reader referenceListReader = reader.getReferenceList().getReferences().size() ? reader.getReferenceList() : reader.getReferenceListOld();
+		capnp::List<capnp::MinHash::ReferenceList::Reference>::Reader referencesReader = referenceListReader.getReferences();
+
+		good =
+			reader.getKmerSize() == parameters.kmerSize &&
+			reader.getWindowSize() == parameters.windowSize &&
+			reader.getMinHashesPerWindow() == parameters.minHashesPerWindow &&
+			reader.getConcatenated() == parameters.concatenated &&
+			reader.getNoncanonical() == parameters.noncanonical &&
+			reader.getPreserveCase() == parameters.preserveCase &&
+			reader.getHashSeed() == parameters.seed &&
+			reader.getError() == float(parameters.error) &&
+			string(reader.getAlphabet().cStr()) == alphabet &&
+			referencesReader.size() == referenceCount;
+
+		if ( good && referenceCount > 0 )
+		{
+			capnp::MinHash::ReferenceList::Reference::Reader referenceReader = referencesReader[0];
+
+			good =
+				string(referenceReader.getName().cStr()) == firstName &&
+				referenceReader.getLength64() == firstLength &&
+				(packed ? HashList::getPackedCount(referenceReader.getHashesPacked().begin(), referenceReader.getHashesPacked().size()) :
+				 use64 ? referenceReader.getHashes64().size() : referenceReader.getHashes32().size()) == firstHashCount;
+		}
+	}
+	catch ( ... )
+	{
+		good = false;
+	}
+
+	munmap(data, fileInfo.st_size);
+	::close(fdRead);
+
+	if ( ! good )
+	{
+		cerr << "ERROR: " << file << " did not read back correctly after writing." << endl;
+		exit(1);
+	}
+}
+
+void SketchWriter::writeAt(uint64_t offset, const void * data, uint64_t size) const
+{
+	const char * bytes = (const char *)data;
+
+	while ( size > 0 )
+	{
+		ssize_t written = pwrite(fd, bytes, size, fileBase + offset);
+
+		if ( written <= 0 )
+		{
+			cerr << "ERROR: could not write to " << file << "." << endl;
+			exit(1);
+		}
+
+		bytes += written;
+		offset += written;
+		size -= written;
+	}
+}
@@ -0,0 +1,79 @@
+// Copyright © 2015, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen,
+// Sergey Koren, and Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#ifndef SketchWriter_h
+#define SketchWriter_h
+
+#include "Sketch.h"
+#include <string>
+#include <vector>
+
+// Writes a sketch file incrementally, so references can be dropped from memory
+// as soon as they are finished. The output is an ordinary MinHash Cap'n Proto
+// message, encoded directly in stream framing with a fixed segment table:
+//
+//   segment 0       root struct, parameters and alphabet (written up front)
+//   segments 1..n   names, comments, hashes and counts (written as added)
+//   segment n + 1   the list of Reference structs (written by close())
+//
+// Reference structs point into the data segments with far pointers, so only
+// their fixed-size bodies (11 words each) are kept until the end. Windowed
+// sketches (loci) are not supported; use Sketch::writeToCapnp() for those.
+//
+// With append, the message is instead added after those already in an
+// existing file (which must have the same parameters), in place, so only the
+// new references are written. Its segment table is written last, so an
+// interrupted append is ignored by readers (see getSketchMessages()) and
+// replaced by the next one. Pasting the file folds its messages into one.
+
+class SketchWriter
+{
+public:
+
+    SketchWriter(const std::string & fileNew, const Sketch::Parameters & parameters, const std::string & alphabet, bool append = false);
+    ~SketchWriter();
+
+    // references may be added in any order, but each index exactly once
+    //
+    void addReference(uint64_t index, const Sketch::Reference & reference); // index within this message
+    void close(); // finishes the file; also done on destruction
+
+private:
+
+    uint64_t addList(const void * data, uint64_t count, int elementSize, int elementBytes);
+    uint64_t addText(const std::string & text);
+    void checkParameters() const;
+    void flushBuffer();
+    void verify() const;
+    void writeAt(uint64_t offset, const void * data, uint64_t size) const;
+
+    std::string file;
+    int fd;
+    bool append;
+    uint64_t fileBase; // start of this message
+    bool use64;
+    bool reads;
+    bool packed;
+
+    std::vector<uint64_t> buffer; // pending words of the current data segment
+    uint64_t fileOffset;
+    uint32_t segment;
+    uint64_t segmentWords;
+    std::vector<uint32_t> segmentSizes;
+
+    std::vector<uint64_t> structs;
+    uint64_t referenceCount;
+
+    // for the read-back check
+    //
+    Sketch::Parameters parameters;
+    std::string alphabet;
+    std::string firstName;
+    uint64_t firstLength;
+    uint64_t firstHashCount;
+};
+
+#endif
@@ -0,0 +1,217 @@
+// Copyright © 2015, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen,
+// Sergey Koren, and Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#include "Stats.h"
+#include <iostream>
+#include <fstream>
+#include <string.h>
+
+using namespace::std;
+
+static const char * counterNames[Stats::counterCount] =
+{
+	"bytes_read",
+	"bytes_compressed",
+	"chunks",
+	"sequences",
+	"kmers_hashed",
+	"heap_rejects",
+	"tasks"
+};
+
+static const char * stageNames[Stats::stageCount] =
+{
+	"reading",
+	"decompressing",
+	"parsing",
+	"hashing",
+	"merging_heap",
+	"merging_outputs",
+	"writing",
+	"waiting_to_submit",
+	"waiting_for_output",
+	"idle",
+	"waiting_for_chunk",
+	"waiting_to_push",
+	"waiting_to_pop"
+};
+
+bool Stats::enabled = false;
+Stats::Clock::time_point Stats::wallStart;
+thread_local Stats::Thread * Stats::threadCurrent = 0;
+mutex Stats::threadsMutex;
+vector<Stats::Thread *> Stats::threads;
+vector<pair<string, uint64_t> > Stats::settings;
+
+void Stats::Timer::start(Stage stageNew)
+{
+	Thread & thread = getThread();
+	Clock::time_point now = Clock::now();
+
+	stagePrevious = thread.stage;
+
+	if ( stagePrevious >= 0 )
+	{
+		thread.nanoseconds[stagePrevious] += chrono::duration_cast<chrono::nanoseconds>(now - thread.start).count();
+	}
+
+	thread.stage = stageNew;
+	thread.start = now;
+}
+
+void Stats::Timer::stop()
+{
+	Thread & thread = getThread();
+	Clock::time_point now = Clock::now();
+
+	thread.nanoseconds[thread.stage] += chrono::duration_cast<chrono::nanoseconds>(now - thread.start).count();
+	thread.stage = stagePrevious;
+	thread.start = now;
+}
+
+void Stats::enable()
+{
+	wallStart = Clock::now();
+	enabled = true;
+}
+
+void Stats::setting(const string & name, uint64_t value)
+{
+	if ( ! enabled )
+	{
+		return;
+	}
+	
+	lock_guard<mutex> lock(threadsMutex);
+	
+	for ( size_t i = 0; i < settings.size(); i++ )
+	{
+		if ( settings[i].first == name )
+		{
+			settings[i].second = value;
+			return;
+		}
+	}
+	
+	settings.push_back(make_pair(name, value));
+}
+
+Stats::Thread * Stats::addThread()
+{
+	Thread * thread = new Thread();
+
+	memset(thread->counts, 0, sizeof(thread->counts));
+	memset(thread->nanoseconds, 0, sizeof(thread->nanoseconds));
+	thread->stage = -1;
+
+	lock_guard<mutex> lock(threadsMutex);
+	threads.push_back(thread);
+
+	return thread;
+}
+
+static void writeFields(ostream & out, const uint64_t * counts, const uint64_t * nanoseconds, const char * indent)
+{
+	out << indent << "\"counters\": {";
+
+	for ( int i = 0; i < Stats::counterCount; i++ )
+	{
+		out << (i ? ", " : "") << '"' << counterNames[i] << "\": " << counts[i];
+	}
+
+	out << "},\n" << indent << "\"seconds\": {";
+
+	for ( int i = 0; i < Stats::stageCount; i++ )
+	{
+		out << (i ? ", " : "") << '"' << stageNames[i] << "\": " << nanoseconds[i] / 1e9;
+	}
+
+	out << "}";
+}
+
+bool Stats::write(const string & file, const string & command)
+{
+	double wall = chrono::duration_cast<chrono::nanoseconds>(Clock::now() - wallStart).count() / 1e9;
+
+	ofstream fileStream;
+
+	if ( file != "-" )
+	{
+		fileStream.open(file);
+
+		if ( ! fileStream )
+		{
+			return false;
+		}
+	}
+
+	ostream & out = file == "-" ? cerr : fileStream;
+
+	lock_guard<mutex> lock(threadsMutex);
+
+	uint64_t counts[counterCount] = {0};
+	uint64_t nanoseconds[stageCount] = {0};
+
+	for ( size_t i = 0; i < threads.size(); i++ )
+	{
+		for ( int j = 0; j < counterCount; j++ )
+		{
+			counts[j] += threads[i]->counts[j];
+		}
+
+		for ( int j = 0; j < stageCount; j++ )
+		{
+			nanoseconds[j] += threads[i]->nanoseconds[j];
+		}
+	}
+
+	out << "{\n";
+	out << "  \"command\": \"" << command << "\",\n";
+	out << "  \"wall_seconds\": " << wall << ",\n";
+	out << "  \"thread_count\": " << threads.size() << ",\n";
+	out << "  \"settings\": {";
+	
+	for ( size_t i = 0; i < settings.size(); i++ )
+	{
+		out << (i ? ", " : "") << '"' << settings[i].first << "\": " << settings[i].second;
+	}
+	
+	out << "},\n";
+	writeFields(out, counts, nanoseconds, "  ");
+	out << ",\n  \"threads\": [";
+
+	bool first = true;
+
+	for ( size_t i = 0; i < threads.size(); i++ )
+	{
+		const Thread & thread = *threads[i];
+		bool used = false;
+
+		for ( int j = 0; j < counterCount; j++ )
+		{
+			used |= thread.counts[j] != 0;
+		}
+
+		for ( int j = 0; j < stageCount; j++ )
+		{
+			used |= thread.nanoseconds[j] != 0;
+		}
+
+		if ( ! used )
+		{
+			continue;
+		}
+
+		out << (first ? "" : ",") << "\n    {\n";
+		writeFields(out, thread.counts, thread.nanoseconds, "      ");
+		out << "\n    }";
+		first = false;
+	}
+
+	out << "\n  ]\n}\n";
+
+	return true;
+}
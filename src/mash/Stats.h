@@ -0,0 +1,146 @@
+// Copyright © 2015, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen,
+// Sergey Koren, and Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#ifndef Stats_h
+#define Stats_h
+
+#include <chrono>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Counts and times of the stages of a run (for -stats), to tell what a slow
+// one is bound by. Each thread adds to a block of its own (created on its
+// first use and kept until exit, so nothing is shared or locked while
+// counting), and the blocks are summed when written. Nothing is counted
+// unless enabled, and then a count is a thread-local add and a timing two
+// clock reads, so counts are taken per chunk, sequence or batch of hashes
+// rather than per k-mer.
+//
+// Timers nest: starting one pauses the one running on its thread until it
+// stops, so the time of each stage excludes the stages within it, and the
+// stages of a thread add up to (at most) the time it was timed for.
+
+class Stats
+{
+public:
+
+	enum Counter
+	{
+		bytesRead, // sequence data, after decompression
+		bytesCompressed, // read from gzipped files
+		chunks,
+		sequences,
+		kmersHashed,
+		heapRejects, // hashes above the sketch threshold
+		tasks, // run by thread pools
+		counterCount
+	};
+
+	enum Stage
+	{
+		reading,
+		decompressing,
+		parsing,
+		hashing, // including heap maintenance other than mergingHeap
+		mergingHeap,
+		mergingOutputs, // of threads
+		writing,
+		waitingToSubmit, // to thread pools
+		waitingForOutput, // from thread pools
+		idle, // threads of pools
+		waitingForChunk, // to read into
+		waitingToPush, // to data queues
+		waitingToPop, // from data queues
+		stageCount
+	};
+
+	class Timer
+	{
+	public:
+
+		Timer(Stage stageNew) :
+			active(enabled)
+		{
+			if ( active )
+			{
+				start(stageNew);
+			}
+		}
+
+		~Timer()
+		{
+			if ( active )
+			{
+				stop();
+			}
+		}
+
+	private:
+
+		void start(Stage stageNew);
+		void stop();
+
+		bool active;
+		int stagePrevious;
+	};
+
+	static void count(Counter counter, uint64_t count = 1)
+	{
+		if ( enabled )
+		{
+			getThread().counts[counter] += count;
+		}
+	}
+
+	// Records a value picked for the run (such as a size tuned while it
+	// runs), written with the totals; setting a name again replaces it.
+	//
+	static void setting(const std::string & name, uint64_t value);
+	
+	static bool getEnabled() {return enabled;}
+	static void enable(); // starts the wall clock
+
+	// Writes the totals (and those of each thread) as JSON to file, or to
+	// stderr if it is "-"; false if it could not be opened.
+	//
+	static bool write(const std::string & file, const std::string & command);
+
+private:
+
+	typedef std::chrono::steady_clock Clock;
+
+	struct Thread
+	{
+		uint64_t counts[counterCount];
+		uint64_t nanoseconds[stageCount];
+		int stage; // running, or -1
+		Clock::time_point start;
+	};
+
+	static Thread & getThread()
+	{
+		if ( threadCurrent == 0 )
+		{
+			threadCurrent = addThread();
+		}
+
+		return *threadCurrent;
+	}
+
+	static Thread * addThread();
+
+	static bool enabled;
+	static Clock::time_point wallStart;
+	static thread_local Thread * threadCurrent;
+	static std::mutex threadsMutex;
+	static std::vector<Thread *> threads;
+	static std::vector<std::pair<std::string, uint64_t> > settings; // guarded by threadsMutex
+};
+
+#endif
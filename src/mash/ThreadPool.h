@@ -7,56 +7,117 @@
 #ifndef ThreadPool_h
 #define ThreadPool_h
 
+#include <atomic>
 #include <pthread.h>
-#include <queue>
+#include <stdint.h>
+#include <vector>
+
+// Runs a function on inputs from a pool of threads and gives the outputs back
+// in input order. Inputs go through a bounded lock-free queue (so submitting
+// waits only when the threads are that far behind) and each gets a slot in a
+// sequence-numbered output ring, which the thread fills when it finishes. The
+// ring grows in segments rather than blocking, since outputs behind a slow
+// one can pile up until it is done and only the caller pops them. Locks are
+// only taken to sleep and wake when there is nothing to do.
+//
+// Inputs are submitted, and outputs popped, by one thread at a time (as every
+// command does, from its main thread).
 
 template <class TypeInput, class TypeOutput>
 class ThreadPool
 {
 public:
-    
+
     ThreadPool(TypeOutput * (* functionNew)(TypeInput *), unsigned int threadCountNew);
     ~ThreadPool();
-    
+
     bool outputAvailable() const;
     TypeOutput * popOutputWhenAvailable(); // output must be deleted by calling function
     bool running() const;
     void runWhenThreadAvailable(TypeInput * input); // thread deletes input when finished
     void runWhenThreadAvailable(TypeInput * input, TypeOutput * (* functionNew)(TypeInput *)); // thread deletes input when finished
-    
+
+    // Submits several inputs (in order) at once, waking the threads once
+    // rather than per input.
+    //
+    void runWhenThreadAvailable(const std::vector<TypeInput *> & inputs);
+    void runWhenThreadAvailable(const std::vector<TypeInput *> & inputs, TypeOutput * (* functionNew)(TypeInput *));
+
 private:
-    
-    struct OutputQueueNode
+
+    static const uint64_t segmentSlots = 256;
+    static const int spinsMax = 256; // polls before sleeping
+
+    struct OutputSlot
     {
-        // used to preserve input order when outputting
-        
-        OutputQueueNode * prev;
-        OutputQueueNode * next;
-        
         TypeOutput * output;
-        bool ready;
+        std::atomic<bool> ready;
+    };
+
+    struct OutputSegment
+    {
+        OutputSlot slots[segmentSlots];
+        std::atomic<OutputSegment *> next;
     };
-    
+
+    struct Task
+    {
+        std::atomic<uint64_t> sequence; // of the queue position it is ready for
+        TypeInput * input;
+        TypeOutput * (* function)(TypeInput *);
+        OutputSlot * slot;
+    };
+
     unsigned int threadCount;
-    
+
     pthread_t * threads;
-    
+
     static void * thread(void *);
-    
+
     TypeOutput * (* function)(TypeInput *);
-    TypeInput * inputCurrent;
-    OutputQueueNode * outputQueueNodeCurrent;
-    
+
+    bool tryPush(TypeInput * input, TypeOutput * (* functionNew)(TypeInput *), OutputSlot * slot);
+    bool tryPop(Task & task);
+    void push(TypeInput * input, TypeOutput * (* functionNew)(TypeInput *));
+    void wakeThreads(uint64_t count);
+    void runTask(Task & task);
+
+    // bounded queue of inputs (capacity a power of 2)
+    //
+    Task * tasks;
+    uint64_t taskMask;
+    char padEnqueue[64];
+    std::atomic<uint64_t> enqueuePosition;
+    char padDequeue[64];
+    std::atomic<uint64_t> dequeuePosition;
+    char padCounts[64];
+
+    // output ring; the tail is only touched by the submitting thread and the
+    // head by the popping thread
+    //
+    OutputSegment * outputTail;
+    uint64_t outputTailIndex;
+    std::atomic<uint64_t> submitted;
+    OutputSegment * outputHead;
+    uint64_t outputHeadIndex;
+    uint64_t popped;
+
+    // sleeping and waking
+    //
+    std::atomic<int> threadsIdle;
+    std::atomic<bool> submitterWaiting;
+    std::atomic<bool> popperWaiting;
+
     pthread_mutex_t * mutexInput;
+    pthread_mutex_t * mutexSpace;
     pthread_mutex_t * mutexOutput;
-    
+
     pthread_cond_t * condInput;
+    pthread_cond_t * condSpace;
     pthread_cond_t * condOutput;
-    
-    OutputQueueNode * outputQueueHead;
-    OutputQueueNode * outputQueueTail;
-    
-    bool finished;
+
+    std::atomic<bool> finished;
+    std::atomic<uint64_t> threadsStarted; // for spreading them over NUMA nodes
     friend void * thread(void *);
 };
 
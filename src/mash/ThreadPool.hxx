@@ -5,10 +5,19 @@
 // See the LICENSE.txt file included with this software for license information.
 
 #include "ThreadPool.h"
+#include "Numa.h"
+#include "Stats.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <iostream>
 
+static inline void threadPoolPause()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
 template <class TypeInput, class TypeOutput>
 ThreadPool<TypeInput, TypeOutput>::ThreadPool(TypeOutput * (* functionNew)(TypeInput *), unsigned int threadCountNew)
     :
@@ -16,26 +25,59 @@ ThreadPool<TypeInput, TypeOutput>::ThreadPool(TypeOutput * (* functionNew)(TypeI
     function(functionNew)
 {
     mutexInput = new pthread_mutex_t();
+    mutexSpace = new pthread_mutex_t();
     mutexOutput = new pthread_mutex_t();
-    
+
     condInput = new pthread_cond_t();
+    condSpace = new pthread_cond_t();
     condOutput = new pthread_cond_t();
-    
+
     pthread_mutex_init(mutexInput, NULL);
+    pthread_mutex_init(mutexSpace, NULL);
     pthread_mutex_init(mutexOutput, NULL);
-    
+
     pthread_cond_init(condInput, NULL);
+    pthread_cond_init(condSpace, NULL);
     pthread_cond_init(condOutput, NULL);
-    
-    inputCurrent = 0;
-    
-    outputQueueHead = 0;
-    outputQueueTail = 0;
-    
-    finished = false;
-    
+
+    // a few inputs per thread, so threads finishing together find the next
+    // ones queued
+    //
+    uint64_t capacity = 16;
+
+    while ( capacity < 4 * threadCount )
+    {
+        capacity *= 2;
+    }
+
+    tasks = new Task[capacity];
+    taskMask = capacity - 1;
+
+    for ( uint64_t i = 0; i < capacity; i++ )
+    {
+        tasks[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    enqueuePosition.store(0);
+    dequeuePosition.store(0);
+
+    outputTail = new OutputSegment();
+    outputTail->next.store(0);
+    outputTailIndex = 0;
+    outputHead = outputTail;
+    outputHeadIndex = 0;
+    submitted.store(0);
+    popped = 0;
+
+    threadsIdle.store(0);
+    submitterWaiting.store(false);
+    popperWaiting.store(false);
+
+    finished.store(false);
+    threadsStarted.store(0);
+
     threads = new pthread_t[threadCount];
-    
+
     for ( int i = 0; i < threadCount; i++ )
     {
         pthread_create(&threads[i], NULL, &ThreadPool::thread, this);
@@ -46,74 +88,118 @@ template <class TypeInput, class TypeOutput>
 ThreadPool<TypeInput, TypeOutput>::~ThreadPool()
 {
     pthread_mutex_lock(mutexInput);
-    finished = true;
+    finished.store(true);
     pthread_cond_broadcast(condInput);
     pthread_mutex_unlock(mutexInput);
-    
+
     for ( int i = 0; i < threadCount; i++ )
     {
         pthread_join(threads[i], NULL);
     }
-    
+
     delete [] threads;
-    
-    while ( outputQueueHead != 0 )
+
+    // inputs never run (outputs are left to the caller, as they were)
+    //
+    Task task;
+
+    while ( tryPop(task) )
     {
-        OutputQueueNode * next = outputQueueHead->next;
-        delete outputQueueHead;
-        outputQueueHead = next;
+        delete task.input;
     }
-    
+
+    delete [] tasks;
+
+    while ( outputHead != 0 )
+    {
+        OutputSegment * next = outputHead->next.load();
+        delete outputHead;
+        outputHead = next;
+    }
+
+    pthread_mutex_destroy(mutexInput);
+    pthread_mutex_destroy(mutexSpace);
+    pthread_mutex_destroy(mutexOutput);
+
+    pthread_cond_destroy(condInput);
+    pthread_cond_destroy(condSpace);
+    pthread_cond_destroy(condOutput);
+
     delete mutexInput;
+    delete mutexSpace;
     delete mutexOutput;
-    
+
     delete condInput;
+    delete condSpace;
     delete condOutput;
 }
 
 template <class TypeInput, class TypeOutput>
 bool ThreadPool<TypeInput, TypeOutput>::outputAvailable() const
 {
-    bool available;
-    
-    pthread_mutex_lock(mutexOutput);
-    available = outputQueueHead != 0 && outputQueueHead->ready;
-    pthread_mutex_unlock(mutexOutput);
-    
-    return available;
+    if ( popped == submitted.load(std::memory_order_acquire) )
+    {
+        return false;
+    }
+
+    // the head may be at the end of its segment until the next pop moves on
+    //
+    const OutputSlot & slot = outputHeadIndex == segmentSlots ?
+        outputHead->next.load(std::memory_order_acquire)->slots[0] :
+        outputHead->slots[outputHeadIndex];
+
+    return slot.ready.load(std::memory_order_acquire);
 }
 
 template <class TypeInput, class TypeOutput>
 TypeOutput * ThreadPool<TypeInput, TypeOutput>::popOutputWhenAvailable()
 {
-    pthread_mutex_lock(mutexOutput);
-    
-    if ( outputQueueHead == 0 )
+    if ( popped == submitted.load(std::memory_order_acquire) )
     {
         // TODO: error?
         std::cerr << "ERROR: waiting for output when no output queued\n";
-        pthread_mutex_unlock(mutexOutput);
         return 0;
     }
-    
-    while ( ! outputQueueHead->ready )
+
+    if ( outputHeadIndex == segmentSlots )
     {
-        pthread_cond_wait(condOutput, mutexOutput);
+        OutputSegment * next = outputHead->next.load(std::memory_order_acquire);
+        delete outputHead;
+        outputHead = next;
+        outputHeadIndex = 0;
     }
-    
-    TypeOutput * output = outputQueueHead->output;
-    
-    OutputQueueNode * next = outputQueueHead->next;
-    
-    if ( outputQueueTail == outputQueueHead )
+
+    OutputSlot & slot = outputHead->slots[outputHeadIndex];
+
+    if ( ! slot.ready.load(std::memory_order_acquire) )
     {
-        outputQueueTail = 0;
+        Stats::Timer timer(Stats::waitingForOutput);
+
+        for ( int i = 0; i < spinsMax && ! slot.ready.load(std::memory_order_acquire); i++ )
+        {
+            threadPoolPause();
+        }
+
+        if ( ! slot.ready.load(std::memory_order_acquire) )
+        {
+            pthread_mutex_lock(mutexOutput);
+            popperWaiting.store(true);
+
+            while ( ! slot.ready.load() )
+            {
+                pthread_cond_wait(condOutput, mutexOutput);
+            }
+
+            popperWaiting.store(false);
+            pthread_mutex_unlock(mutexOutput);
+        }
     }
-    
-    delete outputQueueHead;
-    outputQueueHead = next;
-    pthread_mutex_unlock(mutexOutput);
-    
+
+    TypeOutput * output = slot.output;
+
+    outputHeadIndex++;
+    popped++;
+
     return output;
 }
 
@@ -126,105 +212,259 @@ void ThreadPool<TypeInput, TypeOutput>::runWhenThreadAvailable(TypeInput * input
 template <class TypeInput, class TypeOutput>
 void ThreadPool<TypeInput, TypeOutput>::runWhenThreadAvailable(TypeInput * input, TypeOutput * (* functionNew)(TypeInput *))
 {
-    pthread_mutex_lock(mutexInput);
-    
-    while ( inputCurrent != 0 )
+    push(input, functionNew);
+    wakeThreads(1);
+}
+
+template <class TypeInput, class TypeOutput>
+void ThreadPool<TypeInput, TypeOutput>::runWhenThreadAvailable(const std::vector<TypeInput *> & inputs)
+{
+    runWhenThreadAvailable(inputs, function);
+}
+
+template <class TypeInput, class TypeOutput>
+void ThreadPool<TypeInput, TypeOutput>::runWhenThreadAvailable(const std::vector<TypeInput *> & inputs, TypeOutput * (* functionNew)(TypeInput *))
+{
+    for ( uint64_t i = 0; i < inputs.size(); i++ )
     {
-        pthread_cond_wait(condInput, mutexInput);
+        push(inputs[i], functionNew);
     }
-    
-    inputCurrent = input;
-    function = functionNew;
-    
-    // enqueue output while input locked (to preserve order)
-    //
-    OutputQueueNode * outputQueueNode = new OutputQueueNode();
-    outputQueueNode->next = 0;
-    outputQueueNode->ready = false;
-    //
-    pthread_mutex_lock(mutexOutput);
-    //
-    if ( outputQueueHead == 0 )
+
+    wakeThreads(inputs.size());
+}
+
+template <class TypeInput, class TypeOutput>
+bool ThreadPool<TypeInput, TypeOutput>::running() const
+{
+    return popped != submitted.load(std::memory_order_acquire);
+}
+
+template <class TypeInput, class TypeOutput>
+bool ThreadPool<TypeInput, TypeOutput>::tryPush(TypeInput * input, TypeOutput * (* functionNew)(TypeInput *), OutputSlot * slot)
+{
+    uint64_t position = enqueuePosition.load(std::memory_order_relaxed);
+
+    while ( true )
     {
-        outputQueueHead = outputQueueNode;
+        Task & task = tasks[position & taskMask];
+        int64_t difference = int64_t(task.sequence.load(std::memory_order_acquire) - position);
+
+        if ( difference == 0 )
+        {
+            if ( enqueuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed) )
+            {
+                task.input = input;
+                task.function = functionNew;
+                task.slot = slot;
+                task.sequence.store(position + 1, std::memory_order_release);
+                return true;
+            }
+        }
+        else if ( difference < 0 )
+        {
+            return false; // full
+        }
+        else
+        {
+            position = enqueuePosition.load(std::memory_order_relaxed);
+        }
     }
-    //
-    outputQueueNode->prev = outputQueueTail;
-    //
-    if ( outputQueueTail != 0 )
+}
+
+template <class TypeInput, class TypeOutput>
+bool ThreadPool<TypeInput, TypeOutput>::tryPop(Task & taskPopped)
+{
+    uint64_t position = dequeuePosition.load(std::memory_order_relaxed);
+
+    while ( true )
     {
-        outputQueueTail->next = outputQueueNode;
+        Task & task = tasks[position & taskMask];
+        int64_t difference = int64_t(task.sequence.load(std::memory_order_acquire) - (position + 1));
+
+        if ( difference == 0 )
+        {
+            if ( dequeuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed) )
+            {
+                taskPopped.input = task.input;
+                taskPopped.function = task.function;
+                taskPopped.slot = task.slot;
+                task.sequence.store(position + taskMask + 1, std::memory_order_release);
+                return true;
+            }
+        }
+        else if ( difference < 0 )
+        {
+            return false; // empty
+        }
+        else
+        {
+            position = dequeuePosition.load(std::memory_order_relaxed);
+        }
     }
+}
+
+template <class TypeInput, class TypeOutput>
+void ThreadPool<TypeInput, TypeOutput>::push(TypeInput * input, TypeOutput * (* functionNew)(TypeInput *))
+{
+    // next slot of the output ring, in submission order
+
+    if ( outputTailIndex == segmentSlots )
+    {
+        OutputSegment * segment = new OutputSegment();
+
+        segment->next.store(0, std::memory_order_relaxed);
+        outputTail->next.store(segment, std::memory_order_release);
+        outputTail = segment;
+        outputTailIndex = 0;
+    }
+
+    OutputSlot * slot = &outputTail->slots[outputTailIndex++];
+
+    slot->output = 0;
+    slot->ready.store(false, std::memory_order_relaxed);
+    submitted.fetch_add(1, std::memory_order_release);
+
+    for ( int i = 0; i < spinsMax; i++ )
+    {
+        if ( tryPush(input, functionNew, slot) )
+        {
+            return;
+        }
+
+        if ( i == 0 )
+        {
+            // the threads may be asleep behind inputs of an unfinished batch
+            //
+            wakeThreads(threadCount);
+        }
+
+        threadPoolPause();
+    }
+
+    Stats::Timer timer(Stats::waitingToSubmit);
+
+    pthread_mutex_lock(mutexSpace);
+    submitterWaiting.store(true);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    while ( ! tryPush(input, functionNew, slot) )
+    {
+        pthread_cond_wait(condSpace, mutexSpace);
+    }
+
+    submitterWaiting.store(false);
+    pthread_mutex_unlock(mutexSpace);
+}
+
+template <class TypeInput, class TypeOutput>
+void ThreadPool<TypeInput, TypeOutput>::wakeThreads(uint64_t count)
+{
+    // pairs with the fence in thread() after a thread counts itself idle, so
+    // either it sees the input or this sees it idle
     //
-    outputQueueTail = outputQueueNode;
-    //
-    pthread_mutex_unlock(mutexOutput);
-    
-    outputQueueNodeCurrent = outputQueueNode;
-    
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    if ( threadsIdle.load(std::memory_order_relaxed) == 0 )
+    {
+        return;
+    }
+
+    pthread_mutex_lock(mutexInput);
+
+    if ( count == 1 )
+    {
+        pthread_cond_signal(condInput);
+    }
+    else
+    {
+        pthread_cond_broadcast(condInput);
+    }
+
     pthread_mutex_unlock(mutexInput);
-    pthread_cond_broadcast(condInput);
 }
 
 template <class TypeInput, class TypeOutput>
-bool ThreadPool<TypeInput, TypeOutput>::running() const
+void ThreadPool<TypeInput, TypeOutput>::runTask(Task & task)
 {
-    bool running;
-    
-    pthread_mutex_lock(mutexOutput);
-    running = outputQueueHead != 0;
-    pthread_mutex_unlock(mutexOutput);
-    
-    return running;
+    // room for one more input
+    //
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    if ( submitterWaiting.load(std::memory_order_relaxed) )
+    {
+        pthread_mutex_lock(mutexSpace);
+        pthread_cond_signal(condSpace);
+        pthread_mutex_unlock(mutexSpace);
+    }
+
+    // run function
+    //
+    Stats::count(Stats::tasks);
+    task.slot->output = task.function(task.input);
+
+    delete task.input;
+
+    // signal output
+    //
+    task.slot->ready.store(true, std::memory_order_release);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    if ( popperWaiting.load(std::memory_order_relaxed) )
+    {
+        pthread_mutex_lock(mutexOutput);
+        pthread_cond_broadcast(condOutput);
+        pthread_mutex_unlock(mutexOutput);
+    }
 }
 
 template <class TypeInput, class TypeOutput>
 void * ThreadPool<TypeInput, TypeOutput>::thread(void * arg)
 {
     ThreadPool * threadPool = (ThreadPool *)arg;
-    TypeInput * input;
-    OutputQueueNode * outputQueueNode;
-    
-    while ( ! threadPool->finished )
-    {
-        // wait for input
-        //
-        pthread_mutex_lock(threadPool->mutexInput);
-        //
-        while ( ! threadPool->finished && threadPool->inputCurrent == 0 )
+    Task task;
+
+    pinThreadToNumaNode(threadPool->threadsStarted.fetch_add(1));
+
+    while ( ! threadPool->finished.load(std::memory_order_relaxed) )
+    {
+        bool found = false;
+
+        for ( int i = 0; i < spinsMax && ! found; i++ )
         {
-            pthread_cond_wait(threadPool->condInput, threadPool->mutexInput);
+            found = threadPool->tryPop(task);
+
+            if ( ! found )
+            {
+                threadPoolPause();
+            }
         }
-        
-        if ( threadPool->finished )
+
+        if ( ! found )
         {
+            // wait for input
+            //
+            Stats::Timer timer(Stats::idle);
+
+            pthread_mutex_lock(threadPool->mutexInput);
+            threadPool->threadsIdle.fetch_add(1);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+
+            while ( ! threadPool->finished.load() && ! (found = threadPool->tryPop(task)) )
+            {
+                pthread_cond_wait(threadPool->condInput, threadPool->mutexInput);
+            }
+
+            threadPool->threadsIdle.fetch_sub(1);
             pthread_mutex_unlock(threadPool->mutexInput);
-            return 0;
+
+            if ( ! found )
+            {
+                return 0;
+            }
         }
-        //
-        input = threadPool->inputCurrent;
-        outputQueueNode = threadPool->outputQueueNodeCurrent;
-        threadPool->inputCurrent = 0;
-        TypeOutput * (* function)(TypeInput *) = threadPool->function;
-        
-        pthread_mutex_unlock(threadPool->mutexInput);
-        
-        pthread_cond_broadcast(threadPool->condInput);
-        
-        // run function
-        //
-        outputQueueNode->output = function(input);
-        
-        delete input;
-        
-        // signal output
-        //
-        outputQueueNode->ready = true;
-        //
-        pthread_mutex_lock(threadPool->mutexOutput);
-        pthread_cond_broadcast(threadPool->condOutput);
-        pthread_mutex_unlock(threadPool->mutexOutput);
-    }
-    
+
+        threadPool->runTask(task);
+    }
+
     return NULL;
 }
@@ -0,0 +1,122 @@
+// Copyright © 2015, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen,
+// Sergey Koren, and Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#ifndef H_CHUNK_READER
+#define H_CHUNK_READER
+
+#include "FastxIO.h"
+
+#include <atomic>
+#include <thread>
+
+namespace mash
+{
+
+namespace core
+{
+
+// Reads the chunks of one file (with a FastaReader or FastqReader) on a
+// thread of its own, so reading goes on while the caller submits chunks and
+// handles outputs. Chunks are queued for Next() in file order. How far the
+// thread reads ahead is bounded by the pool the reader takes its parts from
+// (it waits in Acquire once they are all out) and by the queue depth.
+//
+// The caller may stop taking chunks before the end of the file; destruction
+// then stops the thread and releases the chunks it had queued.
+
+inline void ReleaseChunk(fa::FastaDataPool & pool, fa::FastaChunk * chunk)
+{
+	pool.Release(chunk->chunk);
+	delete chunk;
+}
+
+inline void ReleaseChunk(fq::FastqDataPool & pool, fq::FastqDataChunk * chunk)
+{
+	pool.Release(chunk);
+}
+
+template <class TReader, class TPool, class TChunk>
+class TChunkReader
+{
+public:
+	static const uint32 DefaultDepth = 4;
+
+	TChunkReader(TReader & reader_, TPool & pool_, uint32 depth_ = DefaultDepth)
+		:	reader(reader_)
+		,	pool(pool_)
+		,	queue(depth_)
+		,	stopped(false)
+		,	thread(&TChunkReader::Run, this)
+	{}
+
+	~TChunkReader()
+	{
+		stopped = true;
+
+		TChunk * chunk;
+
+		while ((chunk = Next()) != NULL)
+		{
+			ReleaseChunk(pool, chunk);
+		}
+
+		thread.join();
+	}
+
+	// the next chunk (in file order), waiting for it to be read; NULL at the
+	// end of the file
+	//
+	TChunk * Next()
+	{
+		int64 id;
+		TChunk * chunk;
+
+		return queue.Pop(id, chunk) ? chunk : NULL;
+	}
+
+private:
+
+	void Run()
+	{
+		int64 id = 0;
+
+		while (!stopped)
+		{
+			TChunk * chunk = reader.readNextChunk();
+
+			if (chunk == NULL)
+			{
+				break;
+			}
+
+			queue.Push(id++, chunk);
+		}
+
+		queue.SetCompleted();
+	}
+
+	TReader & reader;
+	TPool & pool;
+	TDataQueue<TChunk> queue;
+	std::atomic<bool> stopped;
+	std::thread thread; // last, so it starts once the rest is set up
+};
+
+} // namespace core
+
+namespace fa
+{
+typedef core::TChunkReader<FastaReader, FastaDataPool, FastaChunk> FastaChunkReader;
+} // namespace fa
+
+namespace fq
+{
+typedef core::TChunkReader<FastqReader, FastqDataPool, FastqDataChunk> FastqChunkReader;
+} // namespace fq
+
+} // namespace mash
+
+#endif // H_CHUNK_READER
@@ -0,0 +1,132 @@
+// Copyright © 2015, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen,
+// Sergey Koren, and Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#ifndef H_CHUNK_SIZER
+#define H_CHUNK_SIZER
+
+#include "Globals.h"
+
+#include <algorithm>
+#include <atomic>
+
+namespace mash
+{
+
+namespace core
+{
+
+// Picks the size of each chunk a file is read in (at most the size of the
+// pool's parts), from the throughput the threads report for the chunks they
+// have hashed. Chunks are sized to take about TargetNanoseconds each, so the
+// costs of each chunk (handing it to a thread, its halo) stay small when
+// hashing is fast, and there are still chunks for every thread when it is
+// slow. Near the end of a file of known size, chunks shrink to spread what
+// is left over the threads, rather than a few large ones finishing while
+// the rest wait. A fixed size turns this off (for benchmarking).
+//
+// Next() is called by the reading thread and Record() by the threads
+// hashing, so neither waits on the other.
+
+class ChunkSizer
+{
+public:
+	static const uint64 MinSize = 1 << 16;
+	static const uint64 InitialSize = 1 << 20; // until throughput is known
+	static const uint64 MaxSize = 1 << 26; // what FastaFileReader can carry over
+	static const uint64 TargetNanoseconds = 20000000;
+
+	ChunkSizer(uint64 maxSize_, uint32 threadNum_, uint64 fixedSize_ = 0)
+		:	maxSize(maxSize_)
+		,	threadNum(threadNum_)
+		,	fixedSize(fixedSize_)
+		,	fileSize(0)
+		,	fileIssued(0)
+		,	smallest(0)
+		,	largest(0)
+		,	bytes(0)
+		,	nanoseconds(0)
+	{}
+
+	// starts reading a file of this many bytes (as parsed), or 0 if not
+	// known (e.g. gzipped)
+	//
+	void StartFile(uint64 size_)
+	{
+		fileSize = size_;
+		fileIssued = 0;
+	}
+
+	// the size to read the next chunk in
+	//
+	uint64 Next()
+	{
+		uint64 size = fixedSize;
+
+		if (size == 0)
+		{
+			uint64 ns = nanoseconds.load(std::memory_order_relaxed);
+
+			size = ns == 0 ? InitialSize : uint64(double(bytes.load(std::memory_order_relaxed)) * TargetNanoseconds / ns);
+
+			if (fileSize != 0)
+			{
+				uint64 left = fileSize > fileIssued ? fileSize - fileIssued : 0;
+
+				size = std::min(size, left / (2 * threadNum));
+			}
+
+			size = std::max(size, uint64(MinSize));
+		}
+
+		size = std::min(size, maxSize);
+		fileIssued += size;
+
+		smallest = smallest == 0 ? size : std::min(smallest, size);
+		largest = std::max(largest, size);
+
+		return size;
+	}
+
+	// a chunk of bytes hashed by one thread in nanoseconds
+	//
+	void Record(uint64 bytes_, uint64 nanoseconds_)
+	{
+		bytes.fetch_add(bytes_, std::memory_order_relaxed);
+		nanoseconds.fetch_add(nanoseconds_, std::memory_order_relaxed);
+	}
+
+	// of one thread, as observed so far
+	//
+	uint64 GetBytesPerSecond() const
+	{
+		uint64 ns = nanoseconds.load();
+
+		return ns == 0 ? 0 : uint64(double(bytes.load()) * 1e9 / ns);
+	}
+
+	uint64 GetSmallest() const {return smallest;}
+	uint64 GetLargest() const {return largest;}
+
+private:
+	const uint64 maxSize;
+	const uint32 threadNum;
+	const uint64 fixedSize;
+
+	// only touched by the reading thread
+	uint64 fileSize;
+	uint64 fileIssued;
+	uint64 smallest;
+	uint64 largest;
+
+	std::atomic<uint64> bytes;
+	std::atomic<uint64> nanoseconds;
+};
+
+} // namespace core
+
+} // namespace mash
+
+#endif // H_CHUNK_SIZER
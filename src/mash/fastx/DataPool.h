@@ -11,6 +11,7 @@
 #define H_DATA_POOL
 
 #include "Globals.h"
+#include "../Stats.h"
 
 #include <vector>
 #include <iostream>
@@ -75,8 +76,13 @@ public:
 	{
 		th::unique_lock<th::mutex> lock(mutex);
 
-		while (partNum >= maxPartNum)
-			partsAvailableCondition.wait(lock);
+		if (partNum >= maxPartNum)
+		{
+			Stats::Timer timer(Stats::waitingForChunk);
+
+			while (partNum >= maxPartNum)
+				partsAvailableCondition.wait(lock);
+		}
 
 		ASSERT(availablePartsPool.size() > 0);
 
@@ -11,6 +11,7 @@
 #define H_DATAQUEUE
 
 #include "Globals.h"
+#include "../Stats.h"
 
 #include <queue>
 
@@ -90,8 +91,13 @@ public:
 	{
 		th::unique_lock<th::mutex> lock(mutex);
 
-		while (partNum > maxPartNum)
-			queueFullCondition.wait(lock);
+		if (partNum > maxPartNum)
+		{
+			Stats::Timer timer(Stats::waitingToPush);
+
+			while (partNum > maxPartNum)
+				queueFullCondition.wait(lock);
+		}
 
 		parts.push(std::make_pair(partId_, (DataType*)part_));
 		partNum++;
@@ -103,8 +109,13 @@ public:
 	{
 		th::unique_lock<th::mutex> lock(mutex);
 
-		while ((parts.size() == 0) && currentThreadMask != completedThreadMask)
-			queueEmptyCondition.wait(lock);
+		if ((parts.size() == 0) && currentThreadMask != completedThreadMask)
+		{
+			Stats::Timer timer(Stats::waitingToPop);
+
+			while ((parts.size() == 0) && currentThreadMask != completedThreadMask)
+				queueEmptyCondition.wait(lock);
+		}
 
 		if (parts.size() != 0)
 		{
@@ -25,6 +25,20 @@
 namespace mash
 {
 
+// A record parsed in place: spans into a pooled chunk, valid until the chunk
+// is released. The sequence is compacted over its own line breaks, so it is
+// contiguous (and writable) in the chunk buffer.
+struct SequenceView
+{
+	char * name;
+	uint32 nameLength;
+	char * comment;
+	uint32 commentLength;
+	char * seq;
+	uint64 length;
+	uint64 gid;
+};
+
 namespace fa
 {
 
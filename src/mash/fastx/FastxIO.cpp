@@ -8,11 +8,13 @@
 */
   
 #include <cstdio>
+#include <cstring>
 #include <vector>
 #include <map>
 #include <cstdio>
 
 #include "../Sketch.h"
+#include "../Stats.h"
 #include "FastxIO.h"
 #include "Buffer.h"
 #include "FastxStream.h" 
@@ -32,8 +34,11 @@ FastaChunk* FastaReader::readNextChunk(){
 	recordsPool.Acquire(part);
 	FastaChunk *dataPart = new FastaChunk;
 	dataPart->chunk = part;
+	Stats::Timer timer(Stats::reading);
 	if(fileReader.ReadNextChunk(dataPart, this->seqInfos))
 	{
+		Stats::count(Stats::chunks);
+		Stats::count(Stats::bytesRead, part->size);
 		return dataPart;
 	}
 	else
@@ -166,6 +171,93 @@ int chunkFormat(FastaChunk & fachunk, vector<Sketch::Reference> & refs, int kmer
 	
 }
 
+//same record boundaries as getSequence(), but joins the lines in place
+static uint64 compactSequence(FastaDataChunk * chunk, uint64 &pos)
+{
+	char * data = (char *)chunk->data.Pointer();
+	uint64 start_pos = pos;
+	uint64 end = pos; //end of the compacted sequence
+
+	while(pos < chunk->size - 1)
+	{
+		if(data[pos] == '\n'){
+			if(end != start_pos)
+				memmove(data + end, data + start_pos, pos - start_pos);
+			end += pos - start_pos;
+			pos++;
+			start_pos = pos;
+			if(data[pos] == '>')
+				return end;
+		}
+		else{
+			pos++;
+		}
+	}
+
+	//deal with last char
+	if(pos == chunk->size - 1)
+	{
+		uint64 len = data[pos] == '\n' ? pos - start_pos : pos - start_pos + 1;
+		if(end != start_pos)
+			memmove(data + end, data + start_pos, len);
+		end += len;
+	}
+
+	return end;
+}
+
+int chunkFormat(FastaChunk & fachunk, vector<SequenceView> & seqs)
+{
+	uint64 pos = 0;
+	SequenceView seq;
+
+	while(getNextSeqView(fachunk, seq, pos)){
+		seqs.push_back(seq);
+	}
+
+	ASSERT(seqs.size() == fachunk.nseqs);
+
+	return seqs.size();
+}
+
+bool getNextSeqView(FastaChunk & fachunk, SequenceView & seq, uint64 & pos)
+{
+	if(pos >= fachunk.chunk->size - 1){
+		return false;
+	}
+
+	char *data = (char *)fachunk.chunk->data.Pointer();
+
+	seq.name = seq.comment = data;
+	seq.nameLength = seq.commentLength = 0;
+
+	if(data[pos] == '>')
+	{
+		uint64 line = pos + 1;
+		while(pos < fachunk.chunk->size && data[pos] != '\n') pos++;
+		uint64 lineEnd = pos;
+		if(pos < fachunk.chunk->size) pos++;
+
+		//name up to the first space, comment after it
+		uint64 space = line;
+		while(space < lineEnd && data[space] != ' ') space++;
+		seq.name = data + line;
+		seq.nameLength = space - line;
+		if(space < lineEnd){
+			seq.comment = data + space + 1;
+			seq.commentLength = lineEnd - space - 1;
+		}
+	}
+
+	uint64 start = pos;
+	seq.seq = data + start;
+	seq.length = compactSequence(fachunk.chunk, pos) - start;
+	seq.gid = fachunk.start;
+	fachunk.start++;
+
+	return true;
+}
+
 Sketch::Reference getNextSeq(FastaChunk & fachunk, bool & done, uint64 & pos)
 {
 	Sketch::Reference ref;
@@ -234,8 +326,11 @@ void FastqReader::readChunk()
 FastqDataChunk* FastqReader::readNextChunk(){
 	FastqDataChunk* part = NULL;
 	recordsPool.Acquire(part);
+	Stats::Timer timer(Stats::reading);
 	if(fileReader.ReadNextChunk(part))
 	{
+		Stats::count(Stats::chunks);
+		Stats::count(Stats::bytesRead, part->size);
 		return part;
 	}
 	else
@@ -377,6 +472,58 @@ int chunkFormat(FastqChunk* &fqChunk, std::vector<Sketch::Reference> &data, bool
 //}
 
 
+//line span without its terminator, as getLine() below
+static bool getLineView(FastqDataChunk* &chunk, int &pos, char* &line, uint32 &length){
+	int start_pos = pos;
+	char* data = (char *)chunk->data.Pointer();
+
+	while(pos <= (chunk->size + 1)){
+		if(data[pos] == '\n' || data[pos] == '\r' || pos == (chunk->size + 1)){
+			pos++;
+			line = data + start_pos;
+			length = pos - start_pos - 1;
+			return true;
+		}
+		else{
+			pos++;
+		}
+	}
+	line = data;
+	length = 0;
+	return false;
+}
+
+int chunkFormat(FastqChunk* &fqChunk, std::vector<SequenceView> &data, bool mHasQuality){
+	//format a whole chunk and return number of reads
+	FastqDataChunk * chunk = fqChunk->chunk;
+	int seq_count = 0;
+	int pos_ = 0;
+	SequenceView read;
+	char * line;
+	uint32 length;
+
+	read.comment = NULL;
+	read.commentLength = 0;
+
+	while(true){
+		getLineView(chunk, pos_, read.name, read.nameLength);
+		if(read.nameLength == 0) break;//dsrc guarantees that read are completed!
+
+		getLineView(chunk, pos_, read.seq, length);
+		read.length = length;
+		read.gid = seq_count;
+
+		getLineView(chunk, pos_, line, length); //strand
+		if(mHasQuality)
+			getLineView(chunk, pos_, line, length);
+
+		data.push_back(read);
+		seq_count++;
+	}
+
+	return seq_count;
+}
+
 string getLine(FastqDataChunk* &chunk, int &pos){
 	int start_pos = pos;
 	char* data = (char *)chunk->data.Pointer();
@@ -63,6 +63,8 @@ std::string getSequence(FastaDataChunk* &chunk, uint64 &pos);	//addbyxxm
 std::string getLine(FastaDataChunk* &chunk, uint64 &pos);
 int chunkFormat(FastaChunk & fachunk, std::vector<Sketch::Reference> & refs);
 int chunkFormat(FastaChunk & fachunk, std::vector<Sketch::Reference> & refs, int kmerSize);
+int chunkFormat(FastaChunk & fachunk, std::vector<SequenceView> & seqs);
+bool getNextSeqView(FastaChunk & fachunk, SequenceView & seq, uint64 & pos);
 Sketch::Reference getNextSeq(FastaChunk & fachunk, bool & done, uint64 & pos);
 
 } // namespace fa
@@ -103,6 +105,7 @@ private:
 };
 
 int chunkFormat(FastqChunk* &chunk, std::vector< Sketch::Reference > &,bool);
+int chunkFormat(FastqChunk* &chunk, std::vector<SequenceView> &, bool);
 
 //single pe file 
 //int pairedChunkFormat(FastqDataChunk* &chunk, std::vector<ReadPair*>&,bool mHasQuality);
@@ -32,8 +32,15 @@ bool FastaFileReader::ReadNextChunk(FastaChunk* dataChunk_, SeqInfos& seqInfos)
 
 	// flush the data from previous incomplete chunk
 	uchar* data = chunk_->data.Pointer();
-	const uint64 cbufSize = chunk_->data.Size();
+	uint64 cbufSize = chunk_->data.Size();
 	chunk_->size = 0;
+
+	if (mSizer != NULL)
+	{
+		// with room for a minimum chunk past the tail carried over
+		cbufSize = std::min(cbufSize, std::max(mSizer->Next(), bufferSize + uint64(core::ChunkSizer::MinSize)));
+	}
+
 	int64 toRead = cbufSize - bufferSize;// buffersize: size left from last chunk
 	
 	if (bufferSize > 0)
@@ -16,11 +16,13 @@
 #include "Globals.h"
 
 #include "Buffer.h"
+#include "ChunkSizer.h"
 #include "FastxChunk.h"
+#include "GzipStream.h"
 #include "utils.h"
 #include <iostream>
 #include <string>
-#include <zlib.h> //support gziped files, functional but inefficient
+#include <fcntl.h>
 
 
 #if defined (_WIN32)
@@ -72,21 +74,23 @@ private:
 	//static const uint32 SwapBufferSize = 1 << 13;
 
 public:
-	FastaFileReader(const std::string& fileName_, uint64 halo = 21, bool isZippedNew = false)
+	FastaFileReader(const std::string& fileName_, uint64 halo = 21, bool isZippedNew = false, uint32 gzipThreads = 1)
 		:	swapBuffer(SwapBufferSize)
 		,	bufferSize(0)
 		,	eof(false)
 		,	usesCrlf(false)
-		,	totalSeqs(0)
-		,	mHalo(halo)
 		,	isZipped(isZippedNew)
+		,	mHalo(halo)
+		,	totalSeqs(0)
 	{	
 		//if(ends_with(fileName_,".gz"))
 		if(isZipped)
 		{
-			mZipFile = gzopen(fileName_.c_str(),"r");
-			//isZipped=true;
-			gzrewind(mZipFile);
+			int fd = open(fileName_.c_str(), O_RDONLY);
+			if(fd == -1){
+				throw DsrcException(("Can not open file to read: " + fileName_).c_str()); //--------------need to change----------//
+			}
+			mZipStream = new core::GzipStream(fd, gzipThreads, true);
 
 		}else{
 			mFile = FOPEN(fileName_.c_str(), "rb");
@@ -99,22 +103,20 @@ public:
 			
 	}
 
-	FastaFileReader(int fd, uint64 halo = 21, bool isZippedNew = false)
+	// When zipped, the descriptor stays owned by the caller and is read from
+	// its current offset.
+	FastaFileReader(int fd, uint64 halo = 21, bool isZippedNew = false, uint32 gzipThreads = 1)
 		:	swapBuffer(SwapBufferSize)
 		,	bufferSize(0)
 		,	eof(false)
 		,	usesCrlf(false)
-		,	totalSeqs(0)
-		,	mHalo(halo)
 		,	isZipped(isZippedNew)
+		,	mHalo(halo)
+		,	totalSeqs(0)
 	{	
 		if(isZipped)
 		{
-			mZipFile = gzdopen(fd,"r");
-			if(mZipFile == NULL){
-				throw DsrcException("Can not open file to read!"); //--------------need to change----------//
-			}
-			gzrewind(mZipFile);
+			mZipStream = new core::GzipStream(fd, gzipThreads);
 
 		}else{
 
@@ -129,10 +131,9 @@ public:
 	~FastaFileReader()
 	{
 		//std::cerr << "totalSeqs: " << this->totalSeqs << std::endl;
-		if(mFile != NULL || mZipFile != NULL)
+		if(mFile != NULL || mZipStream != NULL)
 			Close();
 		//delete mFile;
-		//delete mZipFile;
 	}
 
 	bool Eof() const
@@ -142,6 +143,13 @@ public:
 
 	bool ReadNextChunk(FastaChunk* chunk_, SeqInfos& seqInfos);
 
+	// Chunks are then read in the sizes it picks (up to the size of the
+	// pool's parts) rather than filling each part.
+	void SetChunkSizer(core::ChunkSizer* sizer_)
+	{
+		mSizer = sizer_;
+	}
+
 	void Close()
 	{
 		if(mFile != NULL){
@@ -149,9 +157,9 @@ public:
 			mFile = NULL;
 		}
 
-		if(mZipFile !=NULL && isZipped){
-			gzclose(mZipFile);
-			mZipFile=NULL;
+		if(mZipStream != NULL){
+			delete mZipStream;
+			mZipStream = NULL;
 		}
 
 	}
@@ -159,7 +167,7 @@ public:
 	int64 Read(byte* memory_, uint64 size_)
 	{	
 		if(isZipped){
-			int64 n = gzread(mZipFile,memory_,size_);
+			int64 n = mZipStream->Read(memory_, size_);
 			if(n == -1)
 				std::cerr << "Error to read gzip file" << std::endl;
 			return n;
@@ -178,10 +186,12 @@ private:
 	bool			isZipped;
 
 	FILE*           mFile = NULL;
-	gzFile          mZipFile = NULL;
+	core::GzipStream* mZipStream = NULL;
 
 	uint64 			mHalo;
 
+	core::ChunkSizer* mSizer = NULL;
+
 public:
 	uint64          totalSeqs;
 	uint64			gid = 0;
@@ -290,7 +300,7 @@ private:
 	static const uint32 SwapBufferSize = 1 << 20; // the longest FASTQ sequence todate is no longer than 1Mbp. 
 
 public:
-	FastqFileReader(const std::string& fileName_, bool isZippedNew = false)
+	FastqFileReader(const std::string& fileName_, bool isZippedNew = false, uint32 gzipThreads = 1)
 		:	swapBuffer(SwapBufferSize)
 		,	bufferSize(0)
 		,	eof(false)
@@ -299,12 +309,11 @@ public:
 	{	
 		//if(ends_with(fileName_,".gz"))
 		if(isZipped){
-			mZipFile = gzopen(fileName_.c_str(),"r");
-		  if(mZipFile == NULL){
+			int fd = open(fileName_.c_str(), O_RDONLY);
+		  if(fd == -1){
 		  	throw DsrcException(("Can not open file to read: " + fileName_).c_str()); //--------------need to change----------//
 		  }
-			//isZipped=true;
-			gzrewind(mZipFile);
+			mZipStream = new core::GzipStream(fd, gzipThreads, true);
 
 		}else{
 		  mFile = FOPEN(fileName_.c_str(), "rb");
@@ -316,7 +325,7 @@ public:
 			
 	}
 
-	FastqFileReader(int fd, bool isZippedNew = false)
+	FastqFileReader(int fd, bool isZippedNew = false, uint32 gzipThreads = 1)
 		:	swapBuffer(SwapBufferSize)
 		,	bufferSize(0)
 		,	eof(false)
@@ -325,13 +334,7 @@ public:
 	{	
 		//if(ends_with(fileName_,".gz"))
 		if(isZipped){
-			mZipFile = gzdopen(fd, "r");
-			//isZipped=true;
-			if(mZipFile == NULL){
-		  		throw DsrcException("Can not open file to read: " ); //--------------need to change----------//
-			}
-
-			gzrewind(mZipFile);
+			mZipStream = new core::GzipStream(fd, gzipThreads);
 
 		}else{
 		  mFile = FDOPEN(fd, "rb");
@@ -346,12 +349,10 @@ public:
 	~FastqFileReader()
 	{
 		//if( mFile != NULL )
-		if(mFile != NULL || mZipFile !=NULL)
+		if(mFile != NULL || mZipStream != NULL)
 			Close();
 		//if(mFile != NULL)
 		//	delete mFile;
-		//if(mZipFile != NULL)
-		//	delete mZipFile;
 	}
 
 	bool Eof() const
@@ -367,9 +368,9 @@ public:
 			FCLOSE(mFile);
 			mFile = NULL;
 		}
-		if(mZipFile !=NULL && isZipped){
-			gzclose(mZipFile);
-			mZipFile=NULL;
+		if(mZipStream != NULL){
+			delete mZipStream;
+			mZipStream = NULL;
 		}
 
 	}
@@ -377,7 +378,7 @@ public:
 	int64 Read(byte* memory_, uint64 size_)
 	{	
 		if(isZipped){
-			int64 n = gzread(mZipFile,memory_,size_);
+			int64 n = mZipStream->Read(memory_, size_);
 			if(n == -1)
 				std::cerr<<"Error to read gzip file" <<std::endl;
 			return n;
@@ -395,7 +396,7 @@ private:
 	bool			usesCrlf;
 	bool			isZipped;
 	FILE*           mFile = NULL;
-	gzFile          mZipFile = NULL;
+	core::GzipStream* mZipStream = NULL;
 
 	uint64 lastOneReadPos;
 	uint64 lastTwoReadPos;
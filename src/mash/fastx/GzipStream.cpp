@@ -0,0 +1,472 @@
+#include "GzipStream.h"
+#include "../Stats.h"
+
+#include <algorithm>
+#include <iostream>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+namespace mash
+{
+
+namespace core
+{
+
+static inline uint32 ReadLe32(const byte* p_)
+{
+	return (uint32)p_[0] | ((uint32)p_[1] << 8) | ((uint32)p_[2] << 16) | ((uint32)p_[3] << 24);
+}
+
+GzipStream::GzipStream(int fd_, uint32 threadNum_, bool ownsFd_)
+	:	fd(fd_)
+	,	ownsFd(ownsFd_)
+	,	threadNum(std::max(threadNum_, (uint32)1))
+	,	bgzf(false)
+	,	input(InputBufferSize)
+	,	inputPos(0)
+	,	inputEnd(0)
+	,	inputEof(false)
+	,	inputError(false)
+	,	blockPos(0)
+	,	readerDone(false)
+	,	readerFailed(false)
+	,	stopping(false)
+	,	warned(false)
+{
+	maxBlocks = threadNum * BlocksPerThread + 1;
+
+	uint64 size;
+	bgzf = AtGzipMember() && BgzfMemberSize(size);
+
+	if (bgzf)
+	{
+		for (uint32 i = 0; i < threadNum; ++i)
+			workers.push_back(std::thread(&GzipStream::WorkerMain, this));
+	}
+
+	reader = std::thread(&GzipStream::ReaderMain, this);
+}
+
+GzipStream::~GzipStream()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	spaceCondition.notify_all();
+	jobCondition.notify_all();
+
+	reader.join();
+
+	for (uint32 i = 0; i < workers.size(); ++i)
+		workers[i].join();
+
+	for (uint32 i = 0; i < blocks.size(); ++i)
+		delete blocks[i];
+
+	if (ownsFd)
+		close(fd);
+}
+
+int64 GzipStream::Read(byte* memory_, uint64 size_)
+{
+	uint64 copied = 0;
+	std::unique_lock<std::mutex> lock(mutex);
+
+	while (copied < size_)
+	{
+		readyCondition.wait(lock, [this]{ return (!blocks.empty() && blocks.front()->ready) || (blocks.empty() && readerDone); });
+
+		if (blocks.empty() && !readerFailed)
+			break;
+
+		if (blocks.empty() || blocks.front()->failed)
+		{
+			// like gzread, data before the error is still returned
+			if (!warned)
+			{
+				std::cerr << "WARNING: gzip input is truncated or corrupt" << std::endl;
+				warned = true;
+			}
+			return copied > 0 ? copied : -1;
+		}
+
+		Block* block = blocks.front();
+
+		// the front block is no longer touched by the other threads
+		lock.unlock();
+
+		uint64 n = std::min(size_ - copied, block->outputSize - blockPos);
+		memcpy(memory_ + copied, block->output.data() + blockPos, n);
+		copied += n;
+		blockPos += n;
+
+		lock.lock();
+
+		if (blockPos == block->outputSize)
+		{
+			blocks.pop_front();
+			delete block;
+			blockPos = 0;
+			spaceCondition.notify_one();
+		}
+	}
+
+	return copied;
+}
+
+void GzipStream::ReaderMain()
+{
+	bool ok;
+
+	if (!AtGzipMember())
+		ok = ReadPlain();
+	else if (bgzf)
+		ok = ReadBgzf();
+	else
+		ok = ReadGzip();
+
+	Finish(!ok);
+}
+
+void GzipStream::WorkerMain()
+{
+	z_stream stream;
+	memset(&stream, 0, sizeof(stream));
+	inflateInit2(&stream, -15);
+
+	while (true)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		jobCondition.wait(lock, [this]{ return !jobs.empty() || readerDone || stopping; });
+
+		if (stopping || jobs.empty())
+			break;
+
+		Block* block = jobs.front();
+		jobs.pop();
+		lock.unlock();
+
+		bool ok;
+
+		{
+			Stats::Timer timer(Stats::decompressing);
+			ok = InflateMembers(stream, block);
+		}
+
+		lock.lock();
+		block->failed = !ok;
+		block->ready = true;
+		readyCondition.notify_all();
+	}
+
+	inflateEnd(&stream);
+}
+
+bool GzipStream::Fill(uint64 need_)
+{
+	if (inputEnd - inputPos >= need_)
+		return true;
+
+	if (inputPos + need_ > input.size())
+	{
+		memmove(input.data(), input.data() + inputPos, inputEnd - inputPos);
+		inputEnd -= inputPos;
+		inputPos = 0;
+
+		if (need_ > input.size())
+			input.resize(need_);
+	}
+
+	while (inputEnd - inputPos < need_ && !inputEof)
+	{
+		ssize_t n;
+
+		{
+			Stats::Timer timer(Stats::reading);
+			n = read(fd, input.data() + inputEnd, input.size() - inputEnd);
+		}
+
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			inputError = true;
+			inputEof = true;
+		}
+		else if (n == 0)
+		{
+			inputEof = true;
+		}
+		else
+		{
+			inputEnd += n;
+			Stats::count(Stats::bytesCompressed, n);
+		}
+	}
+
+	return inputEnd - inputPos >= need_;
+}
+
+bool GzipStream::AtGzipMember()
+{
+	return Fill(2) && input[inputPos] == 0x1f && input[inputPos + 1] == 0x8b;
+}
+
+bool GzipStream::BgzfMemberSize(uint64& size_)
+{
+	// gzip header with an extra field holding the 'BC' subfield (BSIZE)
+
+	if (!Fill(12))
+		return false;
+
+	const byte* p = input.data() + inputPos;
+
+	if (p[0] != 0x1f || p[1] != 0x8b || p[2] != 8 || (p[3] & 4) == 0)
+		return false;
+
+	uint32 xlen = p[10] | (p[11] << 8);
+
+	if (!Fill(12 + xlen))
+		return false;
+
+	p = input.data() + inputPos;
+
+	for (uint32 off = 12; off + 4 <= 12 + xlen; off += 4 + (p[off + 2] | (p[off + 3] << 8)))
+	{
+		if (p[off] == 'B' && p[off + 1] == 'C' && (p[off + 2] | (p[off + 3] << 8)) == 2 && off + 6 <= 12 + xlen)
+		{
+			size_ = (p[off + 4] | (p[off + 5] << 8)) + 1;
+			return size_ >= 12 + xlen + 8;
+		}
+	}
+
+	return false;
+}
+
+bool GzipStream::ReadBgzf()
+{
+	Block* block = NULL;
+
+	while (Fill(1))
+	{
+		uint64 size;
+
+		if (!BgzfMemberSize(size))
+		{
+			if (block != NULL && !PushBlock(block, true))
+				return true;
+
+			// not BGZF from here on; an ordinary member is inflated in
+			// sequence, anything else is trailing garbage and ignored (as gzread)
+			if (AtGzipMember())
+				return ReadGzip();
+
+			return !inputError;
+		}
+
+		if (!Fill(size))
+		{
+			delete block;
+			return false;
+		}
+
+		if (block == NULL)
+			block = new Block;
+
+		const byte* p = input.data() + inputPos;
+		Member member;
+		member.offset = block->input.size();
+		member.size = size;
+		member.crc = ReadLe32(p + size - 8);
+		member.isize = ReadLe32(p + size - 4);
+
+		block->input.insert(block->input.end(), p, p + size);
+		block->members.push_back(member);
+		block->outputSize += member.isize;
+		inputPos += size;
+
+		if (block->members.size() == GroupMembers)
+		{
+			if (!PushBlock(block, true))
+				return true;
+
+			block = NULL;
+		}
+	}
+
+	if (block != NULL)
+		PushBlock(block, true);
+
+	return !inputError;
+}
+
+bool GzipStream::ReadGzip()
+{
+	z_stream stream;
+	memset(&stream, 0, sizeof(stream));
+
+	if (inflateInit2(&stream, 15 + 16) != Z_OK)
+		return false;
+
+	Block* block = new Block;
+	block->output.resize(BlockSize);
+	bool ok = true;
+
+	while (true)
+	{
+		if (inputPos == inputEnd && !Fill(1))
+		{
+			ok = false; // truncated member
+			break;
+		}
+
+		stream.next_in = input.data() + inputPos;
+		stream.avail_in = inputEnd - inputPos;
+		stream.next_out = block->output.data() + block->outputSize;
+		stream.avail_out = BlockSize - block->outputSize;
+
+		int ret;
+
+		{
+			Stats::Timer timer(Stats::decompressing);
+			ret = inflate(&stream, Z_NO_FLUSH);
+		}
+
+		inputPos = inputEnd - stream.avail_in;
+		block->outputSize = BlockSize - stream.avail_out;
+
+		if (block->outputSize == BlockSize)
+		{
+			block->ready = true;
+
+			if (!PushBlock(block, false))
+			{
+				inflateEnd(&stream);
+				return true;
+			}
+
+			block = new Block;
+			block->output.resize(BlockSize);
+		}
+
+		if (ret == Z_STREAM_END)
+		{
+			if (!AtGzipMember())
+				break;
+
+			inflateReset(&stream);
+		}
+		else if (ret != Z_OK && ret != Z_BUF_ERROR)
+		{
+			ok = false;
+			break;
+		}
+	}
+
+	inflateEnd(&stream);
+
+	if (block->outputSize > 0)
+	{
+		block->ready = true;
+		PushBlock(block, false);
+	}
+	else
+	{
+		delete block;
+	}
+
+	return ok && !inputError;
+}
+
+bool GzipStream::ReadPlain()
+{
+	while (Fill(1))
+	{
+		Block* block = new Block;
+		uint64 n = std::min((uint64)BlockSize, inputEnd - inputPos);
+
+		block->output.assign(input.data() + inputPos, input.data() + inputPos + n);
+		block->outputSize = n;
+		block->ready = true;
+		inputPos += n;
+
+		if (!PushBlock(block, false))
+			return true;
+	}
+
+	return !inputError;
+}
+
+bool GzipStream::PushBlock(Block* block_, bool job_)
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	spaceCondition.wait(lock, [this]{ return blocks.size() < maxBlocks || stopping; });
+
+	if (stopping)
+	{
+		delete block_;
+		return false;
+	}
+
+	blocks.push_back(block_);
+
+	if (job_)
+	{
+		jobs.push(block_);
+		jobCondition.notify_one();
+	}
+	else
+	{
+		readyCondition.notify_all();
+	}
+
+	return true;
+}
+
+void GzipStream::Finish(bool failed_)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	readerDone = true;
+	readerFailed = failed_;
+	jobCondition.notify_all();
+	readyCondition.notify_all();
+}
+
+bool GzipStream::InflateMembers(z_stream& stream_, Block* block_)
+{
+	block_->output.resize(block_->outputSize);
+	uint64 out = 0;
+	byte empty;
+
+	for (uint32 i = 0; i < block_->members.size(); ++i)
+	{
+		const Member& member = block_->members[i];
+		const byte* p = block_->input.data() + member.offset;
+		uint32 header = 12 + (p[10] | (p[11] << 8));
+
+		inflateReset(&stream_);
+		stream_.next_in = (byte*)p + header;
+		stream_.avail_in = member.size - header - 8;
+		stream_.next_out = member.isize > 0 ? block_->output.data() + out : &empty;
+		stream_.avail_out = member.isize;
+
+		if (inflate(&stream_, Z_FINISH) != Z_STREAM_END || stream_.avail_out != 0)
+			return false;
+
+		if (crc32(0, block_->output.data() + out, member.isize) != member.crc)
+			return false;
+
+		out += member.isize;
+	}
+
+	std::vector<byte>().swap(block_->input);
+
+	return true;
+}
+
+} // namespace core
+
+} // namespace mash
@@ -0,0 +1,124 @@
+/*
+  Decompression stage for gzipped FASTA/FASTQ input.
+
+  A reader thread pulls compressed data from the file descriptor ahead of the
+  parser. BGZF files (and any gzip stream made of BGZF-style members, which
+  record their compressed size in the header) are split into groups of
+  members that are inflated in parallel by worker threads; other gzip streams,
+  including multi-member ones, are inflated by the reader thread itself, so
+  decompression still overlaps with parsing. Plain files are passed through.
+  Output is always returned in file order through Read(), with the same
+  semantics as gzread().
+*/
+#ifndef H_GZIPSTREAM
+#define H_GZIPSTREAM
+
+#include "Globals.h"
+
+#include <deque>
+#include <queue>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <zlib.h>
+
+namespace mash
+{
+
+namespace core
+{
+
+class GzipStream
+{
+private:
+	static const uint32 InputBufferSize = 1 << 22;
+	static const uint32 BlockSize = 1 << 20; // output per block in sequential modes
+	static const uint32 GroupMembers = 16;   // BGZF members per parallel job (<= 1MB output)
+	static const uint32 BlocksPerThread = 4;
+
+	struct Member
+	{
+		uint32 offset;
+		uint32 size;
+		uint32 crc;
+		uint32 isize;
+	};
+
+	struct Block
+	{
+		std::vector<byte> input;
+		std::vector<Member> members;
+		std::vector<byte> output;
+		uint64 outputSize = 0;
+		bool ready = false;
+		bool failed = false;
+	};
+
+public:
+	GzipStream(int fd_, uint32 threadNum_ = 1, bool ownsFd_ = false);
+	~GzipStream();
+
+	// Fills memory_ with up to size_ decompressed bytes; returns fewer only at
+	// the end of the stream or at an error, and -1 once nothing is left before
+	// a read or decompression error.
+	//
+	int64 Read(byte* memory_, uint64 size_);
+
+	bool IsBgzf() const
+	{
+		return bgzf;
+	}
+
+private:
+	int fd;
+	bool ownsFd;
+	uint32 threadNum;
+	uint32 maxBlocks;
+	bool bgzf;
+
+	// input buffer, only touched by the reader thread
+	//
+	std::vector<byte> input;
+	uint64 inputPos;
+	uint64 inputEnd;
+	bool inputEof;
+	bool inputError;
+
+	std::deque<Block*> blocks; // in file order, not yet consumed
+	std::queue<Block*> jobs;   // BGZF groups waiting for a worker
+	uint64 blockPos;           // consumed bytes of blocks.front()
+	bool readerDone;
+	bool readerFailed;
+	bool stopping;
+	bool warned;
+
+	std::mutex mutex;
+	std::condition_variable spaceCondition;
+	std::condition_variable jobCondition;
+	std::condition_variable readyCondition;
+
+	std::thread reader;
+	std::vector<std::thread> workers;
+
+	void ReaderMain();
+	void WorkerMain();
+
+	bool Fill(uint64 need_);
+	bool AtGzipMember();
+	bool ReadBgzf();
+	bool ReadGzip();
+	bool ReadPlain();
+	bool BgzfMemberSize(uint64& size_);
+
+	bool PushBlock(Block* block_, bool job_);
+	void Finish(bool failed_);
+
+	static bool InflateMembers(z_stream& stream_, Block* block_);
+};
+
+} // namespace core
+
+} // namespace mash
+
+#endif // H_GZIPSTREAM
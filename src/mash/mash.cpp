@@ -14,9 +14,12 @@
 #include "CommandContain.h"
 #include "CommandInfo.h"
 #include "CommandPaste.h"
+#include "CommandServe.h"
 
 #include "CommandDumptri.h"
 #include "CommandDumpdist.h"
+#include "CommandMerge.h"
+#include "CommandCluster.h"
 
 int main(int argc, const char ** argv)
 {
@@ -38,6 +41,9 @@ int main(int argc, const char ** argv)
     commandList.addCommand(new mash::CommandBounds());
 	commandList.addCommand(new mash::CommandDumptri());
 	commandList.addCommand(new mash::CommandDumpdist());
+	commandList.addCommand(new mash::CommandMerge());
+	commandList.addCommand(new mash::CommandCluster());
+	commandList.addCommand(new mash::CommandServe());
     
     return commandList.run(argc, argv);
 }
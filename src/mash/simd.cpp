@@ -0,0 +1,200 @@
+#include "simd.h"
+#include "MurmurHash3.h"
+#include "MinHashHeap.h"
+#include "HashList.h"
+#include "HyperLogLog.h"
+#include "Sketch.h"
+#include "CommandDistance.h"
+#include <ctype.h>
+
+using namespace::std;
+using namespace::mash;
+
+static const SimdKernels & getKernelsForLevel(SimdLevel level);
+static const SimdKernels * & getKernelsSelected();
+
+static const SimdKernels kernelsNone =
+{
+	SIMD_NONE,
+	1,
+	0,
+	0,
+	filterBelowScalar,
+	u64_intersect_scalar_stop,
+	u32_intersect_scalar_stop,
+	u64_intersect_counts_scalar,
+	u32_intersect_counts_scalar,
+	unpackBlockScalar,
+	toUpperScalar,
+	alphabetRunScalar,
+	hllSumScalar
+};
+
+#ifdef SIMD_X86
+static const SimdKernels kernelsSse4 =
+{
+	SIMD_SSE4,
+	1,
+	0,
+	0,
+	filterBelowScalar,
+	u64_intersection_vector_sse,
+	u32_intersection_vector_sse,
+	u64_intersect_counts_scalar,
+	u32_intersect_counts_scalar,
+	unpackBlockScalar,
+	toUpperScalar,
+	alphabetRunScalar,
+	hllSumScalar
+};
+
+static const SimdKernels kernelsAvx2 =
+{
+	SIMD_AVX2,
+	4,
+	MurmurHash3_x64_128_kmers_avx2,
+	MurmurHash3_x64_128_kmers_avx2_sized,
+	filterBelowAvx2,
+	u64_intersect_vector_avx2,
+	u32_intersect_vector_avx2,
+	u64_intersect_counts_avx2,
+	u32_intersect_counts_avx2,
+	unpackBlockAvx2,
+	toUpperAvx2,
+	alphabetRunAvx2,
+	hllSumAvx2
+};
+
+static const SimdKernels kernelsAvx512 =
+{
+	SIMD_AVX512,
+	16,
+	MurmurHash3_x64_128_kmers_avx512,
+	MurmurHash3_x64_128_kmers_avx512_sized,
+	filterBelowAvx512,
+	u64_intersect_vector_avx512,
+	u32_intersect_vector_avx512,
+	u64_intersect_counts_avx512,
+	u32_intersect_counts_avx512,
+	unpackBlockAvx2, // the layout has four lanes
+	toUpperAvx2,
+	alphabetRunAvx2,
+	hllSumAvx2
+};
+#endif
+
+const SimdKernels & getSimdKernels()
+{
+	return *getKernelsSelected();
+}
+
+SimdLevel getSimdLevelSupported()
+{
+#ifdef SIMD_X86
+	__builtin_cpu_init();
+
+	if
+	(
+		__builtin_cpu_supports("avx512f") &&
+		__builtin_cpu_supports("avx512cd") &&
+		__builtin_cpu_supports("avx512bw") &&
+		__builtin_cpu_supports("avx512dq") &&
+		__builtin_cpu_supports("avx512vl") &&
+		__builtin_cpu_supports("popcnt")
+	)
+	{
+		return SIMD_AVX512;
+	}
+
+	if ( __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt") )
+	{
+		return SIMD_AVX2;
+	}
+
+	if ( __builtin_cpu_supports("sse4.1") && __builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("popcnt") )
+	{
+		return SIMD_SSE4;
+	}
+#endif
+
+	return SIMD_NONE;
+}
+
+const char * getSimdLevelName(SimdLevel level)
+{
+	switch ( level )
+	{
+		case SIMD_SSE4: return "SSE4";
+		case SIMD_AVX2: return "AVX2";
+		case SIMD_AVX512: return "AVX512";
+		default: return "none";
+	}
+}
+
+bool parseSimdLevel(const string & name, SimdLevel & level)
+{
+	string lower;
+
+	for ( size_t i = 0; i < name.length(); i++ )
+	{
+		lower += tolower(name[i]);
+	}
+
+	if ( lower == "auto" )
+	{
+		level = getSimdLevelSupported();
+		return true;
+	}
+
+	const SimdLevel levels[] = {SIMD_NONE, SIMD_SSE4, SIMD_AVX2, SIMD_AVX512};
+
+	for ( int i = 0; i < 4; i++ )
+	{
+		string levelName = getSimdLevelName(levels[i]);
+
+		for ( size_t j = 0; j < levelName.length(); j++ )
+		{
+			levelName[j] = tolower(levelName[j]);
+		}
+
+		if ( lower == levelName )
+		{
+			level = levels[i];
+			return true;
+		}
+	}
+
+	return false;
+}
+
+bool setSimdLevel(SimdLevel level)
+{
+	if ( level > getSimdLevelSupported() )
+	{
+		return false;
+	}
+
+	getKernelsSelected() = &getKernelsForLevel(level);
+	return true;
+}
+
+const SimdKernels & getKernelsForLevel(SimdLevel level)
+{
+	switch ( level )
+	{
+#ifdef SIMD_X86
+		case SIMD_SSE4: return kernelsSse4;
+		case SIMD_AVX2: return kernelsAvx2;
+		case SIMD_AVX512: return kernelsAvx512;
+#endif
+		default: return kernelsNone;
+	}
+}
+
+const SimdKernels * & getKernelsSelected()
+{
+	// detected once; setSimdLevel() may replace it before any work starts
+
+	static const SimdKernels * kernels = &getKernelsForLevel(getSimdLevelSupported());
+	return kernels;
+}
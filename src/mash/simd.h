@@ -0,0 +1,98 @@
+// Runtime selection of SIMD kernels.
+//
+// Every kernel variant is compiled into the same binary (on x86 with GCC or
+// clang, using per-function target options), and the best one supported by the
+// running CPU is picked the first time the kernels are requested. The choice
+// can be overridden with setSimdLevel(), e.g. from the -simd option, to
+// benchmark or force a specific path.
+
+#ifndef INCLUDED_simd
+#define INCLUDED_simd
+
+#include <stdint.h>
+#include <string>
+
+#if defined __GNUC__ && (defined __x86_64__ || defined __i386__)
+
+#define SIMD_X86
+
+#define SIMD_PRAGMA(x) _Pragma(#x)
+
+#if defined __clang__
+#define SIMD_TARGET_BEGIN(isa) SIMD_PRAGMA(clang attribute push (__attribute__((target(isa))), apply_to = function))
+#define SIMD_TARGET_END SIMD_PRAGMA(clang attribute pop)
+#else
+#define SIMD_TARGET_BEGIN(isa) SIMD_PRAGMA(GCC push_options) SIMD_PRAGMA(GCC target(isa))
+#define SIMD_TARGET_END SIMD_PRAGMA(GCC pop_options)
+#endif
+
+#define SIMD_TARGET_AVX512 "avx512f,avx512cd,avx512bw,avx512dq,avx512vl,popcnt"
+#define SIMD_TARGET_AVX2 "avx2,popcnt"
+#define SIMD_TARGET_SSE4 "sse4.1,sse4.2,popcnt"
+
+#endif
+
+enum SimdLevel
+{
+	SIMD_NONE,
+	SIMD_SSE4,
+	SIMD_AVX2,
+	SIMD_AVX512
+};
+
+typedef void (* HashKmers)(const char * const * kmers, int kmerSize, uint32_t seed, uint64_t * out);
+
+struct SimdKernels
+{
+	SimdLevel level;
+
+	// Hashes hashWidth k-mers (MurmurHash3_x64_128), writing 2 words each.
+	// hashKmersSized() gives a variant compiled for one k-mer size if there
+	// is one (for common sizes), or else hashKmers; it is picked once per
+	// sequence rather than branching on the size for each batch.
+	//
+	int hashWidth;
+	HashKmers hashKmers;
+	HashKmers (* hashKmersSized)(int kmerSize);
+
+	// Copies values <= threshold to out, returning how many were copied.
+	//
+	int (* filterBelow)(const uint64_t * values, int count, uint64_t threshold, uint64_t * out);
+
+	// Sorted-list intersections that stop once the union reaches size3; the
+	// positions reached in each list are returned in i_a and i_b.
+	//
+	uint64_t (* intersect64)(const uint64_t * list1, uint64_t size1, const uint64_t * list2, uint64_t size2, uint64_t size3, uint64_t * i_a, uint64_t * i_b);
+	uint64_t (* intersect32)(const uint32_t * list1, uint64_t size1, const uint32_t * list2, uint64_t size2, uint64_t size3, uint64_t * i_a, uint64_t * i_b);
+
+	// As intersect64 and intersect32, also with the count of each hash (see
+	// Sketch::Reference::counts), giving the sum of counts of the hashes
+	// passed in either list and of the smaller counts of those shared, for
+	// weighted distances.
+	//
+	uint64_t (* intersectCounts64)(const uint64_t * list1, const uint32_t * counts1, uint64_t size1, const uint64_t * list2, const uint32_t * counts2, uint64_t size2, uint64_t size3, uint64_t * i_a, uint64_t * i_b, uint64_t * minSum, uint64_t * countSum);
+	uint64_t (* intersectCounts32)(const uint32_t * list1, const uint32_t * counts1, uint64_t size1, const uint32_t * list2, const uint32_t * counts2, uint64_t size2, uint64_t size3, uint64_t * i_a, uint64_t * i_b, uint64_t * minSum, uint64_t * countSum);
+
+	// Decodes a block of hashPackBlock packed hashes (see HashList::pack()).
+	//
+	void (* unpackBlock)(const uint64_t * words, int width, uint64_t base, uint64_t * out);
+
+	// Uppercases a sequence in place, and gives the length of its prefix
+	// that is all in (or all out of) an alphabet (see getAlphabetTable()).
+	//
+	void (* toUpper)(char * seq, uint64_t length);
+	uint64_t (* alphabetRun)(const char * seq, uint64_t length, const uint8_t * table, bool inAlphabet);
+
+	// Sums 2^-max(a[i], b[i]) over HyperLogLog registers, for estimating the
+	// size of (the union of) sets (see hllEstimate()).
+	//
+	double (* hllSum)(const uint8_t * a, const uint8_t * b, uint64_t count, uint64_t * zeros);
+};
+
+const SimdKernels & getSimdKernels();
+SimdLevel getSimdLevelSupported();
+const char * getSimdLevelName(SimdLevel level);
+bool parseSimdLevel(const std::string & name, SimdLevel & level);
+bool setSimdLevel(SimdLevel level);
+
+#endif
@@ -5,6 +5,8 @@
 // See the LICENSE.txt file included with this software for license information.
 
 #include "sketchParameterSetup.h"
+#include "CountingFilter.h"
+#include <algorithm>
 #include <iostream>
 
 using std::cerr;
@@ -12,6 +14,63 @@ using std::endl;
 
 namespace mash {
 
+int sketchSubsetSetup(Sketch & sketch, const Command & command)
+{
+	bool names = command.getOption("names").active;
+	bool range = command.getOption("range").active;
+	
+	if ( ! names && ! range )
+	{
+		return 0;
+	}
+	
+	Sketch::ReferenceSubset subset;
+	
+	if ( names )
+	{
+		splitFile(command.getOption("names").argument, subset.names);
+		subset.names.erase(std::remove(subset.names.begin(), subset.names.end(), ""), subset.names.end());
+		
+		if ( subset.names.size() == 0 )
+		{
+			cerr << "ERROR: no names in " << command.getOption("names").argument << "." << endl;
+			return 1;
+		}
+	}
+	
+	if ( range )
+	{
+		const std::string & argument = command.getOption("range").argument;
+		size_t dash = argument.find('-');
+		
+		if
+		(
+			dash == std::string::npos ||
+			dash == 0 ||
+			dash == argument.size() - 1 ||
+			argument.find_first_not_of("0123456789-") != std::string::npos ||
+			argument.find('-', dash + 1) != std::string::npos
+		)
+		{
+			cerr << "ERROR: range (-range) must be <first>-<last>." << endl;
+			return 1;
+		}
+		
+		subset.first = std::stoull(argument.substr(0, dash));
+		subset.last = std::stoull(argument.substr(dash + 1));
+		
+		if ( subset.last < subset.first )
+		{
+			cerr << "ERROR: range (-range) is empty." << endl;
+			return 1;
+		}
+	}
+	
+	sketch.setReferenceSubset(subset);
+	
+	return 0;
+}
+
 int sketchParameterSetup(Sketch::Parameters & parameters, const Command & command)
 {
     parameters.kmerSize = command.getOption("kmer").getArgumentAsNumber();
@@ -41,12 +100,15 @@ int sketchParameterSetup(Sketch::Parameters & parameters, const Command & comman
 	if ( command.getOption("memory").active )
 	{
 		parameters.reads = true;
-		//parameters.minCov = 2;
 		parameters.memoryBound = command.getOption("memory").getArgumentAsNumber();
 		
-		if ( command.getOption("minCov").active )
+		if ( ! command.getOption("minCov").active )
+		{
+			parameters.minCov = 2;
+		}
+		else if ( parameters.minCov < 2 || parameters.minCov > CountingFilter::countMax )
 		{
-			cerr << "ERROR: The option " << command.getOption("minCov").identifier << " cannot be used with " << command.getOption("memory").identifier << "." << endl;
+			cerr << "ERROR: The option " << command.getOption("minCov").identifier << " must be between 2 and " << CountingFilter::countMax << " with " << command.getOption("memory").identifier << "." << endl;
 			return 1;
 		}
 	}
@@ -62,11 +124,6 @@ int sketchParameterSetup(Sketch::Parameters & parameters, const Command & comman
     	parameters.genomeSize = command.getOption("genome").getArgumentAsNumber();
     }
     
-    if ( parameters.reads && command.getOption("threads").active )
-    {
-    	cerr << "WARNING: The option " << command.getOption("threads").identifier << " will be ignored with " << command.getOption("reads").identifier << "." << endl;
-    }
-    
     if ( parameters.reads && ! parameters.concatenated )
     {
         cerr << "ERROR: The option " << command.getOption("individual").identifier << " cannot be used with " << command.getOption("reads").identifier << "." << endl;
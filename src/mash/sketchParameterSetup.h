@@ -13,6 +13,7 @@
 namespace mash {
 
 int sketchParameterSetup(Sketch::Parameters & parameters, const Command & command);
+int sketchSubsetSetup(Sketch & sketch, const Command & command);
 void warnKmerSize(const Sketch::Parameters & parameters, const Command & command, uint64_t lengthMax, const std::string & lengthMaxName, double randomChance, int kMin, int warningCount);
 
 } // namespace mash
@@ -0,0 +1,47 @@
+#!/bin/sh
+#
+# compareNumbers.sh <expected> <actual> <tolerance>
+#
+# Compares two tab-separated text outputs line by line and field by field,
+# allowing numeric fields to differ by up to <tolerance>, for outputs that
+# store values with less precision (e.g. dist -pack, triangle -condensed).
+# Other fields must be the same.
+
+if [ $# -ne 3 ]
+then
+	echo "usage: $0 <expected> <actual> <tolerance>" >&2
+	exit 2
+fi
+
+if [ `wc -l < "$1"` -ne `wc -l < "$2"` ]
+then
+	echo "$1 and $2 have different numbers of lines" >&2
+	exit 1
+fi
+
+paste -d '\n' "$1" "$2" | awk -F '\t' -v tolerance="$3" '
+	function numeric(x) { return x ~ /^-?[0-9]+(\.[0-9]+)?([eE][-+]?[0-9]+)?$/ }
+	NR % 2 == 1 { split($0, expected, "\t"); count = NF; line = $0; next }
+	{
+		differs = NF != count
+
+		for ( i = 1; i <= NF && ! differs; i++ )
+		{
+			if ( numeric(expected[i]) && numeric($i) )
+			{
+				difference = expected[i] - $i
+				differs = difference > tolerance || -difference > tolerance
+			}
+			else
+			{
+				differs = expected[i] != $i
+			}
+		}
+
+		if ( differs )
+		{
+			print "line " NR / 2 " differs:\n< " line "\n> " $0 > "/dev/stderr"
+			failed = 1
+		}
+	}
+	END { exit failed }'